@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+
+#include "bench/bench.h"
+#include "bench/compare.h"
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
+namespace bench {
+
+//----------------------------------------------------------------------------
+//
+// State
+//
+//----------------------------------------------------------------------------
+
+State::State(const Options &options, int64_t arg)
+  : m_options(options)
+  , m_arg(arg)
+  , m_phase(Starting)
+  , m_remaining(0)
+  , m_iterations(1)
+  , m_itemsPerIteration(1)
+  , m_samplesLeft(0)
+  , m_paused(Clock::duration::zero())
+{
+    m_samples.reserve(options.samples);
+}
+
+void State::pauseTiming()
+{
+    m_pausedAt = Clock::now();
+}
+
+void State::resumeTiming()
+{
+    m_paused += Clock::now() - m_pausedAt;
+}
+
+void State::startSample(uint64_t iterations)
+{
+    // The call to keepRunning() that starts a sample counts as an iteration
+    m_iterations = iterations;
+    m_remaining = iterations - 1;
+    m_paused = Clock::duration::zero();
+    m_start = Clock::now();
+}
+
+bool State::nextSample()
+{
+    const Clock::time_point end = Clock::now();
+    const double elapsed = duration_cast<duration<double>>(end - m_start - m_paused).count();
+
+    if (m_phase == Starting) {
+        m_phase = Calibrating;
+        startSample(1);
+        return true;
+    }
+
+    if (m_phase == Calibrating) {
+        if (elapsed < m_options.minSampleTime) {
+            // Grow geometrically, aiming slightly beyond the minimum time
+            double scale = elapsed > 0 ? 1.2 * m_options.minSampleTime / elapsed : 10.0;
+            scale = std::min(10.0, std::max(2.0, scale));
+            startSample(static_cast<uint64_t>(std::ceil(m_iterations * scale)));
+            return true;
+        }
+
+        // The final calibration sample doubles as the first warmup sample
+        m_phase = WarmingUp;
+        m_samplesLeft = m_options.warmupSamples - 1;
+    } else if (m_phase == WarmingUp) {
+        m_samplesLeft--;
+    } else if (m_phase == Measuring) {
+        m_samples.push_back(elapsed * 1e9 / static_cast<double>(m_iterations * m_itemsPerIteration));
+        m_samplesLeft--;
+    }
+
+    if (m_phase == WarmingUp && m_samplesLeft <= 0) {
+        m_phase = Measuring;
+        m_samplesLeft = m_options.samples;
+    }
+
+    if (m_samplesLeft <= 0) {
+        m_phase = Finished;
+        return false;
+    }
+
+    startSample(m_iterations);
+    return true;
+}
+
+Result State::result() const
+{
+    Result result;
+    result.arg = m_arg;
+    result.iterations = m_iterations;
+    result.itemsPerIteration = m_itemsPerIteration;
+    result.samples = m_samples;
+
+    if (m_samples.empty()) {
+        return result;
+    }
+
+    std::vector<double> sorted(m_samples);
+    std::sort(sorted.begin(), sorted.end());
+
+    const size_t n = sorted.size();
+    result.min = sorted.front();
+    result.median = n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+
+    // Nearest-rank percentile
+    const size_t rank = static_cast<size_t>(std::ceil(0.99 * n));
+    result.p99 = sorted[std::max<size_t>(rank, 1) - 1];
+
+    double sum = 0;
+    for (double sample: sorted) {
+        sum += sample;
+    }
+    result.mean = sum / n;
+
+    double sumSquares = 0;
+    for (double sample: sorted) {
+        sumSquares += (sample - result.mean) * (sample - result.mean);
+    }
+    result.stddev = n > 1 ? std::sqrt(sumSquares / (n - 1)) : 0;
+
+    return result;
+}
+
+//----------------------------------------------------------------------------
+//
+// Registry
+//
+//----------------------------------------------------------------------------
+
+namespace {
+
+std::vector<std::unique_ptr<Benchmark>>& benchmarks()
+{
+    static std::vector<std::unique_ptr<Benchmark>> s_benchmarks;
+    return s_benchmarks;
+}
+
+}   // end anonymous namespace
+
+Benchmark* registerBenchmark(const char *name, BenchmarkFn fn)
+{
+    // Benchmark functions are conventionally prefixed with 'bm_'
+    if (strncmp(name, "bm_", 3) == 0) {
+        name += 3;
+    }
+
+    benchmarks().emplace_back(new Benchmark(name, fn));
+    return benchmarks().back().get();
+}
+
+}   // end namespace bench
+
+//----------------------------------------------------------------------------
+//
+// Runner
+//
+//----------------------------------------------------------------------------
+
+namespace {
+
+using bench::Benchmark;
+using bench::Options;
+using bench::Result;
+using bench::State;
+
+std::string fullName(const Benchmark &benchmark, int64_t arg, bool hasArg)
+{
+    if (!hasArg) {
+        return benchmark.name();
+    }
+
+    return benchmark.name() + "/" + std::to_string(arg);
+}
+
+void writeJson(std::ostream &out, const Options &options, const std::vector<Result> &results)
+{
+    out << std::setprecision(9);
+    out << "{\n"
+        << "  \"options\": {\"minSampleTime\": " << options.minSampleTime
+        << ", \"warmupSamples\": " << options.warmupSamples
+        << ", \"samples\": " << options.samples << "},\n"
+        << "  \"benchmarks\": [";
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\""
+            << ", \"iterations\": " << r.iterations
+            << ", \"itemsPerIteration\": " << r.itemsPerIteration
+            << ", \"min\": " << r.min
+            << ", \"median\": " << r.median
+            << ", \"p99\": " << r.p99
+            << ", \"mean\": " << r.mean
+            << ", \"stddev\": " << r.stddev
+            << ", \"samples\": [";
+        for (size_t j = 0; j < r.samples.size(); ++j) {
+            out << (j ? ", " : "") << r.samples[j];
+        }
+        out << "]}";
+    }
+
+    out << "\n  ]\n}\n";
+}
+
+void printUsage(const char *program)
+{
+    std::cerr
+        << "Usage: " << program << " [options]\n"
+        << "\n"
+        << "  --filter=<text>     Only run benchmarks whose name contains <text>\n"
+        << "  --json=<path>       Write results as JSON to <path> ('-' for stdout)\n"
+        << "  --min-time=<secs>   Minimum duration of each sample (default 0.01)\n"
+        << "  --warmup=<n>        Number of warmup samples (default 2)\n"
+        << "  --samples=<n>       Number of measured samples (default 15)\n"
+        << "  --max-arg=<n>       Skip arguments larger than <n> (default 1000000)\n"
+        << "  --list              List benchmarks without running them\n"
+        << "\n"
+        << "  --baseline=<path>   Compare against results from a previous --json run,\n"
+        << "                      exiting with status 1 if any benchmark has regressed\n"
+        << "  --alpha=<p>         Significance level for comparison (default 0.01)\n"
+        << "  --threshold=<frac>  Minimum slowdown of the median that counts as a\n"
+        << "                      regression (default 0.05)\n";
+}
+
+bool parseOption(const char *arg, const char *name, const char **value)
+{
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        *value = arg + len + 1;
+        return true;
+    }
+
+    return false;
+}
+
+}   // end anonymous namespace
+
+int main(int argc, char **argv)
+{
+    Options options;
+    bench::CompareOptions compareOptions;
+    std::string filter;
+    std::string jsonPath;
+    std::string baselinePath;
+    bool list = false;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *value = nullptr;
+        if (parseOption(argv[i], "--filter", &value)) {
+            filter = value;
+        } else if (parseOption(argv[i], "--json", &value)) {
+            jsonPath = value;
+        } else if (parseOption(argv[i], "--min-time", &value)) {
+            options.minSampleTime = atof(value);
+        } else if (parseOption(argv[i], "--warmup", &value)) {
+            options.warmupSamples = std::max(1, atoi(value));
+        } else if (parseOption(argv[i], "--samples", &value)) {
+            options.samples = std::max(1, atoi(value));
+        } else if (parseOption(argv[i], "--max-arg", &value)) {
+            options.maxArg = atoll(value);
+        } else if (parseOption(argv[i], "--baseline", &value)) {
+            baselinePath = value;
+        } else if (parseOption(argv[i], "--alpha", &value)) {
+            compareOptions.alpha = atof(value);
+        } else if (parseOption(argv[i], "--threshold", &value)) {
+            compareOptions.threshold = atof(value);
+        } else if (strcmp(argv[i], "--list") == 0) {
+            list = true;
+        } else {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    // Read the baseline up front, so that a bad path fails immediately
+    std::vector<Result> baseline;
+    if (!baselinePath.empty()) {
+        std::string error;
+        if (!bench::readResults(baselinePath, baseline, error)) {
+            std::cerr << error << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<Result> results;
+
+    // Keep stdout clean when it is used for JSON output
+    FILE *report = jsonPath == "-" ? stderr : stdout;
+    if (!list) {
+        fprintf(report, "%-40s %12s %12s %12s %12s\n", "benchmark", "min ns", "median ns", "p99 ns", "stddev %");
+    }
+
+    for (const auto &pBenchmark: bench::benchmarks()) {
+        const Benchmark &benchmark = *pBenchmark;
+        const bool hasArgs = !benchmark.args().empty();
+        const std::vector<int64_t> args = hasArgs ? benchmark.args() : std::vector<int64_t>(1, 0);
+
+        for (int64_t arg: args) {
+            const std::string name = fullName(benchmark, arg, hasArgs);
+            if (name.find(filter) == std::string::npos || arg > options.maxArg) {
+                continue;
+            }
+
+            if (list) {
+                printf("%s\n", name.c_str());
+                continue;
+            }
+
+            State state(options, arg);
+            benchmark.fn()(state);
+
+            Result result = state.result();
+            result.name = name;
+            results.push_back(result);
+
+            fprintf(report, "%-40s %12.2f %12.2f %12.2f %12.1f\n", name.c_str(),
+                result.min, result.median, result.p99,
+                result.mean > 0 ? 100.0 * result.stddev / result.mean : 0.0);
+            fflush(report);
+        }
+    }
+
+    if (jsonPath == "-") {
+        writeJson(std::cout, options, results);
+    } else if (!jsonPath.empty()) {
+        std::ofstream out(jsonPath.c_str());
+        if (!out) {
+            std::cerr << "Could not open " << jsonPath << " for writing" << std::endl;
+            return 1;
+        }
+        writeJson(out, options, results);
+    }
+
+    if (!baselinePath.empty() && !list) {
+        if (bench::compareResults(report, compareOptions, baseline, results) > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
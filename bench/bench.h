@@ -0,0 +1,245 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A minimal, self-contained microbenchmark harness.
+ *
+ * Benchmarks are functions that take a State. Any setup is performed before
+ * the timed loop, which is driven by State::keepRunning():
+ *
+ *     static void bm_example(bench::State &state)
+ *     {
+ *         std::vector<int> values(state.arg());
+ *         state.setItemsPerIteration(values.size());
+ *
+ *         while (state.keepRunning()) {
+ *             for (auto &value: values) {
+ *                 value++;
+ *             }
+ *             bench::clobberMemory();
+ *         }
+ *     }
+ *
+ *     BENCHMARK(bm_example)->range(1000, 1000000);
+ *
+ * The harness first calibrates the number of iterations in each sample, so
+ * that a sample takes at least the minimum sample time. It then runs a number
+ * of warmup samples, which are discarded, followed by the measured samples.
+ * Results are reported in nanoseconds per item.
+ *
+ */
+namespace bench {
+
+/**
+ * Prevent the compiler from optimising away the computation of 'value'.
+ */
+template<typename T>
+inline void doNotOptimize(const T &value)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+/**
+ * Force the compiler to assume that all memory may have been read or written.
+ */
+inline void clobberMemory()
+{
+#if defined(__GNUC__)
+    asm volatile("" : : : "memory");
+#endif
+}
+
+struct Options
+{
+    Options()
+      : minSampleTime(0.01)
+      , warmupSamples(2)
+      , samples(15)
+      , maxArg(1000000) { }
+
+    double minSampleTime;   // Minimum duration of a sample, in seconds
+    int warmupSamples;      // Samples that are run, but not measured
+    int samples;            // Measured samples
+    int64_t maxArg;         // Arguments larger than this are skipped
+};
+
+/**
+ * Summary of the samples recorded for a single benchmark run.
+ */
+struct Result
+{
+    Result()
+      : arg(0)
+      , iterations(0)
+      , itemsPerIteration(0)
+      , min(0)
+      , median(0)
+      , p99(0)
+      , mean(0)
+      , stddev(0) { }
+
+    std::string name;
+    int64_t arg;
+    uint64_t iterations;            // Iterations per sample
+    uint64_t itemsPerIteration;
+    std::vector<double> samples;    // Nanoseconds per item, in run order
+
+    double min;
+    double median;
+    double p99;
+    double mean;
+    double stddev;
+};
+
+class State
+{
+public:
+    State(const Options &options, int64_t arg);
+
+    /**
+     *  Returns true while the benchmark should continue to run. Must be
+     *  called exactly once for each iteration of the timed loop.
+     */
+    bool keepRunning()
+    {
+        if (m_remaining > 0) {
+            m_remaining--;
+            return true;
+        }
+
+        return nextSample();
+    }
+
+    /**
+     *  Argument for parameterised benchmarks, e.g. the number of entities.
+     */
+    int64_t arg() const
+    {
+        return m_arg;
+    }
+
+    /**
+     *  Number of items processed by each iteration of the timed loop. Results
+     *  are reported per item.
+     */
+    void setItemsPerIteration(uint64_t items)
+    {
+        m_itemsPerIteration = items;
+    }
+
+    /**
+     *  Exclude work in the timed loop from the current sample.
+     */
+    void pauseTiming();
+    void resumeTiming();
+
+    /**
+     *  Summarise the samples that have been recorded.
+     */
+    Result result() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum Phase
+    {
+        Starting,
+        Calibrating,
+        WarmingUp,
+        Measuring,
+        Finished
+    };
+
+    bool nextSample();
+    void startSample(uint64_t iterations);
+
+    const Options &m_options;
+    const int64_t m_arg;
+
+    Phase m_phase;
+    uint64_t m_remaining;
+    uint64_t m_iterations;
+    uint64_t m_itemsPerIteration;
+    int m_samplesLeft;
+
+    Clock::time_point m_start;
+    Clock::duration m_paused;
+    Clock::time_point m_pausedAt;
+
+    std::vector<double> m_samples;
+};
+
+typedef void (*BenchmarkFn)(State &);
+
+class Benchmark
+{
+public:
+    Benchmark(const char *name, BenchmarkFn fn)
+      : m_name(name)
+      , m_fn(fn) { }
+
+    /**
+     *  Run the benchmark with a single argument.
+     */
+    Benchmark* arg(int64_t arg)
+    {
+        m_args.push_back(arg);
+        return this;
+    }
+
+    /**
+     *  Run the benchmark with arguments lo, lo * 10, ..., up to hi.
+     */
+    Benchmark* range(int64_t lo, int64_t hi)
+    {
+        for (int64_t arg = lo; arg <= hi; arg *= 10) {
+            m_args.push_back(arg);
+        }
+
+        return this;
+    }
+
+    const std::string& name() const
+    {
+        return m_name;
+    }
+
+    const std::vector<int64_t>& args() const
+    {
+        return m_args;
+    }
+
+    BenchmarkFn fn() const
+    {
+        return m_fn;
+    }
+
+private:
+    const std::string m_name;
+    const BenchmarkFn m_fn;
+    std::vector<int64_t> m_args;
+};
+
+/**
+ * Register a benchmark. Usually called via the BENCHMARK macro.
+ */
+Benchmark* registerBenchmark(const char *name, BenchmarkFn fn);
+
+}   // end namespace bench
+
+#define BENCHMARK_CONCAT_INNER(a, b) a ## b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT_INNER(a, b)
+
+#define BENCHMARK(fn) \
+    static ::bench::Benchmark *BENCHMARK_CONCAT(s_benchmark_, __LINE__) = \
+        ::bench::registerBenchmark(#fn, fn)
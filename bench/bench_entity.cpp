@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "gameutils/entity.h"
+#include "gameutils/math.h"
+
+#include "bench/bench.h"
+
+using std::make_shared;
+using std::vector;
+
+using gameutils::Component;
+using gameutils::EntityId;
+using gameutils::EntityManager;
+using gameutils::EntityNodes;
+using gameutils::Vec3;
+using gameutils::getComponentAs;
+
+namespace {
+
+struct PositionComponent: public Component
+{
+    Vec3<float> position;
+};
+
+struct VelocityComponent: public Component
+{
+    Vec3<float> velocity;
+};
+
+struct AccountComponent: public Component
+{
+    uint64_t accountId;
+};
+
+// Pooled components, stored by value
+struct Position
+{
+    Vec3<float> position;
+};
+
+struct Velocity
+{
+    Vec3<float> velocity;
+};
+
+const size_t kRandomLookups = 4096;
+
+void populate(EntityManager &em, int64_t count, vector<EntityId> &ids, bool withVelocity)
+{
+    ids.reserve(count);
+    for (int64_t i = 0; i < count; ++i) {
+        const EntityId id = em.createEntity();
+        em.attachComponent(id, make_shared<PositionComponent>());
+        if (withVelocity) {
+            auto pVelocity = make_shared<VelocityComponent>();
+            pVelocity->velocity = Vec3<float>(1.0f, 2.0f, 3.0f);
+            em.attachComponent(id, pVelocity);
+        }
+        ids.push_back(id);
+    }
+}
+
+}   // end anonymous namespace
+
+static void bm_createDestroy(bench::State &state)
+{
+    // Churn against a populated entity table
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, 10000, ids, false);
+
+    while (state.keepRunning()) {
+        const EntityId id = em.createEntity();
+        em.destroyEntity(id);
+    }
+}
+
+BENCHMARK(bm_createDestroy);
+
+static void bm_attachDetach(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, 10000, ids, false);
+
+    const EntityId id = ids[ids.size() / 2];
+    while (state.keepRunning()) {
+        em.attachComponent(id, make_shared<VelocityComponent>());
+        em.detachComponent<VelocityComponent>(id);
+    }
+}
+
+BENCHMARK(bm_attachDetach);
+
+static void bm_getComponentRandom(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<size_t> dist(0, ids.size() - 1);
+    vector<EntityId> lookups(kRandomLookups);
+    for (auto &lookup: lookups) {
+        lookup = ids[dist(rng)];
+    }
+
+    state.setItemsPerIteration(lookups.size());
+    while (state.keepRunning()) {
+        float sum = 0;
+        for (EntityId id: lookups) {
+            sum += em.getComponent<PositionComponent>(id)->position.x;
+        }
+        bench::doNotOptimize(sum);
+    }
+}
+
+BENCHMARK(bm_getComponentRandom)->range(1000, 10000000);
+
+static void bm_iterateSingle(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+
+    auto pNodes = em.getEntityNodes<PositionComponent>();
+
+    state.setItemsPerIteration(pNodes->size());
+    while (state.keepRunning()) {
+        for (auto &node: *pNodes) {
+            auto pPosition = getComponentAs<PositionComponent>(node.second);
+            pPosition->position.x += 1.0f;
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_iterateSingle)->range(1000, 10000000);
+
+static void bm_iterateMulti(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, true);
+
+    auto pNodes = em.getEntityNodes<PositionComponent>();
+    const float dt = 1.0f / 60.0f;
+
+    state.setItemsPerIteration(pNodes->size());
+    while (state.keepRunning()) {
+        for (auto &node: *pNodes) {
+            auto pPosition = getComponentAs<PositionComponent>(node.second);
+            auto pVelocity = em.getComponent<VelocityComponent>(node.first);
+            pPosition->position += pVelocity->velocity * dt;
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_iterateMulti)->range(1000, 10000000);
+
+static void bm_iteratePooledMulti(bench::State &state)
+{
+    EntityManager em;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        const EntityId id = em.createEntity();
+        em.addComponent<Position>(id);
+        em.addComponent<Velocity>(id)->velocity = Vec3<float>(1.0f, 2.0f, 3.0f);
+    }
+
+    gameutils::ComponentPool *pPositions = em.findPool<Position>();
+    gameutils::ComponentPool *pVelocities = em.findPool<Velocity>();
+    const float dt = 1.0f / 60.0f;
+
+    state.setItemsPerIteration(pPositions->size());
+    while (state.keepRunning()) {
+        Position *pPosition = pPositions->data<Position>();
+        const EntityId *pEntities = pPositions->entities();
+        for (size_t i = 0; i < pPositions->size(); ++i) {
+            const Velocity *pVelocity = static_cast<const Velocity *>(pVelocities->find(pEntities[i]));
+            pPosition[i].position += pVelocity->velocity * dt;
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_iteratePooledMulti)->range(1000, 10000000);
+
+static void bm_iterateChunks(bench::State &state)
+{
+    EntityManager em;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        const EntityId id = em.createEntity();
+        em.addComponent<Position>(id);
+        em.addComponent<Velocity>(id)->velocity = Vec3<float>(1.0f, 2.0f, 3.0f);
+    }
+
+    const float dt = 1.0f / 60.0f;
+
+    state.setItemsPerIteration(state.arg());
+    while (state.keepRunning()) {
+        em.forEachChunk<Position, Velocity>(
+            [dt](size_t count, const EntityId *, Position *pPositions, Velocity *pVelocities) {
+                for (size_t i = 0; i < count; ++i) {
+                    pPositions[i].position += pVelocities[i].velocity * dt;
+                }
+            });
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_iterateChunks)->range(1000, 10000000);
+
+static void bm_moveEntities(bench::State &state)
+{
+    // Hand a batch of entities back and forth between two managers
+    EntityManager zoneA;
+    EntityManager zoneB;
+    vector<EntityId> ids;
+    vector<EntityId> newIds;
+    populate(zoneA, state.arg(), ids, true);
+
+    state.setItemsPerIteration(ids.size());
+    while (state.keepRunning()) {
+        zoneA.moveEntities(ids, zoneB, newIds);
+        zoneB.moveEntities(newIds, zoneA, ids);
+    }
+}
+
+BENCHMARK(bm_moveEntities)->range(1000, 100000);
+
+static void bm_reserveEntities(bench::State &state)
+{
+    // Uncontended cost of reserving a block of IDs from the atomic counter
+    EntityManager em;
+    const EntityId blockSize = 64;
+
+    state.setItemsPerIteration(blockSize);
+    while (state.keepRunning()) {
+        bench::doNotOptimize(em.reserveEntities(blockSize));
+    }
+}
+
+BENCHMARK(bm_reserveEntities);
+
+static void bm_resourceAccess(bench::State &state)
+{
+    // Global state stored as a resource, rather than on a dummy entity
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, 10000, ids, false);
+    em.setResource<PositionComponent>();
+
+    while (state.keepRunning()) {
+        em.resource<PositionComponent>().position.x += 1.0f;
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_resourceAccess);
+
+static void bm_dummyEntityAccess(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, 10000, ids, false);
+    const EntityId globals = ids[ids.size() / 2];
+
+    while (state.keepRunning()) {
+        em.getComponent<PositionComponent>(globals)->position.x += 1.0f;
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_dummyEntityAccess);
+
+static void bm_cloneEntity(bench::State &state)
+{
+    EntityManager em;
+    const EntityId id = em.createEntity();
+    em.attachComponent(id, make_shared<PositionComponent>());
+    em.addComponent<Velocity>(id);
+
+    vector<EntityId> newIds;
+    state.setItemsPerIteration(state.arg());
+    while (state.keepRunning()) {
+        em.cloneEntity(id, static_cast<size_t>(state.arg()), newIds);
+        for (EntityId newId: newIds) {
+            em.destroyEntity(newId);
+        }
+    }
+}
+
+BENCHMARK(bm_cloneEntity)->range(100, 10000);
+
+static void populateAccounts(EntityManager &em, int64_t count, vector<uint64_t> &lookups)
+{
+    for (int64_t i = 0; i < count; ++i) {
+        auto pAccount = make_shared<AccountComponent>();
+        pAccount->accountId = static_cast<uint64_t>(i) * 7919;
+        em.attachComponent(em.createEntity(), pAccount);
+    }
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int64_t> dist(0, count - 1);
+    for (auto &lookup: lookups) {
+        lookup = static_cast<uint64_t>(dist(rng)) * 7919;
+    }
+}
+
+static void bm_indexLookup(bench::State &state)
+{
+    EntityManager em;
+    vector<uint64_t> lookups(kRandomLookups);
+    populateAccounts(em, state.arg(), lookups);
+    const auto &index = em.addHashIndex(&AccountComponent::accountId);
+
+    state.setItemsPerIteration(lookups.size());
+    while (state.keepRunning()) {
+        EntityId sum = 0;
+        for (uint64_t accountId: lookups) {
+            sum += index.findFirst(accountId);
+        }
+        bench::doNotOptimize(sum);
+    }
+}
+
+BENCHMARK(bm_indexLookup)->range(1000, 1000000);
+
+static void bm_scanLookup(bench::State &state)
+{
+    // The linear scan that an index replaces
+    EntityManager em;
+    vector<uint64_t> lookups(16);
+    populateAccounts(em, state.arg(), lookups);
+    auto pNodes = em.getEntityNodes<AccountComponent>();
+
+    state.setItemsPerIteration(lookups.size());
+    while (state.keepRunning()) {
+        EntityId sum = 0;
+        for (uint64_t accountId: lookups) {
+            for (const auto &node: *pNodes) {
+                if (static_cast<const AccountComponent &>(*node.second).accountId == accountId) {
+                    sum += node.first;
+                    break;
+                }
+            }
+        }
+        bench::doNotOptimize(sum);
+    }
+}
+
+BENCHMARK(bm_scanLookup)->range(1000, 100000);
+
+struct Targets { };
+
+static void bm_destroyRelationTarget(bench::State &state)
+{
+    // Destroying a target costs O(its relationships), regardless of how
+    // many other relationships exist
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+    for (size_t i = 1; i < ids.size(); ++i) {
+        em.addRelation<Targets>(ids[i], ids[i - 1]);
+    }
+
+    while (state.keepRunning()) {
+        const EntityId target = em.createEntity();
+        for (size_t i = 0; i < 8; ++i) {
+            em.addRelation<Targets>(ids[i], target);
+        }
+        em.destroyEntity(target);
+    }
+}
+
+BENCHMARK(bm_destroyRelationTarget)->range(1000, 1000000);
+
+static void bm_forEachRelated(bench::State &state)
+{
+    // A query on a target visits only its sources, so the cost does not
+    // depend on the number of other entities with the component
+    EntityManager em;
+    const EntityId target = em.createEntity();
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        const EntityId id = em.createEntity();
+        em.addComponent<Position>(id);
+        if (i % 1000 == 0) {
+            em.addRelation<Targets>(id, target);
+        }
+    }
+
+    state.setItemsPerIteration(em.relationSources<Targets>(target).size());
+    while (state.keepRunning()) {
+        em.forEachRelated<Targets, Position>(target, [](EntityId, Position &position) {
+            position.position.x += 1.0f;
+        });
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_forEachRelated)->range(1000, 1000000);
+
+struct Stunned { };
+
+namespace gameutils {
+
+template<>
+struct ComponentStoragePolicy<Stunned>: std::integral_constant<StoragePolicy, TagStorage> { };
+
+}   // end namespace gameutils
+
+static void bm_toggleTag(bench::State &state)
+{
+    // A tag costs one bit per entity, with no payload to construct or move
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+
+    size_t i = 0;
+    while (state.keepRunning()) {
+        const EntityId id = ids[i++ % ids.size()];
+        em.addComponent<Stunned>(id);
+        em.removeComponent<Stunned>(id);
+    }
+}
+
+BENCHMARK(bm_toggleTag)->range(1000, 1000000);
+
+static void bm_togglePooled(bench::State &state)
+{
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+
+    size_t i = 0;
+    while (state.keepRunning()) {
+        const EntityId id = ids[i++ % ids.size()];
+        em.addComponent<Velocity>(id);
+        em.removeComponent<Velocity>(id);
+    }
+}
+
+BENCHMARK(bm_togglePooled)->range(1000, 1000000);
+
+static void bm_toggleEnabled(bench::State &state)
+{
+    // Recycling a pooled entity by disabling it, rather than removing its
+    // components
+    EntityManager em;
+    vector<EntityId> ids;
+    populate(em, state.arg(), ids, false);
+
+    size_t i = 0;
+    while (state.keepRunning()) {
+        const EntityId id = ids[i++ % ids.size()];
+        em.setEntityEnabled(id, false);
+        em.setEntityEnabled(id, true);
+    }
+}
+
+BENCHMARK(bm_toggleEnabled)->range(1000, 1000000);
+
+struct Lifetime
+{
+    uint32_t ticks;
+};
+
+static void bm_expireLifetimes(bench::State &state)
+{
+    // A thousandth of the entities expire each tick, and are replaced. The
+    // cost is proportional to those, rather than to every entity alive.
+    EntityManager em;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        em.setLifetime(em.createEntity(), 1 + i % 1000);
+    }
+
+    while (state.keepRunning()) {
+        const size_t expired = em.advanceLifetimes();
+        for (size_t i = 0; i < expired; ++i) {
+            em.setLifetime(em.createEntity(), 1000);
+        }
+    }
+}
+
+BENCHMARK(bm_expireLifetimes)->range(1000, 1000000);
+
+static void bm_scanLifetimes(bench::State &state)
+{
+    // The equivalent system that visits every lifetime each tick
+    EntityManager em;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        em.addComponent<Lifetime>(em.createEntity(), Lifetime{static_cast<uint32_t>(1 + i % 1000)});
+    }
+
+    size_t expired = 0;
+    while (state.keepRunning()) {
+        em.forEach<Lifetime>([&](EntityId id, Lifetime &lifetime) {
+            if (--lifetime.ticks == 0) {
+                em.markForRemoval(id);
+                expired++;
+            }
+        });
+        em.purge();
+
+        for (; expired > 0; --expired) {
+            em.addComponent<Lifetime>(em.createEntity(), Lifetime{1000});
+        }
+    }
+}
+
+BENCHMARK(bm_scanLifetimes)->range(1000, 1000000);
+
+static void bm_forEachDue(bench::State &state)
+{
+    // Agents updated every 8th tick, so each tick visits an eighth of them
+    EntityManager em;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        const EntityId id = em.createEntity();
+        em.addComponent<Velocity>(id);
+        em.setUpdateInterval(id, 8);
+    }
+
+    uint64_t tick = 0;
+    while (state.keepRunning()) {
+        em.forEachDue<Velocity>(tick++, [](EntityId, Velocity &velocity, uint32_t interval) {
+            velocity.velocity.x += static_cast<float>(interval);
+        });
+    }
+}
+
+BENCHMARK(bm_forEachDue)->range(1000, 100000);
+
+static void bm_deferRemovals(bench::State &state)
+{
+    // Each visit removes a component from another entity, so every removal
+    // is deferred until the end of the iteration
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int64_t i = 0; i < state.arg(); ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<Velocity>(ids.back());
+    }
+
+    state.setItemsPerIteration(state.arg());
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        for (EntityId id: ids) {
+            em.addComponent<Position>(id);
+        }
+        state.resumeTiming();
+
+        size_t i = 0;
+        em.forEach<Velocity>([&](EntityId, Velocity &) {
+            em.removeComponent<Position>(ids[i++]);
+        });
+    }
+}
+
+BENCHMARK(bm_deferRemovals)->range(1000, 100000);
+
+struct HitEvent
+{
+    HitEvent(EntityId target, float damage)
+      : target(target)
+      , damage(damage) { }
+
+    EntityId target;
+    float damage;
+};
+
+static void bm_emitEvents(bench::State &state)
+{
+    // One frame of events emitted, swapped and read back, with warm buffers
+    EntityManager em;
+    em.registerEvent<HitEvent>();
+
+    state.setItemsPerIteration(state.arg());
+    float total = 0.0f;
+    while (state.keepRunning()) {
+        for (int64_t i = 0; i < state.arg(); ++i) {
+            em.emit<HitEvent>(static_cast<EntityId>(i), 1.0f);
+        }
+
+        em.swapEvents();
+        for (const HitEvent &event: em.events<HitEvent>()) {
+            total += event.damage;
+        }
+    }
+    bench::doNotOptimize(total);
+}
+
+BENCHMARK(bm_emitEvents)->range(1000, 100000);
+
+namespace gameutils {
+
+template<>
+struct ChecksumHash<AccountComponent>
+{
+    uint64_t operator()(const AccountComponent &account) const
+    {
+        return account.accountId;
+    }
+};
+
+}   // end namespace gameutils
+
+static void bm_modifyChecksummed(bench::State &state)
+{
+    // Each modification rehashes one component, rather than the whole world
+    EntityManager em;
+    vector<uint64_t> lookups(kRandomLookups);
+    populateAccounts(em, state.arg(), lookups);
+    em.addChecksum<AccountComponent>(1);
+
+    vector<EntityId> entities;
+    for (const auto &node: *em.getEntityNodes<AccountComponent>()) {
+        entities.push_back(node.first);
+    }
+
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<size_t> dist(0, entities.size() - 1);
+    vector<EntityId> ids(kRandomLookups);
+    for (EntityId &id: ids) {
+        id = entities[dist(rng)];
+    }
+
+    state.setItemsPerIteration(ids.size());
+    while (state.keepRunning()) {
+        for (EntityId id: ids) {
+            em.modifyComponent<AccountComponent>(id, [](AccountComponent &account) {
+                account.accountId++;
+            });
+        }
+        bench::doNotOptimize(em.checksum());
+    }
+}
+
+BENCHMARK(bm_modifyChecksummed)->range(1000, 1000000);
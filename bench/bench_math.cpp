@@ -0,0 +1,121 @@
+#include <random>
+#include <vector>
+
+#include "gameutils/math.h"
+
+#include "bench/bench.h"
+
+using std::vector;
+
+using gameutils::Mat4;
+using gameutils::Quat;
+using gameutils::Vec3;
+
+namespace {
+
+// Inputs are processed in batches, so that loop overhead is amortised
+const size_t kBatchSize = 1024;
+
+float randomFloat(std::mt19937 &rng)
+{
+    return std::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
+}
+
+vector<Mat4<float>> randomMat4s(std::mt19937 &rng)
+{
+    vector<Mat4<float>> result;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        Mat4<float> m;
+        for (int j = 0; j < 16; ++j) {
+            m.data()[j] = randomFloat(rng);
+        }
+        result.push_back(m);
+    }
+
+    return result;
+}
+
+vector<Quat<float>> randomQuats(std::mt19937 &rng)
+{
+    vector<Quat<float>> result;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        result.push_back(Quat<float>(randomFloat(rng), randomFloat(rng), randomFloat(rng), randomFloat(rng)));
+    }
+
+    return result;
+}
+
+}   // end anonymous namespace
+
+static void bm_mat4Multiply(bench::State &state)
+{
+    std::mt19937 rng(12345);
+    const vector<Mat4<float>> a = randomMat4s(rng);
+    const vector<Mat4<float>> b = randomMat4s(rng);
+    vector<Mat4<float>> result(kBatchSize);
+
+    state.setItemsPerIteration(kBatchSize);
+    while (state.keepRunning()) {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            result[i] = a[i] * b[i];
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_mat4Multiply);
+
+static void bm_quatMultiply(bench::State &state)
+{
+    std::mt19937 rng(12345);
+    const vector<Quat<float>> a = randomQuats(rng);
+    const vector<Quat<float>> b = randomQuats(rng);
+    vector<Quat<float>> result(kBatchSize);
+
+    state.setItemsPerIteration(kBatchSize);
+    while (state.keepRunning()) {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            result[i] = a[i] * b[i];
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_quatMultiply);
+
+static void bm_quatNormalise(bench::State &state)
+{
+    std::mt19937 rng(12345);
+    const vector<Quat<float>> input = randomQuats(rng);
+    vector<Quat<float>> result(kBatchSize);
+
+    state.setItemsPerIteration(kBatchSize);
+    while (state.keepRunning()) {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            result[i] = input[i].normalised();
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_quatNormalise);
+
+static void bm_vec3Normalise(bench::State &state)
+{
+    std::mt19937 rng(12345);
+    vector<Vec3<float>> input;
+    for (size_t i = 0; i < kBatchSize; ++i) {
+        input.push_back(Vec3<float>(randomFloat(rng), randomFloat(rng), randomFloat(rng)));
+    }
+    vector<Vec3<float>> result(kBatchSize);
+
+    state.setItemsPerIteration(kBatchSize);
+    while (state.keepRunning()) {
+        for (size_t i = 0; i < kBatchSize; ++i) {
+            result[i] = input[i].normalised();
+        }
+        bench::clobberMemory();
+    }
+}
+
+BENCHMARK(bm_vec3Normalise);
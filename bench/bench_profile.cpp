@@ -0,0 +1,13 @@
+#include "gameutils/profile.h"
+
+#include "bench/bench.h"
+
+static void bm_profileZone(bench::State &state)
+{
+    // Measures the cost of an enabled zone, regardless of GAMEUTILS_PROFILE
+    while (state.keepRunning()) {
+        gameutils::profile::Zone zone("bm_profileZone");
+    }
+}
+
+BENCHMARK(bm_profileZone);
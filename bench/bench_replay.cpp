@@ -0,0 +1,97 @@
+#include <memory>
+#include <vector>
+
+#include "gameutils/replay.h"
+
+#include "bench/bench.h"
+
+using gameutils::CommandPlayer;
+using gameutils::CommandRecorder;
+using gameutils::Component;
+using gameutils::EntityId;
+using gameutils::EntityManager;
+using gameutils::ReplayFormat;
+
+namespace {
+
+struct ReplayHealth: public Component
+{
+    int value;
+};
+
+struct ReplayPosition
+{
+    float x, y, z;
+};
+
+struct ReplayVelocity
+{
+    float x, y, z;
+};
+
+// Spawns waves of short-lived entities, with a mix of attached and pooled
+// components, and of immediate and purged destruction
+void recordSession(EntityManager &world, int64_t entityCount)
+{
+    std::vector<EntityId> ids;
+    for (int64_t wave = 0; wave < 4; ++wave) {
+        ids.clear();
+        for (int64_t i = 0; i < entityCount / 4; ++i) {
+            const EntityId id = world.createEntity();
+            world.addComponent<ReplayPosition>(id);
+            if (i % 2 == 0) {
+                world.addComponent<ReplayVelocity>(id);
+            }
+            if (i % 4 == 0) {
+                world.attachComponent(id, std::make_shared<ReplayHealth>());
+            }
+            ids.push_back(id);
+        }
+
+        for (size_t i = 0; i < ids.size(); ++i) {
+            if (i % 3 == 0) {
+                world.removeComponent<ReplayVelocity>(ids[i]);
+            } else if (i % 3 == 1) {
+                world.markForRemoval(ids[i]);
+            } else {
+                world.destroyEntity(ids[i]);
+            }
+        }
+
+        world.purge();
+    }
+}
+
+}   // end anonymous namespace
+
+static void bm_replaySession(bench::State &state)
+{
+    // Throughput of replaying a recorded session into an empty world
+    ReplayFormat format;
+    format.registerComponent<ReplayHealth>(1);
+    format.registerComponent<ReplayPosition>(2);
+    format.registerComponent<ReplayVelocity>(3);
+
+    EntityManager world;
+    CommandRecorder recorder(world, format);
+    recordSession(world, state.arg());
+    recorder.stop();
+
+    CommandPlayer player(format);
+    player.load(recorder.data());
+
+    state.setItemsPerIteration(player.size());
+    while (state.keepRunning()) {
+        state.pauseTiming();
+        std::unique_ptr<EntityManager> pReplayed(new EntityManager());
+        state.resumeTiming();
+
+        bench::doNotOptimize(player.replay(*pReplayed).failed);
+
+        state.pauseTiming();
+        pReplayed.reset();
+        state.resumeTiming();
+    }
+}
+
+BENCHMARK(bm_replaySession)->range(1000, 100000);
@@ -0,0 +1,423 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <utility>
+
+#include "bench/compare.h"
+
+namespace bench {
+
+//----------------------------------------------------------------------------
+//
+// JSON
+//
+// Just enough of a JSON parser to read the output of bench_runner. Values
+// that are not needed for comparison are parsed and discarded.
+//
+//----------------------------------------------------------------------------
+
+namespace {
+
+class JsonReader
+{
+public:
+    JsonReader(const std::string &text, std::vector<Result> &results)
+      : m_text(text)
+      , m_pos(0)
+      , m_results(results) { }
+
+    bool read(std::string &error)
+    {
+        skipWhitespace();
+        if (!expect('{')) {
+            return fail(error);
+        }
+
+        // Top level object; only the 'benchmarks' array is of interest
+        bool first = true;
+        while (true) {
+            skipWhitespace();
+            if (consume('}')) {
+                skipWhitespace();
+                return m_pos == m_text.size() || fail(error);
+            }
+
+            std::string key;
+            if ((!first && !expect(',')) || !readKey(key)) {
+                return fail(error);
+            }
+            first = false;
+
+            if (key == "benchmarks") {
+                if (!readBenchmarks()) {
+                    return fail(error);
+                }
+            } else if (!skipValue()) {
+                return fail(error);
+            }
+        }
+    }
+
+private:
+    bool fail(std::string &error)
+    {
+        std::ostringstream message;
+        message << "Invalid JSON at offset " << m_pos;
+        error = message.str();
+        return false;
+    }
+
+    void skipWhitespace()
+    {
+        while (m_pos < m_text.size() && isspace(static_cast<unsigned char>(m_text[m_pos]))) {
+            m_pos++;
+        }
+    }
+
+    bool consume(char c)
+    {
+        skipWhitespace();
+        if (m_pos < m_text.size() && m_text[m_pos] == c) {
+            m_pos++;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool expect(char c)
+    {
+        return consume(c);
+    }
+
+    bool readString(std::string &str)
+    {
+        if (!expect('"')) {
+            return false;
+        }
+
+        str.clear();
+        while (m_pos < m_text.size()) {
+            const char c = m_text[m_pos++];
+            if (c == '"') {
+                return true;
+            } else if (c == '\\') {
+                if (m_pos >= m_text.size()) {
+                    return false;
+                }
+                str += m_text[m_pos++];
+            } else {
+                str += c;
+            }
+        }
+
+        return false;
+    }
+
+    bool readKey(std::string &key)
+    {
+        return readString(key) && expect(':');
+    }
+
+    bool readNumber(double &value)
+    {
+        skipWhitespace();
+        const char *begin = m_text.c_str() + m_pos;
+        char *end = nullptr;
+        value = strtod(begin, &end);
+        if (end == begin) {
+            return false;
+        }
+
+        m_pos += end - begin;
+        return true;
+    }
+
+    bool readNumbers(std::vector<double> &values)
+    {
+        if (!expect('[')) {
+            return false;
+        }
+
+        values.clear();
+        if (consume(']')) {
+            return true;
+        }
+
+        do {
+            double value;
+            if (!readNumber(value)) {
+                return false;
+            }
+            values.push_back(value);
+        } while (consume(','));
+
+        return expect(']');
+    }
+
+    bool readBenchmark(Result &result)
+    {
+        if (!expect('{')) {
+            return false;
+        }
+
+        if (consume('}')) {
+            return true;
+        }
+
+        do {
+            std::string key;
+            if (!readKey(key)) {
+                return false;
+            }
+
+            bool ok;
+            if (key == "name") {
+                ok = readString(result.name);
+            } else if (key == "samples") {
+                ok = readNumbers(result.samples);
+            } else if (key == "min") {
+                ok = readNumber(result.min);
+            } else if (key == "median") {
+                ok = readNumber(result.median);
+            } else if (key == "p99") {
+                ok = readNumber(result.p99);
+            } else if (key == "mean") {
+                ok = readNumber(result.mean);
+            } else if (key == "stddev") {
+                ok = readNumber(result.stddev);
+            } else {
+                ok = skipValue();
+            }
+
+            if (!ok) {
+                return false;
+            }
+        } while (consume(','));
+
+        return expect('}') && !result.name.empty();
+    }
+
+    bool readBenchmarks()
+    {
+        if (!expect('[')) {
+            return false;
+        }
+
+        if (consume(']')) {
+            return true;
+        }
+
+        do {
+            Result result;
+            if (!readBenchmark(result)) {
+                return false;
+            }
+            m_results.push_back(result);
+        } while (consume(','));
+
+        return expect(']');
+    }
+
+    bool skipValue()
+    {
+        skipWhitespace();
+        if (m_pos >= m_text.size()) {
+            return false;
+        }
+
+        const char c = m_text[m_pos];
+        if (c == '"') {
+            std::string ignored;
+            return readString(ignored);
+        } else if (c == '{' || c == '[') {
+            const char close = c == '{' ? '}' : ']';
+            m_pos++;
+            if (consume(close)) {
+                return true;
+            }
+
+            do {
+                if (c == '{') {
+                    std::string ignored;
+                    if (!readKey(ignored)) {
+                        return false;
+                    }
+                }
+                if (!skipValue()) {
+                    return false;
+                }
+            } while (consume(','));
+
+            return expect(close);
+        } else if (m_text.compare(m_pos, 4, "true") == 0 || m_text.compare(m_pos, 4, "null") == 0) {
+            m_pos += 4;
+            return true;
+        } else if (m_text.compare(m_pos, 5, "false") == 0) {
+            m_pos += 5;
+            return true;
+        }
+
+        double ignored;
+        return readNumber(ignored);
+    }
+
+    const std::string &m_text;
+    size_t m_pos;
+    std::vector<Result> &m_results;
+};
+
+}   // end anonymous namespace
+
+bool readResults(const std::string &path, std::vector<Result> &results, std::string &error)
+{
+    std::ifstream in(path.c_str());
+    if (!in) {
+        error = "Could not open " + path;
+        return false;
+    }
+
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    return parseResults(buffer.str(), results, error);
+}
+
+bool parseResults(const std::string &text, std::vector<Result> &results, std::string &error)
+{
+    std::vector<Result> parsed;
+    JsonReader reader(text, parsed);
+    if (!reader.read(error)) {
+        return false;
+    }
+
+    results.insert(results.end(), parsed.begin(), parsed.end());
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+// Statistics
+//
+//----------------------------------------------------------------------------
+
+double mannWhitneyPValue(const std::vector<double> &baseline, const std::vector<double> &current)
+{
+    const size_t n1 = current.size();
+    const size_t n2 = baseline.size();
+    if (n1 == 0 || n2 == 0) {
+        return 1.0;
+    }
+
+    // Pool the samples, remembering which set each came from
+    std::vector<std::pair<double, bool>> pooled;
+    pooled.reserve(n1 + n2);
+    for (double sample: current) {
+        pooled.push_back(std::make_pair(sample, true));
+    }
+    for (double sample: baseline) {
+        pooled.push_back(std::make_pair(sample, false));
+    }
+    std::sort(pooled.begin(), pooled.end());
+
+    // Sum the ranks of the current samples, assigning tied values the
+    // average of their ranks
+    const size_t n = pooled.size();
+    double rankSum = 0;
+    double tieCorrection = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && pooled[j].first == pooled[i].first) {
+            j++;
+        }
+
+        const double ties = static_cast<double>(j - i);
+        const double rank = 0.5 * static_cast<double>(i + 1 + j);
+        for (size_t k = i; k < j; ++k) {
+            if (pooled[k].second) {
+                rankSum += rank;
+            }
+        }
+
+        tieCorrection += ties * ties * ties - ties;
+        i = j;
+    }
+
+    // Normal approximation, with corrections for ties and continuity
+    const double u = rankSum - 0.5 * n1 * (n1 + 1);
+    const double mean = 0.5 * n1 * n2;
+    const double variance = n1 * n2 / 12.0 *
+        ((n + 1) - tieCorrection / (static_cast<double>(n) * (n - 1)));
+    if (variance <= 0) {
+        return 1.0;
+    }
+
+    const double z = (u - mean - 0.5) / std::sqrt(variance);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+int compareResults(FILE *out, const CompareOptions &options,
+    const std::vector<Result> &baseline, const std::vector<Result> &current)
+{
+    std::map<std::string, const Result *> baselineByName;
+    for (const Result &result: baseline) {
+        baselineByName[result.name] = &result;
+    }
+
+    fprintf(out, "\n%-40s %12s %12s %9s %9s %9s  %s\n",
+        "benchmark", "base median", "median", "delta %", "min %", "p-value", "verdict");
+
+    int regressions = 0;
+    for (const Result &result: current) {
+        auto iter = baselineByName.find(result.name);
+        if (iter == baselineByName.end()) {
+            fprintf(out, "%-40s %12s %12.2f %9s %9s %9s  %s\n",
+                result.name.c_str(), "-", result.median, "-", "-", "-", "new");
+            continue;
+        }
+        const Result &base = *iter->second;
+        baselineByName.erase(iter);
+
+        const double delta = base.median > 0 ? result.median / base.median - 1.0 : 0.0;
+        const double minDelta = base.min > 0 ? result.min / base.min - 1.0 : 0.0;
+        const double pSlower = mannWhitneyPValue(base.samples, result.samples);
+        const double pFaster = mannWhitneyPValue(result.samples, base.samples);
+
+        const char *verdict = "same";
+        if (pSlower < options.alpha && delta > options.threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (pFaster < options.alpha && -delta > options.threshold) {
+            verdict = "improved";
+        }
+
+        fprintf(out, "%-40s %12.2f %12.2f %+9.1f %+9.1f %9.4f  %s\n",
+            result.name.c_str(), base.median, result.median,
+            100.0 * delta, 100.0 * minDelta, std::min(pSlower, pFaster), verdict);
+    }
+
+    // Benchmarks that were not run, in baseline order
+    int missing = 0;
+    for (const Result &result: baseline) {
+        auto iter = baselineByName.find(result.name);
+        if (iter != baselineByName.end() && iter->second == &result) {
+            fprintf(out, "%-40s %12.2f %12s %9s %9s %9s  %s\n",
+                result.name.c_str(), result.median, "-", "-", "-", "-", "missing");
+            missing++;
+        }
+    }
+
+    fprintf(out, "\n%d regression(s) at alpha=%g, threshold=%g%%",
+        regressions, options.alpha, 100.0 * options.threshold);
+    if (missing > 0) {
+        fprintf(out, ", %d missing", missing);
+    }
+    fprintf(out, "\n");
+
+    return regressions;
+}
+
+}   // end namespace bench
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench/bench.h"
+
+/**
+ * Comparison of benchmark results against a baseline.
+ *
+ * A baseline is a JSON file previously written by bench_runner using --json.
+ * For each benchmark that appears in both the baseline and the current run,
+ * the raw samples are compared using a one-sided Mann-Whitney U test. This
+ * makes no assumptions about the distribution of the samples, which tend to
+ * be skewed by outliers (interrupts, frequency scaling, etc).
+ *
+ * A benchmark is considered to have regressed if the test is significant and
+ * the median has slowed down by more than a minimum threshold. The threshold
+ * prevents small but consistent shifts from failing the comparison.
+ * Benchmarks that are only in the baseline are reported as missing, but are
+ * not counted as regressions, since the current run may have been filtered.
+ *
+ */
+namespace bench {
+
+struct CompareOptions
+{
+    CompareOptions()
+      : alpha(0.01)
+      , threshold(0.05) { }
+
+    double alpha;       // Significance level for the Mann-Whitney U test
+    double threshold;   // Minimum relative slowdown of the median
+};
+
+/**
+ * Read results from a JSON file written by bench_runner. Returns false and
+ * sets 'error' if the file could not be read or parsed.
+ */
+bool readResults(const std::string &path, std::vector<Result> &results, std::string &error);
+
+/**
+ * Parse results from the contents of a JSON file written by bench_runner.
+ * Returns false and sets 'error' if the text is malformed or truncated, or a
+ * benchmark has no name, in which case 'results' is left unchanged.
+ */
+bool parseResults(const std::string &text, std::vector<Result> &results, std::string &error);
+
+/**
+ * Probability of observing samples 'current' at least as slow as they are,
+ * assuming they come from the same distribution as 'baseline'.
+ */
+double mannWhitneyPValue(const std::vector<double> &baseline, const std::vector<double> &current);
+
+/**
+ * Print a table comparing 'current' against 'baseline', and return the number
+ * of benchmarks that have regressed.
+ */
+int compareResults(FILE *out, const CompareOptions &options,
+    const std::vector<Result> &baseline, const std::vector<Result> &current);
+
+}   // end namespace bench
@@ -1,20 +1,39 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <typeindex>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "gameutils/profile.h"
+
 /**
  * This header contains an implementation of an entity management system.
  *
- * This is an early stage (simplistic) implementation that does not make any
- * particular effort to optimise memory layout, management
- * overhead, etc.
+ * Components can be attached as individually allocated objects, which is
+ * flexible but costs a heap allocation and map nodes per component, or
+ * stored by value in dense pools and other stores chosen per type (see
+ * 'Component Pools' and 'Storage Policies'). The memory used by each can be
+ * measured using collectStats (see 'Memory Statistics').
  *
  *
  * Entities
@@ -94,292 +113,8104 @@
  *
  *     em.purge();
  *
+ * Alternatively, see 'Structural Changes During Iteration' below.
+ *
+ *
+ * Component Pools
+ * ---------------
+ * Components can also be stored by value, in a dense pool for each type.
+ * Pooled components do not need to subclass Component, and are constructed
+ * in place:
+ *
+ *     struct Velocity {
+ *         Velocity(float x, float y, float z) : value(x, y, z) {}
+ *         Vec3<float> value;
+ *     };
+ *
+ *     Velocity *pVelocity = em.addComponent<Velocity>(id, 0.0f, 1.0f, 0.0f);
+ *     em.removeComponent<Velocity>(id);
+ *
+ * Pooled components are retrieved using findComponent, which returns a plain
+ * pointer. Such pointers are invalidated whenever a component of the same
+ * type is added or removed, or the pool is reordered by forEachChunk.
+ *
+ * Each pool stores its components contiguously, alongside the IDs of the
+ * entities that own them, so a pool can be processed in a single loop:
+ *
+ *     ComponentPool *pPool = em.findPool<Velocity>();
+ *     Velocity *pVelocities = pPool->data<Velocity>();
+ *     for (size_t i = 0; i < pPool->size(); ++i) {
+ *         pVelocities[i].value.y -= 9.8f * dt;
+ *     }
+ *
+ * Pools rely on the layout of each type, as recorded in the ComponentRegistry.
+ * Components that are trivially relocatable are moved using memcpy (when a
+ * pool grows, when a removed component's slot is filled, or when an entity is
+ * moved to another manager), and no destructors are called for components
+ * that are trivially destructible. Types that are not trivially copyable, but
+ * can safely be moved using memcpy, can opt in by specialising
+ * IsTriviallyRelocatable.
+ *
+ *
+ * Storage Policies
+ * ----------------
+ * Pools suit components that most entities have, and that are processed in
+ * bulk. Other types can select a different layout by specialising
+ * ComponentStoragePolicy:
+ *
+ *     template<>
+ *     struct ComponentStoragePolicy<Frozen>:
+ *         std::integral_constant<StoragePolicy, TagStorage> { };
+ *
+ * The policies are:
+ *
+ *   - PooledStorage: the dense pool described above. This is the default.
+ *   - SparseStorage: a hash map from entity ID to component, so memory is
+ *     only used by entities that have the component. Suits rare types.
+ *   - StableStorage: pages of fixed-size slots. Components are never moved,
+ *     so pointers to them remain valid until they are removed. Suits large
+ *     types, and types that other code points to.
+ *   - TagStorage: a bitset with one bit per entity, for empty types.
+ *
+ * Components of every policy are used through the same functions:
+ * addComponent, removeComponent, findComponent, hasComponent and forEach. A
+ * policy can therefore be changed without changing the systems that use the
+ * type. Destroying, moving, merging and cloning entities handles components
+ * of every policy.
+ *
+ * Stable slots can hold types that cannot be moved or copied. An entity with
+ * such a component cannot be moved or copied to another manager, and a
+ * merge that would have to move one is refused (see 'Merging' below).
+ *
+ * Every policy stores whole components. There is no policy that splits the
+ * fields of a type into separate arrays: fields that are processed
+ * separately should be separate pooled components, which forEachChunk
+ * already presents as parallel arrays.
+ *
+ * The policy is recorded in the ComponentTypeInfo of the type. Only pooled
+ * types can be used with findPool, forEachChunk, and the overload of
+ * addComponent that takes a ComponentTypeInfo. Iterating over a type that is
+ * not pooled copies its list of entities first, so forEach allows the same
+ * structural changes for every policy.
+ *
+ *
+ * Chunk Iteration
+ * ---------------
+ * Entities that have pooled components of several types can be processed in
+ * chunks, with a plain array for each type:
+ *
+ *     em.forEachChunk<Position, Velocity>(
+ *         [dt](size_t count, const EntityId *pEntities, Position *pPositions,
+ *              Velocity *pVelocities) {
+ *             for (size_t i = 0; i < count; ++i) {
+ *                 pPositions[i].value += pVelocities[i].value * dt;
+ *             }
+ *         });
+ *
+ * Element i of each array belongs to entity pEntities[i], so loops like this
+ * one can be vectorized by the compiler. Each array begins on a cache line
+ * boundary, and chunks hold at most EntityManager::ChunkSize entities.
+ *
+ * To make this possible, the pools are reordered so that matching entities
+ * come first, in the same order in every pool. The order is only rebuilt
+ * after components of one of the types have been added or removed, so in
+ * the steady state a query costs nothing more than the loop itself. Queries
+ * that share a type, but not all of their types, will reorder that type's
+ * pool each time they alternate.
+ *
+ *
+ * Structural Changes During Iteration
+ * -----------------------------------
+ * The forEach and forEachAttached functions visit each pooled or attached
+ * component of a type, and allow entities to be destroyed, or components to
+ * be removed or detached, from within the loop:
+ *
+ *     em.forEach<Projectile>([&](EntityId id, Projectile &projectile) {
+ *         EntityId target = findCollision(projectile);
+ *         if (target != InvalidEntity) {
+ *             em.destroyEntity(target);
+ *             em.destroyEntity(id);
+ *         }
+ *     });
+ *
+ * Changes to the entity being visited take effect immediately. Pools are
+ * visited from back to front, so the component that is moved into the place
+ * of a removed component has already been visited. Changes to any other
+ * entity (or to any entity, within a nested loop) are deferred until the
+ * outermost loop is complete, and entities that are due to be destroyed, or
+ * to lose the component being visited, are skipped. The list of deferred
+ * changes is reused, so neither function allocates in the steady state.
+ *
+ * Components added during iteration may not be visited. Adding a pooled
+ * component of the type being visited may move the pool, which invalidates
+ * the reference passed to the loop body. destroyAllEntities must not be
+ * called during iteration.
+ *
+ * Moving an entity to another manager cannot be deferred, since the new ID
+ * is returned immediately. Only the entity being visited can be moved, and
+ * moving any other entity fails in the same way as a missing entity. merge
+ * does nothing, and returns 0, while either manager is iterating.
+ *
+ *
+ * Enabling and Disabling
+ * ----------------------
+ * Entities that should not be processed for a while (e.g. AI that is off
+ * screen, or pooled projectiles that are waiting to be reused) can be
+ * disabled, rather than having their components removed:
+ *
+ *     em.setEntityEnabled(id, false);
+ *
+ * Individual components added using addComponent can be disabled in the same
+ * way, using setComponentEnabled<T>. Both are stored as one bit per entity
+ * in an EntityBitset, so toggling them is O(1), does not allocate in the
+ * steady state, and is not a structural change, so it is allowed during
+ * iteration.
+ *
+ * forEach, forEachAttached and forEachChunk skip disabled entities, and
+ * disabled components, unless they are passed IncludeDisabled. Lookups by
+ * entity ID, such as findComponent, are not affected. When anything is
+ * disabled, forEachChunk splits its chunks around the disabled entities, so
+ * chunks may be shorter, and only the first begins on a cache line boundary.
+ *
+ * Moving, copying and merging entities keeps their enabled state, while
+ * entities instantiated from a prefab are always enabled.
+ *
+ *
+ * Lifetimes
+ * ---------
+ * Entities with a finite lifetime (e.g. particles, projectiles and decals)
+ * can be destroyed automatically, rather than by a system that checks every
+ * entity each tick:
+ *
+ *     em.setLifetime(id, 90);
+ *
+ *     // Once per tick
+ *     em.advanceLifetimes();
+ *
+ * Lifetimes are measured in ticks, which only advance when advanceLifetimes
+ * is called. Expiry times are held in an ExpiryWheel, so setting or clearing
+ * a lifetime is O(1), and finding the entities that expire costs O(1) plus
+ * the number of those entities. Expired entities are destroyed together, at
+ * the end of the call, visiting each pool and store once for the whole batch
+ * and skipping those that are empty. Destroying them costs O(number expired)
+ * plus, for each component type in use, the smaller of the number expired
+ * and the number of components of that type.
+ *
+ * Moving, copying and merging entities keeps their remaining lifetimes,
+ * relative to the tick of the destination manager.
+ *
+ *
+ * Update Intervals
+ * ----------------
+ * Entities that are less important (e.g. distant NPCs) can be given an
+ * update interval, so that systems only process them every few ticks:
+ *
+ *     em.setUpdateInterval(id, 8);
+ *
+ *     em.forEachDue<AiState>(tick, [&](EntityId id, AiState &ai, uint32_t interval) {
+ *         think(ai, interval * dt);
+ *     });
+ *
+ * forEachDue only visits entities that have been given an interval, and
+ * whose bucket is due on 'tick'. Intervals are rounded up to a power of two,
+ * up to UpdateBuckets::MaxInterval. Each entity is placed in the bucket that
+ * keeps the number of entities due on each tick most even, so the work of a
+ * system is spread across ticks rather than arriving in spikes. Each tick
+ * costs the number of entities that are due, and the entities of a bucket
+ * are stored contiguously.
+ *
+ * forEachDue copies the due entities first, so it allows the same structural
+ * changes as forEach, as well as changing update intervals. Disabled entities
+ * and components are skipped in the same way. Moving, copying and merging
+ * entities keeps their intervals, but not their buckets.
+ *
+ *
+ * Shared Components
+ * -----------------
+ * Components that hold configuration (e.g. a mesh reference or AI profile)
+ * often have the same value for thousands of entities. Such components can
+ * be shared, so that each distinct value is stored only once:
+ *
+ *     em.setSharedComponent(id, MeshRef("crate.mesh"));
+ *     const MeshRef *pMesh = em.findSharedComponent<MeshRef>(id);
+ *
+ * Values are interned by comparing them with operator==, after hashing them
+ * using SharedComponentHash (which defaults to std::hash). Shared values are
+ * immutable, but setting a new value for an entity moves it to a different
+ * group. A value is destroyed once no entity refers to it.
+ *
+ * Entities can be visited in groups that share the same value, e.g. to batch
+ * draw calls:
+ *
+ *     em.forEachSharedGroup<MeshRef>(
+ *         [](const MeshRef &mesh, const EntityId *pEntities, size_t count) {
+ *             drawInstanced(mesh, pEntities, count);
+ *         });
+ *
+ *
+ * Resources
+ * ---------
+ * Global state, such as the current time or input, can be stored as a
+ * resource of the EntityManager, rather than on a dummy entity. There is at
+ * most one resource of each type:
+ *
+ *     em.setResource<Time>(0.0f);
+ *     em.resource<Time>().elapsed += dt;
+ *
+ * Each resource type is assigned a dense index the first time it is used, so
+ * access is O(1) and does not involve any map lookups, reference counting or
+ * virtual calls: after the first use, it is a load of the index, a bounds
+ * check and a load of the value pointer. Each value is a separate allocation,
+ * made when the resource is set.
+ * resource<T>() throws if the resource has not been set, while findResource
+ * returns nullptr. Resources are not affected by destroyAllEntities, and are
+ * not moved or copied between managers.
+ *
+ * Systems can describe the resources they use with a ResourceAccess, which
+ * a scheduler can use to run systems concurrently when their accesses do not
+ * conflict. Any number of systems may read the same resource at once:
+ *
+ *     ResourceAccess physics = ResourceAccess().read<Time>().write<PhysicsSettings>();
+ *     ResourceAccess ai = ResourceAccess().read<Time>();
+ *     physics.conflictsWith(ai);   // false
+ *
+ * Setting or removing a resource is a structural change, but modifying the
+ * value of an existing resource is not.
+ *
+ *
+ * Events
+ * ------
+ * Systems can communicate using typed events, rather than ad-hoc vectors of
+ * structs. Events are emitted during one phase, and read during the next:
+ *
+ *     em.registerEvent<Damage>();
+ *
+ *     // Any thread, during the update phase
+ *     em.emit<Damage>(target, 10.0f);
+ *
+ *     // At the phase boundary, on the thread that owns the EntityManager
+ *     em.swapEvents();
+ *
+ *     // During the next phase
+ *     for (const Damage &damage: em.events<Damage>()) { ... }
+ *
+ * Each event type has a buffer per thread, so emit does not take any locks,
+ * and events from different threads do not share cache lines. swapEvents
+ * discards the events that were readable, and gathers those emitted since
+ * the last swap into a single contiguous array, which events() returns. The
+ * events of each thread stay in the order they were emitted, but the order
+ * of the threads is unspecified. Buffers are cleared rather than freed, so
+ * once they have grown to fit a frame's events, emitting does not allocate.
+ *
+ * Each event type is assigned a dense index, in the same way as resources.
+ * Registering an event type is a structural change. emit registers the type
+ * if needed, but only on the thread that owns the EntityManager, so types
+ * that are emitted from worker threads must be registered beforehand. emit
+ * must not overlap with swapEvents. Events are not affected by
+ * destroyAllEntities, and are not moved or copied between managers.
+ *
+ * Each thread that emits events is assigned one of
+ * GAMEUTILS_ENTITY_EVENT_THREADS buffer slots (64 by default) until it exits.
+ *
+ *
+ * Value Indexes
+ * -------------
+ * Entities can be found by the value of a field of a component, without
+ * scanning every component of its type, by adding a secondary index:
+ *
+ *     auto &byAccount = em.addHashIndex(&PlayerComponent::accountId);
+ *     auto &byTeam = em.addOrderedIndex(&UnitComponent::team);
+ *
+ *     EntityId player = byAccount.findFirst(accountId);
+ *     auto units = byTeam.range(2, 4);  // Units with 2 <= team <= 4
+ *
+ * A HashIndex finds entities with a given value in O(1), while an
+ * OrderedIndex supports range queries in O(log n). Indexes are kept up to
+ * date as components are attached and detached, and as entities are
+ * destroyed, moved or merged. Since components are modified in place, the
+ * index cannot see changes to an indexed field; modify such fields using
+ * modifyComponent, or call reindexComponent afterwards:
+ *
+ *     em.modifyComponent<UnitComponent>(id, [](UnitComponent &unit) {
+ *         unit.team = 3;
+ *     });
+ *
+ * Attached components are indexed if their most-derived type is the indexed
+ * type. Pooled and stored components (see addComponent) are indexed too, as
+ * the index observes the pool or store for its type. Shared components are
+ * not indexed, since one value belongs to many entities; find those with
+ * forEachSharedGroup instead.
+ *
+ * Indexes are owned by the EntityManager, and remain valid until removed
+ * using removeIndex. Each index adds a small cost to every change to a
+ * component of its type, and there is no cost for types without indexes.
+ *
+ *
+ * Checksums
+ * ---------
+ * In lockstep games, peers can detect a desync by comparing checksums of the
+ * world each tick. Rather than hashing every component each time, a
+ * checksum of a component type can be kept up to date in the same way as a
+ * value index. Each type is given an ID that is the same on every peer:
+ *
+ *     em.addChecksum<UnitComponent>(1);
+ *     em.addChecksum<HealthComponent>(2);
+ *
+ *     uint64_t checksum = em.checksum();   // O(types)
+ *
+ * Components are hashed using ChecksumHash<T>, which should be specialised
+ * for each type. The checksum of a type is the sum of the hash of each
+ * entity, which mixes its ID with the hash of its component, so it does not
+ * depend on the order in which components were attached. As with indexes,
+ * modify components using modifyComponent, or call reindexComponent
+ * afterwards, so that the checksum sees the change. em.checksum() combines
+ * the checksum of each type with its ID, so peers may add the types in any
+ * order. Like indexes, checksums cover attached, pooled and stored
+ * components, but not shared components, and em.checksum() only covers the
+ * types that have been given a checksum.
+ *
+ * When the checksums differ, the diverging entities can be found by
+ * comparing the bucket values of each type (see ComponentChecksum), and then
+ * the hashes of the entities in those buckets that differ:
+ *
+ *     const uint64_t *pLocal = units.bucketValues();
+ *     for (size_t b = 0; b < ComponentChecksum::BucketCount; ++b) {
+ *         if (pLocal[b] != remoteBuckets[b]) {
+ *             units.forEachInBucket(b, [&](EntityId id, uint64_t hash) { ... });
+ *         }
+ *     }
+ *
+ *
+ * Relationships
+ * -------------
+ * Entities can be linked by relationships of any number of kinds, each
+ * identified by an empty tag type. Each relationship is a (source, target)
+ * pair, and an entity can have many targets and many sources:
+ *
+ *     struct Targets { };
+ *
+ *     em.addRelation<Targets>(turret, ship);
+ *     em.relationTargets<Targets>(turret);     // What does the turret target?
+ *     em.relationSources<Targets>(ship);       // Who targets the ship?
+ *
+ * Forward and reverse indexes are maintained for each kind, so both queries
+ * are O(1), and return the matching entities without scanning any
+ * components. Destroying an entity removes its relationships as either
+ * source or target, in O(number of relationships involving the entity).
+ *
+ * Queries can match on a relationship target. forEachRelated visits the
+ * components of the sources of a target, in O(number of sources):
+ *
+ *     em.forEachRelated<Targets, Turret>(ship, [](EntityId id, Turret &turret) {
+ *         turret.fire();
+ *     });
+ *
+ * Relationships are kept by merge (with IDs remapped), but are dropped when
+ * an entity is moved to another manager, and are not copied by copyEntity,
+ * cloneEntity or prefabs.
+ *
+ *
+ * Cloning and Prefabs
+ * -------------------
+ * An entity can be copied any number of times, along with all of its
+ * components:
+ *
+ *     std::vector<EntityId> newIds;
+ *     em.cloneEntity(slime, 2, newIds);
+ *
+ * The components of an entity can also be copied into a Prefab, which can be
+ * instantiated later, even after the original entity has been destroyed:
+ *
+ *     Prefab prefab;
+ *     em.makePrefab(projectile, prefab);
+ *     em.instantiate(prefab, 100, newIds);
+ *
+ * Components are copied using the functions in their ComponentTypeInfo, so
+ * the same requirements apply as for copyEntity. Each pool is grown once for
+ * the whole batch, and each component type is looked up once, rather than
+ * once for each new entity.
+ *
+ *
+ * Memory Statistics
+ * -----------------
+ * The memory used by an EntityManager can be sampled at any time:
+ *
+ *     MemoryStats stats;
+ *     em.collectStats(stats);
+ *
+ * The statistics include a breakdown for each component type, as well as
+ * totals for the entity table. Byte counts for container nodes and shared_ptr
+ * control blocks are estimates, since the STL does not expose the exact size
+ * of its allocations. Component payload sizes are only known for types that
+ * have been attached using a shared_ptr to their most-derived type (or have
+ * otherwise been named using a template function such as getEntityNodes).
+ * The memory used by value indexes and checksums, and by relationships, is
+ * totalled separately in indexBytes and relationBytes, which are also
+ * included in bookkeepingBytes.
+ *
+ * Collecting statistics is O(number of component, resource, event and
+ * relationship types, plus the number of indexes). It does not depend on the
+ * number of entities, components, shared values or scheduled lifetimes,
+ * since the structures that hold those keep running totals of the memory
+ * they use. If the same MemoryStats object is reused, no allocations will
+ * occur once it has grown to fit the number of component types, so it is
+ * safe to sample every frame.
+ *
+ *
+ * Recording
+ * ---------
+ * The structural changes made to an EntityManager can be observed by setting
+ * an EntityRecorder, which is called when each entity is created or
+ * destroyed, and each component is attached, detached, added or removed:
+ *
+ *     em.setRecorder(&recorder);
+ *
+ * Creation and additions are reported after they are made, and destruction
+ * and removals before, so the recorder can still inspect the entity.
+ * Changes are reported when they are applied, so a change deferred during
+ * iteration is reported once the iteration ends, and only if it still has
+ * an effect. markForRemoval and purge are reported as such, rather than as
+ * the destruction of each marked entity.
+ *
+ * cloneEntity, instantiate and transferEntities report each entity that
+ * they create, followed by each of its components. Moving an entity away
+ * is reported as its destruction. merge reports nothing, since the merged
+ * entities were not created by this manager. Without a recorder, the cost
+ * is a single branch per change. replay.h uses this to record sessions to a
+ * compact log, which can be replayed as a benchmark.
+ *
+ *
+ * Multiple Managers
+ * -----------------
+ * An application may use several EntityManagers, e.g. one for each zone of
+ * a sharded simulation. Entities can be moved or copied between managers,
+ * either individually or in batches:
+ *
+ *     EntityId newId = zoneA.moveEntity(id, zoneB);
+ *
+ *     std::vector<EntityId> newIds;
+ *     zoneA.moveEntities(ids, zoneB, newIds);
+ *
+ * Entities are assigned new IDs in the destination manager. Batch functions
+ * report the new ID of each entity at the same position in the output vector,
+ * or InvalidEntity if that entity could not be transferred.
+ *
+ * Moving an entity transfers ownership of its existing components, so no
+ * components are allocated or copied. Copying an entity copy-constructs each
+ * of its components, which requires that every component was attached using
+ * a shared_ptr to its most-derived type, and that the type is copyable.
+ *
+ * Neither manager may be used by another thread during a transfer.
+ *
+ *
+ * Merging
+ * -------
+ * A world (e.g. a level chunk) can be built in a staging EntityManager, on a
+ * loader thread, then merged into the live EntityManager all at once:
+ *
+ *     EntityManager staging(&live);   // Reserves its IDs from 'live'
+ *     ... populate 'staging' on a loader thread ...
+ *
+ *     live.merge(std::move(staging));
+ *
+ * Reserving IDs from the live manager is lock-free, and ensures that merged
+ * entities keep their IDs. Attached components, and whole EntityNodes maps,
+ * are then moved without being copied. A pool is swapped in if the live
+ * manager has no components of the same type, and is otherwise appended with
+ * a single relocation. The per-entity cost is limited to moving each entry
+ * of the entity table, and updating the index of each pooled component.
+ *
+ * Any manager can be merged into any other, but entities whose IDs are
+ * already in use are given new IDs. Component fields that hold entity IDs can
+ * be updated by specialising EntityFields for the component type. Shared
+ * component values are not updated.
+ *
+ *
+ * Concurrent Creation
+ * -------------------
+ * An EntityManager is not thread-safe in general, but entity IDs can be
+ * reserved from any thread, without locking:
+ *
+ *     EntityId id = em.reserveEntity();
+ *     EntityId last = em.reserveEntities(64);  // IDs (last - 64, last]
+ *
+ * A reserved ID does not refer to an entity until it has been committed, on
+ * the thread that owns the EntityManager:
+ *
+ *     em.commitEntity(id);
+ *
+ * Worker threads will usually record their changes in an EntityCommandBuffer,
+ * which reserves IDs in blocks, and queues components to be attached once
+ * the buffer is committed:
+ *
+ *     // On a worker thread
+ *     EntityId projectile = buffer.createEntity();
+ *     buffer.attachComponent(projectile, std::make_shared<Projectile>());
+ *
+ *     // Later, on the thread that owns the EntityManager
+ *     buffer.commit();
+ *
+ * Each worker thread should use its own EntityCommandBuffer.
+ *
+ *
+ * Concurrent Reads
+ * ----------------
+ * Any number of threads may read from an EntityManager at the same time, as
+ * long as no thread is making structural changes (creating or destroying
+ * entities, attaching or detaching components, etc). The functions that are
+ * safe to call concurrently are the const overloads of getComponent,
+ * findEntityNodes and forEach, and collectStats. The non-const
+ * getEntityNodes is also safe, but only for component types that already
+ * have an entry.
+ *
+ * Structural changes should be serialized at phase boundaries. Where phases
+ * are not already separated by some other means (e.g. joining worker
+ * threads), the EntityManager provides a reader-writer lock for this purpose:
+ *
+ *     // Render thread, once per frame
+ *     {
+ *         EntityManager::ReadScope scope(em);
+ *         ... any number of reads ...
+ *     }
+ *
+ *     // Main thread, at a phase boundary
+ *     {
+ *         EntityManager::WriteScope scope(em);
+ *         em.purge();
+ *     }
+ *
+ * These scopes are intended to be held for an entire phase. A WriteScope
+ * waits for active readers to finish, and blocks new readers until it ends.
+ *
+ * Debug builds include a race detector, which reports structural changes
+ * that overlap with reads (or other structural changes) on another thread,
+ * or within a ReadScope. Reports are passed to the function registered with
+ * setRaceHandler(), which by default prints a message and aborts. Define
+ * GAMEUTILS_ENTITY_RACE_DETECTOR as 0 or 1 to override the default, which
+ * is to enable the detector unless NDEBUG is defined.
+ *
  */
+#ifndef GAMEUTILS_ENTITY_RACE_DETECTOR
+#ifdef NDEBUG
+#define GAMEUTILS_ENTITY_RACE_DETECTOR 0
+#else
+#define GAMEUTILS_ENTITY_RACE_DETECTOR 1
+#endif
+#endif
+
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+#define GAMEUTILS_ENTITY_CHECK_READ(detector) \
+    ::gameutils::RaceDetector::ReadCheck GAMEUTILS_PROFILE_CONCAT(raceCheck, __LINE__)(detector)
+#define GAMEUTILS_ENTITY_CHECK_WRITE(detector) \
+    ::gameutils::RaceDetector::WriteCheck GAMEUTILS_PROFILE_CONCAT(raceCheck, __LINE__)(detector)
+#else
+#define GAMEUTILS_ENTITY_CHECK_READ(detector)
+#define GAMEUTILS_ENTITY_CHECK_WRITE(detector)
+#endif
+
+#ifndef GAMEUTILS_ENTITY_EVENT_THREADS
+#define GAMEUTILS_ENTITY_EVENT_THREADS 64
+#endif
+
 namespace gameutils {
 
-struct Component
+typedef void (*RaceHandler)(const char *message);
+
+inline void defaultRaceHandler(const char *message)
 {
-    virtual ~Component() = default;
-};
+    fprintf(stderr, "gameutils: data race detected: %s\n", message);
+    abort();
+}
 
-typedef uint32_t EntityId;
-typedef std::map< EntityId, std::shared_ptr<Component> > EntityNodes;
+inline std::atomic<RaceHandler>& raceHandlerStorage()
+{
+    static std::atomic<RaceHandler> handler(&defaultRaceHandler);
+    return handler;
+}
 
-static const EntityId InvalidEntity = 0;
+/**
+ * Set the function that is called when the race detector finds a conflict.
+ * Returns the previous handler.
+ */
+inline RaceHandler setRaceHandler(RaceHandler handler)
+{
+    return raceHandlerStorage().exchange(handler ? handler : &defaultRaceHandler);
+}
 
-class EntityManager
+/**
+ * Detects reads and writes that overlap in time. Each storage structure that
+ * may be read concurrently (e.g. the entity table) has its own RaceDetector.
+ *
+ * Writes by a thread that is already writing are permitted, so that public
+ * functions may call each other.
+ */
+class RaceDetector
 {
 public:
-    EntityManager()
-      : m_nextEntityId(std::numeric_limits<EntityId>::max()) { }
+    RaceDetector()
+      : m_readers(0)
+      , m_writer(std::thread::id())
+      , m_writeDepth(0) { }
 
-    /**
-     *  Create an entity
-     */
-    EntityId createEntity()
+    void beginRead() const
     {
-        const EntityId maxEntityId = std::numeric_limits<EntityId>::max();
-
-        if (m_entities.size() == maxEntityId) {
-            // Somehow, we have more than 4 billion entities...
-            return InvalidEntity;
+        m_readers.fetch_add(1, std::memory_order_acq_rel);
+        const std::thread::id writer = m_writer.load(std::memory_order_acquire);
+        if (writer != std::thread::id() && writer != std::this_thread::get_id()) {
+            report("read while another thread is making structural changes");
         }
+    }
 
-        EntityId entityId = m_nextEntityId;
+    void endRead() const
+    {
+        m_readers.fetch_sub(1, std::memory_order_acq_rel);
+    }
 
-        // Find next available entity ID
-        while (m_entities.find(entityId) != m_entities.end()) {
-            if (entityId == 1) {
-                entityId = maxEntityId;
-            } else {
-                entityId--;
-            }
+    // Returns true if the calling thread now owns the write
+    bool beginWrite() const
+    {
+        const std::thread::id self = std::this_thread::get_id();
+        if (m_writer.load(std::memory_order_acquire) == self) {
+            m_writeDepth++;
+            return true;
         }
 
-        // Add entity to entity map
-        auto result = m_entities.insert(Entities::value_type(entityId, ComponentNodes()));
-        if (!result.second) {
-            return InvalidEntity;
+        std::thread::id none;
+        if (!m_writer.compare_exchange_strong(none, self, std::memory_order_acq_rel)) {
+            report("structural changes made by two threads at once");
+            return false;
         }
 
-        // Calculate starting entity ID for next time
-        if (entityId == 1) {
-            m_nextEntityId = maxEntityId;
-        } else {
-            m_nextEntityId = entityId - 1;
+        m_writeDepth = 1;
+        if (m_readers.load(std::memory_order_acquire) != 0) {
+            report("structural change while being read");
         }
 
-        return entityId;
+        return true;
     }
 
-    /**
-     *  Destroy an entity with the specified name.
-     */
-    bool destroyEntity(EntityId entityId)
+    void endWrite() const
     {
-        // Find the entity
-        auto enIter = m_entities.find(entityId);
-        if (enIter == m_entities.end()) {
-            // Entity does not exist
-            return false;
+        if (--m_writeDepth == 0) {
+            m_writer.store(std::thread::id(), std::memory_order_release);
         }
+    }
 
-        // For each component type attached to this entity
-        auto &componentNodes = enIter->second;
-        for (auto cmNode: componentNodes) {
+    class ReadCheck
+    {
+    public:
+        explicit ReadCheck(const RaceDetector &detector)
+          : m_detector(detector)
+        {
+            m_detector.beginRead();
+        }
 
-            // Remove the associated entity nodes
-            const auto &cmType = cmNode.first;
-            auto cmIter = m_componentTypes.find(cmType);
-            if (cmIter == m_componentTypes.end()) {
-                throw std::runtime_error("Could not find expected component type in EM.");
-            }
+        ~ReadCheck()
+        {
+            m_detector.endRead();
+        }
 
-            auto &enNodes = cmIter->second;
-            auto enNodeIter = enNodes->find(entityId);
-            if (enNodeIter == enNodes->end()) {
-                throw std::runtime_error("Could not find expected entity node in EM.");
-            }
+    private:
+        ReadCheck(const ReadCheck &);
+        ReadCheck& operator=(const ReadCheck &);
 
-            // Remove the entity node (as well as the embedded shared_ptr to the component)
-            enNodes->erase(enNodeIter);
+        const RaceDetector &m_detector;
+    };
+
+    class WriteCheck
+    {
+    public:
+        explicit WriteCheck(const RaceDetector &detector)
+          : m_detector(detector)
+          , m_owner(detector.beginWrite()) { }
+
+        ~WriteCheck()
+        {
+            if (m_owner) {
+                m_detector.endWrite();
+            }
         }
 
-        // Finally, erase the entity and its component nodes
-        m_entities.erase(enIter);
+    private:
+        WriteCheck(const WriteCheck &);
+        WriteCheck& operator=(const WriteCheck &);
 
-        return true;
-    }
+        const RaceDetector &m_detector;
+        const bool m_owner;
+    };
 
-    /**
-     *  Destroy all entities.
-     */
-    bool destroyAllEntities()
+private:
+    static void report(const char *message)
     {
-        // Clearing both maps will destroy everything.
-        m_entities.clear();
-        m_componentTypes.clear();
+        raceHandlerStorage().load()(message);
+    }
 
-        return true;
+    mutable std::atomic<int> m_readers;
+    mutable std::atomic<std::thread::id> m_writer;
+    mutable int m_writeDepth;   // Only accessed by the writing thread
+};
+
+/**
+ * Reader-writer lock used to separate read phases from structural changes.
+ * Waiting writers take priority over new readers.
+ */
+class PhaseLock
+{
+public:
+    PhaseLock()
+      : m_readers(0)
+      , m_waitingWriters(0)
+      , m_writer(false) { }
+
+    void lockShared()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return !m_writer && m_waitingWriters == 0; });
+        m_readers++;
     }
 
-    /**
-     *  Attach a component of type <T> to the specified entity.
-     */
-    bool attachComponent(EntityId entityId, std::shared_ptr<Component> pComponent)
+    void unlockShared()
     {
-        // Find the entity
-        auto enIter = m_entities.find(entityId);
-        if (enIter == m_entities.end()) {
-            // Entity does not exist
-            return false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_readers == 0) {
+            m_cond.notify_all();
         }
+    }
 
-        // Examine type of internal component pointer
-        Component *pInner = pComponent.get();
-        if (!pInner) {
-            return false;
-        }
+    void lock()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_waitingWriters++;
+        m_cond.wait(lock, [this] { return !m_writer && m_readers == 0; });
+        m_waitingWriters--;
+        m_writer = true;
+    }
 
-        // Construct type index for <T>
+    void unlock()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_writer = false;
+        m_cond.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    int m_readers;
+    int m_waitingWriters;
+    bool m_writer;
+};
+
+struct Component
+{
+    virtual ~Component() = default;
+};
+
+typedef uint32_t EntityId;
+typedef std::map< EntityId, std::shared_ptr<Component> > EntityNodes;
+
+static const EntityId InvalidEntity = 0;
+
+/**
+ * Maps old entity IDs to new ones, when entities are given new IDs by
+ * EntityManager::merge. IDs that have not been changed map to themselves,
+ * unless setUnmapped() is called.
+ */
+class EntityRemap
+{
+public:
+    EntityRemap()
+      : m_unmapped(InvalidEntity)
+      , m_hasUnmapped(false) { }
+
+    bool empty() const
+    {
+        return m_ids.empty() && !m_hasUnmapped;
+    }
+
+    size_t size() const
+    {
+        return m_ids.size();
+    }
+
+    void add(EntityId from, EntityId to)
+    {
+        m_ids[from] = to;
+    }
+
+    /**
+     *  Map IDs that have not been added to 'entityId', rather than to
+     *  themselves, e.g. to clear references to entities that were not
+     *  copied.
+     */
+    void setUnmapped(EntityId entityId)
+    {
+        m_unmapped = entityId;
+        m_hasUnmapped = true;
+    }
+
+    EntityId operator()(EntityId entityId) const
+    {
+        if (m_ids.empty() && !m_hasUnmapped) {
+            return entityId;
+        }
+
+        auto iter = m_ids.find(entityId);
+        if (iter != m_ids.end()) {
+            return iter->second;
+        }
+
+        return m_hasUnmapped ? m_unmapped : entityId;
+    }
+
+    /**
+     *  Replace an entity ID, in place.
+     */
+    void apply(EntityId &entityId) const
+    {
+        entityId = (*this)(entityId);
+    }
+
+    void clear()
+    {
+        m_ids.clear();
+        m_hasUnmapped = false;
+    }
+
+private:
+    std::unordered_map<EntityId, EntityId> m_ids;
+    EntityId m_unmapped;
+    bool m_hasUnmapped;
+};
+
+/**
+ * Trait that lists the fields of a component type that hold entity IDs, so
+ * that they can be updated when entities are given new IDs. Specialise this
+ * with a static remap function, e.g.:
+ *
+ *     template<>
+ *     struct EntityFields<Targeting> {
+ *         static void remap(Targeting &component, const EntityRemap &remap) {
+ *             remap.apply(component.target);
+ *         }
+ *     };
+ */
+template<typename T>
+struct EntityFields { };
+
+/**
+ * Trait for types that can be relocated (moved to a new address, with the
+ * original left destroyed) using memcpy. This holds for all trivially
+ * copyable types, and can be specialised for other types whose objects hold
+ * no pointers into themselves, e.g.:
+ *
+ *     template<>
+ *     struct IsTriviallyRelocatable<MyHandle>: std::true_type { };
+ */
+template<typename T>
+struct IsTriviallyRelocatable: std::integral_constant<bool, std::is_trivially_copyable<T>::value> { };
+
+/**
+ * Whether queries visit disabled entities and components. See 'Enabling and
+ * Disabling' above.
+ */
+enum EnabledFilter
+{
+    EnabledOnly,        // Skip disabled entities and components (the default)
+    IncludeDisabled     // Visit every entity
+};
+
+/**
+ * Storage policies for component types. See 'Storage Policies' above.
+ */
+enum StoragePolicy
+{
+    PooledStorage,      // Dense pool, shared with forEachChunk (the default)
+    SparseStorage,      // Hash map, for rarely used types
+    StableStorage,      // Paged slots, whose addresses never change
+    TagStorage          // Bitset, for empty types
+};
+
+/**
+ * Trait that selects the storage policy for a component type that is added
+ * using addComponent. Defaults to PooledStorage, and can be specialised, e.g.:
+ *
+ *     template<>
+ *     struct ComponentStoragePolicy<Frozen>:
+ *         std::integral_constant<StoragePolicy, TagStorage> { };
+ */
+template<typename T>
+struct ComponentStoragePolicy: std::integral_constant<StoragePolicy, PooledStorage> { };
+
+namespace detail {
+
+// Whether every type in <Ts...> uses PooledStorage
+template<typename... Ts>
+struct AllPooled: std::true_type { };
+
+template<typename T, typename... Ts>
+struct AllPooled<T, Ts...>: std::integral_constant<bool,
+    ComponentStoragePolicy<T>::value == PooledStorage && AllPooled<Ts...>::value> { };
+
+}   // end namespace detail
+
+/**
+ * Information about a component type, including its layout and type-erased
+ * functions for moving, copying and destroying instances. There is a single
+ * ComponentTypeInfo for each type, owned by the ComponentRegistry.
+ */
+struct ComponentTypeInfo
+{
+    typedef std::shared_ptr<Component> (*CopyFn)(const Component &);
+    typedef void (*MoveConstructFn)(void *pDest, void *pSrc);
+    typedef void (*CopyConstructFn)(void *pDest, const void *pSrc);
+    typedef void (*DestroyFn)(void *pObject);
+    typedef void (*RemapFn)(void *pObject, const EntityRemap &remap);
+    typedef void (*RemapComponentFn)(Component &component, const EntityRemap &remap);
+
+    std::type_index type;
+    const char *name;               // Implementation-defined name of the type
+    size_t index;                   // Dense index, assigned in order of registration
+    size_t size;
+    size_t alignment;
+    bool triviallyCopyable;
+    bool triviallyRelocatable;
+    bool triviallyDestructible;
+    StoragePolicy storage;          // Where addComponent stores components of this type
+
+    CopyFn copy;                    // Null if not a copy constructible Component
+    MoveConstructFn moveConstruct;  // Null if not move constructible
+    CopyConstructFn copyConstruct;  // Null if not copy constructible
+    DestroyFn destroy;              // Null if trivially destructible
+    RemapFn remap;                  // Null if EntityFields is not specialised
+    RemapComponentFn remapComponent;    // Null if 'remap' is null, or not a Component
+
+    /**
+     *  Move-construct 'count' objects at 'pDest' from those at 'pSrc', and
+     *  destroy the originals. The ranges must not overlap.
+     */
+    void relocate(void *pDest, void *pSrc, size_t count) const
+    {
+        if (count == 0) {
+            return;
+        }
+
+        if (triviallyRelocatable) {
+            memcpy(pDest, pSrc, count * size);
+            return;
+        }
+
+        if (!moveConstruct) {
+            throw std::runtime_error("Attempted to relocate a component type that cannot be moved.");
+        }
+
+        unsigned char *pDestBytes = static_cast<unsigned char *>(pDest);
+        unsigned char *pSrcBytes = static_cast<unsigned char *>(pSrc);
+        for (size_t i = 0; i < count; ++i) {
+            moveConstruct(pDestBytes + i * size, pSrcBytes + i * size);
+        }
+
+        destroyRange(pSrc, count);
+    }
+
+    /**
+     *  Destroy 'count' consecutive objects, starting at 'pFirst'.
+     */
+    void destroyRange(void *pFirst, size_t count) const
+    {
+        if (!destroy) {
+            return;
+        }
+
+        unsigned char *pBytes = static_cast<unsigned char *>(pFirst);
+        for (size_t i = 0; i < count; ++i) {
+            destroy(pBytes + i * size);
+        }
+    }
+};
+
+namespace detail {
+
+template<typename T>
+std::shared_ptr<Component> copyComponent(const Component &component)
+{
+    return std::make_shared<T>(static_cast<const T &>(component));
+}
+
+template<typename T>
+ComponentTypeInfo::CopyFn componentCopyFn(std::true_type)
+{
+    return &copyComponent<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::CopyFn componentCopyFn(std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+void moveConstruct(void *pDest, void *pSrc)
+{
+    new (pDest) T(std::move(*static_cast<T *>(pSrc)));
+}
+
+template<typename T>
+ComponentTypeInfo::MoveConstructFn moveConstructFn(std::true_type)
+{
+    return &moveConstruct<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::MoveConstructFn moveConstructFn(std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+void copyConstruct(void *pDest, const void *pSrc)
+{
+    new (pDest) T(*static_cast<const T *>(pSrc));
+}
+
+template<typename T>
+ComponentTypeInfo::CopyConstructFn copyConstructFn(std::true_type)
+{
+    return &copyConstruct<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::CopyConstructFn copyConstructFn(std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+void destroy(void *pObject)
+{
+    static_cast<T *>(pObject)->~T();
+}
+
+template<typename T>
+ComponentTypeInfo::DestroyFn destroyFn(std::false_type)
+{
+    return &destroy<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::DestroyFn destroyFn(std::true_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+class HasEntityFields
+{
+    template<typename U>
+    static std::true_type test(decltype(&EntityFields<U>::remap));
+
+    template<typename U>
+    static std::false_type test(...);
+
+public:
+    static const bool value = decltype(test<T>(nullptr))::value;
+};
+
+template<typename T>
+void remap(void *pObject, const EntityRemap &remap)
+{
+    EntityFields<T>::remap(*static_cast<T *>(pObject), remap);
+}
+
+template<typename T>
+void remapComponent(Component &component, const EntityRemap &remap)
+{
+    EntityFields<T>::remap(static_cast<T &>(component), remap);
+}
+
+template<typename T>
+ComponentTypeInfo::RemapFn remapFn(std::true_type)
+{
+    return &remap<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::RemapFn remapFn(std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+ComponentTypeInfo::RemapComponentFn remapComponentFn(std::true_type)
+{
+    return &remapComponent<T>;
+}
+
+template<typename T>
+ComponentTypeInfo::RemapComponentFn remapComponentFn(std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+ComponentTypeInfo makeComponentTypeInfo()
+{
+    ComponentTypeInfo info = {
+        typeid(T),
+        typeid(T).name(),
+        0,
+        sizeof(T),
+        alignof(T),
+        std::is_trivially_copyable<T>::value,
+        IsTriviallyRelocatable<T>::value,
+        std::is_trivially_destructible<T>::value,
+        ComponentStoragePolicy<T>::value,
+        componentCopyFn<T>(std::integral_constant<bool,
+            std::is_base_of<Component, T>::value && std::is_copy_constructible<T>::value>()),
+        moveConstructFn<T>(std::is_move_constructible<T>()),
+        copyConstructFn<T>(std::is_copy_constructible<T>()),
+        destroyFn<T>(std::is_trivially_destructible<T>()),
+        remapFn<T>(std::integral_constant<bool, HasEntityFields<T>::value>()),
+        remapComponentFn<T>(std::integral_constant<bool,
+            HasEntityFields<T>::value && std::is_base_of<Component, T>::value>())
+    };
+
+    return info;
+}
+
+/**
+ * Allocate a block of memory with the given alignment. Must be released
+ * using deallocateAligned().
+ */
+inline unsigned char* allocateAligned(size_t bytes, size_t alignment)
+{
+    // Over-allocate, and store the original pointer just before the block
+    unsigned char *pRaw = static_cast<unsigned char *>(
+        ::operator new(bytes + alignment + sizeof(void *)));
+    const uintptr_t address = reinterpret_cast<uintptr_t>(pRaw + sizeof(void *));
+    unsigned char *pAligned = pRaw + sizeof(void *) +
+        ((alignment - address % alignment) % alignment);
+
+    reinterpret_cast<void **>(pAligned)[-1] = pRaw;
+    return pAligned;
+}
+
+inline void deallocateAligned(unsigned char *pBlock)
+{
+    if (pBlock) {
+        ::operator delete(reinterpret_cast<void **>(pBlock)[-1]);
+    }
+}
+
+}   // end namespace detail
+
+/**
+ * Registry of all component types known to the program. Types are registered
+ * the first time their ComponentTypeInfo is requested, from any thread.
+ */
+class ComponentRegistry
+{
+public:
+    static ComponentRegistry& instance()
+    {
+        // Leaked, so that it outlives any static EntityManager
+        static ComponentRegistry *pRegistry = new ComponentRegistry();
+        return *pRegistry;
+    }
+
+    /**
+     *  Register a type, assigning its index. Returns the registered info,
+     *  which remains valid for the lifetime of the program.
+     */
+    const ComponentTypeInfo& add(const ComponentTypeInfo &info)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto iter = m_byType.find(info.type);
+        if (iter != m_byType.end()) {
+            return *iter->second;
+        }
+
+        m_types.emplace_back(new ComponentTypeInfo(info));
+        ComponentTypeInfo *pInfo = m_types.back().get();
+        pInfo->index = m_types.size() - 1;
+        m_byType.insert(TypeMap::value_type(pInfo->type, pInfo));
+
+        return *pInfo;
+    }
+
+    /**
+     *  Returns the info for a registered type, or nullptr.
+     */
+    const ComponentTypeInfo* find(std::type_index type) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto iter = m_byType.find(type);
+        return iter == m_byType.end() ? nullptr : iter->second;
+    }
+
+    /**
+     *  Returns the info for the type with the given index, or nullptr.
+     */
+    const ComponentTypeInfo* at(size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return index < m_types.size() ? m_types[index].get() : nullptr;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_types.size();
+    }
+
+private:
+    ComponentRegistry() { }
+    ComponentRegistry(const ComponentRegistry &);
+    ComponentRegistry& operator=(const ComponentRegistry &);
+
+    typedef std::unordered_map<std::type_index, const ComponentTypeInfo *> TypeMap;
+
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<ComponentTypeInfo>> m_types;
+    TypeMap m_byType;
+};
+
+/**
+ * Returns the ComponentTypeInfo for type <T>, registering the type if
+ * necessary.
+ */
+template<typename T>
+const ComponentTypeInfo& componentTypeInfo()
+{
+    static const ComponentTypeInfo &info =
+        ComponentRegistry::instance().add(detail::makeComponentTypeInfo<T>());
+
+    return info;
+}
+
+/**
+ * Notified as components are inserted into, and erased from, a pool or
+ * store, so that indexes can follow components that are not attached.
+ * Components are not reported when a pool or store is cleared, nor when
+ * they are relocated within it.
+ */
+class ComponentObserver
+{
+public:
+    virtual ~ComponentObserver() { }
+
+    /**
+     *  Called once a component has been constructed. 'pComponent' points to
+     *  an object of the pool or store's type, and is only valid for the
+     *  duration of the call.
+     */
+    virtual void inserted(EntityId entityId, const void *pComponent) = 0;
+
+    /**
+     *  Called when a component is removed, after it may have been destroyed.
+     */
+    virtual void erased(EntityId entityId) = 0;
+};
+
+/**
+ * Dense storage for the components of a single type. See 'Component Pools'
+ * above.
+ *
+ * Components are stored contiguously, in no particular order, alongside the
+ * IDs of the entities that own them. A paged sparse array maps each entity ID
+ * to the position of its component, so lookups are O(1).
+ *
+ * The pool itself is type-erased, and manipulates components using the
+ * functions in their ComponentTypeInfo.
+ */
+class ComponentPool
+{
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    // Minimum alignment of component storage
+    static const size_t CacheLineSize = 64;
+
+    explicit ComponentPool(const ComponentTypeInfo &info)
+      : m_info(info)
+      , m_alignment(std::max(info.alignment, static_cast<size_t>(CacheLineSize)))
+      , m_pData(nullptr)
+      , m_capacity(0)
+      , m_pageCount(0)
+      , m_pScratch(nullptr)
+      , m_version(0)
+      , m_pObserver(nullptr) { }
+
+    ~ComponentPool()
+    {
+        m_pObserver = nullptr;
+        clear();
+        detail::deallocateAligned(m_pData);
+        detail::deallocateAligned(m_pScratch);
+    }
+
+    const ComponentTypeInfo& typeInfo() const
+    {
+        return m_info;
+    }
+
+    size_t size() const
+    {
+        return m_entities.size();
+    }
+
+    bool empty() const
+    {
+        return m_entities.empty();
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+
+    /**
+     *  Incremented whenever components are added, removed or reordered.
+     */
+    uint64_t version() const
+    {
+        return m_version;
+    }
+
+    /**
+     *  Set the observer that is notified as components are inserted and
+     *  erased, or null.
+     */
+    void setObserver(ComponentObserver *pObserver)
+    {
+        m_pObserver = pObserver;
+    }
+
+    /**
+     *  IDs of the entities that own each component, in storage order.
+     */
+    const EntityId* entities() const
+    {
+        return m_entities.data();
+    }
+
+    void* data()
+    {
+        return m_pData;
+    }
+
+    const void* data() const
+    {
+        return m_pData;
+    }
+
+    /**
+     *  Returns the components as an array. <T> must be the pool's type.
+     */
+    template<typename T>
+    T* data()
+    {
+        return reinterpret_cast<T *>(m_pData);
+    }
+
+    template<typename T>
+    const T* data() const
+    {
+        return reinterpret_cast<const T *>(m_pData);
+    }
+
+    void* at(size_t index)
+    {
+        return m_pData + index * m_info.size;
+    }
+
+    const void* at(size_t index) const
+    {
+        return m_pData + index * m_info.size;
+    }
+
+    /**
+     *  Returns the position of an entity's component, or npos.
+     */
+    size_t indexOf(EntityId entityId) const
+    {
+        const size_t slot = slotOf(entityId);
+        const size_t page = slot >> PageBits;
+        if (page >= m_pages.size() || !m_pages[page]) {
+            return npos;
+        }
+
+        const uint32_t index = m_pages[page][slot & PageMask];
+        return index == Absent ? npos : index;
+    }
+
+    bool contains(EntityId entityId) const
+    {
+        return indexOf(entityId) != npos;
+    }
+
+    void* find(EntityId entityId)
+    {
+        const size_t index = indexOf(entityId);
+        return index == npos ? nullptr : at(index);
+    }
+
+    const void* find(EntityId entityId) const
+    {
+        const size_t index = indexOf(entityId);
+        return index == npos ? nullptr : at(index);
+    }
+
+    /**
+     *  Construct a component for an entity, which must not already have one.
+     *  <T> must be the pool's type.
+     *
+     *  The arguments may refer to components in this pool.
+     */
+    template<typename T, typename... Args>
+    T* emplace(EntityId entityId, Args&&... args)
+    {
+        T *pComponent = size() == m_capacity ?
+            emplaceGrowing<T>(entityId, std::is_move_constructible<T>(), std::forward<Args>(args)...) :
+            new (prepareInsert(entityId)) T(std::forward<Args>(args)...);
+
+        commitInsert(entityId);
+        return pComponent;
+    }
+
+    /**
+     *  Copy-construct a component for an entity, which must not already have
+     *  one, from 'pSource'. 'pSource' may point to a component in this pool.
+     */
+    void* insertCopy(EntityId entityId, const void *pSource)
+    {
+        void *pSlot;
+        if (size() == m_capacity && pSource >= m_pData && pSource < at(size())) {
+            if (!m_pScratch) {
+                m_pScratch = detail::allocateAligned(m_info.size, m_alignment);
+            }
+
+            m_info.copyConstruct(m_pScratch, pSource);
+            try {
+                pSlot = prepareInsert(entityId);
+            } catch (...) {
+                m_info.destroyRange(m_pScratch, 1);
+                throw;
+            }
+
+            m_info.relocate(pSlot, m_pScratch, 1);
+        } else {
+            pSlot = prepareInsert(entityId);
+            m_info.copyConstruct(pSlot, pSource);
+        }
+
+        commitInsert(entityId);
+        return pSlot;
+    }
+
+    /**
+     *  Make room for a component for 'entityId', and return the address at
+     *  which it should be constructed. The component is not part of the pool
+     *  until commitInsert() is called, so no cleanup is needed if its
+     *  construction fails.
+     */
+    void* prepareInsert(EntityId entityId)
+    {
+        if (size() == m_capacity) {
+            reserve(std::max<size_t>(16, 2 * m_capacity));
+        }
+
+        // Allocate the page now, so that commitInsert() cannot fail
+        page(slotOf(entityId) >> PageBits);
+        return at(size());
+    }
+
+    void commitInsert(EntityId entityId)
+    {
+        const size_t slot = slotOf(entityId);
+        m_pages[slot >> PageBits][slot & PageMask] = static_cast<uint32_t>(size());
+        m_entities.push_back(entityId);
+        m_version++;
+
+        if (m_pObserver) {
+            m_pObserver->inserted(entityId, at(size() - 1));
+        }
+    }
+
+    /**
+     *  Destroy an entity's component. The last component in the pool is moved
+     *  into the hole that it leaves.
+     */
+    bool erase(EntityId entityId)
+    {
+        const size_t index = indexOf(entityId);
+        if (index == npos) {
+            return false;
+        }
+
+        m_info.destroyRange(at(index), 1);
+        removeAt(index);
+        return true;
+    }
+
+    /**
+     *  Relocate an entity's component to 'pDest', and remove it from the pool.
+     */
+    bool extract(EntityId entityId, void *pDest)
+    {
+        const size_t index = indexOf(entityId);
+        if (index == npos) {
+            return false;
+        }
+
+        m_info.relocate(pDest, at(index), 1);
+        removeAt(index);
+        return true;
+    }
+
+    /**
+     *  Exchange the positions of two components.
+     */
+    void swap(size_t a, size_t b)
+    {
+        if (a == b) {
+            return;
+        }
+
+        if (!m_pScratch) {
+            m_pScratch = detail::allocateAligned(m_info.size, m_alignment);
+        }
+
+        m_info.relocate(m_pScratch, at(a), 1);
+        m_info.relocate(at(a), at(b), 1);
+        m_info.relocate(at(b), m_pScratch, 1);
+
+        std::swap(m_entities[a], m_entities[b]);
+        setIndex(m_entities[a], a);
+        setIndex(m_entities[b], b);
+        m_version++;
+    }
+
+    /**
+     *  Exchange all components with 'other', which must be a pool for the
+     *  same type.
+     */
+    void swapContents(ComponentPool &other)
+    {
+        notifyErased();
+        other.notifyErased();
+
+        std::swap(m_pData, other.m_pData);
+        std::swap(m_capacity, other.m_capacity);
+        m_entities.swap(other.m_entities);
+        m_pages.swap(other.m_pages);
+        std::swap(m_pageCount, other.m_pageCount);
+        m_version++;
+        other.m_version++;
+
+        notifyInserted(0);
+        other.notifyInserted(0);
+    }
+
+    /**
+     *  Relocate all components from 'other', which must be a pool for the same
+     *  type, to the end of this pool. Entity IDs are mapped using 'remap'.
+     */
+    void append(ComponentPool &other, const EntityRemap &remap)
+    {
+        const size_t first = size();
+        reserve(first + other.size());
+        m_info.relocate(at(first), other.m_pData, other.size());
+
+        for (EntityId entityId: other.m_entities) {
+            const EntityId newId = remap(entityId);
+            page(slotOf(newId) >> PageBits);
+            setIndex(newId, m_entities.size());
+            m_entities.push_back(newId);
+
+            other.setIndex(entityId, Absent);
+        }
+
+        other.notifyErased();
+        other.m_entities.clear();
+        other.m_version++;
+        m_version++;
+        notifyInserted(first);
+    }
+
+    /**
+     *  Ensure that the pool can hold 'capacity' components without allocating.
+     */
+    void reserve(size_t capacity)
+    {
+        if (capacity <= m_capacity) {
+            return;
+        }
+
+        unsigned char *pData = detail::allocateAligned(capacity * m_info.size, m_alignment);
+        m_info.relocate(pData, m_pData, size());
+        detail::deallocateAligned(m_pData);
+
+        m_pData = pData;
+        m_capacity = capacity;
+        m_entities.reserve(capacity);
+    }
+
+    /**
+     *  Destroy all components. Capacity is retained.
+     */
+    void clear()
+    {
+        m_info.destroyRange(m_pData, size());
+
+        for (EntityId entityId: m_entities) {
+            setIndex(entityId, Absent);
+        }
+
+        m_entities.clear();
+        m_version++;
+    }
+
+    /**
+     *  Bytes used other than by the components themselves, including unused
+     *  capacity.
+     */
+    size_t bookkeepingBytes() const
+    {
+        return (m_capacity - size()) * m_info.size +
+            (m_pScratch ? m_info.size : 0) +
+            m_entities.capacity() * sizeof(EntityId) +
+            m_pages.capacity() * sizeof(Page) +
+            m_pageCount * PageSize * sizeof(uint32_t);
+    }
+
+    size_t heapBlocks() const
+    {
+        return (m_pData ? 2 : 0) + (m_pScratch ? 1 : 0) + (m_pages.capacity() ? 1 : 0) + m_pageCount;
+    }
+
+private:
+    // Growing the pool would move any component that the arguments refer
+    // to, so the new component is constructed before room is made for it
+    template<typename T, typename... Args>
+    T* emplaceGrowing(EntityId entityId, std::true_type, Args&&... args)
+    {
+        T component(std::forward<Args>(args)...);
+        return new (prepareInsert(entityId)) T(std::move(component));
+    }
+
+    // Pools cannot grow with types that cannot be moved
+    template<typename T, typename... Args>
+    T* emplaceGrowing(EntityId entityId, std::false_type, Args&&... args)
+    {
+        return new (prepareInsert(entityId)) T(std::forward<Args>(args)...);
+    }
+
+    ComponentPool(const ComponentPool &);
+    ComponentPool& operator=(const ComponentPool &);
+
+    typedef std::unique_ptr<uint32_t[]> Page;
+
+    static const size_t PageBits = 12;
+    static const size_t PageSize = static_cast<size_t>(1) << PageBits;
+    static const size_t PageMask = PageSize - 1;
+    static const uint32_t Absent = std::numeric_limits<uint32_t>::max();
+
+    // Entity IDs are allocated downwards from the maximum ID, so this keeps
+    // the occupied part of the sparse array dense
+    static size_t slotOf(EntityId entityId)
+    {
+        return std::numeric_limits<EntityId>::max() - entityId;
+    }
+
+    uint32_t* page(size_t page)
+    {
+        if (page >= m_pages.size()) {
+            m_pages.resize(page + 1);
+        }
+
+        if (!m_pages[page]) {
+            m_pages[page].reset(new uint32_t[PageSize]);
+            std::fill(m_pages[page].get(), m_pages[page].get() + PageSize, static_cast<uint32_t>(Absent));
+            m_pageCount++;
+        }
+
+        return m_pages[page].get();
+    }
+
+    void setIndex(EntityId entityId, size_t index)
+    {
+        const size_t slot = slotOf(entityId);
+        m_pages[slot >> PageBits][slot & PageMask] = static_cast<uint32_t>(index);
+    }
+
+    // Report each component from 'first' onwards as inserted
+    void notifyInserted(size_t first)
+    {
+        if (m_pObserver) {
+            for (size_t i = first; i < size(); ++i) {
+                m_pObserver->inserted(m_entities[i], at(i));
+            }
+        }
+    }
+
+    void notifyErased()
+    {
+        if (m_pObserver) {
+            for (EntityId entityId: m_entities) {
+                m_pObserver->erased(entityId);
+            }
+        }
+    }
+
+    // Remove the (already destroyed or relocated) component at 'index'
+    void removeAt(size_t index)
+    {
+        const EntityId entityId = m_entities[index];
+        const size_t last = size() - 1;
+        if (m_pObserver) {
+            m_pObserver->erased(entityId);
+        }
+
+        if (index != last) {
+            m_info.relocate(at(index), at(last), 1);
+
+            const EntityId movedId = m_entities[last];
+            setIndex(movedId, index);
+            m_entities[index] = movedId;
+        }
+
+        setIndex(entityId, Absent);
+        m_entities.pop_back();
+        m_version++;
+    }
+
+    const ComponentTypeInfo &m_info;
+    const size_t m_alignment;
+
+    unsigned char *m_pData;
+    size_t m_capacity;
+    std::vector<EntityId> m_entities;
+
+    std::vector<Page> m_pages;
+    size_t m_pageCount;
+
+    unsigned char *m_pScratch;  // Space for one component, used by swap() and insertCopy()
+    uint64_t m_version;
+    ComponentObserver *m_pObserver;
+};
+
+/**
+ * Memory statistics for a single component type.
+ */
+struct ComponentStats
+{
+    ComponentStats()
+      : type(typeid(void))
+      , count(0)
+      , componentSize(0)
+      , payloadBytes(0)
+      , bookkeepingBytes(0)
+      , capacity(0)
+      , loadFactor(0) { }
+
+    std::type_index type;       // Component type
+    size_t count;               // Number of attached components
+    size_t componentSize;       // sizeof(T), or zero if not yet known
+    size_t payloadBytes;        // Bytes occupied by the components themselves
+    size_t bookkeepingBytes;    // Map nodes, control blocks, pool indexes and unused capacity
+    size_t capacity;            // Number of components that fit without allocating
+    float loadFactor;           // count / capacity
+};
+
+/**
+ * Memory statistics for the entity table, which maps each entity to the
+ * components attached to it.
+ */
+struct EntityTableStats
+{
+    EntityTableStats()
+      : count(0)
+      , buckets(0)
+      , loadFactor(0)
+      , componentNodes(0)
+      , componentNodeBuckets(0)
+      , bookkeepingBytes(0)
+      , markedForRemoval(0)
+      , markedForRemovalCapacity(0)
+      , disabled(0) { }
+
+    size_t count;                       // Number of live entities
+    size_t buckets;                     // Bucket count of the entity map
+    float loadFactor;                   // Load factor of the entity map
+    size_t componentNodes;              // Per-entity component nodes, all entities
+    size_t componentNodeBuckets;        // Buckets in per-entity component maps
+    size_t bookkeepingBytes;            // Estimated bytes for all of the above
+    size_t markedForRemoval;            // Entities waiting for purge()
+    size_t markedForRemovalCapacity;    // Capacity of the removal list
+    size_t disabled;                    // Entities that have been disabled
+};
+
+/**
+ * Memory statistics for an entire EntityManager.
+ */
+struct MemoryStats
+{
+    MemoryStats()
+      : payloadBytes(0)
+      , bookkeepingBytes(0)
+      , resourceBytes(0)
+      , indexBytes(0)
+      , relationBytes(0)
+      , heapBlocks(0)
+      , fragmentation(0) { }
+
+    EntityTableStats entities;
+    std::vector<ComponentStats> components;
+
+    size_t payloadBytes;        // Sum of component payloads
+    size_t bookkeepingBytes;    // Sum of all estimated management overhead
+    size_t resourceBytes;       // Bytes occupied by world resources
+    size_t indexBytes;          // Value indexes and checksums (part of bookkeepingBytes)
+    size_t relationBytes;       // Relationships (part of bookkeepingBytes)
+    size_t heapBlocks;          // Estimated number of live heap allocations
+
+    // Estimated fraction of managed memory that is management overhead.
+    // This approaches 1 as per-node overhead comes to dominate memory usage.
+    float fragmentation;
+
+    size_t totalBytes() const
+    {
+        return payloadBytes + bookkeepingBytes + resourceBytes;
+    }
+};
+
+/**
+ * Hash function used to intern shared components. Defaults to std::hash, and
+ * can be specialised for component types that do not have a std::hash.
+ */
+template<typename T>
+struct SharedComponentHash: std::hash<T> { };
+
+namespace detail {
+
+// Location of an entity within the group of entities that share a value
+struct SharedMembership
+{
+    uint32_t group;
+    uint32_t position;
+};
+
+}   // end namespace detail
+
+/**
+ * Type-erased interface to the shared components of a single type.
+ */
+class SharedComponentStoreBase
+{
+public:
+    virtual ~SharedComponentStoreBase() = default;
+
+    virtual const ComponentTypeInfo& typeInfo() const = 0;
+    virtual bool contains(EntityId entityId) const = 0;
+
+    /**
+     *  Entities that have a value, and the number of such entities.
+     */
+    virtual const EntityId* entities() const = 0;
+    virtual size_t size() const = 0;
+
+    virtual bool remove(EntityId entityId) = 0;
+    virtual void clear() = 0;
+
+    /**
+     *  Share the value used by 'entityId' with 'destId' in 'dest', which
+     *  must be a store for the same type.
+     */
+    virtual void copyTo(EntityId entityId, SharedComponentStoreBase &dest, EntityId destId) const = 0;
+
+    /**
+     *  Create an empty store for the same type.
+     */
+    virtual SharedComponentStoreBase* createEmpty() const = 0;
+
+    /**
+     *  Fill in 'stats', and return the estimated number of heap blocks.
+     */
+    virtual size_t collectStats(ComponentStats &stats) const = 0;
+};
+
+/**
+ * Shared components of type <T>. See 'Shared Components' above.
+ *
+ * Each distinct value is stored once, together with the list of entities
+ * that share it. Values are interned using SharedComponentHash<T> and
+ * operator==, and are destroyed once no entity refers to them.
+ */
+template<typename T>
+class SharedComponentStore: public SharedComponentStoreBase
+{
+public:
+    SharedComponentStore()
+      : m_members(componentTypeInfo<detail::SharedMembership>())
+      , m_entityCapacity(0) { }
+
+    const ComponentTypeInfo& typeInfo() const override
+    {
+        return componentTypeInfo<T>();
+    }
+
+    bool contains(EntityId entityId) const override
+    {
+        return m_members.contains(entityId);
+    }
+
+    /**
+     *  Set the value shared by an entity, replacing any previous value.
+     *  Returns the interned value.
+     */
+    const T* set(EntityId entityId, const T &value)
+    {
+        const size_t hash = SharedComponentHash<T>()(value);
+        uint32_t group = findGroup(value, hash);
+        if (group == NoGroup) {
+            group = createGroup(value, hash);
+        }
+
+        Group &newGroup = *m_groups[group];
+        const size_t capacity = newGroup.entities.capacity();
+        newGroup.entities.reserve(newGroup.entities.size() + 1);
+        m_entityCapacity += newGroup.entities.capacity() - capacity;
+
+        detail::SharedMembership *pMember = member(entityId);
+        if (!pMember) {
+            pMember = m_members.emplace<detail::SharedMembership>(entityId);
+        } else if (pMember->group == group) {
+            return &newGroup.value;
+        } else {
+            leaveGroup(*pMember);
+        }
+
+        pMember->group = group;
+        pMember->position = static_cast<uint32_t>(newGroup.entities.size());
+        newGroup.entities.push_back(entityId);
+
+        return &newGroup.value;
+    }
+
+    bool remove(EntityId entityId) override
+    {
+        const detail::SharedMembership *pMember = member(entityId);
+        if (!pMember) {
+            return false;
+        }
+
+        leaveGroup(*pMember);
+        m_members.erase(entityId);
+        return true;
+    }
+
+    void clear() override
+    {
+        m_members.clear();
+        m_groups.clear();
+        m_freeGroups.clear();
+        m_index.clear();
+        m_entityCapacity = 0;
+    }
+
+    /**
+     *  Returns the value shared by an entity, or nullptr.
+     */
+    const T* find(EntityId entityId) const
+    {
+        const detail::SharedMembership *pMember =
+            static_cast<const detail::SharedMembership *>(m_members.find(entityId));
+        return pMember ? &m_groups[pMember->group]->value : nullptr;
+    }
+
+    /**
+     *  Returns the entities that share 'value', or nullptr if there are none.
+     */
+    const std::vector<EntityId>* findEntities(const T &value) const
+    {
+        const uint32_t group = findGroup(value, SharedComponentHash<T>()(value));
+        return group == NoGroup ? nullptr : &m_groups[group]->entities;
+    }
+
+    /**
+     *  Call fn(value, entities, count) for each distinct value. Entities
+     *  must not be added or removed during the call.
+     */
+    template<typename Fn>
+    void forEachGroup(Fn fn) const
+    {
+        for (const auto &pGroup: m_groups) {
+            if (pGroup && !pGroup->entities.empty()) {
+                fn(pGroup->value, pGroup->entities.data(), pGroup->entities.size());
+            }
+        }
+    }
+
+    /**
+     *  Number of distinct values.
+     */
+    size_t valueCount() const
+    {
+        return m_index.size();
+    }
+
+    const EntityId* entities() const override
+    {
+        return m_members.entities();
+    }
+
+    /**
+     *  Number of entities that have a value.
+     */
+    size_t size() const override
+    {
+        return m_members.size();
+    }
+
+    void copyTo(EntityId entityId, SharedComponentStoreBase &dest, EntityId destId) const override
+    {
+        const T *pValue = find(entityId);
+        if (pValue) {
+            static_cast<SharedComponentStore<T> &>(dest).set(destId, *pValue);
+        }
+    }
+
+    SharedComponentStoreBase* createEmpty() const override
+    {
+        return new SharedComponentStore<T>();
+    }
+
+    size_t collectStats(ComponentStats &stats) const override
+    {
+        // Hash nodes hold a next pointer alongside their value
+        const size_t indexNodeBytes = sizeof(void *) + sizeof(typename Index::value_type);
+
+        stats.type = typeid(T);
+        stats.count = m_members.size();
+        stats.componentSize = sizeof(T);
+        stats.payloadBytes = m_index.size() * sizeof(T);
+        stats.bookkeepingBytes = sizeof(*this) +
+            m_members.capacity() * sizeof(detail::SharedMembership) + m_members.bookkeepingBytes() +
+            m_groups.capacity() * sizeof(GroupPtr) + m_freeGroups.capacity() * sizeof(uint32_t) +
+            m_index.size() * indexNodeBytes + m_index.bucket_count() * sizeof(void *);
+
+        // There is a group for each entry in m_index, and each group has at
+        // least one entity, so has allocated its list of entities
+        const size_t groups = m_index.size();
+        stats.bookkeepingBytes += groups * (sizeof(Group) - sizeof(T)) +
+            m_entityCapacity * sizeof(EntityId);
+
+        const size_t heapBlocks = 3 + m_members.heapBlocks() + m_index.size() + 2 * groups;
+
+        stats.capacity = stats.count;
+        stats.loadFactor = stats.count > 0 ? 1.0f : 0.0f;
+
+        return heapBlocks;
+    }
+
+private:
+    struct Group
+    {
+        Group(const T &value, size_t hash)
+          : value(value)
+          , hash(hash) { }
+
+        const T value;
+        const size_t hash;
+        std::vector<EntityId> entities;
+    };
+
+    typedef std::unique_ptr<Group> GroupPtr;
+
+    // Maps hashes to groups, so that values are not stored twice
+    typedef std::unordered_multimap<size_t, uint32_t> Index;
+
+    static const uint32_t NoGroup = std::numeric_limits<uint32_t>::max();
+
+    detail::SharedMembership* member(EntityId entityId)
+    {
+        return static_cast<detail::SharedMembership *>(m_members.find(entityId));
+    }
+
+    uint32_t findGroup(const T &value, size_t hash) const
+    {
+        auto range = m_index.equal_range(hash);
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (m_groups[iter->second]->value == value) {
+                return iter->second;
+            }
+        }
+
+        return NoGroup;
+    }
+
+    uint32_t createGroup(const T &value, size_t hash)
+    {
+        GroupPtr pGroup(new Group(value, hash));
+
+        uint32_t group;
+        if (m_freeGroups.empty()) {
+            group = static_cast<uint32_t>(m_groups.size());
+            m_groups.push_back(nullptr);
+        } else {
+            group = m_freeGroups.back();
+            m_freeGroups.pop_back();
+        }
+
+        m_groups[group] = std::move(pGroup);
+        m_index.insert(Index::value_type(hash, group));
+        return group;
+    }
+
+    void leaveGroup(const detail::SharedMembership &member)
+    {
+        const uint32_t groupIndex = member.group;
+        Group &group = *m_groups[groupIndex];
+
+        // Fill the hole with the last entity in the group
+        const EntityId last = group.entities.back();
+        group.entities[member.position] = last;
+        this->member(last)->position = member.position;
+        group.entities.pop_back();
+
+        if (group.entities.empty()) {
+            auto range = m_index.equal_range(group.hash);
+            for (auto iter = range.first; iter != range.second; ++iter) {
+                if (iter->second == groupIndex) {
+                    m_index.erase(iter);
+                    break;
+                }
+            }
+
+            m_entityCapacity -= group.entities.capacity();
+            m_groups[groupIndex].reset();
+            m_freeGroups.push_back(groupIndex);
+        }
+    }
+
+    ComponentPool m_members;
+    std::vector<GroupPtr> m_groups;     // Null for unused slots
+    std::vector<uint32_t> m_freeGroups;
+    Index m_index;
+
+    // Sum of the capacities of the groups' lists of entities, so that
+    // collectStats does not need to visit every group
+    size_t m_entityCapacity;
+};
+
+/**
+ * Type-erased storage for the components of a single type whose storage
+ * policy is not PooledStorage. See 'Storage Policies' above.
+ *
+ * Like a ComponentPool, each store keeps the list of entities that have a
+ * component, and manipulates components using the functions in their
+ * ComponentTypeInfo where the type is not known.
+ */
+class ComponentStoreBase
+{
+public:
+    ComponentStoreBase()
+      : m_pObserver(nullptr) { }
+
+    virtual ~ComponentStoreBase() = default;
+
+    virtual const ComponentTypeInfo& typeInfo() const = 0;
+    virtual bool contains(EntityId entityId) const = 0;
+
+    /**
+     *  Returns the component of an entity, or nullptr.
+     */
+    virtual void* find(EntityId entityId) = 0;
+
+    const void* find(EntityId entityId) const
+    {
+        return const_cast<ComponentStoreBase *>(this)->find(entityId);
+    }
+
+    /**
+     *  Entities that have a component, in no particular order, and the
+     *  number of such entities. Invalidated by any change to the store.
+     */
+    virtual const EntityId* entities() const = 0;
+    virtual size_t size() const = 0;
+
+    virtual bool erase(EntityId entityId) = 0;
+    virtual void clear() = 0;
+
+    /**
+     *  Create an empty store for the same type.
+     */
+    virtual ComponentStoreBase* createEmpty() const = 0;
+
+    /**
+     *  Fill in 'stats', and return the estimated number of heap blocks.
+     */
+    virtual size_t collectStats(ComponentStats &stats) const = 0;
+
+    /**
+     *  Set the observer that is notified as components are inserted and
+     *  erased, or null.
+     */
+    void setObserver(ComponentObserver *pObserver)
+    {
+        m_pObserver = pObserver;
+    }
+
+    /**
+     *  Construct a component for an entity, which must not already have one.
+     *  <T> must be the store's type.
+     */
+    template<typename T, typename... Args>
+    T* emplace(EntityId entityId, Args&&... args)
+    {
+        void *pSlot = allocate(entityId);
+        T *pComponent;
+        try {
+            pComponent = new (pSlot) T(std::forward<Args>(args)...);
+        } catch (...) {
+            release(entityId);
+            throw;
+        }
+
+        notifyInserted(entityId, pComponent);
+        return pComponent;
+    }
+
+    /**
+     *  Copy-construct a component for an entity from 'pSource'. Returns
+     *  nullptr if the entity already has a component, or the type cannot be
+     *  copied.
+     */
+    void* insertCopy(EntityId entityId, const void *pSource)
+    {
+        const ComponentTypeInfo &info = typeInfo();
+        if (!info.copyConstruct || contains(entityId)) {
+            return nullptr;
+        }
+
+        void *pSlot = allocate(entityId);
+        try {
+            info.copyConstruct(pSlot, pSource);
+        } catch (...) {
+            release(entityId);
+            throw;
+        }
+
+        notifyInserted(entityId, pSlot);
+        return pSlot;
+    }
+
+    /**
+     *  Move-construct a component for an entity from 'pSource', which is left
+     *  in its moved-from state. Returns nullptr if the entity already has a
+     *  component, or the type cannot be moved.
+     */
+    void* insertMove(EntityId entityId, void *pSource)
+    {
+        const ComponentTypeInfo &info = typeInfo();
+        if (!info.moveConstruct || contains(entityId)) {
+            return nullptr;
+        }
+
+        void *pSlot = allocate(entityId);
+        try {
+            info.moveConstruct(pSlot, pSource);
+        } catch (...) {
+            release(entityId);
+            throw;
+        }
+
+        notifyInserted(entityId, pSlot);
+        return pSlot;
+    }
+
+protected:
+    void notifyInserted(EntityId entityId, const void *pComponent)
+    {
+        if (m_pObserver) {
+            m_pObserver->inserted(entityId, pComponent);
+        }
+    }
+
+    void notifyErased(EntityId entityId)
+    {
+        if (m_pObserver) {
+            m_pObserver->erased(entityId);
+        }
+    }
+
+    /**
+     *  Add an entity to the store, and return the address at which its
+     *  component should be constructed.
+     */
+    virtual void* allocate(EntityId entityId) = 0;
+
+    /**
+     *  Remove an entity from the store, without destroying its component.
+     */
+    virtual void release(EntityId entityId) = 0;
+
+private:
+    ComponentObserver *m_pObserver;
+};
+
+/**
+ * Components of type <T>, stored in a hash map keyed by entity ID. Suits types
+ * that few entities have, since memory is only used for those entities.
+ * Addresses are stable until the component is removed.
+ */
+template<typename T>
+class SparseStore: public ComponentStoreBase
+{
+public:
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+        "Sparse components must not be over-aligned");
+
+    SparseStore() { }
+
+    ~SparseStore()
+    {
+        clear();
+    }
+
+    const ComponentTypeInfo& typeInfo() const override
+    {
+        return componentTypeInfo<T>();
+    }
+
+    bool contains(EntityId entityId) const override
+    {
+        return m_nodes.find(entityId) != m_nodes.end();
+    }
+
+    void* find(EntityId entityId) override
+    {
+        auto iter = m_nodes.find(entityId);
+        return iter == m_nodes.end() ? nullptr : &iter->second.storage;
+    }
+
+    const EntityId* entities() const override
+    {
+        return m_entities.data();
+    }
+
+    size_t size() const override
+    {
+        return m_entities.size();
+    }
+
+    bool erase(EntityId entityId) override
+    {
+        T *pComponent = static_cast<T *>(find(entityId));
+        if (!pComponent) {
+            return false;
+        }
+
+        notifyErased(entityId);
+        pComponent->~T();
+        release(entityId);
+        return true;
+    }
+
+    void clear() override
+    {
+        for (auto &node: m_nodes) {
+            reinterpret_cast<T *>(&node.second.storage)->~T();
+        }
+
+        m_nodes.clear();
+        m_entities.clear();
+    }
+
+    ComponentStoreBase* createEmpty() const override
+    {
+        return new SparseStore<T>();
+    }
+
+    size_t collectStats(ComponentStats &stats) const override
+    {
+        // Hash nodes hold a next pointer and a cached hash code alongside their value
+        const size_t nodeBytes = 2 * sizeof(void *) + sizeof(typename Nodes::value_type);
+
+        stats.type = typeid(T);
+        stats.count = size();
+        stats.componentSize = sizeof(T);
+        stats.payloadBytes = stats.count * sizeof(T);
+        stats.bookkeepingBytes = sizeof(*this) + stats.count * (nodeBytes - sizeof(T)) +
+            m_nodes.bucket_count() * sizeof(void *) + m_entities.capacity() * sizeof(EntityId);
+        stats.capacity = stats.count;
+        stats.loadFactor = stats.count > 0 ? 1.0f : 0.0f;
+
+        return 2 + stats.count;
+    }
+
+protected:
+    void* allocate(EntityId entityId) override
+    {
+        m_entities.reserve(m_entities.size() + 1);
+
+        Node &node = m_nodes[entityId];
+        node.index = m_entities.size();
+        m_entities.push_back(entityId);
+        return &node.storage;
+    }
+
+    void release(EntityId entityId) override
+    {
+        auto iter = m_nodes.find(entityId);
+        const size_t index = iter->second.index;
+        m_nodes.erase(iter);
+
+        // Move the last entity into the hole
+        if (index + 1 != m_entities.size()) {
+            m_entities[index] = m_entities.back();
+            m_nodes.find(m_entities[index])->second.index = index;
+        }
+
+        m_entities.pop_back();
+    }
+
+private:
+    SparseStore(const SparseStore &);
+    SparseStore& operator=(const SparseStore &);
+
+    struct Node
+    {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        size_t index;   // Position in m_entities
+    };
+
+    typedef std::unordered_map<EntityId, Node> Nodes;
+
+    Nodes m_nodes;
+    std::vector<EntityId> m_entities;
+};
+
+/**
+ * Components of type <T>, stored in pages of fixed-size slots. Components are
+ * never moved, so pointers to them remain valid until they are removed. Suits
+ * large components, and components that other code holds pointers to.
+ */
+template<typename T>
+class StableStore: public ComponentStoreBase
+{
+public:
+    StableStore()
+      : m_slots(componentTypeInfo<T *>()) { }
+
+    ~StableStore()
+    {
+        clear();
+        for (unsigned char *pPage: m_pages) {
+            detail::deallocateAligned(pPage);
+        }
+    }
+
+    const ComponentTypeInfo& typeInfo() const override
+    {
+        return componentTypeInfo<T>();
+    }
+
+    bool contains(EntityId entityId) const override
+    {
+        return m_slots.contains(entityId);
+    }
+
+    void* find(EntityId entityId) override
+    {
+        T **ppComponent = static_cast<T **>(m_slots.find(entityId));
+        return ppComponent ? *ppComponent : nullptr;
+    }
+
+    const EntityId* entities() const override
+    {
+        return m_slots.entities();
+    }
+
+    size_t size() const override
+    {
+        return m_slots.size();
+    }
+
+    bool erase(EntityId entityId) override
+    {
+        T *pComponent = static_cast<T *>(find(entityId));
+        if (!pComponent) {
+            return false;
+        }
+
+        notifyErased(entityId);
+        pComponent->~T();
+        release(entityId);
+        return true;
+    }
+
+    void clear() override
+    {
+        for (size_t i = 0; i < m_slots.size(); ++i) {
+            T *pComponent = *static_cast<T **>(m_slots.at(i));
+            pComponent->~T();
+            m_free.push_back(pComponent);
+        }
+
+        m_slots.clear();
+    }
+
+    ComponentStoreBase* createEmpty() const override
+    {
+        return new StableStore<T>();
+    }
+
+    size_t collectStats(ComponentStats &stats) const override
+    {
+        stats.type = typeid(T);
+        stats.count = size();
+        stats.componentSize = sizeof(T);
+        stats.payloadBytes = stats.count * sizeof(T);
+        stats.bookkeepingBytes = sizeof(*this) + m_free.size() * sizeof(T) +
+            m_free.capacity() * sizeof(T *) + m_pages.capacity() * sizeof(unsigned char *) +
+            m_slots.size() * sizeof(T *) + m_slots.bookkeepingBytes();
+        stats.capacity = m_pages.size() * PageSize;
+        stats.loadFactor = stats.capacity > 0 ?
+            static_cast<float>(stats.count) / static_cast<float>(stats.capacity) : 0.0f;
+
+        return 1 + m_pages.size() + m_slots.heapBlocks();
+    }
+
+protected:
+    void* allocate(EntityId entityId) override
+    {
+        if (m_free.empty()) {
+            addPage();
+        }
+
+        T *pComponent = m_free.back();
+        m_slots.emplace<T *>(entityId, pComponent);
+        m_free.pop_back();
+        return pComponent;
+    }
+
+    void release(EntityId entityId) override
+    {
+        m_free.push_back(static_cast<T *>(find(entityId)));
+        m_slots.erase(entityId);
+    }
+
+private:
+    StableStore(const StableStore &);
+    StableStore& operator=(const StableStore &);
+
+    static const size_t PageSize = 64;
+
+    void addPage()
+    {
+        m_pages.reserve(m_pages.size() + 1);
+        m_free.reserve(m_free.size() + PageSize);
+
+        unsigned char *pPage = detail::allocateAligned(PageSize * sizeof(T), alignof(T));
+        m_pages.push_back(pPage);
+
+        // Hand out the slots of the page in order
+        for (size_t i = PageSize; i-- > 0; ) {
+            m_free.push_back(reinterpret_cast<T *>(pPage + i * sizeof(T)));
+        }
+    }
+
+    std::vector<unsigned char *> m_pages;
+    std::vector<T *> m_free;
+    ComponentPool m_slots;  // Address of each entity's component
+};
+
+/**
+ * A set of entities, stored as one bit per entity in pages of 4096 bits.
+ * Pages are allocated the first time one of their entities is added, and
+ * kept until the set is destroyed, so adding and removing entities is O(1)
+ * and does not allocate in the steady state.
+ */
+class EntityBitset
+{
+public:
+    EntityBitset()
+      : m_count(0) { }
+
+    bool test(EntityId entityId) const
+    {
+        const size_t slot = slotOf(entityId);
+        const size_t page = slot >> PageBits;
+        return page < m_pages.size() && m_pages[page] &&
+            (m_pages[page][(slot & PageMask) >> 6] & bit(slot)) != 0;
+    }
+
+    /**
+     *  Add an entity to the set. Returns false if it was already present.
+     */
+    bool set(EntityId entityId)
+    {
+        const size_t slot = slotOf(entityId);
+        const size_t page = slot >> PageBits;
+        if (page >= m_pages.size()) {
+            m_pages.resize(page + 1);
+        }
+
+        if (!m_pages[page]) {
+            m_pages[page].reset(new uint64_t[WordsPerPage]());
+        }
+
+        uint64_t &word = m_pages[page][(slot & PageMask) >> 6];
+        if ((word & bit(slot)) != 0) {
+            return false;
+        }
+
+        word |= bit(slot);
+        m_count++;
+        return true;
+    }
+
+    /**
+     *  Remove an entity from the set. Returns false if it was not present.
+     */
+    bool reset(EntityId entityId)
+    {
+        if (!test(entityId)) {
+            return false;
+        }
+
+        const size_t slot = slotOf(entityId);
+        m_pages[slot >> PageBits][(slot & PageMask) >> 6] &= ~bit(slot);
+        m_count--;
+        return true;
+    }
+
+    /**
+     *  Remove every entity, keeping the pages.
+     */
+    void clear()
+    {
+        if (m_count == 0) {
+            return;
+        }
+
+        for (auto &pPage: m_pages) {
+            if (pPage) {
+                std::fill(pPage.get(), pPage.get() + WordsPerPage, 0);
+            }
+        }
+
+        m_count = 0;
+    }
+
+    /**
+     *  Call fn(entityId) for each entity in the set, in order of slot.
+     */
+    template<typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (size_t page = 0; page < m_pages.size(); ++page) {
+            if (!m_pages[page]) {
+                continue;
+            }
+
+            for (size_t word = 0; word < WordsPerPage; ++word) {
+                for (uint64_t bits = m_pages[page][word]; bits != 0; bits &= bits - 1) {
+                    const size_t slot = (page << PageBits) + (word << 6) + lowestBit(bits);
+                    fn(std::numeric_limits<EntityId>::max() - static_cast<EntityId>(slot));
+                }
+            }
+        }
+    }
+
+    size_t count() const
+    {
+        return m_count;
+    }
+
+    bool empty() const
+    {
+        return m_count == 0;
+    }
+
+    size_t pageCount() const
+    {
+        size_t pageCount = 0;
+        for (const auto &pPage: m_pages) {
+            pageCount += pPage ? 1 : 0;
+        }
+
+        return pageCount;
+    }
+
+    /**
+     *  Number of entities that can be added without allocating, assuming
+     *  they fall in existing pages.
+     */
+    size_t capacity() const
+    {
+        return pageCount() * PageSize;
+    }
+
+    /**
+     *  Bytes used by the pages and the page table, excluding sizeof(*this).
+     */
+    size_t bookkeepingBytes() const
+    {
+        return pageCount() * WordsPerPage * sizeof(uint64_t) + m_pages.capacity() * sizeof(Page);
+    }
+
+    size_t heapBlocks() const
+    {
+        return (m_pages.capacity() > 0 ? 1 : 0) + pageCount();
+    }
+
+private:
+    EntityBitset(const EntityBitset &);
+    EntityBitset& operator=(const EntityBitset &);
+
+    typedef std::unique_ptr<uint64_t[]> Page;
+
+    static const size_t PageBits = 12;
+    static const size_t PageSize = static_cast<size_t>(1) << PageBits;
+    static const size_t PageMask = PageSize - 1;
+    static const size_t WordsPerPage = PageSize / 64;
+
+    // Entity IDs are allocated downwards, as in ComponentPool
+    static size_t slotOf(EntityId entityId)
+    {
+        return std::numeric_limits<EntityId>::max() - entityId;
+    }
+
+    static uint64_t bit(size_t slot)
+    {
+        return static_cast<uint64_t>(1) << (slot & 63);
+    }
+
+    static size_t lowestBit(uint64_t bits)
+    {
+        size_t index = 0;
+        while ((bits & 1) == 0) {
+            bits >>= 1;
+            index++;
+        }
+
+        return index;
+    }
+
+    std::vector<Page> m_pages;
+    size_t m_count;
+};
+
+/**
+ * Components of an empty type <T>, stored in an EntityBitset. find() returns
+ * the same object for every entity that has the component.
+ */
+template<typename T>
+class TagStore: public ComponentStoreBase
+{
+public:
+    static_assert(std::is_empty<T>::value && std::is_trivially_destructible<T>::value,
+        "Tag components must be empty, and trivially destructible");
+
+    TagStore()
+      : m_entitiesValid(true) { }
+
+    const ComponentTypeInfo& typeInfo() const override
+    {
+        return componentTypeInfo<T>();
+    }
+
+    bool contains(EntityId entityId) const override
+    {
+        return m_bits.test(entityId);
+    }
+
+    void* find(EntityId entityId) override
+    {
+        return contains(entityId) ? &m_tag : nullptr;
+    }
+
+    /**
+     *  The list of entities is rebuilt from the bitset after a removal, so
+     *  this is O(number of pages) in that case. Since that writes the cached
+     *  list, this is not safe to call concurrently; readers should use
+     *  forEachEntity instead.
+     */
+    const EntityId* entities() const override
+    {
+        if (!m_entitiesValid) {
+            m_entities.clear();
+            m_bits.forEach([this](EntityId entityId) {
+                m_entities.push_back(entityId);
+            });
+
+            m_entitiesValid = true;
+        }
+
+        return m_entities.data();
+    }
+
+    size_t size() const override
+    {
+        return m_bits.count();
+    }
+
+    /**
+     *  Call fn(entityId) for each entity with the tag, in order of ID. Reads
+     *  the bitset directly, so it is safe to call concurrently with other
+     *  reads.
+     */
+    template<typename Fn>
+    void forEachEntity(Fn fn) const
+    {
+        m_bits.forEach(fn);
+    }
+
+    bool erase(EntityId entityId) override
+    {
+        if (!contains(entityId)) {
+            return false;
+        }
+
+        notifyErased(entityId);
+        release(entityId);
+        return true;
+    }
+
+    void clear() override
+    {
+        // Pages are kept, so that re-adding tags does not allocate
+        m_bits.clear();
+        m_entities.clear();
+        m_entitiesValid = true;
+    }
+
+    ComponentStoreBase* createEmpty() const override
+    {
+        return new TagStore<T>();
+    }
+
+    size_t collectStats(ComponentStats &stats) const override
+    {
+        stats.type = typeid(T);
+        stats.count = m_bits.count();
+        stats.componentSize = 0;
+        stats.payloadBytes = 0;
+        stats.bookkeepingBytes = sizeof(*this) + m_bits.bookkeepingBytes() +
+            m_entities.capacity() * sizeof(EntityId);
+        stats.capacity = m_bits.capacity();
+        stats.loadFactor = stats.capacity > 0 ?
+            static_cast<float>(stats.count) / static_cast<float>(stats.capacity) : 0.0f;
+
+        return 1 + m_bits.heapBlocks();
+    }
+
+protected:
+    void* allocate(EntityId entityId) override
+    {
+        if (m_entitiesValid) {
+            m_entities.push_back(entityId);
+        }
+
+        m_bits.set(entityId);
+        return &m_tag;
+    }
+
+    void release(EntityId entityId) override
+    {
+        m_bits.reset(entityId);
+        m_entitiesValid = false;
+    }
+
+private:
+    TagStore(const TagStore &);
+    TagStore& operator=(const TagStore &);
+
+    T m_tag;
+    EntityBitset m_bits;
+
+    // Cached list of entities, appended to when tags are added, and rebuilt
+    // when needed after a tag has been removed
+    mutable std::vector<EntityId> m_entities;
+    mutable bool m_entitiesValid;
+};
+
+namespace detail {
+
+template<typename T>
+ComponentStoreBase* createStore(std::integral_constant<StoragePolicy, PooledStorage>)
+{
+    return nullptr;
+}
+
+template<typename T>
+ComponentStoreBase* createStore(std::integral_constant<StoragePolicy, SparseStorage>)
+{
+    return new SparseStore<T>();
+}
+
+template<typename T>
+ComponentStoreBase* createStore(std::integral_constant<StoragePolicy, StableStorage>)
+{
+    return new StableStore<T>();
+}
+
+template<typename T>
+ComponentStoreBase* createStore(std::integral_constant<StoragePolicy, TagStorage>)
+{
+    return new TagStore<T>();
+}
+
+inline std::atomic<size_t>& resourceCounter()
+{
+    static std::atomic<size_t> counter(0);
+    return counter;
+}
+
+}   // end namespace detail
+
+/**
+ * Returns the dense index of resource type <T>. Indexes are assigned the first
+ * time each type is used, from any thread, and are shared by all managers.
+ */
+template<typename T>
+size_t resourceIndex()
+{
+    static const size_t index = detail::resourceCounter().fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+namespace detail {
+
+inline std::atomic<size_t>& relationCounter()
+{
+    static std::atomic<size_t> counter(0);
+    return counter;
+}
+
+}   // end namespace detail
+
+/**
+ * Returns the dense index of relationship kind <R>, in the same way as
+ * resourceIndex().
+ */
+template<typename R>
+size_t relationIndex()
+{
+    static const size_t index = detail::relationCounter().fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+/**
+ * The (source, target) pairs of a single relationship kind, with forward and
+ * reverse indexes. See 'Relationships' above.
+ *
+ * Every operation on a single pair is O(1), and removing all pairs involving
+ * an entity is O(number of such pairs).
+ */
+class RelationStore
+{
+public:
+    RelationStore()
+      : m_linkCapacity(0) { }
+
+    bool add(EntityId source, EntityId target)
+    {
+        std::vector<EntityId> &targets = m_targets[source];
+        std::vector<EntityId> &sources = m_sources[target];
+
+        Slots slots = { targets.size(), sources.size() };
+        if (!m_pairs.insert(Pairs::value_type(pairKey(source, target), slots)).second) {
+            return false;
+        }
+
+        const size_t capacity = targets.capacity() + sources.capacity();
+        targets.push_back(target);
+        sources.push_back(source);
+        m_linkCapacity += targets.capacity() + sources.capacity() - capacity;
+        return true;
+    }
+
+    bool remove(EntityId source, EntityId target)
+    {
+        auto pairIter = m_pairs.find(pairKey(source, target));
+        if (pairIter == m_pairs.end()) {
+            return false;
+        }
+
+        const Slots slots = pairIter->second;
+        m_pairs.erase(pairIter);
+
+        // Each side is removed by swapping with the last element, so the pair
+        // that held that element must be told about its new slot
+        auto targetsIter = m_targets.find(source);
+        std::vector<EntityId> &targets = targetsIter->second;
+        if (slots.target + 1 != targets.size()) {
+            targets[slots.target] = targets.back();
+            m_pairs[pairKey(source, targets.back())].target = slots.target;
+        }
+
+        targets.pop_back();
+        if (targets.empty()) {
+            m_linkCapacity -= targets.capacity();
+            m_targets.erase(targetsIter);
+        }
+
+        auto sourcesIter = m_sources.find(target);
+        std::vector<EntityId> &sources = sourcesIter->second;
+        if (slots.source + 1 != sources.size()) {
+            sources[slots.source] = sources.back();
+            m_pairs[pairKey(sources.back(), target)].source = slots.source;
+        }
+
+        sources.pop_back();
+        if (sources.empty()) {
+            m_linkCapacity -= sources.capacity();
+            m_sources.erase(sourcesIter);
+        }
+
+        return true;
+    }
+
+    /**
+     *  Remove every pair in which 'entityId' is the source or the target.
+     *  Returns the number of pairs removed.
+     */
+    size_t removeEntity(EntityId entityId)
+    {
+        size_t removed = 0;
+
+        // Pairs are removed from the back of each list, so nothing is moved
+        for (auto iter = m_targets.find(entityId); iter != m_targets.end(); iter = m_targets.find(entityId)) {
+            remove(entityId, iter->second.back());
+            removed++;
+        }
+
+        for (auto iter = m_sources.find(entityId); iter != m_sources.end(); iter = m_sources.find(entityId)) {
+            remove(iter->second.back(), entityId);
+            removed++;
+        }
+
+        return removed;
+    }
+
+    bool contains(EntityId source, EntityId target) const
+    {
+        return m_pairs.find(pairKey(source, target)) != m_pairs.end();
+    }
+
+    /**
+     *  Returns the targets of 'source', in no particular order.
+     */
+    const std::vector<EntityId>& targets(EntityId source) const
+    {
+        return find(m_targets, source);
+    }
+
+    /**
+     *  Returns the sources that have 'target' as a target, in no particular
+     *  order.
+     */
+    const std::vector<EntityId>& sources(EntityId target) const
+    {
+        return find(m_sources, target);
+    }
+
+    /**
+     *  Call fn(source, target) for each pair.
+     */
+    template<typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (const auto &targets: m_targets) {
+            for (EntityId target: targets.second) {
+                fn(targets.first, target);
+            }
+        }
+    }
+
+    /**
+     *  Number of pairs.
+     */
+    size_t size() const
+    {
+        return m_pairs.size();
+    }
+
+    void clear()
+    {
+        m_targets.clear();
+        m_sources.clear();
+        m_pairs.clear();
+        m_linkCapacity = 0;
+    }
+
+    /**
+     *  Estimated bytes used by the forward and reverse indexes and the pair
+     *  map, excluding sizeof(*this). This is O(1).
+     */
+    size_t bookkeepingBytes() const
+    {
+        const size_t linkNodeBytes = 2 * sizeof(void *) + sizeof(Links::value_type);
+        return (m_targets.size() + m_sources.size()) * linkNodeBytes +
+            (m_targets.bucket_count() + m_sources.bucket_count()) * sizeof(void *) +
+            m_linkCapacity * sizeof(EntityId) +
+            m_pairs.size() * (2 * sizeof(void *) + sizeof(Pairs::value_type)) +
+            m_pairs.bucket_count() * sizeof(void *);
+    }
+
+    /**
+     *  Estimated number of heap allocations: a node and a list for each
+     *  source and target, a node for each pair, and the bucket arrays.
+     */
+    size_t heapBlocks() const
+    {
+        return 3 + 2 * (m_targets.size() + m_sources.size()) + m_pairs.size();
+    }
+
+private:
+    typedef std::unordered_map<EntityId, std::vector<EntityId>> Links;
+
+    // Positions of a pair in the lists of its source and its target
+    struct Slots
+    {
+        size_t target;
+        size_t source;
+    };
+
+    typedef std::unordered_map<uint64_t, Slots> Pairs;
+
+    static uint64_t pairKey(EntityId source, EntityId target)
+    {
+        return (static_cast<uint64_t>(source) << 32) | target;
+    }
+
+    static const std::vector<EntityId>& find(const Links &links, EntityId entityId)
+    {
+        static const std::vector<EntityId> none;
+
+        auto iter = links.find(entityId);
+        return iter == links.end() ? none : iter->second;
+    }
+
+    Links m_targets;
+    Links m_sources;
+    Pairs m_pairs;
+
+    // Sum of the capacities of the lists in m_targets and m_sources
+    size_t m_linkCapacity;
+};
+
+/**
+ * Hierarchical timing wheel of entity expiry times, measured in ticks. See
+ * 'Lifetimes' above.
+ *
+ * Each level has 64 slots, and each slot of a level spans all 64 slots of the
+ * level below. An entity is placed in the lowest level at which its expiry
+ * tick shares every higher digit with the current tick, so scheduling and
+ * cancelling are O(1). When the lower digits of the current tick wrap around
+ * to zero, the slot of the next level is moved down a level. Each entity is
+ * therefore moved at most once per level, and advancing by one tick costs
+ * O(1) plus the number of entities that expire.
+ */
+class ExpiryWheel
+{
+public:
+    ExpiryWheel()
+      : m_now(0)
+      , m_slotCapacity(0) { }
+
+    /**
+     *  The current tick, which starts at zero.
+     */
+    uint64_t now() const
+    {
+        return m_now;
+    }
+
+    /**
+     *  Schedule an entity to expire after 'delay' ticks, replacing any
+     *  previous expiry time. A delay of zero is treated as one tick.
+     */
+    void schedule(EntityId entityId, uint64_t delay)
+    {
+        if (m_slots.empty()) {
+            m_slots.resize(LevelCount * SlotCount);
+        }
+
+        const uint64_t maxTick = std::numeric_limits<uint64_t>::max();
+        const uint64_t expiry = delay < maxTick - m_now ? m_now + std::max<uint64_t>(delay, 1) : maxTick;
+
+        auto result = m_entries.insert(Entries::value_type(entityId, Entry()));
+        if (!result.second) {
+            unlink(result.first->second);
+        }
+
+        result.first->second.expiry = expiry;
+        place(entityId, result.first->second);
+    }
+
+    bool cancel(EntityId entityId)
+    {
+        auto iter = m_entries.find(entityId);
+        if (iter == m_entries.end()) {
+            return false;
+        }
+
+        unlink(iter->second);
+        m_entries.erase(iter);
+        return true;
+    }
+
+    bool contains(EntityId entityId) const
+    {
+        return m_entries.find(entityId) != m_entries.end();
+    }
+
+    /**
+     *  Number of ticks until an entity expires, or zero if it is not scheduled.
+     */
+    uint64_t remaining(EntityId entityId) const
+    {
+        auto iter = m_entries.find(entityId);
+        return iter == m_entries.end() ? 0 : iter->second.expiry - m_now;
+    }
+
+    /**
+     *  Advance the current tick, and append the entities that expire to
+     *  'expired', in order of expiry. The entities are no longer scheduled.
+     */
+    void advance(uint64_t ticks, std::vector<EntityId> &expired)
+    {
+        for (uint64_t i = 0; i < ticks; ++i) {
+            if (m_entries.empty()) {
+                m_now += ticks - i;
+                return;
+            }
+
+            m_now++;
+
+            // Move slots down from the highest level whose lower digits have
+            // all wrapped around, so that each slot is refilled before it is
+            // itself moved down
+            size_t level = 0;
+            while (level + 1 < LevelCount && (m_now & ((static_cast<uint64_t>(1) << (SlotBits * (level + 1))) - 1)) == 0) {
+                level++;
+            }
+
+            for (; level > 0; --level) {
+                std::vector<EntityId> &slot = m_slots[level * SlotCount + digit(m_now, level)];
+                if (slot.empty()) {
+                    continue;
+                }
+
+                m_slotCapacity += m_cascade.capacity() - slot.capacity();
+                m_cascade.swap(slot);
+                for (EntityId entityId: m_cascade) {
+                    place(entityId, m_entries.find(entityId)->second);
+                }
+                m_cascade.clear();
+            }
+
+            std::vector<EntityId> &slot = m_slots[digit(m_now, 0)];
+            for (EntityId entityId: slot) {
+                m_entries.erase(entityId);
+                expired.push_back(entityId);
+            }
+            slot.clear();
+        }
+    }
+
+    /**
+     *  Call fn(entityId, remaining) for each scheduled entity.
+     */
+    template<typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (const auto &entry: m_entries) {
+            fn(entry.first, entry.second.expiry - m_now);
+        }
+    }
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+
+    /**
+     *  Cancel every expiry. The current tick, and the slots' capacity, are kept.
+     */
+    void clear()
+    {
+        if (m_entries.empty()) {
+            return;
+        }
+
+        for (auto &slot: m_slots) {
+            slot.clear();
+        }
+
+        m_entries.clear();
+    }
+
+    /**
+     *  Estimated bytes used by the slots and the entry map, excluding
+     *  sizeof(*this). This is O(1).
+     */
+    size_t bookkeepingBytes() const
+    {
+        return m_slots.capacity() * sizeof(std::vector<EntityId>) +
+            (m_slotCapacity + m_cascade.capacity()) * sizeof(EntityId) +
+            m_entries.size() * (2 * sizeof(void *) + sizeof(Entries::value_type)) +
+            m_entries.bucket_count() * sizeof(void *);
+    }
+
+private:
+    static const size_t SlotBits = 6;
+    static const size_t SlotCount = static_cast<size_t>(1) << SlotBits;
+
+    // Enough levels to hold any 64-bit tick
+    static const size_t LevelCount = (64 + SlotBits - 1) / SlotBits;
+
+    struct Entry
+    {
+        uint64_t expiry;
+        uint32_t slot;      // Index into m_slots
+        uint32_t index;     // Position within the slot
+    };
+
+    typedef std::unordered_map<EntityId, Entry> Entries;
+
+    static size_t digit(uint64_t tick, size_t level)
+    {
+        return static_cast<size_t>(tick >> (SlotBits * level)) & (SlotCount - 1);
+    }
+
+    void place(EntityId entityId, Entry &entry)
+    {
+        size_t level = 0;
+        while (level + 1 < LevelCount &&
+            (entry.expiry >> (SlotBits * (level + 1))) != (m_now >> (SlotBits * (level + 1)))) {
+            level++;
+        }
+
+        std::vector<EntityId> &slot = m_slots[level * SlotCount + digit(entry.expiry, level)];
+        entry.slot = static_cast<uint32_t>(level * SlotCount + digit(entry.expiry, level));
+        entry.index = static_cast<uint32_t>(slot.size());
+
+        const size_t capacity = slot.capacity();
+        slot.push_back(entityId);
+        m_slotCapacity += slot.capacity() - capacity;
+    }
+
+    void unlink(const Entry &entry)
+    {
+        // Swap with the last entity in the slot, which must be told its new position
+        std::vector<EntityId> &slot = m_slots[entry.slot];
+        if (entry.index + 1 != slot.size()) {
+            slot[entry.index] = slot.back();
+            m_entries.find(slot.back())->second.index = entry.index;
+        }
+
+        slot.pop_back();
+    }
+
+    uint64_t m_now;
+    std::vector<std::vector<EntityId>> m_slots;     // LevelCount levels of SlotCount slots
+    std::vector<EntityId> m_cascade;                // Slot being moved down a level
+    Entries m_entries;
+    size_t m_slotCapacity;                          // Sum of the capacities of m_slots
+};
+
+/**
+ * Assigns entities to update buckets, so that entities that only need to be
+ * updated every few ticks are spread evenly across ticks. See 'Update
+ * Intervals' above.
+ *
+ * Intervals are powers of two, up to MaxInterval. An entity with interval N
+ * is placed in one of N buckets, and the bucket with phase p is due on ticks
+ * where tick % N == p. The phase is chosen to minimise the largest number of
+ * entities due on any of the ticks that the bucket is due, so the load of
+ * every tick stays as even as possible. Each bucket is a contiguous array of
+ * entity IDs.
+ */
+class UpdateBuckets
+{
+public:
+    static const uint32_t MaxInterval = 64;
+
+    UpdateBuckets()
+      : m_entityCapacity(0)
+    {
+        std::fill(m_tickLoad, m_tickLoad + MaxInterval, 0);
+    }
+
+    /**
+     *  Rounds an interval up to a power of two, between 1 and MaxInterval.
+     */
+    static uint32_t roundInterval(uint32_t interval)
+    {
+        uint32_t rounded = 1;
+        while (rounded < interval && rounded < MaxInterval) {
+            rounded <<= 1;
+        }
+
+        return rounded;
+    }
+
+    /**
+     *  Add an entity to a bucket for 'interval', or move it to one if it
+     *  already has a different interval.
+     */
+    void assign(EntityId entityId, uint32_t interval)
+    {
+        interval = roundInterval(interval);
+        if (m_buckets.empty()) {
+            m_buckets.resize(2 * MaxInterval - 1);
+        }
+
+        auto iter = m_positions.find(entityId);
+        if (iter != m_positions.end()) {
+            if (intervalOf(iter->second.bucket) == interval) {
+                return;
+            }
+
+            unlink(iter->second);
+        } else {
+            iter = m_positions.insert(Positions::value_type(entityId, Position())).first;
+        }
+
+        // Choose the phase whose busiest tick is least busy
+        uint32_t bestPhase = 0;
+        size_t bestLoad = std::numeric_limits<size_t>::max();
+        for (uint32_t phase = 0; phase < interval; ++phase) {
+            size_t load = 0;
+            for (uint32_t tick = phase; tick < MaxInterval; tick += interval) {
+                load = std::max(load, m_tickLoad[tick]);
+            }
+
+            if (load < bestLoad) {
+                bestLoad = load;
+                bestPhase = phase;
+            }
+        }
+
+        Position &position = iter->second;
+        position.bucket = interval - 1 + bestPhase;
+        std::vector<EntityId> &bucket = m_buckets[position.bucket];
+        position.index = static_cast<uint32_t>(bucket.size());
+
+        const size_t capacity = bucket.capacity();
+        bucket.push_back(entityId);
+        m_entityCapacity += bucket.capacity() - capacity;
+        adjustLoad(position.bucket, 1);
+    }
+
+    bool remove(EntityId entityId)
+    {
+        auto iter = m_positions.find(entityId);
+        if (iter == m_positions.end()) {
+            return false;
+        }
+
+        unlink(iter->second);
+        m_positions.erase(iter);
+        return true;
+    }
+
+    /**
+     *  Returns the interval of an entity, or zero if it has not been assigned.
+     */
+    uint32_t interval(EntityId entityId) const
+    {
+        auto iter = m_positions.find(entityId);
+        return iter == m_positions.end() ? 0 : intervalOf(iter->second.bucket);
+    }
+
+    /**
+     *  Call fn(pEntities, count, interval) for each bucket that is due on
+     *  'tick'. The buckets must not be changed during the call.
+     */
+    template<typename Fn>
+    void forEachDue(uint64_t tick, Fn fn) const
+    {
+        if (m_positions.empty()) {
+            return;
+        }
+
+        for (uint32_t interval = 1; interval <= MaxInterval; interval <<= 1) {
+            const std::vector<EntityId> &bucket =
+                m_buckets[interval - 1 + static_cast<uint32_t>(tick & (interval - 1))];
+            if (!bucket.empty()) {
+                fn(bucket.data(), bucket.size(), interval);
+            }
+        }
+    }
+
+    /**
+     *  Call fn(entityId, interval) for each entity that has been assigned.
+     */
+    template<typename Fn>
+    void forEach(Fn fn) const
+    {
+        for (const auto &position: m_positions) {
+            fn(position.first, intervalOf(position.second.bucket));
+        }
+    }
+
+    /**
+     *  Number of entities due on 'tick'.
+     */
+    size_t dueCount(uint64_t tick) const
+    {
+        return m_tickLoad[tick & (MaxInterval - 1)];
+    }
+
+    size_t size() const
+    {
+        return m_positions.size();
+    }
+
+    void clear()
+    {
+        if (m_positions.empty()) {
+            return;
+        }
+
+        for (auto &bucket: m_buckets) {
+            bucket.clear();
+        }
+
+        std::fill(m_tickLoad, m_tickLoad + MaxInterval, 0);
+        m_positions.clear();
+    }
+
+    /**
+     *  Estimated bytes used by the buckets and the position map, excluding
+     *  sizeof(*this). This is O(1).
+     */
+    size_t bookkeepingBytes() const
+    {
+        return m_buckets.capacity() * sizeof(std::vector<EntityId>) +
+            m_entityCapacity * sizeof(EntityId) +
+            m_positions.size() * (2 * sizeof(void *) + sizeof(Positions::value_type)) +
+            m_positions.bucket_count() * sizeof(void *);
+    }
+
+private:
+    // Buckets for interval N are stored at [N - 1, 2N - 1), one per phase
+    struct Position
+    {
+        uint32_t bucket;
+        uint32_t index;     // Position within the bucket
+    };
+
+    typedef std::unordered_map<EntityId, Position> Positions;
+
+    static uint32_t intervalOf(uint32_t bucket)
+    {
+        uint32_t interval = 1;
+        while (2 * interval - 1 <= bucket) {
+            interval <<= 1;
+        }
+
+        return interval;
+    }
+
+    void adjustLoad(uint32_t bucket, int delta)
+    {
+        const uint32_t interval = intervalOf(bucket);
+        for (uint32_t tick = bucket - (interval - 1); tick < MaxInterval; tick += interval) {
+            m_tickLoad[tick] += delta;
+        }
+    }
+
+    void unlink(const Position &position)
+    {
+        // Swap with the last entity in the bucket, which must be told its new position
+        std::vector<EntityId> &bucket = m_buckets[position.bucket];
+        if (position.index + 1 != bucket.size()) {
+            bucket[position.index] = bucket.back();
+            m_positions.find(bucket.back())->second.index = position.index;
+        }
+
+        bucket.pop_back();
+        adjustLoad(position.bucket, -1);
+    }
+
+    std::vector<std::vector<EntityId>> m_buckets;
+    Positions m_positions;
+    size_t m_tickLoad[MaxInterval];     // Entities due on each tick, modulo MaxInterval
+    size_t m_entityCapacity;            // Sum of the capacities of m_buckets
+};
+
+/**
+ * Type-erased owner of a single world resource. The value is allocated on its
+ * own, so references to it are not invalidated when other resources are set,
+ * and is reached without any virtual calls.
+ */
+class ResourceSlot
+{
+public:
+    ResourceSlot()
+      : m_pValue(nullptr)
+      , m_destroy(nullptr)
+      , m_size(0) { }
+
+    ResourceSlot(ResourceSlot &&other) noexcept
+      : m_pValue(other.m_pValue)
+      , m_destroy(other.m_destroy)
+      , m_size(other.m_size)
+    {
+        other.m_pValue = nullptr;
+    }
+
+    ~ResourceSlot()
+    {
+        reset();
+    }
+
+    template<typename T, typename... Args>
+    T* emplace(Args&&... args)
+    {
+        T *pValue = new T(std::forward<Args>(args)...);
+        reset();
+        m_pValue = pValue;
+        m_destroy = [](void *p) { delete static_cast<T *>(p); };
+        m_size = sizeof(T);
+        return pValue;
+    }
+
+    void reset()
+    {
+        if (m_pValue) {
+            m_destroy(m_pValue);
+            m_pValue = nullptr;
+        }
+    }
+
+    void* get() const
+    {
+        return m_pValue;
+    }
+
+    size_t size() const
+    {
+        return m_pValue ? m_size : 0;
+    }
+
+private:
+    ResourceSlot(const ResourceSlot &);
+    ResourceSlot& operator=(const ResourceSlot &);
+
+    void *m_pValue;
+    void (*m_destroy)(void *);
+    size_t m_size;
+};
+
+/**
+ * The set of resources that a system reads and writes. See 'Resources' above.
+ *
+ * Two systems may run concurrently if neither writes a resource that the
+ * other reads or writes.
+ */
+class ResourceAccess
+{
+public:
+    template<typename T>
+    ResourceAccess& read()
+    {
+        insert(m_reads, resourceIndex<T>());
+        return *this;
+    }
+
+    template<typename T>
+    ResourceAccess& write()
+    {
+        insert(m_writes, resourceIndex<T>());
+        return *this;
+    }
+
+    template<typename T>
+    bool reads() const
+    {
+        return contains(m_reads, resourceIndex<T>()) || writes<T>();
+    }
+
+    template<typename T>
+    bool writes() const
+    {
+        return contains(m_writes, resourceIndex<T>());
+    }
+
+    /**
+     *  Returns true if this access and 'other' cannot safely overlap.
+     */
+    bool conflictsWith(const ResourceAccess &other) const
+    {
+        return intersects(m_writes, other.m_writes) ||
+            intersects(m_writes, other.m_reads) ||
+            intersects(m_reads, other.m_writes);
+    }
+
+    /**
+     *  Add the reads and writes of 'other' to this access.
+     */
+    ResourceAccess& merge(const ResourceAccess &other)
+    {
+        for (size_t index: other.m_reads) {
+            insert(m_reads, index);
+        }
+
+        for (size_t index: other.m_writes) {
+            insert(m_writes, index);
+        }
+
+        return *this;
+    }
+
+private:
+    // Each list is kept sorted, so that conflicts are found in linear time
+    typedef std::vector<size_t> Indexes;
+
+    static void insert(Indexes &indexes, size_t index)
+    {
+        auto iter = std::lower_bound(indexes.begin(), indexes.end(), index);
+        if (iter == indexes.end() || *iter != index) {
+            indexes.insert(iter, index);
+        }
+    }
+
+    static bool contains(const Indexes &indexes, size_t index)
+    {
+        return std::binary_search(indexes.begin(), indexes.end(), index);
+    }
+
+    static bool intersects(const Indexes &a, const Indexes &b)
+    {
+        auto iterA = a.begin();
+        auto iterB = b.begin();
+        while (iterA != a.end() && iterB != b.end()) {
+            if (*iterA < *iterB) {
+                ++iterA;
+            } else if (*iterB < *iterA) {
+                ++iterB;
+            } else {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    Indexes m_reads;
+    Indexes m_writes;
+};
+
+namespace detail {
+
+inline std::atomic<size_t>& eventCounter()
+{
+    static std::atomic<size_t> counter(0);
+    return counter;
+}
+
+/**
+ * Assigns each thread that emits events a slot in the per-thread buffers of
+ * every EventChannel. Slots are returned when their thread exits.
+ */
+class EventThreadSlots
+{
+public:
+    static const size_t capacity = GAMEUTILS_ENTITY_EVENT_THREADS;
+
+    static EventThreadSlots& instance()
+    {
+        static EventThreadSlots slots;
+        return slots;
+    }
+
+    size_t acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_free.empty()) {
+            const size_t slot = m_free.back();
+            m_free.pop_back();
+            return slot;
+        }
+
+        if (m_next == capacity) {
+            throw std::runtime_error("Too many threads emitting events; increase GAMEUTILS_ENTITY_EVENT_THREADS.");
+        }
+
+        return m_next++;
+    }
+
+    void release(size_t slot)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(slot);
+    }
+
+private:
+    EventThreadSlots()
+      : m_next(0)
+    {
+        m_free.reserve(capacity);
+    }
+
+    std::mutex m_mutex;
+    std::vector<size_t> m_free;
+    size_t m_next;
+};
+
+struct EventThreadSlot
+{
+    EventThreadSlot()
+      : index(EventThreadSlots::instance().acquire()) { }
+
+    ~EventThreadSlot()
+    {
+        EventThreadSlots::instance().release(index);
+    }
+
+    const size_t index;
+};
+
+/**
+ * Returns the event buffer slot of the calling thread. Only the first call
+ * on each thread takes a lock.
+ */
+inline size_t eventThreadSlot()
+{
+    static thread_local EventThreadSlot slot;
+    return slot.index;
+}
+
+}   // end namespace detail
+
+/**
+ * Returns the dense index of event type <E>, in the same way as
+ * resourceIndex().
+ */
+template<typename E>
+size_t eventIndex()
+{
+    static const size_t index = detail::eventCounter().fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+/**
+ * A contiguous array of events of type <E>, returned by
+ * EntityManager::events(). See 'Events' above.
+ */
+template<typename E>
+class EventSpan
+{
+public:
+    EventSpan()
+      : m_pEvents(nullptr)
+      , m_size(0) { }
+
+    EventSpan(const E *pEvents, size_t size)
+      : m_pEvents(pEvents)
+      , m_size(size) { }
+
+    const E* begin() const
+    {
+        return m_pEvents;
+    }
+
+    const E* end() const
+    {
+        return m_pEvents + m_size;
+    }
+
+    const E* data() const
+    {
+        return m_pEvents;
+    }
+
+    const E& operator[](size_t i) const
+    {
+        return m_pEvents[i];
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+private:
+    const E *m_pEvents;
+    size_t m_size;
+};
+
+class EventChannelBase
+{
+public:
+    virtual ~EventChannelBase() = default;
+
+    /**
+     *  Discard the readable events, and make those emitted since the last
+     *  swap readable.
+     */
+    virtual void swap() = 0;
+
+    virtual size_t pendingCount() const = 0;
+
+    /**
+     *  Bytes occupied by the channel and the capacity of its buffers.
+     */
+    virtual size_t size() const = 0;
+};
+
+/**
+ * The double-buffered events of type <E>. Each thread appends to its own
+ * pending buffer, which is padded so that it does not share a cache line
+ * with those of other threads.
+ */
+template<typename E>
+class EventChannel: public EventChannelBase
+{
+public:
+    static const size_t Threads = detail::EventThreadSlots::capacity;
+
+    EventChannel()
+      : m_pending(new Pending[Threads]) { }
+
+    template<typename... Args>
+    void emit(Args&&... args)
+    {
+        m_pending[detail::eventThreadSlot()].events.emplace_back(std::forward<Args>(args)...);
+    }
+
+    EventSpan<E> readable() const
+    {
+        return EventSpan<E>(m_readable.data(), m_readable.size());
+    }
+
+    void swap() override
+    {
+        m_readable.clear();
+        for (size_t i = 0; i < Threads; ++i) {
+            std::vector<E> &events = m_pending[i].events;
+            if (events.empty()) {
+                continue;
+            }
+
+            // The first non-empty buffer is swapped in, so that the common
+            // case of a single emitting thread does not copy any events
+            if (m_readable.empty()) {
+                m_readable.swap(events);
+            } else {
+                m_readable.insert(m_readable.end(),
+                    std::make_move_iterator(events.begin()), std::make_move_iterator(events.end()));
+                events.clear();
+            }
+        }
+    }
+
+    size_t pendingCount() const override
+    {
+        size_t count = 0;
+        for (size_t i = 0; i < Threads; ++i) {
+            count += m_pending[i].events.size();
+        }
+
+        return count;
+    }
+
+    size_t size() const override
+    {
+        size_t bytes = sizeof(*this) + sizeof(Pending) * Threads + m_readable.capacity() * sizeof(E);
+        for (size_t i = 0; i < Threads; ++i) {
+            bytes += m_pending[i].events.capacity() * sizeof(E);
+        }
+
+        return bytes;
+    }
+
+private:
+    // Two cache lines apart, so that no line holds parts of two buffers
+    struct Pending
+    {
+        std::vector<E> events;
+        char padding[2 * ComponentPool::CacheLineSize - sizeof(std::vector<E>)];
+    };
+
+    std::unique_ptr<Pending[]> m_pending;
+    std::vector<E> m_readable;
+};
+
+/**
+ * Base class for secondary indexes over a field of an attached, pooled or
+ * stored component type. See 'Value Indexes' above.
+ */
+class ComponentIndex
+{
+public:
+    virtual ~ComponentIndex() { }
+
+    /**
+     *  Number of entities in the index.
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     *  Estimated bytes used by the index, including the index itself, and
+     *  the number of heap allocations it holds. Both are O(1).
+     */
+    virtual size_t bookkeepingBytes() const = 0;
+    virtual size_t heapBlocks() const = 0;
+
+private:
+    friend class EntityManager;
+
+    // Attached components are passed as a Component, and pooled or stored
+    // components by the address of the indexed type
+    virtual void insert(EntityId entityId, const Component &component) = 0;
+    virtual void insertValue(EntityId entityId, const void *pComponent) = 0;
+    virtual void erase(EntityId entityId) = 0;
+    virtual void clear() = 0;
+};
+
+namespace detail {
+
+/**
+ * Returns the address of an attached component as its most-derived type
+ * <T>. Types that are not Components are never attached, so for those this
+ * is never called.
+ */
+template<typename T>
+const void* attachedValue(const Component &component, std::true_type)
+{
+    return &static_cast<const T &>(component);
+}
+
+template<typename T>
+const void* attachedValue(const Component &, std::false_type)
+{
+    return nullptr;
+}
+
+template<typename T>
+const void* attachedValue(const Component &component)
+{
+    return attachedValue<T>(component, std::is_base_of<Component, T>());
+}
+
+}   // end namespace detail
+
+/**
+ * Index of the entities whose component of type <T> has a given value of a
+ * member of type <K>, for O(1) equality lookups.
+ */
+template<typename T, typename K, typename Hash = std::hash<K>>
+class HashIndex: public ComponentIndex
+{
+public:
+    explicit HashIndex(K T::*pMember)
+      : m_pMember(pMember)
+      , m_entityCapacity(0) { }
+
+    /**
+     *  Returns the entities whose component has 'key', in no particular order.
+     */
+    const std::vector<EntityId>& find(const K &key) const
+    {
+        static const std::vector<EntityId> none;
+
+        auto iter = m_buckets.find(key);
+        return iter == m_buckets.end() ? none : iter->second;
+    }
+
+    /**
+     *  Returns an entity whose component has 'key', or InvalidEntity.
+     */
+    EntityId findFirst(const K &key) const
+    {
+        const std::vector<EntityId> &entities = find(key);
+        return entities.empty() ? InvalidEntity : entities.front();
+    }
+
+    size_t count(const K &key) const
+    {
+        return find(key).size();
+    }
+
+    size_t size() const override
+    {
+        return m_positions.size();
+    }
+
+    size_t bookkeepingBytes() const override
+    {
+        return sizeof(*this) +
+            m_buckets.size() * (2 * sizeof(void *) + sizeof(typename Buckets::value_type)) +
+            m_buckets.bucket_count() * sizeof(void *) + m_entityCapacity * sizeof(EntityId) +
+            m_positions.size() * (2 * sizeof(void *) + sizeof(typename Positions::value_type)) +
+            m_positions.bucket_count() * sizeof(void *);
+    }
+
+    size_t heapBlocks() const override
+    {
+        // A node and a list of entities for each key, and a node per entity
+        return 3 + 2 * m_buckets.size() + m_positions.size();
+    }
+
+private:
+    typedef std::unordered_map<K, std::vector<EntityId>, Hash> Buckets;
+
+    // Location of an entity within its bucket. Elements of an unordered_map
+    // are not moved when it is rehashed, so the bucket can be held directly.
+    struct Position
+    {
+        typename Buckets::value_type *pBucket;
+        size_t index;
+    };
+
+    typedef std::unordered_map<EntityId, Position> Positions;
+
+    void insert(EntityId entityId, const Component &component) override
+    {
+        insertValue(entityId, detail::attachedValue<T>(component));
+    }
+
+    void insertValue(EntityId entityId, const void *pComponent) override
+    {
+        const K &key = static_cast<const T *>(pComponent)->*m_pMember;
+        auto &bucket = *m_buckets.insert(typename Buckets::value_type(key, std::vector<EntityId>())).first;
+
+        Position position = { &bucket, bucket.second.size() };
+        m_positions[entityId] = position;
+
+        const size_t capacity = bucket.second.capacity();
+        bucket.second.push_back(entityId);
+        m_entityCapacity += bucket.second.capacity() - capacity;
+    }
+
+    void erase(EntityId entityId) override
+    {
+        auto posIter = m_positions.find(entityId);
+        if (posIter == m_positions.end()) {
+            return;
+        }
+
+        // Swap with the last entity in the bucket, so that removal is O(1)
+        std::vector<EntityId> &entities = posIter->second.pBucket->second;
+        const size_t index = posIter->second.index;
+        if (index + 1 != entities.size()) {
+            entities[index] = entities.back();
+            m_positions[entities[index]].index = index;
+        }
+
+        entities.pop_back();
+        if (entities.empty()) {
+            m_entityCapacity -= entities.capacity();
+            m_buckets.erase(posIter->second.pBucket->first);
+        }
+
+        m_positions.erase(posIter);
+    }
+
+    void clear() override
+    {
+        m_buckets.clear();
+        m_positions.clear();
+        m_entityCapacity = 0;
+    }
+
+    K T::*m_pMember;
+    Buckets m_buckets;
+    Positions m_positions;
+
+    // Sum of the capacities of the lists of entities in m_buckets, so that
+    // bookkeepingBytes does not need to visit every key
+    size_t m_entityCapacity;
+};
+
+/**
+ * Index of the entities with a component of type <T>, ordered by a member of
+ * type <K>, for O(log n) range queries.
+ */
+template<typename T, typename K, typename Compare = std::less<K>>
+class OrderedIndex: public ComponentIndex
+{
+public:
+    typedef std::multimap<K, EntityId, Compare> Entries;
+    typedef typename Entries::const_iterator const_iterator;
+    typedef std::pair<const_iterator, const_iterator> Range;
+
+    explicit OrderedIndex(K T::*pMember)
+      : m_pMember(pMember) { }
+
+    /**
+     *  Returns the entries whose key is equal to 'key'.
+     */
+    Range find(const K &key) const
+    {
+        return m_entries.equal_range(key);
+    }
+
+    /**
+     *  Returns the entries whose key is in the closed range [first, last].
+     */
+    Range range(const K &first, const K &last) const
+    {
+        const const_iterator lower = m_entries.lower_bound(first);
+        if (m_entries.key_comp()(last, first)) {
+            return Range(lower, lower);
+        }
+
+        return Range(lower, m_entries.upper_bound(last));
+    }
+
+    /**
+     *  Returns an entity whose component has 'key', or InvalidEntity.
+     */
+    EntityId findFirst(const K &key) const
+    {
+        auto iter = m_entries.find(key);
+        return iter == m_entries.end() ? InvalidEntity : iter->second;
+    }
+
+    size_t count(const K &key) const
+    {
+        return m_entries.count(key);
+    }
+
+    /**
+     *  Iterate over every entry, in order of key.
+     */
+    const_iterator begin() const
+    {
+        return m_entries.begin();
+    }
+
+    const_iterator end() const
+    {
+        return m_entries.end();
+    }
+
+    size_t size() const override
+    {
+        return m_entries.size();
+    }
+
+    size_t bookkeepingBytes() const override
+    {
+        // Tree nodes hold three pointers and a colour alongside their value
+        return sizeof(*this) +
+            m_entries.size() * (4 * sizeof(void *) + sizeof(typename Entries::value_type)) +
+            m_positions.size() * (2 * sizeof(void *) + sizeof(typename Positions::value_type)) +
+            m_positions.bucket_count() * sizeof(void *);
+    }
+
+    size_t heapBlocks() const override
+    {
+        return 2 + m_entries.size() + m_positions.size();
+    }
+
+private:
+    typedef std::unordered_map<EntityId, typename Entries::iterator> Positions;
+
+    void insert(EntityId entityId, const Component &component) override
+    {
+        insertValue(entityId, detail::attachedValue<T>(component));
+    }
+
+    void insertValue(EntityId entityId, const void *pComponent) override
+    {
+        const K &key = static_cast<const T *>(pComponent)->*m_pMember;
+        m_positions[entityId] = m_entries.insert(typename Entries::value_type(key, entityId));
+    }
+
+    void erase(EntityId entityId) override
+    {
+        auto posIter = m_positions.find(entityId);
+        if (posIter == m_positions.end()) {
+            return;
+        }
+
+        m_entries.erase(posIter->second);
+        m_positions.erase(posIter);
+    }
+
+    void clear() override
+    {
+        m_entries.clear();
+        m_positions.clear();
+    }
+
+    K T::*m_pMember;
+    Entries m_entries;
+    Positions m_positions;
+};
+
+/**
+ * Hash of a component's value, used by ChecksumIndex. Defaults to std::hash,
+ * and should be specialised for component types. The result must depend
+ * only on the value, so that it is the same on every peer.
+ */
+template<typename T>
+struct ChecksumHash: std::hash<T> { };
+
+namespace detail {
+
+/**
+ * Finalizer of the SplitMix64 generator, which spreads the bits of 'x'
+ * evenly across the result.
+ */
+inline uint64_t mixHash(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+}   // end namespace detail
+
+/**
+ * An order-independent checksum of the components of a type. See
+ * 'Checksums' above.
+ *
+ * The hash of each entity mixes its ID with the hash of its component, and
+ * the checksum is the sum of these hashes, so it can be updated in O(1) as
+ * components are inserted and erased. Entities are also divided into
+ * buckets by ID, each with its own sum, so that the entities that differ
+ * between two checksums can be found without comparing all of them.
+ */
+class ComponentChecksum: public ComponentIndex
+{
+public:
+    static const size_t BucketCount = 256;
+
+    explicit ComponentChecksum(uint32_t typeId)
+      : m_typeId(typeId)
+      , m_value(0)
+      , m_entityCapacity(0)
+      , m_allocatedBuckets(0)
+    {
+        std::fill(m_bucketValues, m_bucketValues + BucketCount, 0);
+    }
+
+    size_t size() const override
+    {
+        return m_positions.size();
+    }
+
+    size_t bookkeepingBytes() const override
+    {
+        return sizeof(*this) + m_entityCapacity * sizeof(EntityId) +
+            m_positions.size() * (2 * sizeof(void *) + sizeof(Positions::value_type)) +
+            m_positions.bucket_count() * sizeof(void *);
+    }
+
+    size_t heapBlocks() const override
+    {
+        return 1 + m_allocatedBuckets + m_positions.size();
+    }
+
+    /**
+     *  ID of the component type, as given to addChecksum.
+     */
+    uint32_t typeId() const
+    {
+        return m_typeId;
+    }
+
+    /**
+     *  Sum of the hashes of every entity.
+     */
+    uint64_t value() const
+    {
+        return m_value;
+    }
+
+    /**
+     *  Sums of the hashes of the entities in each bucket. There are
+     *  BucketCount values.
+     */
+    const uint64_t* bucketValues() const
+    {
+        return m_bucketValues;
+    }
+
+    static size_t bucketOf(EntityId entityId)
+    {
+        return static_cast<size_t>(detail::mixHash(entityId) >> 56);
+    }
+
+    /**
+     *  Returns the hash of an entity, or 0 if it does not have a component.
+     */
+    uint64_t entityHash(EntityId entityId) const
+    {
+        auto posIter = m_positions.find(entityId);
+        return posIter == m_positions.end() ? 0 : posIter->second.hash;
+    }
+
+    /**
+     *  Call fn(entityId, hash) for each entity in a bucket, in no particular
+     *  order.
+     */
+    template<typename Fn>
+    void forEachInBucket(size_t bucket, Fn fn) const
+    {
+        for (EntityId entityId: m_buckets[bucket]) {
+            fn(entityId, m_positions.find(entityId)->second.hash);
+        }
+    }
+
+protected:
+    void add(EntityId entityId, uint64_t componentHash)
+    {
+        erase(entityId);
+
+        const uint64_t hash = detail::mixHash(detail::mixHash(entityId) ^ componentHash);
+        const size_t bucket = bucketOf(entityId);
+        std::vector<EntityId> &entities = m_buckets[bucket];
+        Position position = { hash, entities.size() };
+        m_positions[entityId] = position;
+
+        const size_t capacity = entities.capacity();
+        entities.push_back(entityId);
+        m_entityCapacity += entities.capacity() - capacity;
+        m_allocatedBuckets += capacity == 0 ? 1 : 0;
+
+        m_value += hash;
+        m_bucketValues[bucket] += hash;
+    }
+
+private:
+    struct Position
+    {
+        uint64_t hash;
+        size_t index;
+    };
+
+    typedef std::unordered_map<EntityId, Position> Positions;
+
+    void erase(EntityId entityId) override
+    {
+        auto posIter = m_positions.find(entityId);
+        if (posIter == m_positions.end()) {
+            return;
+        }
+
+        const size_t bucket = bucketOf(entityId);
+        m_value -= posIter->second.hash;
+        m_bucketValues[bucket] -= posIter->second.hash;
+
+        // Swap with the last entity in the bucket, so that removal is O(1)
+        std::vector<EntityId> &entities = m_buckets[bucket];
+        const size_t index = posIter->second.index;
+        if (index + 1 != entities.size()) {
+            entities[index] = entities.back();
+            m_positions[entities[index]].index = index;
+        }
+
+        entities.pop_back();
+        m_positions.erase(posIter);
+    }
+
+    // The lists of entities in each bucket keep their capacity
+    void clear() override
+    {
+        for (auto &entities: m_buckets) {
+            entities.clear();
+        }
+
+        std::fill(m_bucketValues, m_bucketValues + BucketCount, 0);
+        m_positions.clear();
+        m_value = 0;
+    }
+
+    const uint32_t m_typeId;
+    uint64_t m_value;
+    uint64_t m_bucketValues[BucketCount];
+    std::vector<EntityId> m_buckets[BucketCount];
+    Positions m_positions;
+
+    // Sum of the capacities of m_buckets, and the number that have
+    // allocated, so that bookkeepingBytes does not need to visit every bucket
+    size_t m_entityCapacity;
+    size_t m_allocatedBuckets;
+};
+
+/**
+ * Checksum of the components of type <T>, hashed using <Hash>.
+ */
+template<typename T, typename Hash = ChecksumHash<T>>
+class ChecksumIndex: public ComponentChecksum
+{
+public:
+    explicit ChecksumIndex(uint32_t typeId)
+      : ComponentChecksum(typeId) { }
+
+private:
+    void insert(EntityId entityId, const Component &component) override
+    {
+        insertValue(entityId, detail::attachedValue<T>(component));
+    }
+
+    void insertValue(EntityId entityId, const void *pComponent) override
+    {
+        add(entityId, static_cast<uint64_t>(Hash()(*static_cast<const T *>(pComponent))));
+    }
+};
+
+/**
+ * A copy of the components of an entity, from which any number of entities
+ * can be created. See 'Cloning and Prefabs' above.
+ */
+class Prefab
+{
+public:
+    Prefab() { }
+
+    Prefab(Prefab &&other)
+      : m_attached(std::move(other.m_attached))
+      , m_pools(std::move(other.m_pools))
+      , m_stores(std::move(other.m_stores))
+      , m_shared(std::move(other.m_shared)) { }
+
+    Prefab& operator=(Prefab &&other)
+    {
+        m_attached = std::move(other.m_attached);
+        m_pools = std::move(other.m_pools);
+        m_stores = std::move(other.m_stores);
+        m_shared = std::move(other.m_shared);
+        return *this;
+    }
+
+    bool empty() const
+    {
+        return m_attached.empty() && m_pools.empty() && m_stores.empty() && m_shared.empty();
+    }
+
+    /**
+     *  Number of components of all kinds held by the prefab.
+     */
+    size_t size() const
+    {
+        return m_attached.size() + m_pools.size() + m_stores.size() + m_shared.size();
+    }
+
+    void clear()
+    {
+        m_attached.clear();
+        m_pools.clear();
+        m_stores.clear();
+        m_shared.clear();
+    }
+
+private:
+    friend class EntityManager;
+
+    Prefab(const Prefab &);
+    Prefab& operator=(const Prefab &);
+
+    // ID under which pooled and shared components are stored
+    static const EntityId PrefabEntity = std::numeric_limits<EntityId>::max();
+
+    struct Attached
+    {
+        const ComponentTypeInfo *pInfo;
+        std::shared_ptr<Component> pComponent;
+    };
+
+    std::vector<Attached> m_attached;
+    std::vector<std::unique_ptr<ComponentPool>> m_pools;
+    std::vector<std::unique_ptr<ComponentStoreBase>> m_stores;
+    std::vector<std::unique_ptr<SharedComponentStoreBase>> m_shared;
+};
+
+/**
+ * Receives the structural changes made to an EntityManager, in the order
+ * that they are applied. See 'Recording' above.
+ */
+class EntityRecorder
+{
+public:
+    enum Operation
+    {
+        Create,
+        Destroy,
+        DestroyAll,
+        Attach,             // Attached component
+        Detach,
+        Add,                // Pooled or stored component
+        Remove,
+        MarkForRemoval,
+        Purge
+    };
+
+    virtual ~EntityRecorder() { }
+
+    /**
+     *  Called for each change: before Destroy, DestroyAll, Detach and
+     *  Remove, and after the others. 'pType' is the type of the component
+     *  for Attach, Detach, Add and Remove, and null otherwise. 'entityId' is
+     *  InvalidEntity for DestroyAll and Purge.
+     */
+    virtual void record(Operation operation, EntityId entityId, const std::type_index *pType) = 0;
+};
+
+class EntityManager
+{
+public:
+    /**
+     *  Shared access to an EntityManager, for the duration of a read phase.
+     */
+    class ReadScope
+    {
+    public:
+        explicit ReadScope(const EntityManager &em)
+          : m_em(em)
+        {
+            m_em.m_phaseLock.lockShared();
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+            m_em.m_raceDetector.beginRead();
+#endif
+        }
+
+        ~ReadScope()
+        {
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+            m_em.m_raceDetector.endRead();
+#endif
+            m_em.m_phaseLock.unlockShared();
+        }
+
+    private:
+        ReadScope(const ReadScope &);
+        ReadScope& operator=(const ReadScope &);
+
+        const EntityManager &m_em;
+    };
+
+    /**
+     *  Exclusive access to an EntityManager, for making structural changes.
+     */
+    class WriteScope
+    {
+    public:
+        explicit WriteScope(EntityManager &em)
+          : m_em(em)
+        {
+            m_em.m_phaseLock.lock();
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+            m_owner = m_em.m_raceDetector.beginWrite();
+#endif
+        }
+
+        ~WriteScope()
+        {
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+            if (m_owner) {
+                m_em.m_raceDetector.endWrite();
+            }
+#endif
+            m_em.m_phaseLock.unlock();
+        }
+
+    private:
+        WriteScope(const WriteScope &);
+        WriteScope& operator=(const WriteScope &);
+
+        EntityManager &m_em;
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+        bool m_owner;
+#endif
+    };
+
+    // Maximum number of entities in each chunk passed to forEachChunk. This
+    // is a multiple of ComponentPool::CacheLineSize, so every chunk begins on
+    // a cache line boundary.
+    static const size_t ChunkSize = 4096;
+
+    EntityManager()
+      : m_iterationDepth(0)
+      , m_iteratingEntity(InvalidEntity)
+      , m_componentNodeCount(0)
+      , m_componentNodeBuckets(0)
+      , m_nextEntityId(std::numeric_limits<EntityId>::max())
+      , m_pIdSource(nullptr)
+      , m_pRecorder(nullptr) { }
+
+    /**
+     *  Create a staging EntityManager, whose entity IDs are reserved from
+     *  'pIdSource'. Entities created in the staging manager can be merged into
+     *  'pIdSource' without being given new IDs. See 'Merging' above.
+     */
+    explicit EntityManager(EntityManager *pIdSource)
+      : m_iterationDepth(0)
+      , m_iteratingEntity(InvalidEntity)
+      , m_componentNodeCount(0)
+      , m_componentNodeBuckets(0)
+      , m_nextEntityId(std::numeric_limits<EntityId>::max())
+      , m_pIdSource(pIdSource && pIdSource->m_pIdSource ? pIdSource->m_pIdSource : pIdSource)
+      , m_pRecorder(nullptr) { }
+
+    /**
+     *  Create an entity
+     */
+    EntityId createEntity()
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::createEntity");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const EntityId maxEntityId = std::numeric_limits<EntityId>::max();
+
+        if (m_entities.size() == maxEntityId) {
+            // Somehow, we have more than 4 billion entities...
+            return InvalidEntity;
+        }
+
+        // Find next available entity ID. IDs are claimed from the same counter
+        // as reserveEntities(), so this never returns an outstanding reservation.
+        EntityId entityId;
+        do {
+            entityId = reserveEntity();
+        } while (m_entities.find(entityId) != m_entities.end());
+
+        // Add entity to entity map
+        auto result = m_entities.insert(Entities::value_type(entityId, ComponentNodes()));
+        if (!result.second) {
+            return InvalidEntity;
+        }
+
+        record(EntityRecorder::Create, entityId);
+        return entityId;
+    }
+
+    /**
+     *  Reserve a single entity ID. Safe to call from any thread.
+     *
+     *  The entity does not exist until the ID is passed to commitEntity().
+     */
+    EntityId reserveEntity()
+    {
+        return reserveEntities(1);
+    }
+
+    /**
+     *  Reserve a block of 'count' consecutive entity IDs, and return the
+     *  highest ID in the block. The block consists of IDs (first - count, first].
+     *  Safe to call from any thread, and lock-free.
+     *
+     *  The entities do not exist until their IDs are passed to commitEntity().
+     */
+    EntityId reserveEntities(EntityId count)
+    {
+        if (m_pIdSource) {
+            return m_pIdSource->reserveEntities(count);
+        }
+
+        const EntityId maxEntityId = std::numeric_limits<EntityId>::max();
+
+        if (count == 0 || count == maxEntityId) {
+            return InvalidEntity;
+        }
+
+        EntityId next = m_nextEntityId.load(std::memory_order_relaxed);
+        EntityId first;
+        EntityId after;
+
+        do {
+            // IDs are allocated downwards, wrapping around to the top of the
+            // ID space when there are not enough IDs left above zero
+            first = next < count ? maxEntityId : next;
+            after = first - count;
+            if (after == InvalidEntity) {
+                after = maxEntityId;
+            }
+        } while (!m_nextEntityId.compare_exchange_weak(next, after, std::memory_order_relaxed));
+
+        return first;
+    }
+
+    /**
+     *  Create an entity using an ID previously returned by reserveEntity() or
+     *  reserveEntities().
+     *
+     *  Returns false if an entity with that ID already exists. This can only
+     *  happen if the ID space has wrapped around while the ID was reserved.
+     */
+    bool commitEntity(EntityId entityId)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (entityId == InvalidEntity) {
+            return false;
+        }
+
+        if (!m_entities.insert(Entities::value_type(entityId, ComponentNodes())).second) {
+            return false;
+        }
+
+        record(EntityRecorder::Create, entityId);
+        return true;
+    }
+
+    /**
+     *  Destroy an entity with the specified name.
+     */
+    bool destroyEntity(EntityId entityId)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::destroyEntity");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        // Find the entity
+        auto enIter = m_entities.find(entityId);
+        if (enIter == m_entities.end()) {
+            // Entity does not exist
+            return false;
+        }
+
+        if (mustDefer(entityId)) {
+            return defer(DeferredChange::Destroy, entityId, nullptr);
+        }
+
+        record(EntityRecorder::Destroy, entityId);
+        removeAttachedNodes(entityId, enIter->second);
+
+        // Destroy any pooled or stored components, and release any shared components
+        for (ComponentPool *pPool: m_activePools) {
+            pPool->erase(entityId);
+        }
+
+        for (ComponentStoreBase *pStore: m_activeStores) {
+            pStore->erase(entityId);
+        }
+
+        for (SharedComponentStoreBase *pStore: m_activeSharedStores) {
+            pStore->remove(entityId);
+        }
+
+        removeAllRelations(entityId);
+        releaseEntity(enIter);
+
+        return true;
+    }
+
+    /**
+     *  Destroy all entities.
+     */
+    bool destroyAllEntities()
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::destroyAllEntities");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        // Clearing both maps will destroy everything.
+        m_entities.clear();
+        m_componentTypes.clear();
+        m_componentNodeCount = 0;
+        m_componentNodeBuckets = 0;
+        clearIndexes();
+
+        // Pools are cleared rather than destroyed, so that they keep their capacity
+        for (ComponentPool *pPool: m_activePools) {
+            pPool->clear();
+        }
+
+        for (ComponentStoreBase *pStore: m_activeStores) {
+            pStore->clear();
+        }
+
+        for (SharedComponentStoreBase *pStore: m_activeSharedStores) {
+            pStore->clear();
+        }
+
+        for (auto &pStore: m_relations) {
+            if (pStore) {
+                pStore->clear();
+            }
+        }
+
+        m_disabledEntities.clear();
+        for (auto &pDisabled: m_disabledComponents) {
+            if (pDisabled) {
+                pDisabled->clear();
+            }
+        }
+
+        m_lifetimes.clear();
+        m_updateBuckets.clear();
+
+        record(EntityRecorder::DestroyAll, InvalidEntity);
+        return true;
+    }
+
+    /**
+     *  Attach a component of type <T> to the specified entity.
+     */
+    bool attachComponent(EntityId entityId, std::shared_ptr<Component> pComponent)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::attachComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        // Find the entity
+        auto enIter = m_entities.find(entityId);
+        if (enIter == m_entities.end()) {
+            // Entity does not exist
+            return false;
+        }
+
+        // Examine type of internal component pointer
+        Component *pInner = pComponent.get();
+        if (!pInner) {
+            return false;
+        }
+
+        // Construct type index for <T>
         const std::type_index &cmType(typeid(*pInner));
 
         // Find the entity's component node for this type
         auto &cmNodes = enIter->second;
         auto cmNodeIter = cmNodes.find(cmType);
-        if (cmNodeIter != cmNodes.end()) {
-            // Entity already has a component of this type.
+        if (cmNodeIter != cmNodes.end()) {
+            // Entity already has a component of this type.
+            return false;
+        }
+
+        const size_t bucketCount = cmNodes.bucket_count();
+        if (!cmNodes.insert(ComponentNodes::value_type(cmType, pComponent)).second) {
+            // Failed to add a component node
+            return false;
+        }
+
+        m_componentNodeCount++;
+        m_componentNodeBuckets += cmNodes.bucket_count() - bucketCount;
+
+        // Errors beyond this point indicate that state of the EM has become
+        // corrupt. This is essentially irreparable, so exceptions will be thrown.
+
+        // Find the entity nodes associated with the component type
+        auto cmIter = m_componentTypes.find(cmType);
+        if (cmIter == m_componentTypes.end()) {
+            // Create a new component type
+            cmIter = m_componentTypes.insert(
+                ComponentTypes::value_type(cmType, std::make_shared<EntityNodes>())).first;
+        }
+
+        if (cmIter == m_componentTypes.end()) {
+            // Could not find or create a list of entity nodes for type <T>
+            throw std::runtime_error("Could not find or create a list of entity nodes in EM.");
+        }
+
+        // Add a node for this component to the com
+        auto &entityNodes = cmIter->second;
+        entityNodes->insert(EntityNodes::value_type(entityId, pComponent));
+        indexInsert(cmType, entityId, *pInner);
+
+        record(EntityRecorder::Attach, entityId, &cmType);
+        return true;
+    }
+
+    /**
+     *  Attach a component to the specified entity, using its static type
+     *  to record ComponentTypeInfo (size, copy function) for the type.
+     */
+    template<typename T>
+    bool attachComponent(EntityId entityId, std::shared_ptr<T> pComponent)
+    {
+        if (!attachComponent(entityId, std::static_pointer_cast<Component>(pComponent))) {
+            return false;
+        }
+
+        if (typeid(*pComponent) == typeid(T)) {
+            m_componentTypeInfos[typeid(T)] = &componentTypeInfo<T>();
+        }
+
+        return true;
+    }
+
+    /**
+     *  Detach the component of type <T> from the specified entity.
+     */
+    template<typename T>
+    bool detachComponent(EntityId entityId)
+    {
+        return detachComponent(entityId, componentTypeInfo<T>());
+    }
+
+    /**
+     *  Get a specific component type attached to an entity
+     */
+    template<typename T>
+    std::shared_ptr<T> getComponent(EntityId entityId)
+    {
+        return static_cast<const EntityManager &>(*this).getComponent<T>(entityId);
+    }
+
+    /**
+     *  Get a specific component type attached to an entity. Safe to call
+     *  concurrently with other reads.
+     */
+    template<typename T>
+    std::shared_ptr<T> getComponent(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        // Find the entity
+        auto enIter = m_entities.find(entityId);
+        if (enIter == m_entities.end()) {
+            // Entity does not exist
+            return nullptr;
+        }
+
+        // Construct type index for <T>
+        const std::type_index &cmType(typeid(T));
+
+        // Find the component node for type <T>
+        auto &cmNodes = enIter->second;
+        auto cmNodeIter = cmNodes.find(cmType);
+        if (cmNodeIter == cmNodes.end()) {
+            // Entity does not have a component of this type
+            return nullptr;
+        }
+
+        return std::static_pointer_cast<T>(cmNodeIter->second);
+    }
+
+    /**
+     *  Returns the EntityNodes map for a given component type
+     */
+    template<typename T>
+    std::shared_ptr<EntityNodes> getEntityNodes()
+    {
+        // Construct type index for <T>
+        const std::type_index &cmType(typeid(T));
+
+        // Check for existing component type entry
+        auto cmIter = m_componentTypes.find(typeid(T));
+        if (cmIter == m_componentTypes.end()) {
+            GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+            m_componentTypeInfos[cmType] = &componentTypeInfo<T>();
+
+            // Create a new component type entry
+            auto result = m_componentTypes.insert(
+                ComponentTypes::value_type(cmType, std::make_shared<EntityNodes>()));
+            if (!result.second) {
+                return nullptr;
+            }
+
+            return result.first->second;
+        }
+
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+        return cmIter->second;
+    }
+
+    /**
+     *  Returns the EntityNodes map for a given component type, or nullptr if
+     *  no components of that type have been attached. Unlike getEntityNodes,
+     *  this never modifies the EntityManager, so it is safe to call
+     *  concurrently with other reads.
+     */
+    template<typename T>
+    std::shared_ptr<const EntityNodes> findEntityNodes() const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        auto cmIter = m_componentTypes.find(typeid(T));
+        if (cmIter == m_componentTypes.end()) {
+            return nullptr;
+        }
+
+        return cmIter->second;
+    }
+
+    /**
+     *  Construct a component of type <T> in the pool or store for that type,
+     *  and add it to the specified entity. See 'Component Pools' and
+     *  'Storage Policies' above.
+     *
+     *  Returns a pointer to the new component, or nullptr if the entity does
+     *  not exist or already has a pooled component of type <T>.
+     */
+    template<typename T, typename... Args>
+    T* addComponent(EntityId entityId, Args&&... args)
+    {
+        static_assert(std::is_move_constructible<T>::value || ComponentStoragePolicy<T>::value != PooledStorage,
+            "Pooled components must be move constructible");
+
+        GAMEUTILS_PROFILE_ZONE("EntityManager::addComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(entityId) == m_entities.end()) {
+            return nullptr;
+        }
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        T *pComponent;
+        if (ComponentStoragePolicy<T>::value != PooledStorage) {
+            ComponentStoreBase &store = getStore<T>();
+            if (store.contains(entityId)) {
+                return nullptr;
+            }
+
+            pComponent = store.emplace<T>(entityId, std::forward<Args>(args)...);
+        } else {
+            ComponentPool &pool = getPool(info);
+            if (pool.contains(entityId)) {
+                return nullptr;
+            }
+
+            pComponent = pool.emplace<T>(entityId, std::forward<Args>(args)...);
+        }
+
+        record(EntityRecorder::Add, entityId, &info.type);
+        return pComponent;
+    }
+
+    /**
+     *  Remove the pooled component of type <T> from the specified entity.
+     */
+    template<typename T>
+    bool removeComponent(EntityId entityId)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::removeComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        if (ComponentStoragePolicy<T>::value != PooledStorage) {
+            ComponentStoreBase *pStore = findStore(info);
+            if (!pStore || !pStore->contains(entityId)) {
+                return false;
+            }
+
+            if (mustDefer(entityId)) {
+                return defer(DeferredChange::Remove, entityId, &info);
+            }
+
+            record(EntityRecorder::Remove, entityId, &info.type);
+            enableComponent(info, entityId);
+            return pStore->erase(entityId);
+        }
+
+        ComponentPool *pPool = findPool(info);
+        if (!pPool || !pPool->contains(entityId)) {
+            return false;
+        }
+
+        if (mustDefer(entityId)) {
+            return defer(DeferredChange::Remove, entityId, &info);
+        }
+
+        record(EntityRecorder::Remove, entityId, &info.type);
+        enableComponent(info, entityId);
+        return pPool->erase(entityId);
+    }
+
+    /**
+     *  Returns the pooled component of type <T> for the specified entity, or
+     *  nullptr. The pointer is invalidated when a component of type <T> is
+     *  added to, or removed from, any entity, or by forEachChunk, unless the
+     *  type uses StableStorage or SparseStorage.
+     */
+    template<typename T>
+    T* findComponent(EntityId entityId)
+    {
+        return const_cast<T *>(static_cast<const EntityManager &>(*this).findComponent<T>(entityId));
+    }
+
+    /**
+     *  Returns the pooled component of type <T> for the specified entity, or
+     *  nullptr. Safe to call concurrently with other reads.
+     */
+    template<typename T>
+    const T* findComponent(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        if (ComponentStoragePolicy<T>::value != PooledStorage) {
+            const ComponentStoreBase *pStore = findStore(componentTypeInfo<T>());
+            return pStore ? static_cast<const T *>(pStore->find(entityId)) : nullptr;
+        }
+
+        const ComponentPool *pPool = findPool<T>();
+        return pPool ? static_cast<const T *>(pPool->find(entityId)) : nullptr;
+    }
+
+    /**
+     *  Returns true if the specified entity has a component of type <T>, that
+     *  was added using addComponent.
+     */
+    template<typename T>
+    bool hasComponent(EntityId entityId) const
+    {
+        return findComponent<T>(entityId) != nullptr;
+    }
+
+    /**
+     *  Returns the pool for component type <T>, or nullptr if no component of
+     *  that type has been added.
+     */
+    template<typename T>
+    ComponentPool* findPool()
+    {
+        return findPool(componentTypeInfo<T>());
+    }
+
+    template<typename T>
+    const ComponentPool* findPool() const
+    {
+        return findPool(componentTypeInfo<T>());
+    }
+
+    ComponentPool* findPool(const ComponentTypeInfo &info)
+    {
+        return info.index < m_pools.size() ? m_pools[info.index].get() : nullptr;
+    }
+
+    const ComponentPool* findPool(const ComponentTypeInfo &info) const
+    {
+        return info.index < m_pools.size() ? m_pools[info.index].get() : nullptr;
+    }
+
+    /**
+     *  Returns the store for a component type whose storage policy is not
+     *  PooledStorage, or nullptr if no component of that type has been added.
+     */
+    ComponentStoreBase* findStore(const ComponentTypeInfo &info)
+    {
+        return info.index < m_stores.size() ? m_stores[info.index].get() : nullptr;
+    }
+
+    const ComponentStoreBase* findStore(const ComponentTypeInfo &info) const
+    {
+        return info.index < m_stores.size() ? m_stores[info.index].get() : nullptr;
+    }
+
+    /**
+     *  Add a pooled component to the specified entity, copy-constructing it
+     *  from 'pSource', which must point to an object of the type described by
+     *  'info'. Used when the type is not known at compile time.
+     *
+     *  Returns a pointer to the new component, or nullptr if the entity does
+     *  not exist, already has a component of that type, or the type cannot
+     *  be copied. Only types that use PooledStorage are supported.
+     */
+    void* addComponent(EntityId entityId, const ComponentTypeInfo &info, const void *pSource)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (!info.copyConstruct || info.storage != PooledStorage ||
+            m_entities.find(entityId) == m_entities.end()) {
+            return nullptr;
+        }
+
+        ComponentPool &pool = getPool(info);
+        if (pool.contains(entityId)) {
+            return nullptr;
+        }
+
+        void *pSlot = pool.insertCopy(entityId, pSource);
+
+        record(EntityRecorder::Add, entityId, &info.type);
+        return pSlot;
+    }
+
+    /**
+     *  Call fn(count, pEntities, pT, pTs...) for each chunk of the entities
+     *  that have pooled components of every type in <T, Ts...>. See 'Chunk
+     *  Iteration' above.
+     *
+     *  The pools may be reordered, so pointers to pooled components of these
+     *  types are invalidated. Components must not be added or removed during
+     *  the call. Returns the number of entities visited.
+     */
+    template<typename T, typename... Ts, typename Fn>
+    size_t forEachChunk(Fn fn, EnabledFilter filter = EnabledOnly)
+    {
+        static_assert(detail::AllPooled<T, Ts...>::value,
+            "forEachChunk requires components that use PooledStorage");
+
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEachChunk");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        ComponentPool *pools[] = { findPool<T>(), findPool<Ts>()... };
+        for (ComponentPool *pPool: pools) {
+            if (!pPool) {
+                return 0;
+            }
+        }
+
+        const size_t count = alignPools(pools, 1 + sizeof...(Ts));
+
+        if (filter == EnabledOnly) {
+            const EntityBitset *disabled[] = {
+                findDisabledComponents(componentTypeInfo<T>()), findDisabledComponents(componentTypeInfo<Ts>())... };
+            if (!m_disabledEntities.empty() ||
+                std::any_of(std::begin(disabled), std::end(disabled), [](const EntityBitset *p) { return p; })) {
+                return visitEnabledChunks(fn, disabled, 1 + sizeof...(Ts), count, pools[0]->entities(),
+                    pools[0]->template data<T>(), findPool<Ts>()->template data<Ts>()...);
+            }
+        }
+
+        visitChunks(fn, count, pools[0]->entities(),
+            pools[0]->template data<T>(), findPool<Ts>()->template data<Ts>()...);
+
+        return count;
+    }
+
+    /**
+     *  Set the shared component of type <T> for the specified entity,
+     *  replacing any previous value. See 'Shared Components' above.
+     *
+     *  Returns the interned value, or nullptr if the entity does not exist.
+     */
+    template<typename T>
+    const T* setSharedComponent(EntityId entityId, const T &value)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::setSharedComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(entityId) == m_entities.end()) {
+            return nullptr;
+        }
+
+        return getSharedStore<T>().set(entityId, value);
+    }
+
+    /**
+     *  Remove the shared component of type <T> from the specified entity.
+     */
+    template<typename T>
+    bool removeSharedComponent(EntityId entityId)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::removeSharedComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        SharedComponentStoreBase *pStore = findSharedStore(componentTypeInfo<T>());
+        return pStore && pStore->remove(entityId);
+    }
+
+    /**
+     *  Returns the shared component of type <T> for the specified entity, or
+     *  nullptr. Safe to call concurrently with other reads.
+     */
+    template<typename T>
+    const T* findSharedComponent(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const SharedComponentStore<T> *pStore = findSharedComponents<T>();
+        return pStore ? pStore->find(entityId) : nullptr;
+    }
+
+    /**
+     *  Returns the store of shared components of type <T>, which can be used
+     *  to visit entities grouped by value, or nullptr if there is none.
+     */
+    template<typename T>
+    const SharedComponentStore<T>* findSharedComponents() const
+    {
+        return static_cast<const SharedComponentStore<T> *>(findSharedStore(componentTypeInfo<T>()));
+    }
+
+    /**
+     *  Call fn(value, entities, count) for each distinct value of the shared
+     *  component type <T>. Safe to call concurrently with other reads.
+     */
+    template<typename T, typename Fn>
+    void forEachSharedGroup(Fn fn) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const SharedComponentStore<T> *pStore = findSharedComponents<T>();
+        if (pStore) {
+            pStore->forEachGroup(fn);
+        }
+    }
+
+    /**
+     *  Construct the resource of type <T>, replacing any previous value. See
+     *  'Resources' above.
+     *
+     *  References to a previous value are invalidated.
+     */
+    template<typename T, typename... Args>
+    T& setResource(Args&&... args)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const size_t index = resourceIndex<T>();
+        if (index >= m_resources.size()) {
+            m_resources.resize(index + 1);
+        }
+
+        return *m_resources[index].template emplace<T>(std::forward<Args>(args)...);
+    }
+
+    /**
+     *  Destroy the resource of type <T>.
+     */
+    template<typename T>
+    bool removeResource()
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const size_t index = resourceIndex<T>();
+        if (index >= m_resources.size() || !m_resources[index].get()) {
+            return false;
+        }
+
+        m_resources[index].reset();
+        return true;
+    }
+
+    /**
+     *  Returns the resource of type <T>, or nullptr if it has not been set.
+     */
+    template<typename T>
+    T* findResource()
+    {
+        return const_cast<T *>(static_cast<const EntityManager &>(*this).findResource<T>());
+    }
+
+    /**
+     *  Returns the resource of type <T>, or nullptr if it has not been set.
+     *  Safe to call concurrently with other reads.
+     */
+    template<typename T>
+    const T* findResource() const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const size_t index = resourceIndex<T>();
+        if (index >= m_resources.size()) {
+            return nullptr;
+        }
+
+        return static_cast<const T *>(m_resources[index].get());
+    }
+
+    /**
+     *  Returns the resource of type <T>, which must have been set.
+     */
+    template<typename T>
+    T& resource()
+    {
+        return const_cast<T &>(static_cast<const EntityManager &>(*this).resource<T>());
+    }
+
+    template<typename T>
+    const T& resource() const
+    {
+        const T *pValue = findResource<T>();
+        if (!pValue) {
+            throw std::runtime_error("Attempted to access a resource that has not been set.");
+        }
+
+        return *pValue;
+    }
+
+    template<typename T>
+    bool hasResource() const
+    {
+        return findResource<T>() != nullptr;
+    }
+
+    /**
+     *  Create the event buffers for type <E>, so that it can be emitted from
+     *  any thread. See 'Events' above.
+     */
+    template<typename E>
+    void registerEvent()
+    {
+        getEventChannel<E>();
+    }
+
+    /**
+     *  Construct an event of type <E> in the calling thread's buffer. It
+     *  becomes readable after the next call to swapEvents().
+     *
+     *  Safe to call concurrently from any number of threads, once the event
+     *  type has been registered.
+     */
+    template<typename E, typename... Args>
+    void emit(Args&&... args)
+    {
+        const size_t index = eventIndex<E>();
+        EventChannelBase *pChannel = index < m_events.size() ? m_events[index].get() : nullptr;
+        if (!pChannel) {
+            pChannel = &getEventChannel<E>();
+        }
+
+        static_cast<EventChannel<E> *>(pChannel)->emit(std::forward<Args>(args)...);
+    }
+
+    /**
+     *  Returns the events of type <E> that were emitted before the last call
+     *  to swapEvents(), as a contiguous array. Safe to call concurrently with
+     *  other reads.
+     */
+    template<typename E>
+    EventSpan<E> events() const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const size_t index = eventIndex<E>();
+        if (index >= m_events.size() || !m_events[index]) {
+            return EventSpan<E>();
+        }
+
+        return static_cast<const EventChannel<E> *>(m_events[index].get())->readable();
+    }
+
+    /**
+     *  Number of events of type <E> that have been emitted since the last
+     *  call to swapEvents().
+     */
+    template<typename E>
+    size_t pendingEvents() const
+    {
+        const size_t index = eventIndex<E>();
+        if (index >= m_events.size() || !m_events[index]) {
+            return 0;
+        }
+
+        return m_events[index]->pendingCount();
+    }
+
+    /**
+     *  Discard the readable events of every type, and make those emitted
+     *  since the last call readable. Must not overlap with emit().
+     */
+    void swapEvents()
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+        GAMEUTILS_PROFILE_ZONE("EntityManager::swapEvents");
+
+        for (const auto &pChannel: m_events) {
+            if (pChannel) {
+                pChannel->swap();
+            }
+        }
+    }
+
+    /**
+     *  Add a HashIndex over a member of the component type <T>, and index
+     *  the existing components. See 'Value Indexes' above.
+     */
+    template<typename T, typename K, typename Hash = std::hash<K>>
+    HashIndex<T, K, Hash>& addHashIndex(K T::*pMember)
+    {
+        return addIndex<T>(new HashIndex<T, K, Hash>(pMember));
+    }
+
+    /**
+     *  Add an OrderedIndex over a member of the component type <T>, and
+     *  index the existing components.
+     */
+    template<typename T, typename K, typename Compare = std::less<K>>
+    OrderedIndex<T, K, Compare>& addOrderedIndex(K T::*pMember)
+    {
+        return addIndex<T>(new OrderedIndex<T, K, Compare>(pMember));
+    }
+
+    /**
+     *  Add a checksum of the component type <T>, and hash the existing
+     *  components. 'typeId' identifies the type when checksums are
+     *  combined, and must be the same on every peer. See 'Checksums' above.
+     *
+     *  Throws if a checksum with the same ID has already been added.
+     */
+    template<typename T, typename Hash = ChecksumHash<T>>
+    ChecksumIndex<T, Hash>& addChecksum(uint32_t typeId)
+    {
+        for (const ComponentChecksum *pChecksum: m_checksums) {
+            if (pChecksum->typeId() == typeId) {
+                throw std::runtime_error("Checksum type ID has already been added.");
+            }
+        }
+
+        ChecksumIndex<T, Hash> &checksum = addIndex<T>(new ChecksumIndex<T, Hash>(typeId));
+        m_checksums.push_back(&checksum);
+        return checksum;
+    }
+
+    /**
+     *  Combine the checksums of every type. Each is mixed with its type ID,
+     *  and the results are summed, so the order in which the checksums were
+     *  added does not matter. This is O(types). Safe to call concurrently
+     *  with other reads.
+     */
+    uint64_t checksum() const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        uint64_t result = 0;
+        for (const ComponentChecksum *pChecksum: m_checksums) {
+            result += detail::mixHash(detail::mixHash(pChecksum->typeId()) ^ pChecksum->value());
+        }
+
+        return result;
+    }
+
+    /**
+     *  Remove and destroy an index. Returns false if the index does not
+     *  belong to this EntityManager.
+     */
+    bool removeIndex(const ComponentIndex &index)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        for (auto iter = m_indexes.begin(); iter != m_indexes.end(); ++iter) {
+            auto &indexes = iter->second.indexes;
+            for (auto indexIter = indexes.begin(); indexIter != indexes.end(); ++indexIter) {
+                if (indexIter->get() == &index) {
+                    m_checksums.erase(std::remove(m_checksums.begin(), m_checksums.end(), &index),
+                        m_checksums.end());
+                    indexes.erase(indexIter);
+                    if (indexes.empty()) {
+                        observeComponents(*iter->second.pInfo, nullptr);
+                        m_indexes.erase(iter);
+                    }
+
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     *  Call fn(component) for the component of type <T>, then update any
+     *  indexes over that type. An attached component is used if the entity
+     *  has one, and otherwise its pooled or stored component. Returns false
+     *  if the entity does not have a component of type <T>.
+     */
+    template<typename T, typename Fn>
+    bool modifyComponent(EntityId entityId, Fn fn)
+    {
+        T *pComponent = findIndexedComponent<T>(entityId, std::is_base_of<Component, T>());
+        if (!pComponent) {
+            return false;
+        }
+
+        fn(*pComponent);
+        reindex(typeid(T), entityId, pComponent);
+        return true;
+    }
+
+    /**
+     *  Update any indexes over the component of type <T>, after it has been
+     *  modified directly. Returns false if the entity does not have a
+     *  component of type <T>.
+     */
+    template<typename T>
+    bool reindexComponent(EntityId entityId)
+    {
+        T *pComponent = findIndexedComponent<T>(entityId, std::is_base_of<Component, T>());
+        if (!pComponent) {
+            return false;
+        }
+
+        reindex(typeid(T), entityId, pComponent);
+        return true;
+    }
+
+    /**
+     *  Add a relationship of kind <R> from 'source' to 'target'. See
+     *  'Relationships' above.
+     *
+     *  Returns false if either entity does not exist, or the pair already
+     *  exists.
+     */
+    template<typename R>
+    bool addRelation(EntityId source, EntityId target)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(source) == m_entities.end() ||
+            m_entities.find(target) == m_entities.end()) {
+            return false;
+        }
+
+        return getRelationStore(relationIndex<R>()).add(source, target);
+    }
+
+    /**
+     *  Remove the relationship of kind <R> from 'source' to 'target'.
+     */
+    template<typename R>
+    bool removeRelation(EntityId source, EntityId target)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        RelationStore *pStore = findRelationStore(relationIndex<R>());
+        return pStore && pStore->remove(source, target);
+    }
+
+    /**
+     *  Remove every relationship of kind <R> in which an entity is either the
+     *  source or the target. Returns the number of relationships removed.
+     */
+    template<typename R>
+    size_t removeRelations(EntityId entityId)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        RelationStore *pStore = findRelationStore(relationIndex<R>());
+        return pStore ? pStore->removeEntity(entityId) : 0;
+    }
+
+    template<typename R>
+    bool hasRelation(EntityId source, EntityId target) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const RelationStore *pStore = findRelationStore(relationIndex<R>());
+        return pStore && pStore->contains(source, target);
+    }
+
+    /**
+     *  Returns the targets of the relationships of kind <R> from 'source'.
+     *  The result is invalidated by any change to relationships of kind <R>.
+     */
+    template<typename R>
+    const std::vector<EntityId>& relationTargets(EntityId source) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        return getRelations<R>().targets(source);
+    }
+
+    /**
+     *  Returns the sources of the relationships of kind <R> to 'target'.
+     *  The result is invalidated by any change to relationships of kind <R>.
+     */
+    template<typename R>
+    const std::vector<EntityId>& relationSources(EntityId target) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        return getRelations<R>().sources(target);
+    }
+
+    /**
+     *  Returns the relationships of kind <R>, which may be empty.
+     */
+    template<typename R>
+    const RelationStore& getRelations() const
+    {
+        static const RelationStore none;
+
+        const RelationStore *pStore = findRelationStore(relationIndex<R>());
+        return pStore ? *pStore : none;
+    }
+
+    /**
+     *  Call fn(entityId, component) for each component of type <T> whose
+     *  entity has a relationship of kind <R> to 'target'. See 'Relationships'
+     *  above.
+     *
+     *  Only the sources of 'target' are visited, rather than every component
+     *  of type <T>. Structural changes, including changes to relationships,
+     *  are allowed in the same way as in forEach.
+     */
+    template<typename R, typename T, typename Fn>
+    void forEachRelated(EntityId target, Fn fn, EnabledFilter filter = EnabledOnly)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEachRelated");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        const RelationStore *pRelations = findRelationStore(relationIndex<R>());
+        if (!pRelations || (!findPool(info) && !findStore(info))) {
+            return;
+        }
+
+        // The sources are copied, since fn may change the relationships. The
+        // copy's storage is reused, unless forEachRelated is nested.
+        const std::vector<EntityId> &sources = pRelations->sources(target);
+        std::vector<EntityId> related;
+        related.swap(m_relatedEntities);
+        related.assign(sources.begin(), sources.end());
+
+        {
+            IterationScope scope(*this);
+            const EntityBitset *pDisabled = filter == EnabledOnly ? findDisabledComponents(info) : nullptr;
+            const bool filtered = filter == EnabledOnly && (!m_disabledEntities.empty() || pDisabled);
+
+            for (size_t i = 0; i < related.size(); ++i) {
+                const EntityId entityId = related[i];
+                T *pComponent = findComponent<T>(entityId);
+                if (!pComponent || (!m_deferred.empty() && isDeferred(entityId, &info))) {
+                    continue;
+                }
+
+                if (filtered && isDisabled(entityId, pDisabled)) {
+                    continue;
+                }
+
+                m_iteratingEntity = entityId;
+                fn(entityId, *pComponent);
+            }
+        }
+
+        m_relatedEntities.swap(related);
+        applyDeferred();
+    }
+
+    /**
+     *  Destroy an entity once advanceLifetimes has advanced by 'ticks' ticks,
+     *  replacing any previous lifetime. See 'Lifetimes' above.
+     *
+     *  Returns false if the entity does not exist.
+     */
+    bool setLifetime(EntityId entityId, uint64_t ticks)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(entityId) == m_entities.end()) {
+            return false;
+        }
+
+        m_lifetimes.schedule(entityId, ticks);
+        return true;
+    }
+
+    /**
+     *  Stop an entity from expiring. Returns false if it had no lifetime.
+     */
+    bool clearLifetime(EntityId entityId)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        return m_lifetimes.cancel(entityId);
+    }
+
+    /**
+     *  Returns the number of ticks until an entity expires, or zero if it
+     *  has no lifetime.
+     */
+    uint64_t remainingLifetime(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        return m_lifetimes.remaining(entityId);
+    }
+
+    /**
+     *  Advance the lifetime clock by 'ticks' ticks, and destroy the entities
+     *  that expire. Returns the number of entities destroyed.
+     */
+    size_t advanceLifetimes(uint64_t ticks = 1)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::advanceLifetimes");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        m_expired.clear();
+        m_lifetimes.advance(ticks, m_expired);
+        return destroyBatch(m_expired);
+    }
+
+    /**
+     *  Set how often an entity is visited by forEachDue. See 'Update
+     *  Intervals' above.
+     *
+     *  Returns false if the entity does not exist.
+     */
+    bool setUpdateInterval(EntityId entityId, uint32_t interval)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(entityId) == m_entities.end()) {
+            return false;
+        }
+
+        m_updateBuckets.assign(entityId, interval);
+        return true;
+    }
+
+    /**
+     *  Stop an entity from being visited by forEachDue. Returns false if it
+     *  had no update interval.
+     */
+    bool clearUpdateInterval(EntityId entityId)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        return m_updateBuckets.remove(entityId);
+    }
+
+    /**
+     *  Returns the update interval of an entity, or zero if it has none.
+     */
+    uint32_t updateInterval(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        return m_updateBuckets.interval(entityId);
+    }
+
+    const UpdateBuckets& updateBuckets() const
+    {
+        return m_updateBuckets;
+    }
+
+    /**
+     *  Call fn(entityId, component, interval) for each component of type <T>
+     *  whose entity is due to be updated on 'tick'. See 'Update Intervals'
+     *  above.
+     */
+    template<typename T, typename Fn>
+    void forEachDue(uint64_t tick, Fn fn, EnabledFilter filter = EnabledOnly)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEachDue");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        if (!findPool(info) && !findStore(info)) {
+            return;
+        }
+
+        // The due entities are copied, so that they can move between buckets.
+        // The copy's storage is reused, unless forEachDue is nested.
+        std::vector<DueEntity> due;
+        due.swap(m_dueEntities);
+        due.clear();
+        m_updateBuckets.forEachDue(tick, [&due](const EntityId *pEntities, size_t count, uint32_t interval) {
+            for (size_t i = 0; i < count; ++i) {
+                DueEntity entity = { pEntities[i], interval };
+                due.push_back(entity);
+            }
+        });
+
+        {
+            IterationScope scope(*this);
+            const EntityBitset *pDisabled = filter == EnabledOnly ? findDisabledComponents(info) : nullptr;
+            const bool filtered = filter == EnabledOnly && (!m_disabledEntities.empty() || pDisabled);
+
+            for (size_t i = 0; i < due.size(); ++i) {
+                const EntityId entityId = due[i].entityId;
+                T *pComponent = findComponent<T>(entityId);
+                if (!pComponent || (!m_deferred.empty() && isDeferred(entityId, &info))) {
+                    continue;
+                }
+
+                if (filtered && isDisabled(entityId, pDisabled)) {
+                    continue;
+                }
+
+                m_iteratingEntity = entityId;
+                fn(entityId, *pComponent, due[i].interval);
+            }
+        }
+
+        m_dueEntities.swap(due);
+        applyDeferred();
+    }
+
+    /**
+     *  Enable or disable an entity. See 'Enabling and Disabling' above.
+     *
+     *  Returns false if the entity does not exist.
+     */
+    bool setEntityEnabled(EntityId entityId, bool enabled)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (m_entities.find(entityId) == m_entities.end()) {
+            return false;
+        }
+
+        if (enabled) {
+            m_disabledEntities.reset(entityId);
+        } else {
+            m_disabledEntities.set(entityId);
+        }
+
+        return true;
+    }
+
+    /**
+     *  Returns true if the entity exists, and has not been disabled.
+     */
+    bool isEntityEnabled(EntityId entityId) const
+    {
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        return !m_disabledEntities.test(entityId) && m_entities.find(entityId) != m_entities.end();
+    }
+
+    /**
+     *  Enable or disable the component of type <T> of an entity, which was
+     *  added using addComponent. The component is enabled again when it is
+     *  removed. See 'Enabling and Disabling' above.
+     *
+     *  Returns false if the entity does not have a component of type <T>.
+     */
+    template<typename T>
+    bool setComponentEnabled(EntityId entityId, bool enabled)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (!hasComponent<T>(entityId)) {
+            return false;
+        }
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        if (enabled) {
+            enableComponent(info, entityId);
+        } else {
+            getDisabledComponents(info.index).set(entityId);
+        }
+
+        return true;
+    }
+
+    /**
+     *  Returns true if the entity has a component of type <T>, which has not
+     *  been disabled. The entity itself may be disabled.
+     */
+    template<typename T>
+    bool isComponentEnabled(EntityId entityId) const
+    {
+        const EntityBitset *pDisabled = findDisabledComponents(componentTypeInfo<T>());
+        return hasComponent<T>(entityId) && !(pDisabled && pDisabled->test(entityId));
+    }
+
+    /**
+     *  Call fn(entityId, component) for each pooled component of type <T>.
+     *  See 'Structural Changes During Iteration' and 'Enabling and
+     *  Disabling' above.
+     */
+    template<typename T, typename Fn>
+    void forEach(Fn fn, EnabledFilter filter = EnabledOnly)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEach");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (ComponentStoragePolicy<T>::value != PooledStorage) {
+            forEachStored<T>(fn, filter);
+            return;
+        }
+
+        ComponentPool *pPool = findPool<T>();
+        if (!pPool) {
+            return;
+        }
+
+        {
+            IterationScope scope(*this);
+            const EntityBitset *pDisabled = filter == EnabledOnly ?
+                findDisabledComponents(pPool->typeInfo()) : nullptr;
+            const bool filtered = filter == EnabledOnly && (!m_disabledEntities.empty() || pDisabled);
+
+            // Iterating backwards means that when the current component is
+            // removed, the component moved into its place has been visited
+            for (size_t i = pPool->size(); i-- > 0; ) {
+                const EntityId entityId = pPool->entities()[i];
+                if (!m_deferred.empty() && isDeferred(entityId, &pPool->typeInfo())) {
+                    continue;
+                }
+
+                if (filtered && isDisabled(entityId, pDisabled)) {
+                    continue;
+                }
+
+                m_iteratingEntity = entityId;
+                fn(entityId, *static_cast<T *>(pPool->at(i)));
+            }
+        }
+
+        applyDeferred();
+    }
+
+    /**
+     *  Call fn(entityId, const component) for each pooled or stored component
+     *  of type <T>. Unlike the non-const overload, this only reads, so it is
+     *  safe to call concurrently with other reads (e.g. within a ReadScope).
+     */
+    template<typename T, typename Fn>
+    void forEach(Fn fn, EnabledFilter filter = EnabledOnly) const
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEach");
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        const EntityBitset *pDisabled = filter == EnabledOnly ? findDisabledComponents(info) : nullptr;
+        const bool filtered = filter == EnabledOnly && (!m_disabledEntities.empty() || pDisabled);
+
+        if (const ComponentPool *pPool = findPool(info)) {
+            for (size_t i = 0; i < pPool->size(); ++i) {
+                const EntityId entityId = pPool->entities()[i];
+                if (!filtered || !isDisabled(entityId, pDisabled)) {
+                    fn(entityId, *static_cast<const T *>(pPool->at(i)));
+                }
+            }
+        } else if (const ComponentStoreBase *pStore = findStore(info)) {
+            forEachStored<T>(*pStore, fn, filtered ? pDisabled : nullptr, filtered,
+                ComponentStoragePolicy<T>());
+        }
+    }
+
+    /**
+     *  Call fn(entityId, pComponent) for each attached component of type <T>.
+     *  See 'Structural Changes During Iteration' above. Only whole entities
+     *  can be disabled, not attached components.
+     */
+    template<typename T, typename Fn>
+    void forEachAttached(Fn fn, EnabledFilter filter = EnabledOnly)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::forEachAttached");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        auto cmIter = m_componentTypes.find(typeid(T));
+        if (cmIter == m_componentTypes.end()) {
+            return;
+        }
+
+        {
+            IterationScope scope(*this);
+            const std::shared_ptr<EntityNodes> pNodes = cmIter->second;
+            const ComponentTypeInfo &info = componentTypeInfo<T>();
+
+            // The iterator is advanced before each call, so that the current
+            // node can be erased
+            for (auto iter = pNodes->begin(); iter != pNodes->end(); ) {
+                const EntityId entityId = iter->first;
+                const std::shared_ptr<T> pComponent = std::static_pointer_cast<T>(iter->second);
+                ++iter;
+
+                if (!m_deferred.empty() && isDeferred(entityId, &info)) {
+                    continue;
+                }
+
+                if (filter == EnabledOnly && m_disabledEntities.test(entityId)) {
+                    continue;
+                }
+
+                m_iteratingEntity = entityId;
+                fn(entityId, pComponent);
+            }
+        }
+
+        applyDeferred();
+    }
+
+    void markForRemoval(EntityId entityId)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        auto emItr = m_entities.find(entityId);
+        if (emItr != m_entities.end()) {
+            m_entitiesMarkedForRemoval.push_back(entityId);
+            record(EntityRecorder::MarkForRemoval, entityId);
+        }
+    }
+
+    void purge()
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::purge");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        // The purge is recorded instead of the entities that it destroys
+        record(EntityRecorder::Purge, InvalidEntity);
+        EntityRecorder *pRecorder = m_pRecorder;
+        m_pRecorder = nullptr;
+
+        for (auto entityId: m_entitiesMarkedForRemoval) {
+            destroyEntity(entityId);
+        }
+
+        m_pRecorder = pRecorder;
+        m_entitiesMarkedForRemoval.clear();
+    }
+
+    /**
+     *  Set the recorder that receives each structural change, or null to stop
+     *  recording. See 'Recording' above.
+     */
+    void setRecorder(EntityRecorder *pRecorder)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+        m_pRecorder = pRecorder;
+    }
+
+    EntityRecorder* recorder() const
+    {
+        return m_pRecorder;
+    }
+
+    /**
+     *  Move an entity, and all of its components, to another EntityManager.
+     *
+     *  Returns the ID of the entity in the destination manager, or
+     *  InvalidEntity if the entity does not exist, has a component that
+     *  cannot be moved, or cannot be changed during the current iteration.
+     */
+    EntityId moveEntity(EntityId entityId, EntityManager &dest)
+    {
+        EntityId newId = InvalidEntity;
+        transferEntities(&entityId, 1, dest, &newId, true);
+        return newId;
+    }
+
+    /**
+     *  Copy an entity, and all of its components, to another EntityManager.
+     *
+     *  Returns the ID of the new entity in the destination manager, or
+     *  InvalidEntity if the entity does not exist or has a component that
+     *  cannot be copied.
+     */
+    EntityId copyEntity(EntityId entityId, EntityManager &dest)
+    {
+        EntityId newId = InvalidEntity;
+        transferEntities(&entityId, 1, dest, &newId, false);
+        return newId;
+    }
+
+    /**
+     *  Move a batch of entities to another EntityManager. The new ID of each
+     *  entity is written to 'newIds', at the same position as in 'entityIds'.
+     *
+     *  Returns the number of entities that were moved.
+     */
+    size_t moveEntities(const std::vector<EntityId> &entityIds, EntityManager &dest,
+        std::vector<EntityId> &newIds)
+    {
+        newIds.resize(entityIds.size());
+        return entityIds.empty() ? 0 :
+            transferEntities(entityIds.data(), entityIds.size(), dest, newIds.data(), true);
+    }
+
+    /**
+     *  Copy a batch of entities to another EntityManager. The new ID of each
+     *  entity is written to 'newIds', at the same position as in 'entityIds'.
+     *
+     *  Returns the number of entities that were copied.
+     */
+    size_t copyEntities(const std::vector<EntityId> &entityIds, EntityManager &dest,
+        std::vector<EntityId> &newIds)
+    {
+        newIds.resize(entityIds.size());
+        return entityIds.empty() ? 0 :
+            transferEntities(entityIds.data(), entityIds.size(), dest, newIds.data(), false);
+    }
+
+    /**
+     *  Move every entity, and all of its components, from 'other' into this
+     *  EntityManager. See 'Merging' above. 'other' is left empty.
+     *
+     *  Entities keep their IDs unless they are already in use, in which case
+     *  they are given new IDs, and EntityFields of the merged components are
+     *  updated. The new IDs are written to 'remap', if given.
+     *
+     *  Returns the number of entities merged. Nothing is merged, and 'other'
+     *  is left unchanged, if either manager is iterating, or if 'other' has
+     *  stored components that cannot be moved, and either an ID is already
+     *  in use or this manager already has components of the same type.
+     */
+    size_t merge(EntityManager &&other, EntityRemap *pRemap = nullptr)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::merge");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+        GAMEUTILS_ENTITY_CHECK_WRITE(other.m_raceDetector);
+
+        EntityRemap localRemap;
+        EntityRemap &remap = pRemap ? *pRemap : localRemap;
+        remap.clear();
+
+        if (&other == this || m_iterationDepth > 0 || other.m_iterationDepth > 0 ||
+            !canMergeStores(other)) {
+            return 0;
+        }
+
+        // Choose new IDs for entities whose IDs are already in use
+        for (const auto &entity: other.m_entities) {
+            if (m_entities.find(entity.first) != m_entities.end()) {
+                EntityId newId;
+                do {
+                    newId = reserveEntity();
+                } while (m_entities.find(newId) != m_entities.end() ||
+                    other.m_entities.find(newId) != other.m_entities.end());
+                remap.add(entity.first, newId);
+            }
+        }
+
+        for (const auto &info: other.m_componentTypeInfos) {
+            m_componentTypeInfos.insert(info);
+        }
+
+        // The per-entity component maps are moved, rather than rebuilt
+        const size_t count = other.m_entities.size();
+        m_entities.reserve(m_entities.size() + count);
+        for (auto &entity: other.m_entities) {
+            auto result = m_entities.insert(
+                Entities::value_type(remap(entity.first), std::move(entity.second)));
+            if (!remap.empty()) {
+                remapComponents(result.first->second, remap);
+            }
+        }
+
+        m_componentNodeCount += other.m_componentNodeCount;
+        m_componentNodeBuckets += other.m_componentNodeBuckets;
+
+        // Entity node maps are adopted whole when this manager has none for
+        // the same type, and no IDs have changed
+        for (auto &cmType: other.m_componentTypes) {
+            if (m_indexes.count(cmType.first)) {
+                for (const auto &enNode: *cmType.second) {
+                    indexInsert(cmType.first, remap(enNode.first), *enNode.second);
+                }
+            }
+
+            auto cmIter = m_componentTypes.find(cmType.first);
+            if (cmIter == m_componentTypes.end() && remap.empty()) {
+                m_componentTypes.insert(cmType);
+                continue;
+            }
+
+            if (cmIter == m_componentTypes.end()) {
+                cmIter = m_componentTypes.insert(
+                    ComponentTypes::value_type(cmType.first, std::make_shared<EntityNodes>())).first;
+            }
+
+            EntityNodes &enNodes = *cmIter->second;
+            for (const auto &enNode: *cmType.second) {
+                enNodes.insert(EntityNodes::value_type(remap(enNode.first), enNode.second));
+            }
+        }
+
+        // Pools are swapped when this manager's pool is empty, and otherwise
+        // appended using a single relocation
+        for (ComponentPool *pOtherPool: other.m_activePools) {
+            if (pOtherPool->empty()) {
+                continue;
+            }
+
+            const ComponentTypeInfo &info = pOtherPool->typeInfo();
+            ComponentPool &pool = getPool(info);
+            const size_t first = pool.size();
+            if (first == 0 && remap.empty()) {
+                pool.swapContents(*pOtherPool);
+                continue;
+            }
+
+            pool.append(*pOtherPool, remap);
+            if (info.remap && !remap.empty()) {
+                for (size_t i = first; i < pool.size(); ++i) {
+                    info.remap(pool.at(i), remap);
+                }
+            }
+        }
+
+        // Stores are adopted whole in the same way as entity nodes, and
+        // otherwise their components are moved one at a time
+        for (auto &pOtherStore: other.m_stores) {
+            if (!pOtherStore || pOtherStore->size() == 0) {
+                continue;
+            }
+
+            const ComponentTypeInfo &info = pOtherStore->typeInfo();
+            ComponentStoreBase *pStore = findStore(info);
+            if ((!pStore || pStore->size() == 0) && remap.empty()) {
+                addStore(pOtherStore.release());
+                continue;
+            }
+
+            if (!pStore) {
+                pStore = &addStore(pOtherStore->createEmpty());
+            }
+
+            const std::vector<EntityId> entities(pOtherStore->entities(),
+                pOtherStore->entities() + pOtherStore->size());
+            for (EntityId entityId: entities) {
+                void *pComponent = pStore->insertMove(remap(entityId), pOtherStore->find(entityId));
+                if (pComponent && info.remap && !remap.empty()) {
+                    info.remap(pComponent, remap);
+                }
+            }
+
+            pOtherStore->clear();
+        }
+
+        // Shared stores are adopted whole in the same way as entity nodes
+        for (auto &pOtherStore: other.m_sharedStores) {
+            if (!pOtherStore || pOtherStore->size() == 0) {
+                continue;
+            }
+
+            SharedComponentStoreBase *pStore = findSharedStore(pOtherStore->typeInfo());
+            if (!pStore && remap.empty()) {
+                addSharedStore(pOtherStore.release());
+                continue;
+            }
+
+            if (!pStore) {
+                pStore = &addSharedStore(pOtherStore->createEmpty());
+            }
+
+            const EntityId *pEntities = pOtherStore->entities();
+            for (size_t i = 0; i < pOtherStore->size(); ++i) {
+                pOtherStore->copyTo(pEntities[i], *pStore, remap(pEntities[i]));
+            }
+        }
+
+        for (size_t i = 0; i < other.m_relations.size(); ++i) {
+            const RelationStore *pOtherStore = other.m_relations[i].get();
+            if (!pOtherStore || pOtherStore->size() == 0) {
+                continue;
+            }
+
+            RelationStore &store = getRelationStore(i);
+            pOtherStore->forEach([&](EntityId source, EntityId target) {
+                store.add(remap(source), remap(target));
+            });
+        }
+
+        other.m_disabledEntities.forEach([&](EntityId entityId) {
+            m_disabledEntities.set(remap(entityId));
+        });
+
+        for (size_t i = 0; i < other.m_disabledComponents.size(); ++i) {
+            const EntityBitset *pOtherDisabled = other.m_disabledComponents[i].get();
+            if (pOtherDisabled && !pOtherDisabled->empty()) {
+                EntityBitset &disabled = getDisabledComponents(i);
+                pOtherDisabled->forEach([&](EntityId entityId) {
+                    disabled.set(remap(entityId));
+                });
+            }
+        }
+
+        other.m_lifetimes.forEach([&](EntityId entityId, uint64_t lifetime) {
+            m_lifetimes.schedule(remap(entityId), lifetime);
+        });
+
+        other.m_updateBuckets.forEach([&](EntityId entityId, uint32_t interval) {
+            m_updateBuckets.assign(remap(entityId), interval);
+        });
+
+        for (EntityId entityId: other.m_entitiesMarkedForRemoval) {
+            m_entitiesMarkedForRemoval.push_back(remap(entityId));
+        }
+
+        // Leave 'other' empty, but usable
+        other.m_entities.clear();
+        other.m_entitiesMarkedForRemoval.clear();
+        other.m_componentTypes.clear();
+        other.clearIndexes();
+        other.m_stores.clear();
+        other.m_activeStores.clear();
+        other.m_sharedStores.clear();
+        other.m_activeSharedStores.clear();
+        other.m_relations.clear();
+        other.m_disabledEntities.clear();
+        other.m_disabledComponents.clear();
+        other.m_lifetimes.clear();
+        other.m_updateBuckets.clear();
+        other.m_chunkGroups.clear();
+        other.m_componentNodeCount = 0;
+        other.m_componentNodeBuckets = 0;
+
+        return count;
+    }
+
+    /**
+     *  Copy every component of an entity into 'prefab', replacing its previous
+     *  contents.
+     *
+     *  Returns false if the entity does not exist or has a component that
+     *  cannot be copied, in which case 'prefab' is left empty.
+     */
+    bool makePrefab(EntityId entityId, Prefab &prefab) const
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::makePrefab");
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        prefab.clear();
+
+        auto enIter = m_entities.find(entityId);
+        if (enIter == m_entities.end() || !canCopyComponents(entityId, enIter->second)) {
+            return false;
+        }
+
+        const ComponentNodes &cmNodes = enIter->second;
+        prefab.m_attached.reserve(cmNodes.size());
+        for (const auto &cmNode: cmNodes) {
+            const ComponentTypeInfo *pInfo = m_componentTypeInfos.find(cmNode.first)->second;
+            Prefab::Attached attached = { pInfo, pInfo->copy(*cmNode.second) };
+            prefab.m_attached.push_back(attached);
+        }
+
+        for (const ComponentPool *pPool: m_activePools) {
+            const size_t index = pPool->indexOf(entityId);
+            if (index == ComponentPool::npos) {
+                continue;
+            }
+
+            const ComponentTypeInfo &info = pPool->typeInfo();
+            std::unique_ptr<ComponentPool> pPrefabPool(new ComponentPool(info));
+            info.copyConstruct(pPrefabPool->prepareInsert(Prefab::PrefabEntity), pPool->at(index));
+            pPrefabPool->commitInsert(Prefab::PrefabEntity);
+            prefab.m_pools.push_back(std::move(pPrefabPool));
+        }
+
+        for (const ComponentStoreBase *pStore: m_activeStores) {
+            const void *pComponent = pStore->find(entityId);
+            if (pComponent) {
+                std::unique_ptr<ComponentStoreBase> pPrefabStore(pStore->createEmpty());
+                pPrefabStore->insertCopy(Prefab::PrefabEntity, pComponent);
+                prefab.m_stores.push_back(std::move(pPrefabStore));
+            }
+        }
+
+        for (const SharedComponentStoreBase *pStore: m_activeSharedStores) {
+            if (pStore->contains(entityId)) {
+                std::unique_ptr<SharedComponentStoreBase> pPrefabStore(pStore->createEmpty());
+                pStore->copyTo(entityId, *pPrefabStore, Prefab::PrefabEntity);
+                prefab.m_shared.push_back(std::move(pPrefabStore));
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     *  Create 'count' entities from a prefab. The IDs of the new entities are
+     *  written to 'newIds'.
+     *
+     *  Returns the number of entities created.
+     */
+    size_t instantiate(const Prefab &prefab, size_t count, std::vector<EntityId> &newIds)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::instantiate");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        newIds.clear();
+        newIds.reserve(count);
+        m_entities.reserve(m_entities.size() + count);
+
+        // Look up each destination once, and size pools for the whole batch.
+        // New IDs are allocated in sequence, so the last insertion into each
+        // EntityNodes map makes a good hint for the next.
+        typedef std::pair<EntityNodes *, EntityNodes::iterator> Hint;
+        std::vector<Hint> hints;
+        hints.reserve(prefab.m_attached.size());
+        for (const Prefab::Attached &attached: prefab.m_attached) {
+            m_componentTypeInfos[attached.pInfo->type] = attached.pInfo;
+
+            auto cmIter = m_componentTypes.find(attached.pInfo->type);
+            if (cmIter == m_componentTypes.end()) {
+                cmIter = m_componentTypes.insert(ComponentTypes::value_type(
+                    attached.pInfo->type, std::make_shared<EntityNodes>())).first;
+            }
+            hints.push_back(Hint(cmIter->second.get(), cmIter->second->end()));
+        }
+
+        std::vector<ComponentPool *> pools;
+        pools.reserve(prefab.m_pools.size());
+        for (const auto &pPrefabPool: prefab.m_pools) {
+            ComponentPool &pool = getPool(pPrefabPool->typeInfo());
+            pool.reserve(pool.size() + count);
+            pools.push_back(&pool);
+        }
+
+        std::vector<ComponentStoreBase *> componentStores;
+        componentStores.reserve(prefab.m_stores.size());
+        for (const auto &pPrefabStore: prefab.m_stores) {
+            ComponentStoreBase *pStore = findStore(pPrefabStore->typeInfo());
+            componentStores.push_back(pStore ? pStore : &addStore(pPrefabStore->createEmpty()));
+        }
+
+        std::vector<SharedComponentStoreBase *> stores;
+        stores.reserve(prefab.m_shared.size());
+        for (const auto &pPrefabStore: prefab.m_shared) {
+            SharedComponentStoreBase *pStore = findSharedStore(pPrefabStore->typeInfo());
+            stores.push_back(pStore ? pStore : &addSharedStore(pPrefabStore->createEmpty()));
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            const EntityId newId = createEntity();
+            if (newId == InvalidEntity) {
+                break;
+            }
+
+            ComponentNodes &cmNodes = m_entities.find(newId)->second;
+            const size_t bucketCount = cmNodes.bucket_count();
+            cmNodes.reserve(prefab.m_attached.size());
+
+            for (size_t j = 0; j < prefab.m_attached.size(); ++j) {
+                const Prefab::Attached &attached = prefab.m_attached[j];
+                std::shared_ptr<Component> pComponent = attached.pInfo->copy(*attached.pComponent);
+                cmNodes.insert(ComponentNodes::value_type(attached.pInfo->type, pComponent));
+
+                Hint &hint = hints[j];
+                hint.second = hint.first->insert(hint.second, EntityNodes::value_type(newId, pComponent));
+                indexInsert(attached.pInfo->type, newId, *pComponent);
+            }
+
+            m_componentNodeCount += cmNodes.size();
+            m_componentNodeBuckets += cmNodes.bucket_count() - bucketCount;
+
+            for (size_t j = 0; j < pools.size(); ++j) {
+                const ComponentPool &prefabPool = *prefab.m_pools[j];
+                prefabPool.typeInfo().copyConstruct(pools[j]->prepareInsert(newId), prefabPool.at(0));
+                pools[j]->commitInsert(newId);
+            }
+
+            for (size_t j = 0; j < componentStores.size(); ++j) {
+                componentStores[j]->insertCopy(newId, prefab.m_stores[j]->find(Prefab::PrefabEntity));
+            }
+
+            for (size_t j = 0; j < stores.size(); ++j) {
+                prefab.m_shared[j]->copyTo(Prefab::PrefabEntity, *stores[j], newId);
+            }
+
+            recordComponents(newId);
+            newIds.push_back(newId);
+        }
+
+        return newIds.size();
+    }
+
+    /**
+     *  Create 'count' copies of an entity. The IDs of the new entities are
+     *  written to 'newIds'.
+     *
+     *  Returns the number of entities created, which is zero if the entity
+     *  does not exist or has a component that cannot be copied.
+     */
+    size_t cloneEntity(EntityId entityId, size_t count, std::vector<EntityId> &newIds)
+    {
+        Prefab prefab;
+        if (!makePrefab(entityId, prefab)) {
+            newIds.clear();
+            return 0;
+        }
+
+        return instantiate(prefab, count, newIds);
+    }
+
+    /**
+     *  Collect memory statistics for this EntityManager.
+     *
+     *  The components vector in 'stats' is reused, so sampling into the same
+     *  MemoryStats object each frame does not allocate in the steady state.
+     */
+    void collectStats(MemoryStats &stats) const
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::collectStats");
+        GAMEUTILS_ENTITY_CHECK_READ(m_raceDetector);
+
+        // Estimated node sizes for the containers used by the EM. Tree nodes
+        // hold three pointers and a colour, and hash nodes hold a next pointer
+        // and a cached hash code alongside their value.
+        const size_t treeNodeBytes = 4 * sizeof(void *) + sizeof(EntityNodes::value_type);
+        const size_t hashNodeBytes = 2 * sizeof(void *) + sizeof(ComponentNodes::value_type);
+        const size_t entityNodeBytes = 2 * sizeof(void *) + sizeof(Entities::value_type);
+        const size_t typeNodeBytes = 2 * sizeof(void *) + sizeof(ComponentTypes::value_type);
+
+        // Control block for a shared_ptr created using make_shared
+        const size_t controlBlockBytes = sizeof(void *) + 2 * sizeof(int);
+
+        stats.components.resize(m_componentTypes.size() + m_activePools.size() +
+            m_activeStores.size() + m_activeSharedStores.size());
+        stats.payloadBytes = 0;
+        stats.bookkeepingBytes = 0;
+        stats.resourceBytes = 0;
+        stats.heapBlocks = 0;
+
+        size_t i = 0;
+        for (const auto &cmType: m_componentTypes) {
+            ComponentStats &cs = stats.components[i++];
+            const size_t count = cmType.second->size();
+
+            auto infoIter = m_componentTypeInfos.find(cmType.first);
+            cs.type = cmType.first;
+            cs.count = count;
+            cs.componentSize = infoIter == m_componentTypeInfos.end() ? 0 : infoIter->second->size;
+            cs.payloadBytes = count * cs.componentSize;
+            cs.bookkeepingBytes = typeNodeBytes + sizeof(EntityNodes) +
+                count * (treeNodeBytes + hashNodeBytes + controlBlockBytes);
+
+            // Node-based maps allocate exactly one node per component
+            cs.capacity = count;
+            cs.loadFactor = count > 0 ? 1.0f : 0.0f;
+
+            stats.payloadBytes += cs.payloadBytes;
+            stats.bookkeepingBytes += cs.bookkeepingBytes;
+            stats.heapBlocks += 2 + 3 * count;
+        }
+
+        for (const ComponentPool *pPool: m_activePools) {
+            ComponentStats &cs = stats.components[i++];
+            const ComponentTypeInfo &info = pPool->typeInfo();
+
+            cs.type = info.type;
+            cs.count = pPool->size();
+            cs.componentSize = info.size;
+            cs.payloadBytes = cs.count * info.size;
+            cs.bookkeepingBytes = sizeof(ComponentPool) + pPool->bookkeepingBytes();
+            cs.capacity = pPool->capacity();
+            cs.loadFactor = cs.capacity > 0 ?
+                static_cast<float>(cs.count) / static_cast<float>(cs.capacity) : 0.0f;
+
+            stats.payloadBytes += cs.payloadBytes;
+            stats.bookkeepingBytes += cs.bookkeepingBytes;
+            stats.heapBlocks += 1 + pPool->heapBlocks();
+        }
+
+        for (const ComponentStoreBase *pStore: m_activeStores) {
+            ComponentStats &cs = stats.components[i++];
+            stats.heapBlocks += pStore->collectStats(cs);
+            stats.payloadBytes += cs.payloadBytes;
+            stats.bookkeepingBytes += cs.bookkeepingBytes;
+        }
+
+        for (const SharedComponentStoreBase *pStore: m_activeSharedStores) {
+            ComponentStats &cs = stats.components[i++];
+            stats.heapBlocks += pStore->collectStats(cs);
+            stats.payloadBytes += cs.payloadBytes;
+            stats.bookkeepingBytes += cs.bookkeepingBytes;
+        }
+
+        for (const ResourceSlot &resource: m_resources) {
+            if (resource.get()) {
+                stats.resourceBytes += resource.size();
+                stats.heapBlocks++;
+            }
+        }
+
+        for (const auto &pChannel: m_events) {
+            if (pChannel) {
+                stats.bookkeepingBytes += pChannel->size();
+                stats.heapBlocks += 2;
+            }
+        }
+
+        // Each indexed type has a node in m_indexes, holding its list of
+        // indexes, and each index is allocated separately
+        stats.indexBytes = m_indexes.bucket_count() * sizeof(void *) +
+            m_checksums.capacity() * sizeof(const ComponentChecksum *);
+        stats.heapBlocks += (m_indexes.empty() ? 0 : 1) + (m_checksums.capacity() > 0 ? 1 : 0);
+        for (const auto &indexes: m_indexes) {
+            stats.indexBytes += 2 * sizeof(void *) + sizeof(ComponentIndexes::value_type) +
+                indexes.second.indexes.capacity() * sizeof(std::unique_ptr<ComponentIndex>);
+            stats.heapBlocks += 2;
+            for (const auto &pIndex: indexes.second.indexes) {
+                stats.indexBytes += pIndex->bookkeepingBytes();
+                stats.heapBlocks += 1 + pIndex->heapBlocks();
+            }
+        }
+
+        stats.bookkeepingBytes += stats.indexBytes;
+
+        stats.relationBytes = m_relations.capacity() * sizeof(std::unique_ptr<RelationStore>);
+        stats.heapBlocks += m_relations.capacity() > 0 ? 1 : 0;
+        for (const auto &pStore: m_relations) {
+            if (pStore) {
+                stats.relationBytes += sizeof(RelationStore) + pStore->bookkeepingBytes();
+                stats.heapBlocks += 1 + pStore->heapBlocks();
+            }
+        }
+
+        stats.bookkeepingBytes += stats.relationBytes;
+
+        EntityTableStats &es = stats.entities;
+        es.count = m_entities.size();
+        es.buckets = m_entities.bucket_count();
+        es.loadFactor = m_entities.load_factor();
+        es.componentNodes = m_componentNodeCount;
+        es.componentNodeBuckets = m_componentNodeBuckets;
+        es.markedForRemoval = m_entitiesMarkedForRemoval.size();
+        es.markedForRemovalCapacity = m_entitiesMarkedForRemoval.capacity();
+        es.disabled = m_disabledEntities.count();
+
+        size_t disabledBytes = m_disabledEntities.bookkeepingBytes() +
+            m_disabledComponents.capacity() * sizeof(void *);
+        size_t disabledBlocks = m_disabledEntities.heapBlocks() + (m_disabledComponents.capacity() > 0 ? 1 : 0);
+        for (const auto &pDisabled: m_disabledComponents) {
+            if (pDisabled) {
+                disabledBytes += sizeof(EntityBitset) + pDisabled->bookkeepingBytes();
+                disabledBlocks += 1 + pDisabled->heapBlocks();
+            }
+        }
+
+        es.bookkeepingBytes =
+            es.count * entityNodeBytes +
+            (es.buckets + es.componentNodeBuckets) * sizeof(void *) +
+            m_componentTypes.bucket_count() * sizeof(void *) +
+            (m_pools.capacity() + m_stores.capacity() + m_sharedStores.capacity()) * sizeof(void *) +
+            m_resources.capacity() * sizeof(ResourceSlot) +
+            es.markedForRemovalCapacity * sizeof(EntityId) +
+            disabledBytes + m_lifetimes.bookkeepingBytes() + m_expired.capacity() * sizeof(EntityId) +
+            m_batch.bookkeepingBytes() +
+            m_updateBuckets.bookkeepingBytes() + m_dueEntities.capacity() * sizeof(DueEntity) +
+            m_relatedEntities.capacity() * sizeof(EntityId);
+
+        stats.bookkeepingBytes += es.bookkeepingBytes;
+        stats.heapBlocks += 2 * es.count + 2 + disabledBlocks + m_batch.heapBlocks();
+
+        const size_t totalBytes = stats.totalBytes();
+        stats.fragmentation = totalBytes > 0 ?
+            static_cast<float>(stats.bookkeepingBytes) / static_cast<float>(totalBytes) : 0.0f;
+    }
+
+    /**
+     *  Return memory statistics for this EntityManager.
+     */
+    MemoryStats memoryStats() const
+    {
+        MemoryStats stats;
+        collectStats(stats);
+        return stats;
+    }
+
+private:
+    typedef std::unordered_map<std::type_index, std::shared_ptr<Component>> ComponentNodes;
+    typedef std::unordered_map<EntityId, ComponentNodes> Entities;
+
+    // The indexes over a component type. Observes the pool or store for the
+    // type, so that pooled and stored components are indexed as they are
+    // inserted and erased.
+    class TypeIndexes: public ComponentObserver
+    {
+    public:
+        TypeIndexes()
+          : pInfo(nullptr) { }
+
+        void inserted(EntityId entityId, const void *pComponent) override
+        {
+            for (auto &pIndex: indexes) {
+                pIndex->insertValue(entityId, pComponent);
+            }
+        }
+
+        void erased(EntityId entityId) override
+        {
+            for (auto &pIndex: indexes) {
+                pIndex->erase(entityId);
+            }
+        }
+
+        const ComponentTypeInfo *pInfo;
+        std::vector<std::unique_ptr<ComponentIndex>> indexes;
+    };
+
+    // A change that was made to an entity other than the one being visited
+    // by forEach or forEachAttached, to be applied once iteration is complete
+    struct DeferredChange
+    {
+        enum Kind
+        {
+            Destroy,
+            Remove,     // Pooled or stored component
+            Detach      // Attached component
+        };
+
+        Kind kind;
+        EntityId entityId;
+        const ComponentTypeInfo *pInfo;     // Null for Destroy
+    };
+
+    // Tracks the depth of nested forEach and forEachAttached calls
+    class IterationScope
+    {
+    public:
+        explicit IterationScope(EntityManager &em)
+          : m_em(em)
+          , m_outerEntity(em.m_iteratingEntity)
+        {
+            m_em.m_iterationDepth++;
+        }
+
+        ~IterationScope()
+        {
+            m_em.m_iterationDepth--;
+            m_em.m_iteratingEntity = m_outerEntity;
+        }
+
+    private:
+        IterationScope(const IterationScope &);
+        IterationScope& operator=(const IterationScope &);
+
+        EntityManager &m_em;
+        const EntityId m_outerEntity;
+    };
+
+    /**
+     *  Returns true if a change to an entity must be deferred. Only the entity
+     *  being visited by a single (non-nested) iteration can be changed
+     *  immediately.
+     */
+    bool mustDefer(EntityId entityId) const
+    {
+        return m_iterationDepth > 1 || (m_iterationDepth == 1 && entityId != m_iteratingEntity);
+    }
+
+    /**
+     *  Returns true if an entity is due to be destroyed, or to lose the
+     *  component described by 'pInfo'.
+     */
+    bool isDeferred(EntityId entityId, const ComponentTypeInfo *pInfo) const
+    {
+        return m_deferredDestroys.test(entityId) ||
+            (pInfo && m_deferredComponents.count(deferredKey(entityId, *pInfo)) > 0);
+    }
+
+    static uint64_t deferredKey(EntityId entityId, const ComponentTypeInfo &info)
+    {
+        return (static_cast<uint64_t>(info.index) << 32) | entityId;
+    }
+
+    bool defer(DeferredChange::Kind kind, EntityId entityId, const ComponentTypeInfo *pInfo)
+    {
+        if (isDeferred(entityId, pInfo)) {
+            return false;
+        }
+
+        if (pInfo) {
+            m_deferredComponents.insert(deferredKey(entityId, *pInfo));
+        } else {
+            m_deferredDestroys.set(entityId);
+        }
+
+        DeferredChange change = { kind, entityId, pInfo };
+        m_deferred.push_back(change);
+        return true;
+    }
+
+    void record(EntityRecorder::Operation operation, EntityId entityId, const std::type_index *pType = nullptr)
+    {
+        if (m_pRecorder) {
+            m_pRecorder->record(operation, entityId, pType);
+        }
+    }
+
+    /**
+     *  Record an Attach or Add for each component of an entity, when its
+     *  components have been copied or moved in bulk.
+     */
+    void recordComponents(EntityId entityId)
+    {
+        if (!m_pRecorder) {
+            return;
+        }
+
+        for (const auto &cmNode: m_entities.find(entityId)->second) {
+            m_pRecorder->record(EntityRecorder::Attach, entityId, &cmNode.first);
+        }
+
+        for (const ComponentPool *pPool: m_activePools) {
+            if (pPool->contains(entityId)) {
+                m_pRecorder->record(EntityRecorder::Add, entityId, &pPool->typeInfo().type);
+            }
+        }
+
+        for (const ComponentStoreBase *pStore: m_activeStores) {
+            if (pStore->contains(entityId)) {
+                m_pRecorder->record(EntityRecorder::Add, entityId, &pStore->typeInfo().type);
+            }
+        }
+    }
+
+    /**
+     *  Apply deferred changes, once the outermost iteration is complete. The
+     *  list keeps its capacity, so this does not allocate in the steady state.
+     */
+    void applyDeferred()
+    {
+        if (m_iterationDepth > 0) {
+            return;
+        }
+
+        // Changes may be deferred while applying, if a change triggers
+        // another iteration, so the list is not iterated directly
+        for (size_t i = 0; i < m_deferred.size(); ++i) {
+            const DeferredChange change = m_deferred[i];
+            switch (change.kind) {
+            case DeferredChange::Destroy:
+                destroyEntity(change.entityId);
+                break;
+            case DeferredChange::Remove:
+                // An earlier change may have destroyed the entity
+                if (change.pInfo->storage == PooledStorage ?
+                    m_pools[change.pInfo->index]->contains(change.entityId) :
+                    m_stores[change.pInfo->index]->contains(change.entityId)) {
+                    record(EntityRecorder::Remove, change.entityId, &change.pInfo->type);
+                }
+
+                if (change.pInfo->storage == PooledStorage) {
+                    m_pools[change.pInfo->index]->erase(change.entityId);
+                } else {
+                    m_stores[change.pInfo->index]->erase(change.entityId);
+                }
+                enableComponent(*change.pInfo, change.entityId);
+                break;
+            case DeferredChange::Detach:
+                detachComponent(change.entityId, *change.pInfo);
+                break;
+            }
+        }
+
+        for (const DeferredChange &change: m_deferred) {
+            if (change.kind == DeferredChange::Destroy) {
+                m_deferredDestroys.reset(change.entityId);
+            }
+        }
+
+        m_deferredComponents.clear();
+        m_deferred.clear();
+    }
+
+    /**
+     *  Take ownership of an index over components of type <T>, and add the
+     *  components that already exist, whether attached, pooled or stored.
+     */
+    template<typename T, typename Index>
+    Index& addIndex(Index *pNewIndex)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        std::unique_ptr<ComponentIndex> pIndex(pNewIndex);
+        auto cmIter = m_componentTypes.find(typeid(T));
+        if (cmIter != m_componentTypes.end()) {
+            for (const auto &enNode: *cmIter->second) {
+                pIndex->insert(enNode.first, *enNode.second);
+            }
+        }
+
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        if (const ComponentPool *pPool = findPool(info)) {
+            for (size_t i = 0; i < pPool->size(); ++i) {
+                pIndex->insertValue(pPool->entities()[i], pPool->at(i));
+            }
+        } else if (const ComponentStoreBase *pStore = findStore(info)) {
+            const std::vector<EntityId> entities(pStore->entities(), pStore->entities() + pStore->size());
+            for (EntityId entityId: entities) {
+                pIndex->insertValue(entityId, pStore->find(entityId));
+            }
+        }
+
+        TypeIndexes &typeIndexes = m_indexes[typeid(T)];
+        typeIndexes.pInfo = &info;
+        typeIndexes.indexes.push_back(std::move(pIndex));
+        observeComponents(info, &typeIndexes);
+        return *pNewIndex;
+    }
+
+    /**
+     *  Set the observer of the pool or store for a type, if it exists. Pools
+     *  and stores that are created later are given the observer by getPool
+     *  and addStore.
+     */
+    void observeComponents(const ComponentTypeInfo &info, ComponentObserver *pObserver)
+    {
+        if (ComponentPool *pPool = findPool(info)) {
+            pPool->setObserver(pObserver);
+        }
+
+        if (ComponentStoreBase *pStore = findStore(info)) {
+            pStore->setObserver(pObserver);
+        }
+    }
+
+    /**
+     *  Returns the indexes over a type, or nullptr if it has none.
+     */
+    TypeIndexes* findIndexes(const std::type_index &cmType)
+    {
+        if (m_indexes.empty()) {
+            return nullptr;
+        }
+
+        auto iter = m_indexes.find(cmType);
+        return iter == m_indexes.end() ? nullptr : &iter->second;
+    }
+
+    /**
+     *  Add an attached component to the indexes over its type, if any.
+     */
+    void indexInsert(const std::type_index &cmType, EntityId entityId, const Component &component)
+    {
+        if (TypeIndexes *pIndexes = findIndexes(cmType)) {
+            for (auto &pIndex: pIndexes->indexes) {
+                pIndex->insert(entityId, component);
+            }
+        }
+    }
+
+    /**
+     *  Remove an attached component from the indexes over its type, if any.
+     */
+    void indexErase(const std::type_index &cmType, EntityId entityId)
+    {
+        if (TypeIndexes *pIndexes = findIndexes(cmType)) {
+            pIndexes->erased(entityId);
+        }
+    }
+
+    void reindex(const std::type_index &cmType, EntityId entityId, const void *pComponent)
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        if (TypeIndexes *pIndexes = findIndexes(cmType)) {
+            pIndexes->erased(entityId);
+            pIndexes->inserted(entityId, pComponent);
+        }
+    }
+
+    /**
+     *  Returns the component of type <T> that modifyComponent and
+     *  reindexComponent act on: the attached component, if there is one,
+     *  and otherwise the pooled or stored component.
+     */
+    template<typename T>
+    T* findIndexedComponent(EntityId entityId, std::true_type)
+    {
+        const std::shared_ptr<T> pComponent = getComponent<T>(entityId);
+        return pComponent ? pComponent.get() : findComponent<T>(entityId);
+    }
+
+    template<typename T>
+    T* findIndexedComponent(EntityId entityId, std::false_type)
+    {
+        return findComponent<T>(entityId);
+    }
+
+    void clearIndexes()
+    {
+        for (auto &indexes: m_indexes) {
+            for (auto &pIndex: indexes.second.indexes) {
+                pIndex->clear();
+            }
+        }
+    }
+
+    RelationStore* findRelationStore(size_t index)
+    {
+        return index < m_relations.size() ? m_relations[index].get() : nullptr;
+    }
+
+    const RelationStore* findRelationStore(size_t index) const
+    {
+        return index < m_relations.size() ? m_relations[index].get() : nullptr;
+    }
+
+    RelationStore& getRelationStore(size_t index)
+    {
+        if (index >= m_relations.size()) {
+            m_relations.resize(index + 1);
+        }
+
+        if (!m_relations[index]) {
+            m_relations[index].reset(new RelationStore());
+        }
+
+        return *m_relations[index];
+    }
+
+    template<typename E>
+    EventChannel<E>& getEventChannel()
+    {
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        const size_t index = eventIndex<E>();
+        if (index >= m_events.size()) {
+            m_events.resize(index + 1);
+        }
+
+        if (!m_events[index]) {
+            m_events[index].reset(new EventChannel<E>());
+        }
+
+        return static_cast<EventChannel<E> &>(*m_events[index]);
+    }
+
+    /**
+     *  Remove every relationship, of any kind, that involves an entity.
+     */
+    void removeAllRelations(EntityId entityId)
+    {
+        for (auto &pStore: m_relations) {
+            if (pStore && pStore->size() > 0) {
+                pStore->removeEntity(entityId);
+            }
+        }
+    }
+
+    /**
+     *  Remove the attached components of an entity that is being destroyed,
+     *  from the entity nodes and indexes for their types.
+     */
+    void removeAttachedNodes(EntityId entityId, const ComponentNodes &componentNodes)
+    {
+        for (const auto &cmNode: componentNodes) {
+            const auto &cmType = cmNode.first;
+            auto cmIter = m_componentTypes.find(cmType);
+            if (cmIter == m_componentTypes.end()) {
+                throw std::runtime_error("Could not find expected component type in EM.");
+            }
+
+            auto &enNodes = cmIter->second;
+            auto enNodeIter = enNodes->find(entityId);
+            if (enNodeIter == enNodes->end()) {
+                throw std::runtime_error("Could not find expected entity node in EM.");
+            }
+
+            // Remove the entity node (as well as the embedded shared_ptr to the component)
+            enNodes->erase(enNodeIter);
+            indexErase(cmType, entityId);
+        }
+    }
+
+    /**
+     *  Clear the per-entity state of an entity that is being destroyed, once
+     *  its components have been removed, and erase it.
+     */
+    void releaseEntity(Entities::iterator enIter)
+    {
+        const EntityId entityId = enIter->first;
+        enableEntity(entityId);
+        m_lifetimes.cancel(entityId);
+        m_updateBuckets.remove(entityId);
+
+        m_componentNodeCount -= enIter->second.size();
+        m_componentNodeBuckets -= allocatedBuckets(enIter->second);
+        m_entities.erase(enIter);
+    }
+
+    /**
+     *  Destroy a batch of entities, visiting each pool and store once for the
+     *  whole batch, rather than once for each entity. 'entityIds' is reused
+     *  as scratch space. Entities that do not exist are ignored, and changes
+     *  that must be deferred are deferred as for destroyEntity.
+     *
+     *  Returns the number of entities destroyed, or due to be destroyed.
+     */
+    size_t destroyBatch(std::vector<EntityId> &entityIds)
+    {
+        size_t destroyed = 0;
+        size_t count = 0;
+        for (EntityId entityId: entityIds) {
+            if (m_entities.find(entityId) == m_entities.end() || m_batch.test(entityId)) {
+                continue;
+            }
+
+            if (mustDefer(entityId)) {
+                destroyed += destroyEntity(entityId) ? 1 : 0;
+                continue;
+            }
+
+            m_batch.set(entityId);
+            entityIds[count++] = entityId;
+        }
+
+        entityIds.resize(count);
+        if (count == 0) {
+            return destroyed;
+        }
+
+        for (EntityId entityId: entityIds) {
+            record(EntityRecorder::Destroy, entityId);
+            removeAttachedNodes(entityId, m_entities.find(entityId)->second);
+        }
+
+        // A pool that is smaller than the batch is scanned instead, from back
+        // to front, so that components moved into the holes have been checked
+        for (ComponentPool *pPool: m_activePools) {
+            if (pPool->size() > count) {
+                for (EntityId entityId: entityIds) {
+                    pPool->erase(entityId);
+                }
+            } else {
+                for (size_t i = pPool->size(); i-- > 0; ) {
+                    if (m_batch.test(pPool->entities()[i])) {
+                        pPool->erase(pPool->entities()[i]);
+                    }
+                }
+            }
+        }
+
+        for (ComponentStoreBase *pStore: m_activeStores) {
+            for (size_t i = 0; i < count && pStore->size() > 0; ++i) {
+                pStore->erase(entityIds[i]);
+            }
+        }
+
+        for (SharedComponentStoreBase *pStore: m_activeSharedStores) {
+            for (size_t i = 0; i < count && pStore->size() > 0; ++i) {
+                pStore->remove(entityIds[i]);
+            }
+        }
+
+        for (EntityId entityId: entityIds) {
+            removeAllRelations(entityId);
+            releaseEntity(m_entities.find(entityId));
+            m_batch.reset(entityId);
+        }
+
+        return destroyed + count;
+    }
+
+    /**
+     *  Detach the component described by 'info' from the specified entity.
+     */
+    bool detachComponent(EntityId entityId, const ComponentTypeInfo &info)
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityManager::detachComponent");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+
+        // Find the entity
+        auto enIter = m_entities.find(entityId);
+        if (enIter == m_entities.end()) {
+            // Entity does not exist
+            return false;
+        }
+
+        const std::type_index &cmType = info.type;
+
+        // Find the entity's component node for this type
+        auto &cmNodes = enIter->second;
+        auto cmNodeIter = cmNodes.find(cmType);
+        if (cmNodeIter == cmNodes.end()) {
+            // Entity does not have a component of this type
             return false;
         }
 
-        if (!cmNodes.insert(ComponentNodes::value_type(cmType, pComponent)).second) {
-            // Failed to add a component node
-            return false;
+        if (mustDefer(entityId)) {
+            return defer(DeferredChange::Detach, entityId, &info);
+        }
+
+        record(EntityRecorder::Detach, entityId, &cmType);
+
+        // Remove the component node from the entity
+        // Errors beyond this point indicate that state of the EM has become
+        // corrupt. This is essentially irreparable, so exceptions will be thrown.
+        cmNodes.erase(cmNodeIter);
+        m_componentNodeCount--;
+
+        // Find the component
+        auto cmIter = m_componentTypes.find(cmType);
+        if (cmIter == m_componentTypes.end()) {
+            // Component does not exist
+            throw std::runtime_error("Missing component in EM.");
+        }
+
+        auto &enNodes = cmIter->second;
+        auto enNodeIter = enNodes->find(entityId);
+        if (enNodeIter == enNodes->end()) {
+            // Entity node does not exist
+            throw std::runtime_error("Missing entity node for component in EM.");
+        }
+
+        // Remove the entity node from the component
+        enNodes->erase(enNodeIter);
+        indexErase(cmType, entityId);
+
+        return true;
+    }
+
+    /**
+     *  Buckets of a ComponentNodes map beyond the one that an empty map
+     *  starts with. Only these buckets are counted in m_componentNodeBuckets.
+     */
+    static size_t allocatedBuckets(const ComponentNodes &cmNodes)
+    {
+        static const size_t initialBuckets = ComponentNodes().bucket_count();
+        return cmNodes.bucket_count() - initialBuckets;
+    }
+
+    /**
+     *  Update the EntityFields of each component in 'cmNodes'.
+     */
+    void remapComponents(ComponentNodes &cmNodes, const EntityRemap &remap) const
+    {
+        for (auto &cmNode: cmNodes) {
+            auto infoIter = m_componentTypeInfos.find(cmNode.first);
+            if (infoIter != m_componentTypeInfos.end() && infoIter->second->remapComponent) {
+                infoIter->second->remapComponent(*cmNode.second, remap);
+            }
+        }
+    }
+
+    /**
+     *  Returns true if every component of an entity can be copied.
+     */
+    bool canCopyComponents(EntityId entityId, const ComponentNodes &cmNodes) const
+    {
+        for (const auto &cmNode: cmNodes) {
+            auto infoIter = m_componentTypeInfos.find(cmNode.first);
+            if (infoIter == m_componentTypeInfos.end() || !infoIter->second->copy) {
+                return false;
+            }
+        }
+
+        for (const ComponentPool *pPool: m_activePools) {
+            if (!pPool->typeInfo().copyConstruct && pPool->contains(entityId)) {
+                return false;
+            }
+        }
+
+        for (const ComponentStoreBase *pStore: m_activeStores) {
+            if (!pStore->typeInfo().copyConstruct && pStore->contains(entityId)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     *  Returns true if every stored component of an entity can be moved.
+     *  Attached and pooled components can always be moved.
+     */
+    bool canMoveComponents(EntityId entityId) const
+    {
+        for (const ComponentStoreBase *pStore: m_activeStores) {
+            if (!pStore->typeInfo().moveConstruct && pStore->contains(entityId)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     *  Returns true if merging 'other' would not have to move any stored
+     *  component that cannot be moved. Such stores can only be adopted whole,
+     *  which needs every ID to be kept, and this manager to have no
+     *  components of the same type.
+     */
+    bool canMergeStores(const EntityManager &other) const
+    {
+        bool hasUnmovable = false;
+        for (const ComponentStoreBase *pOtherStore: other.m_activeStores) {
+            if (pOtherStore->typeInfo().moveConstruct || pOtherStore->size() == 0) {
+                continue;
+            }
+
+            const ComponentStoreBase *pStore = findStore(pOtherStore->typeInfo());
+            if (pStore && pStore->size() > 0) {
+                return false;
+            }
+
+            hasUnmovable = true;
+        }
+
+        if (hasUnmovable) {
+            for (const auto &entity: other.m_entities) {
+                if (m_entities.find(entity.first) != m_entities.end()) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     *  Order a set of pools so that the entities that have a component in
+     *  every pool come first, in the same order in each pool. Returns the
+     *  number of such entities.
+     */
+    size_t alignPools(ComponentPool *const *pools, size_t poolCount)
+    {
+        if (poolCount == 1) {
+            return pools[0]->size();
+        }
+
+        // Reuse the previous alignment of the same pools if none have changed
+        ChunkGroup *pGroup = nullptr;
+        for (ChunkGroup &group: m_chunkGroups) {
+            if (group.pools.size() == poolCount &&
+                std::equal(group.pools.begin(), group.pools.end(), pools)) {
+                pGroup = &group;
+                break;
+            }
+        }
+
+        if (pGroup) {
+            bool changed = false;
+            for (size_t i = 0; i < poolCount; ++i) {
+                changed = changed || pools[i]->version() != pGroup->versions[i];
+            }
+
+            if (!changed) {
+                return pGroup->count;
+            }
+        } else {
+            m_chunkGroups.push_back(ChunkGroup());
+            pGroup = &m_chunkGroups.back();
+            pGroup->pools.assign(pools, pools + poolCount);
+            pGroup->versions.resize(poolCount);
+        }
+
+        // Partition the smallest pool, so that as few lookups as possible are
+        // needed, then arrange the others to match
+        ComponentPool *pLead = *std::min_element(pools, pools + poolCount,
+            [](const ComponentPool *a, const ComponentPool *b) { return a->size() < b->size(); });
+
+        size_t count = 0;
+        for (size_t i = 0; i < pLead->size(); ++i) {
+            const EntityId entityId = pLead->entities()[i];
+
+            bool matches = true;
+            for (size_t j = 0; j < poolCount && matches; ++j) {
+                matches = pools[j] == pLead || pools[j]->contains(entityId);
+            }
+
+            if (matches) {
+                pLead->swap(i, count++);
+            }
+        }
+
+        for (size_t j = 0; j < poolCount; ++j) {
+            if (pools[j] == pLead) {
+                continue;
+            }
+
+            // Positions before 'i' already hold matching entities, so the
+            // entity for position 'i' must be at or after it
+            for (size_t i = 0; i < count; ++i) {
+                pools[j]->swap(i, pools[j]->indexOf(pLead->entities()[i]));
+            }
+        }
+
+        for (size_t i = 0; i < poolCount; ++i) {
+            pGroup->versions[i] = pools[i]->version();
+        }
+
+        pGroup->count = count;
+        return count;
+    }
+
+    template<typename Fn, typename... Ptrs>
+    static void visitChunks(Fn &fn, size_t count, const EntityId *pEntities, Ptrs... pComponents)
+    {
+        for (size_t first = 0; first < count; first += ChunkSize) {
+            fn(std::min(static_cast<size_t>(ChunkSize), count - first), pEntities + first, (pComponents + first)...);
+        }
+    }
+
+    /**
+     *  visitChunks for when some entities or components are disabled. Each
+     *  chunk is a run of enabled entities. Returns the number of entities
+     *  visited.
+     */
+    template<typename Fn, typename... Ptrs>
+    size_t visitEnabledChunks(Fn &fn, const EntityBitset *const *disabled, size_t disabledCount,
+        size_t count, const EntityId *pEntities, Ptrs... pComponents) const
+    {
+        auto enabled = [&](EntityId entityId) {
+            if (m_disabledEntities.test(entityId)) {
+                return false;
+            }
+
+            for (size_t i = 0; i < disabledCount; ++i) {
+                if (disabled[i] && disabled[i]->test(entityId)) {
+                    return false;
+                }
+            }
+
+            return true;
+        };
+
+        size_t visited = 0;
+        size_t first = 0;
+        while (first < count) {
+            if (!enabled(pEntities[first])) {
+                first++;
+                continue;
+            }
+
+            size_t last = first + 1;
+            while (last < count && last - first < ChunkSize && enabled(pEntities[last])) {
+                last++;
+            }
+
+            fn(last - first, pEntities + first, (pComponents + first)...);
+            visited += last - first;
+            first = last;
+        }
+
+        return visited;
+    }
+
+    /**
+     *  Returns the set of entities whose component of a type is disabled, or
+     *  nullptr if there are none.
+     */
+    const EntityBitset* findDisabledComponents(const ComponentTypeInfo &info) const
+    {
+        const EntityBitset *pDisabled = info.index < m_disabledComponents.size() ?
+            m_disabledComponents[info.index].get() : nullptr;
+        return pDisabled && !pDisabled->empty() ? pDisabled : nullptr;
+    }
+
+    EntityBitset& getDisabledComponents(size_t index)
+    {
+        if (index >= m_disabledComponents.size()) {
+            m_disabledComponents.resize(index + 1);
+        }
+
+        std::unique_ptr<EntityBitset> &pDisabled = m_disabledComponents[index];
+        if (!pDisabled) {
+            pDisabled.reset(new EntityBitset());
+        }
+
+        return *pDisabled;
+    }
+
+    bool isDisabled(EntityId entityId, const EntityBitset *pDisabledComponents) const
+    {
+        return m_disabledEntities.test(entityId) ||
+            (pDisabledComponents && pDisabledComponents->test(entityId));
+    }
+
+    /**
+     *  Called when a component is removed, so that it is enabled if it is
+     *  added again.
+     */
+    void enableComponent(const ComponentTypeInfo &info, EntityId entityId)
+    {
+        if (info.index < m_disabledComponents.size() && m_disabledComponents[info.index]) {
+            m_disabledComponents[info.index]->reset(entityId);
+        }
+    }
+
+    /**
+     *  Called when an entity is destroyed, or moved away.
+     */
+    void enableEntity(EntityId entityId)
+    {
+        m_disabledEntities.reset(entityId);
+        for (auto &pDisabled: m_disabledComponents) {
+            if (pDisabled && !pDisabled->empty()) {
+                pDisabled->reset(entityId);
+            }
+        }
+    }
+
+    /**
+     *  Copy the enabled state of an entity, and of its components, to an
+     *  entity in another manager.
+     */
+    void copyEnabledState(EntityId entityId, EntityManager &dest, EntityId destId) const
+    {
+        if (m_disabledEntities.test(entityId)) {
+            dest.m_disabledEntities.set(destId);
+        }
+
+        for (size_t i = 0; i < m_disabledComponents.size(); ++i) {
+            const EntityBitset *pDisabled = m_disabledComponents[i].get();
+            if (pDisabled && pDisabled->test(entityId)) {
+                dest.getDisabledComponents(i).set(destId);
+            }
         }
+    }
 
-        // Errors beyond this point indicate that state of the EM has become
-        // corrupt. This is essentially irreparable, so exceptions will be thrown.
-
-        // Find the entity nodes associated with the component type
-        auto cmIter = m_componentTypes.find(cmType);
-        if (cmIter == m_componentTypes.end()) {
-            // Create a new component type
-            cmIter = m_componentTypes.insert(
-                ComponentTypes::value_type(cmType, std::make_shared<EntityNodes>())).first;
+    /**
+     *  Returns the pool for a component type, creating it if necessary.
+     */
+    ComponentPool& getPool(const ComponentTypeInfo &info)
+    {
+        if (info.index >= m_pools.size()) {
+            m_pools.resize(info.index + 1);
         }
 
-        if (cmIter == m_componentTypes.end()) {
-            // Could not find or create a list of entity nodes for type <T>
-            throw std::runtime_error("Could not find or create a list of entity nodes in EM.");
+        std::unique_ptr<ComponentPool> &pPool = m_pools[info.index];
+        if (!pPool) {
+            m_activePools.reserve(m_activePools.size() + 1);
+            pPool.reset(new ComponentPool(info));
+            m_activePools.push_back(pPool.get());
+            pPool->setObserver(findIndexes(info.type));
         }
 
-        // Add a node for this component to the com
-        auto &entityNodes = cmIter->second;
-        entityNodes->insert(EntityNodes::value_type(entityId, pComponent));
+        return *pPool;
+    }
 
-        return true;
+    SharedComponentStoreBase* findSharedStore(const ComponentTypeInfo &info) const
+    {
+        return info.index < m_sharedStores.size() ? m_sharedStores[info.index].get() : nullptr;
     }
 
     /**
-     *  Detach the component of type <T> from the specified entity.
+     *  Returns the shared component store for type <T>, creating it if necessary.
      */
     template<typename T>
-    bool detachComponent(EntityId entityId)
+    SharedComponentStore<T>& getSharedStore()
     {
-        // Find the entity
-        auto enIter = m_entities.find(entityId);
-        if (enIter == m_entities.end()) {
-            // Entity does not exist
-            return false;
+        SharedComponentStoreBase *pStore = findSharedStore(componentTypeInfo<T>());
+        if (!pStore) {
+            pStore = &addSharedStore(new SharedComponentStore<T>());
         }
 
-        // Construct type index for <T>
-        const std::type_index &cmType(typeid(T));
+        return static_cast<SharedComponentStore<T> &>(*pStore);
+    }
 
-        // Find the entity's component node for this type
-        auto &cmNodes = enIter->second;
-        auto cmNodeIter = cmNodes.find(cmType);
-        if (cmNodeIter == cmNodes.end()) {
-            // Entity does not have a component of this type
-            return false;
+    template<typename T>
+    ComponentStoreBase& getStore()
+    {
+        const ComponentTypeInfo &info = componentTypeInfo<T>();
+        ComponentStoreBase *pStore = findStore(info);
+        if (!pStore) {
+            pStore = &addStore(detail::createStore<T>(
+                std::integral_constant<StoragePolicy, ComponentStoragePolicy<T>::value>()));
         }
 
-        // Remove the component node from the entity
-        // Errors beyond this point indicate that state of the EM has become
-        // corrupt. This is essentially irreparable, so exceptions will be thrown.
-        cmNodes.erase(cmNodeIter);
+        return *pStore;
+    }
 
-        // Find the component
-        auto cmIter = m_componentTypes.find(cmType);
-        if (cmIter == m_componentTypes.end()) {
-            // Component does not exist
-            throw std::runtime_error("Missing component in EM.");
+    /**
+     *  Take ownership of a component store, replacing any store for the same
+     *  type.
+     */
+    ComponentStoreBase& addStore(ComponentStoreBase *pNewStore)
+    {
+        std::unique_ptr<ComponentStoreBase> pStore(pNewStore);
+
+        const size_t index = pStore->typeInfo().index;
+        if (index >= m_stores.size()) {
+            m_stores.resize(index + 1);
         }
 
-        auto &enNodes = cmIter->second;
-        auto enNodeIter = enNodes->find(entityId);
-        if (enNodeIter == enNodes->end()) {
-            // Entity node does not exist
-            throw std::runtime_error("Missing entity node for component in EM.");
+        // An existing store for the type is replaced
+        auto activeIter = std::find(m_activeStores.begin(), m_activeStores.end(), m_stores[index].get());
+        if (m_stores[index] && activeIter != m_activeStores.end()) {
+            *activeIter = pNewStore;
+        } else {
+            m_activeStores.reserve(m_activeStores.size() + 1);
+            m_activeStores.push_back(pNewStore);
         }
 
-        // Remove the entity node from the component
-        enNodes->erase(enNodeIter);
+        m_stores[index] = std::move(pStore);
 
-        return true;
+        // The store may have been adopted from another manager, so it is
+        // given this manager's indexes, which are told of its components
+        TypeIndexes *pIndexes = findIndexes(pNewStore->typeInfo().type);
+        pNewStore->setObserver(pIndexes);
+        if (pIndexes && pNewStore->size() > 0) {
+            const std::vector<EntityId> entities(pNewStore->entities(),
+                pNewStore->entities() + pNewStore->size());
+            for (EntityId entityId: entities) {
+                pIndexes->inserted(entityId, pNewStore->find(entityId));
+            }
+        }
+
+        return *pNewStore;
     }
 
     /**
-     *  Get a specific component type attached to an entity
+     *  forEach for component types that do not use PooledStorage. The
+     *  entities are copied first, since a store may reorganise itself when
+     *  its components are added or removed.
      */
-    template<typename T>
-    std::shared_ptr<T> getComponent(EntityId entityId)
+    template<typename T, typename Fn>
+    void forEachStored(Fn &fn, EnabledFilter filter)
     {
-        // Find the entity
-        auto enIter = m_entities.find(entityId);
-        if (enIter == m_entities.end()) {
-            // Entity does not exist
-            return nullptr;
+        ComponentStoreBase *pStore = findStore(componentTypeInfo<T>());
+        if (!pStore) {
+            return;
         }
 
-        // Construct type index for <T>
-        const std::type_index &cmType(typeid(T));
+        const std::vector<EntityId> entities(pStore->entities(), pStore->entities() + pStore->size());
 
-        // Find the component node for type <T>
-        auto &cmNodes = enIter->second;
-        auto cmNodeIter = cmNodes.find(cmType);
-        if (cmNodeIter == cmNodes.end()) {
-            // Entity does not have a component of this type
-            return nullptr;
+        {
+            IterationScope scope(*this);
+            const EntityBitset *pDisabled = filter == EnabledOnly ?
+                findDisabledComponents(pStore->typeInfo()) : nullptr;
+            const bool filtered = filter == EnabledOnly && (!m_disabledEntities.empty() || pDisabled);
+
+            for (EntityId entityId: entities) {
+                T *pComponent = static_cast<T *>(pStore->find(entityId));
+                if (!pComponent || (!m_deferred.empty() && isDeferred(entityId, &pStore->typeInfo()))) {
+                    continue;
+                }
+
+                if (filtered && isDisabled(entityId, pDisabled)) {
+                    continue;
+                }
+
+                m_iteratingEntity = entityId;
+                fn(entityId, *pComponent);
+            }
         }
 
-        return std::static_pointer_cast<T>(cmNodeIter->second);
+        applyDeferred();
     }
 
     /**
-     *  Returns the EntityNodes map for a given component type
+     *  The const forEach for component types that do not use PooledStorage.
+     *  The list of entities is read once, before the loop.
      */
-    template<typename T>
-    std::shared_ptr<EntityNodes> getEntityNodes()
+    template<typename T, typename Fn, StoragePolicy Policy>
+    void forEachStored(const ComponentStoreBase &store, Fn &fn, const EntityBitset *pDisabled,
+        bool filtered, std::integral_constant<StoragePolicy, Policy>) const
     {
-        // Construct type index for <T>
-        const std::type_index &cmType(typeid(T));
-
-        // Check for existing component type entry
-        auto cmIter = m_componentTypes.find(typeid(T));
-        if (cmIter == m_componentTypes.end()) {
-            // Create a new component type entry
-            auto result = m_componentTypes.insert(
-                ComponentTypes::value_type(cmType, std::make_shared<EntityNodes>()));
-            if (!result.second) {
-                return nullptr;
+        const EntityId *pEntities = store.entities();
+        const size_t count = store.size();
+        for (size_t i = 0; i < count; ++i) {
+            const EntityId entityId = pEntities[i];
+            if (!filtered || !isDisabled(entityId, pDisabled)) {
+                fn(entityId, *static_cast<const T *>(store.find(entityId)));
             }
-
-            return result.first->second;
         }
+    }
 
-        return cmIter->second;
+    /**
+     *  Tags are visited using the store's bitset, since TagStore::entities
+     *  may rebuild its cached list, which is not safe for concurrent reads.
+     */
+    template<typename T, typename Fn>
+    void forEachStored(const ComponentStoreBase &store, Fn &fn, const EntityBitset *pDisabled,
+        bool filtered, std::integral_constant<StoragePolicy, TagStorage>) const
+    {
+        const TagStore<T> &tags = static_cast<const TagStore<T> &>(store);
+        tags.forEachEntity([&](EntityId entityId) {
+            if (!filtered || !isDisabled(entityId, pDisabled)) {
+                fn(entityId, *static_cast<const T *>(store.find(entityId)));
+            }
+        });
     }
 
-    void markForRemoval(EntityId entityId)
+    /**
+     *  Take ownership of a new, empty shared component store.
+     */
+    SharedComponentStoreBase& addSharedStore(SharedComponentStoreBase *pNewStore)
     {
-        auto emItr = m_entities.find(entityId);
-        if (emItr != m_entities.end()) {
-            m_entitiesMarkedForRemoval.push_back(entityId);
+        std::unique_ptr<SharedComponentStoreBase> pStore(pNewStore);
+
+        const size_t index = pStore->typeInfo().index;
+        if (index >= m_sharedStores.size()) {
+            m_sharedStores.resize(index + 1);
         }
+
+        m_activeSharedStores.reserve(m_activeSharedStores.size() + 1);
+        m_sharedStores[index] = std::move(pStore);
+        m_activeSharedStores.push_back(pNewStore);
+
+        return *pNewStore;
     }
 
-    void purge()
+    /**
+     *  Move or copy entities to another EntityManager.
+     */
+    size_t transferEntities(const EntityId *entityIds, size_t count, EntityManager &dest,
+        EntityId *newIds, bool move)
     {
-        for (auto entityId: m_entitiesMarkedForRemoval) {
-            destroyEntity(entityId);
+        GAMEUTILS_PROFILE_ZONE("EntityManager::transferEntities");
+        GAMEUTILS_ENTITY_CHECK_WRITE(m_raceDetector);
+        GAMEUTILS_ENTITY_CHECK_WRITE(dest.m_raceDetector);
+
+        std::fill(newIds, newIds + count, InvalidEntity);
+        if (&dest == this) {
+            return 0;
         }
-    }
 
-private:
-    typedef std::unordered_map<std::type_index, std::shared_ptr<Component>> ComponentNodes;
+        dest.m_entities.reserve(dest.m_entities.size() + count);
+
+        // New IDs are allocated in sequence, so the last insertion into each
+        // of the destination's EntityNodes maps makes a good hint for the next
+        typedef std::pair<std::shared_ptr<EntityNodes>, EntityNodes::iterator> Hint;
+        std::unordered_map<std::type_index, Hint> hints;
+
+        size_t transferred = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto enIter = m_entities.find(entityIds[i]);
+            if (enIter == m_entities.end()) {
+                continue;
+            }
+
+            // A move is a structural change that cannot be deferred, so only
+            // the entity being visited by an iteration may be moved
+            if (move && mustDefer(entityIds[i])) {
+                continue;
+            }
+
+            ComponentNodes &srcNodes = enIter->second;
+            if (move ? !canMoveComponents(entityIds[i]) : !canCopyComponents(entityIds[i], srcNodes)) {
+                continue;
+            }
+
+            const EntityId newId = dest.createEntity();
+            if (newId == InvalidEntity) {
+                break;
+            }
+
+            if (move) {
+                record(EntityRecorder::Destroy, entityIds[i]);
+            }
+
+            ComponentNodes &destNodes = dest.m_entities.find(newId)->second;
+            const size_t bucketCount = destNodes.bucket_count();
+            destNodes.reserve(srcNodes.size());
+
+            for (auto &cmNode: srcNodes) {
+                const std::type_index &cmType = cmNode.first;
+                auto infoIter = m_componentTypeInfos.find(cmType);
+                if (infoIter != m_componentTypeInfos.end()) {
+                    dest.m_componentTypeInfos.insert(*infoIter);
+                }
+
+                std::shared_ptr<Component> pComponent = move ?
+                    cmNode.second : infoIter->second->copy(*cmNode.second);
+
+                destNodes.insert(ComponentNodes::value_type(cmType, pComponent));
+
+                // Add to the destination's entity nodes for this type
+                auto hintIter = hints.find(cmType);
+                if (hintIter == hints.end()) {
+                    auto cmIter = dest.m_componentTypes.find(cmType);
+                    if (cmIter == dest.m_componentTypes.end()) {
+                        cmIter = dest.m_componentTypes.insert(
+                            ComponentTypes::value_type(cmType, std::make_shared<EntityNodes>())).first;
+                    }
+                    hintIter = hints.insert(std::make_pair(cmType,
+                        Hint(cmIter->second, cmIter->second->end()))).first;
+                }
+
+                Hint &hint = hintIter->second;
+                hint.second = hint.first->insert(hint.second, EntityNodes::value_type(newId, pComponent));
+                dest.indexInsert(cmType, newId, *pComponent);
+
+                // Remove from the source's entity nodes for this type
+                if (move) {
+                    auto cmIter = m_componentTypes.find(cmType);
+                    if (cmIter == m_componentTypes.end()) {
+                        throw std::runtime_error("Could not find expected component type in EM.");
+                    }
+
+                    if (cmIter->second->erase(entityIds[i]) != 1) {
+                        throw std::runtime_error("Could not find expected entity node in EM.");
+                    }
+
+                    indexErase(cmType, entityIds[i]);
+                }
+            }
+
+            dest.m_componentNodeCount += destNodes.size();
+            dest.m_componentNodeBuckets += destNodes.bucket_count() - bucketCount;
+
+            // Pooled components are relocated or copy-constructed directly
+            // into the destination's pools
+            for (ComponentPool *pPool: m_activePools) {
+                const size_t index = pPool->indexOf(entityIds[i]);
+                if (index == ComponentPool::npos) {
+                    continue;
+                }
+
+                const ComponentTypeInfo &info = pPool->typeInfo();
+                ComponentPool &destPool = dest.getPool(info);
+                void *pSlot = destPool.prepareInsert(newId);
+                if (move) {
+                    pPool->extract(entityIds[i], pSlot);
+                } else {
+                    info.copyConstruct(pSlot, pPool->at(index));
+                }
+                destPool.commitInsert(newId);
+            }
+
+            for (ComponentStoreBase *pStore: m_activeStores) {
+                void *pComponent = pStore->find(entityIds[i]);
+                if (!pComponent) {
+                    continue;
+                }
+
+                ComponentStoreBase *pDestStore = dest.findStore(pStore->typeInfo());
+                if (!pDestStore) {
+                    pDestStore = &dest.addStore(pStore->createEmpty());
+                }
+
+                if (move) {
+                    pDestStore->insertMove(newId, pComponent);
+                    pStore->erase(entityIds[i]);
+                } else {
+                    pDestStore->insertCopy(newId, pComponent);
+                }
+            }
+
+            // Shared values are interned again in the destination
+            for (SharedComponentStoreBase *pStore: m_activeSharedStores) {
+                if (!pStore->contains(entityIds[i])) {
+                    continue;
+                }
+
+                SharedComponentStoreBase *pDestStore = dest.findSharedStore(pStore->typeInfo());
+                if (!pDestStore) {
+                    pDestStore = &dest.addSharedStore(pStore->createEmpty());
+                }
+
+                pStore->copyTo(entityIds[i], *pDestStore, newId);
+                if (move) {
+                    pStore->remove(entityIds[i]);
+                }
+            }
+
+            copyEnabledState(entityIds[i], dest, newId);
+            dest.recordComponents(newId);
+
+            const uint64_t lifetime = m_lifetimes.remaining(entityIds[i]);
+            if (lifetime > 0) {
+                dest.m_lifetimes.schedule(newId, lifetime);
+            }
+
+            const uint32_t interval = m_updateBuckets.interval(entityIds[i]);
+            if (interval > 0) {
+                dest.m_updateBuckets.assign(newId, interval);
+            }
+
+            // Relationships refer to entities in this manager, so they are
+            // not transferred
+            if (move) {
+                removeAllRelations(entityIds[i]);
+                enableEntity(entityIds[i]);
+                m_lifetimes.cancel(entityIds[i]);
+                m_updateBuckets.remove(entityIds[i]);
+                m_componentNodeCount -= srcNodes.size();
+                m_componentNodeBuckets -= allocatedBuckets(srcNodes);
+                m_entities.erase(enIter);
+            }
+
+            newIds[i] = newId;
+            transferred++;
+        }
+
+        // Entities that have been moved away must not be purged later, since
+        // their IDs may be reused in the meantime
+        if (move && transferred > 0 && !m_entitiesMarkedForRemoval.empty()) {
+            std::unordered_set<EntityId> moved;
+            for (size_t i = 0; i < count; ++i) {
+                if (newIds[i] != InvalidEntity) {
+                    moved.insert(entityIds[i]);
+                }
+            }
+
+            m_entitiesMarkedForRemoval.erase(
+                std::remove_if(m_entitiesMarkedForRemoval.begin(), m_entitiesMarkedForRemoval.end(),
+                    [&moved](EntityId id) { return moved.count(id) > 0; }),
+                m_entitiesMarkedForRemoval.end());
+        }
+
+        return transferred;
+    }
 
-    typedef std::unordered_map<EntityId, ComponentNodes> Entities;
     Entities m_entities;
 
     typedef std::vector<EntityId> EntitiesMarkedForRemoval;
@@ -388,7 +8219,247 @@ private:
     typedef std::unordered_map<std::type_index, std::shared_ptr<EntityNodes>> ComponentTypes;
     ComponentTypes m_componentTypes;
 
-    EntityId m_nextEntityId;
+    typedef std::unordered_map<std::type_index, const ComponentTypeInfo *> ComponentTypeInfos;
+    ComponentTypeInfos m_componentTypeInfos;
+
+    // Secondary indexes over components, by component type
+    typedef std::unordered_map<std::type_index, TypeIndexes> ComponentIndexes;
+    ComponentIndexes m_indexes;
+
+    // Checksums, which are also held in m_indexes, in the order they were added
+    std::vector<const ComponentChecksum *> m_checksums;
+
+    // Dense component pools, indexed by ComponentTypeInfo::index. Most
+    // entries are null, so the pools that exist are also listed separately.
+    typedef std::vector<std::unique_ptr<ComponentPool>> ComponentPools;
+    ComponentPools m_pools;
+    std::vector<ComponentPool *> m_activePools;
+
+    // Pools that have been aligned by forEachChunk, and their versions at
+    // the time, so that they are only reordered again after a change
+    struct ChunkGroup
+    {
+        std::vector<ComponentPool *> pools;
+        std::vector<uint64_t> versions;
+        size_t count;
+    };
+
+    std::vector<ChunkGroup> m_chunkGroups;
+
+    // Stores for component types that do not use PooledStorage, indexed in
+    // the same way as the pools
+    typedef std::vector<std::unique_ptr<ComponentStoreBase>> ComponentStores;
+    ComponentStores m_stores;
+    std::vector<ComponentStoreBase *> m_activeStores;
+
+    // Shared component stores, indexed in the same way as the pools
+    typedef std::vector<std::unique_ptr<SharedComponentStoreBase>> SharedComponentStores;
+    SharedComponentStores m_sharedStores;
+    std::vector<SharedComponentStoreBase *> m_activeSharedStores;
+
+    // World resources, indexed by resourceIndex()
+    typedef std::vector<ResourceSlot> Resources;
+    Resources m_resources;
+
+    // Event buffers, indexed by eventIndex()
+    typedef std::vector<std::unique_ptr<EventChannelBase>> EventChannels;
+    EventChannels m_events;
+
+    // Relationship pairs, indexed by relationIndex()
+    typedef std::vector<std::unique_ptr<RelationStore>> RelationStores;
+    RelationStores m_relations;
+
+    // Disabled entities, and disabled components indexed in the same way as
+    // the pools. See 'Enabling and Disabling'.
+    EntityBitset m_disabledEntities;
+    std::vector<std::unique_ptr<EntityBitset>> m_disabledComponents;
+
+    // Expiry times, and the entities that expired in the last call to
+    // advanceLifetimes. See 'Lifetimes'.
+    ExpiryWheel m_lifetimes;
+    std::vector<EntityId> m_expired;
+
+    // The entities being destroyed by destroyBatch
+    EntityBitset m_batch;
+
+    // Update buckets, and the entities being visited by forEachDue. See
+    // 'Update Intervals'.
+    struct DueEntity
+    {
+        EntityId entityId;
+        uint32_t interval;
+    };
+
+    UpdateBuckets m_updateBuckets;
+    std::vector<DueEntity> m_dueEntities;
+
+    // Storage reused by forEachRelated
+    std::vector<EntityId> m_relatedEntities;
+
+    // Changes deferred while iterating, see forEach, and the entities and
+    // components that they affect, so that each lookup is O(1)
+    std::vector<DeferredChange> m_deferred;
+    EntityBitset m_deferredDestroys;
+    std::unordered_set<uint64_t> m_deferredComponents;
+    int m_iterationDepth;
+    EntityId m_iteratingEntity;
+
+    // Running totals across all per-entity ComponentNodes maps, so that
+    // statistics can be collected without visiting every entity
+    size_t m_componentNodeCount;
+    size_t m_componentNodeBuckets;
+
+    // Next entity ID to be handed out, shared by createEntity() and reservations
+    std::atomic<EntityId> m_nextEntityId;
+
+    // Manager that IDs are reserved from instead, for staging managers
+    EntityManager *m_pIdSource;
+
+    // Receives structural changes, if set. See 'Recording'.
+    EntityRecorder *m_pRecorder;
+
+    mutable PhaseLock m_phaseLock;
+    RaceDetector m_raceDetector;
+};
+
+/**
+ * Records entity creation, component attachment and entity destruction, to be
+ * applied to an EntityManager later. See 'Concurrent Creation' above.
+ */
+class EntityCommandBuffer
+{
+public:
+    /**
+     *  Create a command buffer for 'em'. Entity IDs are reserved from 'em' in
+     *  blocks of 'blockSize', to limit contention between worker threads.
+     */
+    explicit EntityCommandBuffer(EntityManager &em, EntityId blockSize = 64)
+      : m_em(em)
+      , m_blockSize(blockSize > 0 ? blockSize : 1)
+      , m_blockNext(InvalidEntity)
+      , m_blockRemaining(0) { }
+
+    /**
+     *  Reserve an entity ID, and queue creation of the entity.
+     */
+    EntityId createEntity()
+    {
+        if (m_blockRemaining == 0) {
+            m_blockNext = m_em.reserveEntities(m_blockSize);
+            m_blockRemaining = m_blockSize;
+        }
+
+        const EntityId entityId = m_blockNext--;
+        m_blockRemaining--;
+
+        m_commands.push_back(Command(Create, entityId));
+        return entityId;
+    }
+
+    /**
+     *  Queue a component to be attached to an entity.
+     */
+    template<typename T>
+    void attachComponent(EntityId entityId, std::shared_ptr<T> pComponent)
+    {
+        Command command(Attach, entityId);
+        command.pComponent = pComponent;
+        command.attach = &attachAs<T>;
+        m_commands.push_back(command);
+    }
+
+    /**
+     *  Queue an entity to be destroyed.
+     */
+    void destroyEntity(EntityId entityId)
+    {
+        m_commands.push_back(Command(Destroy, entityId));
+    }
+
+    bool empty() const
+    {
+        return m_commands.empty();
+    }
+
+    /**
+     *  Apply all queued commands, in order, to the EntityManager. Must be
+     *  called on the thread that owns the EntityManager, while no other
+     *  thread is using this buffer.
+     *
+     *  Returns the number of commands that succeeded.
+     */
+    size_t commit()
+    {
+        GAMEUTILS_PROFILE_ZONE("EntityCommandBuffer::commit");
+
+        // IDs that could not be committed (only possible if the ID space has
+        // wrapped around) must not have components attached to them
+        std::unordered_set<EntityId> failed;
+
+        size_t succeeded = 0;
+        for (auto &command: m_commands) {
+            bool ok = false;
+            switch (command.type) {
+            case Create:
+                ok = m_em.commitEntity(command.entityId);
+                if (!ok) {
+                    failed.insert(command.entityId);
+                }
+                break;
+            case Attach:
+                ok = failed.count(command.entityId) == 0 &&
+                    command.attach(m_em, command.entityId, command.pComponent);
+                break;
+            case Destroy:
+                ok = m_em.destroyEntity(command.entityId);
+                break;
+            }
+
+            if (ok) {
+                succeeded++;
+            }
+        }
+
+        m_commands.clear();
+        return succeeded;
+    }
+
+private:
+    typedef bool (*AttachFn)(EntityManager &, EntityId, const std::shared_ptr<Component> &);
+
+    // Attach a component using its static type, so that its
+    // ComponentTypeInfo is recorded by the EntityManager
+    template<typename T>
+    static bool attachAs(EntityManager &em, EntityId entityId, const std::shared_ptr<Component> &pComponent)
+    {
+        return em.attachComponent(entityId, std::static_pointer_cast<T>(pComponent));
+    }
+
+    enum CommandType
+    {
+        Create,
+        Attach,
+        Destroy
+    };
+
+    struct Command
+    {
+        Command(CommandType type, EntityId entityId)
+          : type(type)
+          , entityId(entityId)
+          , attach(nullptr) { }
+
+        CommandType type;
+        EntityId entityId;
+        std::shared_ptr<Component> pComponent;
+        AttachFn attach;
+    };
+
+    EntityManager &m_em;
+    const EntityId m_blockSize;
+    EntityId m_blockNext;
+    EntityId m_blockRemaining;
+    std::vector<Command> m_commands;
 };
 
 template<typename T>
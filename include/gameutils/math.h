@@ -49,9 +49,7 @@ struct Vec2
       : x(0)
       , y(0) { }
 
-    Vec2(const Vec2 &r)
-      : x(r.x)
-      , y(r.y) { }
+    Vec2(const Vec2 &r) = default;
 
     Vec2(T x, T y)
       : x(x)
@@ -207,10 +205,7 @@ struct Vec3
       , y(v2.y)
       , z(z) { }
 
-    Vec3(const Vec3& r)
-      : x(r.x)
-      , y(r.y)
-      , z(r.z) { }
+    Vec3(const Vec3& r) = default;
 
     Vec3(T x, T y, T z)
       : x(x)
@@ -369,6 +364,15 @@ inline T dot(const Vec3<T> &l, const Vec3<T> &r)
     return l.dot(r);
 }
 
+/**
+ * Linear interpolation from 'a' (t = 0) to 'b' (t = 1).
+ */
+template<typename T>
+inline Vec3<T> lerp(const Vec3<T> &a, const Vec3<T> &b, T t)
+{
+    return Vec3<T>(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
 
 //----------------------------------------------------------------------------
 //
@@ -397,11 +401,7 @@ struct Vec4
       , z(v3.z)
       , w(w) { }
 
-    Vec4(const Vec4& r)
-      : x(r.x)
-      , y(r.y)
-      , z(r.z)
-      , w(r.w) { }
+    Vec4(const Vec4& r) = default;
 
     Vec4(T x, T y, T z, T w)
       : x(x)
@@ -572,10 +572,7 @@ struct Mat3
       , m01(0), m11(0), m21(0)  // Column 1
       , m02(0), m12(0), m22(0)  { }
 
-    Mat3(const Mat3& r)
-      : m00(r.m00), m10(r.m10), m20(r.m20)
-      , m01(r.m01), m11(r.m11), m21(r.m21)
-      , m02(r.m02), m12(r.m12), m22(r.m22) { }
+    Mat3(const Mat3& r) = default;
 
     //
     // Constructor, column-major ordering
@@ -789,11 +786,7 @@ struct Mat4
     , m02(col2.x), m12(col2.y), m22(col2.z), m32(col2.w)
     , m03(col3.x), m13(col3.y), m23(col3.z), m33(col3.w) { }
 
-    Mat4(const Mat4& r)
-    : m00(r.m00), m10(r.m10), m20(r.m20), m30(r.m30)
-    , m01(r.m01), m11(r.m11), m21(r.m21), m31(r.m31)
-    , m02(r.m02), m12(r.m12), m22(r.m22), m32(r.m32)
-    , m03(r.m03), m13(r.m13), m23(r.m23), m33(r.m33) { }
+    Mat4(const Mat4& r) = default;
 
     explicit Mat4(const Mat3<T> &r)
     : m00(r.m00), m10(r.m10), m20(r.m20), m30(0)
@@ -1031,11 +1024,7 @@ struct Quat
       , y(0)
       , z(0) { }
 
-    Quat(const Quat &r)
-      : scalar(r.scalar)
-      , x(r.x)
-      , y(r.y)
-      , z(r.z) { }
+    Quat(const Quat &r) = default;
 
     Quat(T scalar, Vec3<T> q)
       : scalar(scalar)
@@ -1168,6 +1157,25 @@ struct Quat
     };
 };
 
+/**
+ * Normalised linear interpolation from 'a' (t = 0) to 'b' (t = 1), along the
+ * shorter arc. Cheaper than slerp, and close to it for nearby rotations, but
+ * the angular velocity is not constant.
+ */
+template<typename T>
+inline Quat<T> nlerp(const Quat<T> &a, const Quat<T> &b, T t)
+{
+    const T dot = a.scalar * b.scalar + a.x * b.x + a.y * b.y + a.z * b.z;
+    const T s = dot < 0 ? -t : t;
+    const T r = 1 - t;
+
+    return Quat<T>(
+        r * a.scalar + s * b.scalar,
+        r * a.x + s * b.x,
+        r * a.y + s * b.y,
+        r * a.z + s * b.z).normalised();
+}
+
 } // end namespace gameutils
 
 //----------------------------------------------------------------------------
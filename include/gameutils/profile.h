@@ -0,0 +1,236 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define GAMEUTILS_PROFILE_HAS_RDTSC 1
+#endif
+
+/**
+ * This header contains a lightweight, zone-based profiler.
+ *
+ * Zones
+ * -----
+ * A zone measures the time between its construction and destruction. Zones
+ * are usually created using the GAMEUTILS_PROFILE_ZONE macro:
+ *
+ *     void PhysicsSystem::update(float dt)
+ *     {
+ *         GAMEUTILS_PROFILE_ZONE("PhysicsSystem::update");
+ *         ...
+ *     }
+ *
+ * Zone names must have static storage duration (e.g. string literals), since
+ * only the pointer is recorded.
+ *
+ * The macro expands to nothing unless GAMEUTILS_PROFILE is defined, so
+ * disabled builds carry no overhead at all. GAMEUTILS_PROFILE must be defined
+ * consistently across a program, since it changes the definition of inline
+ * functions such as those in entity.h. With the SCons build script, this can
+ * be done by building with 'profile=1'.
+ *
+ *
+ * Buffers
+ * -------
+ * Each thread records completed zones into its own ring buffer of fixed-size
+ * records, so recording a zone never takes a lock or allocates memory (other
+ * than once per thread, when its buffer is first created). When a buffer is
+ * full, the oldest records are overwritten.
+ *
+ * When a thread exits, its buffer is kept, so that its records can still be
+ * exported, until another thread needs a buffer. The buffer is then reused,
+ * and its old records are discarded. The number of buffers is therefore
+ * bounded by the largest number of threads that record zones at once.
+ *
+ * Timestamps are read using rdtsc where it is available, and steady_clock
+ * otherwise. Defining GAMEUTILS_PROFILE_STEADY_CLOCK forces the use of
+ * steady_clock.
+ *
+ *
+ * Export
+ * ------
+ * The contents of all thread buffers can be written in the Chrome trace_event
+ * JSON format, which can be loaded into chrome://tracing or Perfetto:
+ *
+ *     std::ofstream out("trace.json");
+ *     gameutils::profile::writeChromeTrace(out);
+ *
+ * Exporting while other threads are recording is safe. Each record carries a
+ * sequence number, and records that are overwritten while they are being
+ * exported are skipped, so the output never contains torn records. To
+ * export every zone, export at a point where worker threads are idle (e.g.
+ * between frames).
+ *
+ */
+
+#define GAMEUTILS_PROFILE_CONCAT_INNER(a, b) a ## b
+#define GAMEUTILS_PROFILE_CONCAT(a, b) GAMEUTILS_PROFILE_CONCAT_INNER(a, b)
+
+#if defined(GAMEUTILS_PROFILE)
+#define GAMEUTILS_PROFILE_ZONE(name) \
+    ::gameutils::profile::Zone GAMEUTILS_PROFILE_CONCAT(gameutilsProfileZone, __LINE__)(name)
+#define GAMEUTILS_PROFILE_THREAD_NAME(name) \
+    ::gameutils::profile::setThreadName(name)
+#else
+#define GAMEUTILS_PROFILE_ZONE(name)
+#define GAMEUTILS_PROFILE_THREAD_NAME(name)
+#endif
+
+#ifndef GAMEUTILS_PROFILE_BUFFER_SIZE
+#define GAMEUTILS_PROFILE_BUFFER_SIZE 16384
+#endif
+
+namespace gameutils {
+namespace profile {
+
+/**
+ * A single completed zone. The fields are atomic so that exporters can read
+ * them while the owning thread overwrites them. 'sequence' is the index of
+ * the zone in its buffer, or Writing while the record is being written.
+ */
+struct ZoneRecord
+{
+    static const uint64_t Writing = ~static_cast<uint64_t>(0);
+
+    std::atomic<uint64_t> sequence;
+    std::atomic<const char *> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> end;
+};
+
+/**
+ * Ring buffer of zone records, owned by a single thread.
+ */
+struct ThreadBuffer
+{
+    static const size_t capacity = GAMEUTILS_PROFILE_BUFFER_SIZE;
+
+    static_assert((capacity & (capacity - 1)) == 0,
+        "GAMEUTILS_PROFILE_BUFFER_SIZE must be a power of two");
+
+    explicit ThreadBuffer(uint32_t threadId)
+      : threadId(threadId)
+      , threadName(nullptr)
+      , head(0)
+      , tail(0)
+    {
+        for (ZoneRecord &record: records) {
+            record.sequence.store(ZoneRecord::Writing, std::memory_order_relaxed);
+        }
+    }
+
+    void push(const char *name, uint64_t start, uint64_t end)
+    {
+        // Only the owning thread writes to 'head', so a relaxed load is
+        // sufficient. The record is marked as being written before its fields
+        // change (a seqlock), and the release stores publish it to exporters.
+        const uint64_t index = head.load(std::memory_order_relaxed);
+        ZoneRecord &record = records[index & (capacity - 1)];
+        record.sequence.store(ZoneRecord::Writing, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        record.name.store(name, std::memory_order_relaxed);
+        record.start.store(start, std::memory_order_relaxed);
+        record.end.store(end, std::memory_order_relaxed);
+        record.sequence.store(index, std::memory_order_release);
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    uint32_t threadId;      // Changed only when the buffer is reused
+    std::atomic<const char *> threadName;
+    std::atomic<uint64_t> head;     // Written only by the owning thread
+    std::atomic<uint64_t> tail;     // Records before 'tail' have been cleared
+    ZoneRecord records[capacity];
+};
+
+/**
+ * Read the current timestamp, in ticks.
+ */
+inline uint64_t timestamp()
+{
+#if defined(GAMEUTILS_PROFILE_HAS_RDTSC) && !defined(GAMEUTILS_PROFILE_STEADY_CLOCK)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/**
+ * The calling thread's buffer, or null if it has not registered one.
+ */
+inline ThreadBuffer*& threadBufferSlot()
+{
+    static thread_local ThreadBuffer *pBuffer = nullptr;
+    return pBuffer;
+}
+
+/**
+ * Create or reuse a buffer for the calling thread, and store it in
+ * threadBufferSlot(). This is called automatically the first time a thread
+ * records a zone. The buffer is released for reuse when the thread exits.
+ */
+ThreadBuffer* registerThread();
+
+/**
+ * Return the buffer for the calling thread.
+ */
+inline ThreadBuffer& threadBuffer()
+{
+    ThreadBuffer *pBuffer = threadBufferSlot();
+    return pBuffer ? *pBuffer : *registerThread();
+}
+
+/**
+ * Set the name shown for the calling thread in exported traces. The name must
+ * have static storage duration.
+ */
+inline void setThreadName(const char *name)
+{
+    threadBuffer().threadName.store(name, std::memory_order_relaxed);
+}
+
+/**
+ * Discard all records. Thread buffers remain registered.
+ */
+void clear();
+
+/**
+ * Number of ticks per microsecond, as used to convert timestamps on export.
+ */
+double ticksPerMicrosecond();
+
+/**
+ * Write all recorded zones, for all threads, as Chrome trace_event JSON.
+ */
+void writeChromeTrace(std::ostream &out);
+
+/**
+ * Scoped zone. Records a ZoneRecord for the calling thread when destroyed.
+ */
+class Zone
+{
+public:
+    explicit Zone(const char *name)
+      : m_name(name)
+      , m_start(timestamp()) { }
+
+    ~Zone()
+    {
+        threadBuffer().push(m_name, m_start, timestamp());
+    }
+
+private:
+    Zone(const Zone &);
+    Zone& operator=(const Zone &);
+
+    const char * const m_name;
+    const uint64_t m_start;
+};
+
+}   // end namespace profile
+}   // end namespace gameutils
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+#include "gameutils/entity.h"
+
+/**
+ * This header contains a recorder for the structural changes made to an
+ * EntityManager, and a player that replays them as a benchmark.
+ *
+ *
+ * Formats
+ * -------
+ * Components are not stored in the log, only the changes that add and remove
+ * them. Each component type that is recorded must be registered with a
+ * ReplayFormat, using an ID that stays the same between builds:
+ *
+ *     ReplayFormat format;
+ *     format.registerComponent<Transform>(1);
+ *     format.registerComponent<Renderable>(2);
+ *
+ * Types must be default constructible, since the player constructs a
+ * default value for each component that is attached or added. Changes to
+ * types that have not been registered are skipped, both when recording and
+ * when loading a log.
+ *
+ *
+ * Recording
+ * ---------
+ * A CommandRecorder receives the changes made to a world (see 'Recording' in
+ * entity.h), from construction until it is stopped or destroyed:
+ *
+ *     CommandRecorder recorder(world, format);
+ *     ... run the session ...
+ *     recorder.stop();
+ *     recorder.save("session.replay");
+ *
+ * Each change is encoded as an operation byte, followed by the entity and
+ * component type where needed, as variable-length integers. Entities are
+ * numbered in the order in which they are first seen, so the numbers are
+ * small, and do not depend on the IDs handed out by the world. An entity
+ * that already existed when recording started is created in the log when it
+ * is first changed.
+ *
+ *
+ * Replay
+ * ------
+ * A CommandPlayer decodes a log once, then replays it against a world as
+ * fast as possible:
+ *
+ *     CommandPlayer player(format);
+ *     player.load("session.replay");
+ *
+ *     EntityManager world;
+ *     ReplayResult result = player.replay(world);
+ *     printf("%.0f commands/s\n", result.commandsPerSecond());
+ *
+ * Replay is usually run against an empty world. Since only structural
+ * changes are recorded, a log is a benchmark of the storage of the world,
+ * rather than of the systems that ran during the session.
+ *
+ */
+
+namespace gameutils {
+
+namespace detail {
+
+template<typename T>
+bool attachReplayed(EntityManager &em, EntityId entityId, std::true_type)
+{
+    return em.attachComponent(entityId, std::make_shared<T>());
+}
+
+template<typename T>
+bool attachReplayed(EntityManager &, EntityId, std::false_type)
+{
+    return false;
+}
+
+template<typename T>
+bool detachReplayed(EntityManager &em, EntityId entityId, std::true_type)
+{
+    return em.detachComponent<T>(entityId);
+}
+
+template<typename T>
+bool detachReplayed(EntityManager &, EntityId, std::false_type)
+{
+    return false;
+}
+
+}   // end namespace detail
+
+/**
+ * The component types that can be recorded and replayed. See 'Formats'
+ * above.
+ */
+class ReplayFormat
+{
+public:
+    typedef bool (*ApplyFn)(EntityManager &em, EntityId entityId);
+
+    struct Entry
+    {
+        uint32_t id;
+        std::type_index type;
+        ApplyFn attach;     // Always fails for types not derived from Component
+        ApplyFn detach;
+        ApplyFn add;
+        ApplyFn remove;
+    };
+
+    /**
+     *  Register a component type, using an ID that identifies the type in
+     *  logs. Throws if the ID or type has already been registered.
+     */
+    template<typename T>
+    void registerComponent(uint32_t id)
+    {
+        static_assert(std::is_default_constructible<T>::value,
+            "Replayed components must be default constructible");
+
+        typedef typename std::is_base_of<Component, T>::type IsAttachable;
+        Entry entry = {
+            id,
+            typeid(T),
+            [](EntityManager &em, EntityId entityId) {
+                return detail::attachReplayed<T>(em, entityId, IsAttachable());
+            },
+            [](EntityManager &em, EntityId entityId) {
+                return detail::detachReplayed<T>(em, entityId, IsAttachable());
+            },
+            [](EntityManager &em, EntityId entityId) {
+                return em.addComponent<T>(entityId) != nullptr;
+            },
+            [](EntityManager &em, EntityId entityId) {
+                return em.removeComponent<T>(entityId);
+            }
+        };
+
+        registerEntry(entry);
+    }
+
+    const Entry* findEntry(uint32_t id) const;
+    const Entry* findEntry(const std::type_index &type) const;
+
+private:
+    void registerEntry(const Entry &entry);
+
+    std::vector<Entry> m_entries;
+    std::unordered_map<std::type_index, size_t> m_byType;
+};
+
+/**
+ * Records the changes made to a world into a compact binary log. See
+ * 'Recording' above.
+ */
+class CommandRecorder: public EntityRecorder
+{
+public:
+    /**
+     *  Start recording the changes made to 'world'. The world must not have
+     *  another recorder.
+     */
+    CommandRecorder(EntityManager &world, const ReplayFormat &format);
+    ~CommandRecorder();
+
+    /**
+     *  Stop recording. The log is kept.
+     */
+    void stop();
+
+    /**
+     *  The encoded log, including its header.
+     */
+    const std::vector<uint8_t>& data() const
+    {
+        return m_data;
+    }
+
+    /**
+     *  Number of changes recorded.
+     */
+    size_t commandCount() const
+    {
+        return m_commandCount;
+    }
+
+    /**
+     *  Number of changes to component types that were not registered.
+     */
+    size_t skippedCount() const
+    {
+        return m_skippedCount;
+    }
+
+    /**
+     *  Write the log to a file. Returns false if it could not be written.
+     */
+    bool save(const std::string &path) const;
+
+    void record(Operation operation, EntityId entityId, const std::type_index *pType) override;
+
+private:
+    CommandRecorder(const CommandRecorder &);
+    CommandRecorder& operator=(const CommandRecorder &);
+
+    /**
+     *  Returns the number of an entity in the log, creating it in the log if
+     *  it has not been seen before.
+     */
+    uint32_t entityNumber(EntityId entityId);
+
+    void writeOperation(Operation operation);
+    void writeVarint(uint32_t value);
+
+    EntityManager *m_pWorld;
+    const ReplayFormat &m_format;
+
+    std::vector<uint8_t> m_data;
+    std::unordered_map<EntityId, uint32_t> m_numbers;
+    uint32_t m_nextNumber;
+    size_t m_commandCount;
+    size_t m_skippedCount;
+};
+
+/**
+ * Throughput of a replay.
+ */
+struct ReplayResult
+{
+    ReplayResult()
+      : commands(0)
+      , failed(0)
+      , seconds(0) { }
+
+    size_t commands;    // Commands replayed
+    size_t failed;      // Commands that had no effect on the world
+    double seconds;
+
+    double commandsPerSecond() const
+    {
+        return seconds > 0 ? static_cast<double>(commands) / seconds : 0;
+    }
+};
+
+/**
+ * Replays a log written by a CommandRecorder. See 'Replay' above.
+ */
+class CommandPlayer
+{
+public:
+    explicit CommandPlayer(const ReplayFormat &format)
+      : m_format(format)
+      , m_entityCount(0)
+      , m_skippedCount(0) { }
+
+    /**
+     *  Decode a log, replacing any that was loaded before. Returns false if
+     *  the log could not be read, or is malformed, in which case the player
+     *  is left empty.
+     */
+    bool load(const std::string &path);
+    bool load(const uint8_t *pData, size_t size);
+
+    bool load(const std::vector<uint8_t> &data)
+    {
+        return load(data.data(), data.size());
+    }
+
+    /**
+     *  Number of commands that will be replayed.
+     */
+    size_t size() const
+    {
+        return m_commands.size();
+    }
+
+    /**
+     *  Number of commands in the log for component types that are not
+     *  registered with the format.
+     */
+    size_t skippedCount() const
+    {
+        return m_skippedCount;
+    }
+
+    /**
+     *  Apply the commands to 'world', in order, and measure how long they
+     *  take.
+     */
+    ReplayResult replay(EntityManager &world) const;
+
+private:
+    struct Command
+    {
+        EntityRecorder::Operation operation;
+        uint32_t entity;
+        const ReplayFormat::Entry *pEntry;
+    };
+
+    void clear();
+
+    const ReplayFormat &m_format;
+    std::vector<Command> m_commands;
+    uint32_t m_entityCount;
+    size_t m_skippedCount;
+};
+
+}   // end namespace gameutils
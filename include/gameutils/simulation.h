@@ -0,0 +1,361 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "gameutils/entity.h"
+#include "gameutils/math.h"
+
+/**
+ * This header contains a runner that advances an EntityManager at a fixed
+ * timestep, and keeps snapshots of selected components so that rendering can
+ * interpolate between simulation steps.
+ *
+ *
+ * Fixed Timestep
+ * --------------
+ * Systems are added to a SimulationRunner in the order that they should run,
+ * and each one is called once per step, with the length of the step:
+ *
+ *     SimulationConfig config;
+ *     config.timestep = 1.0 / 60.0;
+ *     config.maxStepsPerFrame = 5;
+ *
+ *     SimulationRunner runner(world, config);
+ *     runner.addSystem([](EntityManager &em, double dt) { integrate(em, dt); },
+ *         "integrate");
+ *
+ *     // Once per rendered frame
+ *     runner.advance(frameSeconds);
+ *
+ * advance() adds the frame time to an accumulator, and runs as many whole
+ * steps as it holds. If more than maxStepsPerFrame steps are due (e.g. after
+ * a hitch), only that many are run and the rest of the time is dropped, so
+ * that a slow frame does not cause ever more steps to be run. The time left
+ * in the accumulator is less than one step, and alpha() returns it as a
+ * fraction of a step.
+ *
+ * Each system runs in its own profiler zone (see profile.h), named by the
+ * optional second argument to addSystem. Like other zone names, it must have
+ * static storage duration.
+ *
+ *
+ * Interpolation
+ * -------------
+ * The simulation state is usually between two steps at the time of a frame,
+ * so rendering the latest state directly causes visible judder. Fields of
+ * pooled components (see 'Component Pools' in entity.h) can be opted in to
+ * interpolation:
+ *
+ *     const Vec3Snapshot &positions = runner.interpolateVec3(&Transform::position);
+ *     const QuatSnapshot &rotations = runner.interpolateQuat(&Transform::rotation);
+ *
+ *     // On the render thread
+ *     positions.interpolate(runner.alpha(), renderPositions);
+ *     rotations.interpolate(runner.alpha(), renderRotations);
+ *
+ * Each snapshot keeps the values of the field after the previous and the
+ * current step, for every entity that has the component, in structure of
+ * arrays form. Before the values of a step are captured, the previous and
+ * current buffers are swapped, rather than copied. Only the last two steps
+ * of each call to advance() are captured.
+ *
+ * interpolate() writes one value for each of entities(), in the same order.
+ * Positions are interpolated using lerp, and rotations using nlerp (see
+ * math.h). Entities that did not exist at the previous step use their
+ * current value. When the entities are unchanged between the two steps,
+ * which is the usual case, the arrays are read in a single pass without any
+ * lookups. Otherwise, the previous value of each entity is found using an
+ * index that is built when the current step is captured.
+ *
+ * A snapshot may be read on another thread, as long as that does not overlap
+ * with a call to advance().
+ *
+ */
+
+namespace gameutils {
+
+struct SimulationConfig
+{
+    SimulationConfig()
+      : timestep(1.0 / 60.0)
+      , maxStepsPerFrame(5) { }
+
+    double timestep;            // Length of each step, in seconds
+    size_t maxStepsPerFrame;    // Steps beyond this in one call to advance() are dropped
+};
+
+/**
+ * The values of a field of a pooled component, after the previous and the
+ * current step. See 'Interpolation' above.
+ */
+class Snapshot
+{
+public:
+    static const uint32_t NoPrevious = 0xffffffff;
+
+    virtual ~Snapshot() { }
+
+    /**
+     *  Number of entities that had the component at the current step.
+     */
+    size_t size() const
+    {
+        return m_current.entities.size();
+    }
+
+    const EntityId* entities() const
+    {
+        return m_current.entities.data();
+    }
+
+    /**
+     *  True if the entities of the previous step are the same as those of the
+     *  current step, in the same order.
+     */
+    bool aligned() const
+    {
+        return m_aligned;
+    }
+
+    /**
+     *  Swap the previous and current buffers, then capture the current
+     *  values of the field from 'world'.
+     */
+    void capture(const EntityManager &world);
+
+protected:
+    explicit Snapshot(size_t lanes)
+      : m_lanes(lanes)
+      , m_aligned(false) { }
+
+    struct Buffer
+    {
+        std::vector<EntityId> entities;
+        std::vector<float> lanes[4];
+    };
+
+    /**
+     *  Write the field of each component in the pool to the lanes of
+     *  'buffer', in the same order as the pool.
+     */
+    virtual void read(const ComponentPool &pool, Buffer &buffer) const = 0;
+
+    virtual const ComponentTypeInfo& typeInfo() const = 0;
+
+    const size_t m_lanes;
+    Buffer m_previous;
+    Buffer m_current;
+
+    // Index in m_previous of each entity in m_current, or NoPrevious. Only
+    // used when the two are not aligned.
+    std::vector<uint32_t> m_previousIndexes;
+    std::unordered_map<EntityId, uint32_t> m_indexScratch;
+    bool m_aligned;
+};
+
+/**
+ * Snapshot of a Vec3<float> field, interpolated using lerp.
+ */
+class Vec3Snapshot: public Snapshot
+{
+public:
+    /**
+     *  Write the interpolated value for each of entities() to 'pOut'.
+     */
+    void interpolate(float alpha, Vec3<float> *pOut) const;
+
+    void interpolate(float alpha, std::vector<Vec3<float>> &out) const
+    {
+        out.resize(size());
+        interpolate(alpha, out.data());
+    }
+
+protected:
+    Vec3Snapshot()
+      : Snapshot(3) { }
+};
+
+/**
+ * Snapshot of a Quat<float> field, interpolated using nlerp.
+ */
+class QuatSnapshot: public Snapshot
+{
+public:
+    /**
+     *  Write the interpolated value for each of entities() to 'pOut'.
+     */
+    void interpolate(float alpha, Quat<float> *pOut) const;
+
+    void interpolate(float alpha, std::vector<Quat<float>> &out) const
+    {
+        out.resize(size());
+        interpolate(alpha, out.data());
+    }
+
+protected:
+    QuatSnapshot()
+      : Snapshot(4) { }
+};
+
+namespace detail {
+
+template<typename T, typename V, typename Base>
+class FieldSnapshot: public Base
+{
+public:
+    static_assert(ComponentStoragePolicy<T>::value == PooledStorage,
+        "Interpolated components must use PooledStorage");
+
+    explicit FieldSnapshot(V T::*pMember)
+      : m_pMember(pMember) { }
+
+protected:
+    typedef typename Base::Buffer Buffer;
+
+    void read(const ComponentPool &pool, Buffer &buffer) const override
+    {
+        const size_t count = pool.size();
+        const T *pComponents = pool.template data<T>();
+        for (size_t lane = 0; lane < this->m_lanes; ++lane) {
+            buffer.lanes[lane].resize(count);
+            float *pLane = buffer.lanes[lane].data();
+            for (size_t i = 0; i < count; ++i) {
+                pLane[i] = (pComponents[i].*m_pMember).d[lane];
+            }
+        }
+    }
+
+    const ComponentTypeInfo& typeInfo() const override
+    {
+        return componentTypeInfo<T>();
+    }
+
+private:
+    V T::*m_pMember;
+};
+
+}   // end namespace detail
+
+/**
+ * Runs systems on an EntityManager at a fixed timestep. See 'Fixed Timestep'
+ * above.
+ */
+class SimulationRunner
+{
+public:
+    typedef std::function<void(EntityManager &, double)> System;
+
+    SimulationRunner(EntityManager &world, const SimulationConfig &config = SimulationConfig());
+
+    /**
+     *  Add a system, which is run after those already added. 'name' is used
+     *  for the system's profiler zone, and must have static storage duration.
+     */
+    void addSystem(const System &system, const char *name = "SimulationRunner::system");
+
+    /**
+     *  Keep snapshots of a Vec3<float> field of pooled component <T>, from the
+     *  next step onwards. See 'Interpolation' above.
+     */
+    template<typename T>
+    const Vec3Snapshot& interpolateVec3(Vec3<float> T::*pMember)
+    {
+        return addSnapshot(new detail::FieldSnapshot<T, Vec3<float>, Vec3Snapshot>(pMember));
+    }
+
+    /**
+     *  Keep snapshots of a Quat<float> field of pooled component <T>.
+     */
+    template<typename T>
+    const QuatSnapshot& interpolateQuat(Quat<float> T::*pMember)
+    {
+        return addSnapshot(new detail::FieldSnapshot<T, Quat<float>, QuatSnapshot>(pMember));
+    }
+
+    /**
+     *  Add 'frameTime' seconds to the accumulator, and run the steps that are
+     *  due, up to SimulationConfig::maxStepsPerFrame. Returns the number of
+     *  steps run.
+     */
+    size_t advance(double frameTime);
+
+    /**
+     *  Run a single step, regardless of the accumulator.
+     */
+    void step();
+
+    /**
+     *  Fraction of a step that has accumulated since the last step, in the
+     *  range [0, 1). Used to interpolate snapshots.
+     */
+    float alpha() const
+    {
+        return static_cast<float>(m_accumulator / m_config.timestep);
+    }
+
+    /**
+     *  Number of steps that have been run.
+     */
+    uint64_t tick() const
+    {
+        return m_tick;
+    }
+
+    /**
+     *  Simulated time, in seconds.
+     */
+    double time() const
+    {
+        return static_cast<double>(m_tick) * m_config.timestep;
+    }
+
+    /**
+     *  Number of steps that were due, but dropped because of
+     *  maxStepsPerFrame.
+     */
+    uint64_t droppedSteps() const
+    {
+        return m_droppedSteps;
+    }
+
+    const SimulationConfig& config() const
+    {
+        return m_config;
+    }
+
+private:
+    SimulationRunner(const SimulationRunner &);
+    SimulationRunner& operator=(const SimulationRunner &);
+
+    template<typename S>
+    const S& addSnapshot(S *pNewSnapshot)
+    {
+        m_snapshots.push_back(std::unique_ptr<Snapshot>(pNewSnapshot));
+        return *pNewSnapshot;
+    }
+
+    void runSystems(bool capture);
+
+    struct NamedSystem
+    {
+        System system;
+        const char *name;
+    };
+
+    EntityManager &m_world;
+    const SimulationConfig m_config;
+
+    std::vector<NamedSystem> m_systems;
+    std::vector<std::unique_ptr<Snapshot>> m_snapshots;
+
+    double m_accumulator;
+    uint64_t m_tick;
+    uint64_t m_droppedSteps;
+};
+
+}   // end namespace gameutils
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gameutils/entity.h"
+#include "gameutils/math.h"
+
+/**
+ * This header contains a streaming layer for large worlds, which keeps only
+ * the entities near a set of focus points resident in an EntityManager.
+ *
+ *
+ * Cells
+ * -----
+ * The world is partitioned into a grid of square cells. The entities of each
+ * cell are stored in a binary cell file, which holds the pooled components
+ * (see 'Component Pools' in entity.h) of those entities. Each component type
+ * that is stored in cell files must be registered with a CellFormat, using
+ * an ID that stays the same between runs:
+ *
+ *     CellFormat format;
+ *     format.registerComponent<Position>(1);
+ *     format.registerComponent<Renderable>(2);
+ *
+ * Streamed components must be trivially copyable, since they are written and
+ * read as raw bytes, in the byte order of the machine. Cell files are usually
+ * written by tools, using writeCell:
+ *
+ *     format.writeCell("cells/0_0.cell", em, entities);
+ *
+ * Components that refer to other entities in the same cell can specialise
+ * EntityFields (see entity.h), so that references are preserved when the cell
+ * is loaded. References to entities in other cells are not supported, and are
+ * written as InvalidEntity.
+ *
+ *
+ * Streaming
+ * ---------
+ * A WorldStreamer loads and unloads cells as focus points (e.g. players) move
+ * around the world:
+ *
+ *     StreamingConfig config;
+ *     config.cellSize = 64.0f;
+ *     config.loadRadius = 256.0f;
+ *     config.unloadRadius = 320.0f;
+ *     config.cellPath = [](CellCoord cell) { return makeCellPath(cell); };
+ *
+ *     WorldStreamer streamer(world, format, config);
+ *
+ *     // Once per frame, at a frame boundary
+ *     streamer.setFocusPoints(playerPositions);
+ *     streamer.update();
+ *
+ * Cells within loadRadius of any focus point are read on a background I/O
+ * thread, nearest first, into a staging EntityManager that reserves its IDs
+ * from the world. Completed cells are merged into the world by update(), so
+ * the world is only modified on the thread that calls update(). Cells that
+ * are further than unloadRadius from every focus point are unloaded, by
+ * destroying their entities. A cell without a file is treated as empty.
+ *
+ * The components read from resident cells are limited to memoryBudget bytes.
+ * The size of each cell is read from the headers of its file before it is
+ * requested, and no new loads are started while the budget would be
+ * exceeded. Headers are also read on the I/O thread, ahead of any loads, so
+ * a cell is requested by the first update() after its headers have been
+ * read. If the budget is exceeded anyway (e.g. because a file has changed),
+ * cells are evicted according to the EvictionPolicy. Cells outside
+ * loadRadius are always evicted before those inside it.
+ *
+ */
+
+namespace gameutils {
+
+struct CellCoord
+{
+    CellCoord()
+      : x(0)
+      , y(0) { }
+
+    CellCoord(int32_t x, int32_t y)
+      : x(x)
+      , y(y) { }
+
+    bool operator==(const CellCoord &other) const
+    {
+        return x == other.x && y == other.y;
+    }
+
+    bool operator!=(const CellCoord &other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator<(const CellCoord &other) const
+    {
+        return x < other.x || (x == other.x && y < other.y);
+    }
+
+    int32_t x;
+    int32_t y;
+};
+
+/**
+ * Stores the pooled components of a group of entities in cell files. See
+ * 'Cells' above.
+ */
+class CellFormat
+{
+public:
+    /**
+     *  Register a component type to be stored in cell files, using an ID
+     *  that identifies the type in the file.
+     */
+    template<typename T>
+    void registerComponent(uint32_t id)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "Streamed components must be trivially copyable");
+
+        registerComponent(id, componentTypeInfo<T>());
+    }
+
+    /**
+     *  Register a trivially copyable component type. Throws if the ID or type
+     *  has already been registered.
+     */
+    void registerComponent(uint32_t id, const ComponentTypeInfo &info);
+
+    /**
+     *  Write the registered pooled components of 'entities' to a cell file.
+     *
+     *  Returns false if the file could not be written.
+     */
+    bool writeCell(const std::string &path, const EntityManager &em,
+        const std::vector<EntityId> &entities) const;
+
+    /**
+     *  Create an entity in 'em' for each entity in a cell file, and add the
+     *  components that were stored for it. The IDs of the new entities are
+     *  written to 'entities', and the number of bytes of components read is
+     *  written to 'pBytes', if given.
+     *
+     *  Returns false if the file could not be read, or is malformed, in which
+     *  case no entities are created. A file is malformed if it declares more
+     *  entities than it has bytes. Components of types that have not been
+     *  registered are skipped.
+     */
+    bool readCell(const std::string &path, EntityManager &em,
+        std::vector<EntityId> &entities, size_t *pBytes = nullptr) const;
+
+    /**
+     *  Returns the number of bytes of components that readCell would read
+     *  from a cell file, reading only the headers of the file. Returns 0 if
+     *  the file does not exist, or is malformed.
+     */
+    size_t cellBytes(const std::string &path) const;
+
+private:
+    struct Entry
+    {
+        uint32_t id;
+        const ComponentTypeInfo *pInfo;
+    };
+
+    const Entry* findEntry(uint32_t id) const;
+
+    std::vector<Entry> m_entries;
+};
+
+enum EvictionPolicy
+{
+    EvictFarthest,              // Cells furthest from every focus point
+    EvictLeastRecentlyUsed      // Cells that have been outside loadRadius for longest
+};
+
+struct StreamingConfig
+{
+    StreamingConfig()
+      : cellSize(64.0f)
+      , loadRadius(128.0f)
+      , unloadRadius(192.0f)
+      , memoryBudget(64 * 1024 * 1024)
+      , maxMergesPerUpdate(4)
+      , eviction(EvictFarthest) { }
+
+    float cellSize;             // Width of each (square) cell, in world units
+    float loadRadius;           // Cells within this distance of a focus point are loaded
+    float unloadRadius;         // Cells beyond this distance from every focus point are unloaded
+    size_t memoryBudget;        // Maximum bytes of components in resident cells
+    size_t maxMergesPerUpdate;  // Maximum number of cells merged by each call to update()
+    EvictionPolicy eviction;
+
+    // Returns the path of the file for a cell. Called on the I/O thread.
+    std::function<std::string(CellCoord)> cellPath;
+};
+
+/**
+ * Loads and unloads the cells of a world around a set of focus points. See
+ * 'Streaming' above.
+ *
+ * All functions must be called on the thread that owns the world.
+ */
+class WorldStreamer
+{
+public:
+    WorldStreamer(EntityManager &world, const CellFormat &format, const StreamingConfig &config);
+
+    /**
+     *  Stop the I/O thread. Cells that are resident remain in the world.
+     */
+    ~WorldStreamer();
+
+    void setFocusPoints(const std::vector<Vec2<float>> &points);
+
+    /**
+     *  Merge cells that have finished loading, unload cells that are no
+     *  longer needed, and request loads for cells that are needed. Should be
+     *  called once per frame, at a frame boundary.
+     */
+    void update();
+
+    /**
+     *  Destroy the entities of every resident cell, and cancel pending loads.
+     */
+    void unloadAll();
+
+    /**
+     *  Block until all requested loads have completed, then merge them.
+     *  Mostly useful for tests and loading screens.
+     */
+    void flush();
+
+    bool isResident(CellCoord cell) const;
+
+    /**
+     *  Returns the entities of a resident cell, or nullptr.
+     */
+    const std::vector<EntityId>* findCellEntities(CellCoord cell) const;
+
+    size_t residentCells() const
+    {
+        return m_resident.size();
+    }
+
+    size_t residentBytes() const
+    {
+        return m_residentBytes;
+    }
+
+    /**
+     *  Number of cells that have been requested, but not yet merged,
+     *  including those whose headers are still being read.
+     */
+    size_t pendingLoads() const
+    {
+        return m_requested.size() + m_probing.size();
+    }
+
+    /**
+     *  Number of cell files that existed, but could not be read.
+     */
+    size_t failedLoads() const
+    {
+        return m_failedLoads;
+    }
+
+    /**
+     *  Coordinates of the cell that contains a point.
+     */
+    CellCoord cellAt(const Vec2<float> &point) const;
+
+    /**
+     *  Distance from a point to the nearest point of a cell.
+     */
+    float distanceToCell(const Vec2<float> &point, CellCoord cell) const;
+
+private:
+    WorldStreamer(const WorldStreamer &);
+    WorldStreamer& operator=(const WorldStreamer &);
+
+    struct ResidentCell
+    {
+        std::vector<EntityId> entities;
+        size_t bytes;
+        uint64_t lastUsed;      // Last update in which the cell was within loadRadius
+    };
+
+    struct LoadResult
+    {
+        CellCoord cell;
+        std::unique_ptr<EntityManager> pStaging;
+        std::vector<EntityId> entities;
+        size_t bytes;
+        bool failed;
+    };
+
+    void ioThread();
+    void mergeCompleted(size_t maxMerges);
+    void mergeEstimates();
+    void requestLoads();
+    void unloadCell(std::map<CellCoord, ResidentCell>::iterator iter);
+    void enforceBudget(const std::map<CellCoord, float> &wanted);
+    float nearestFocusDistance(CellCoord cell) const;
+
+    EntityManager &m_world;
+    const CellFormat &m_format;
+    const StreamingConfig m_config;
+
+    std::vector<Vec2<float>> m_focusPoints;
+    std::map<CellCoord, float> m_wanted;        // Cells within loadRadius, and their distances
+    std::map<CellCoord, ResidentCell> m_resident;
+    std::set<CellCoord> m_requested;            // Cells queued or being loaded
+    std::set<CellCoord> m_probing;              // Cells whose headers are queued or being read
+    std::map<CellCoord, size_t> m_estimates;    // Bytes of components in each cell
+    size_t m_residentBytes;
+    size_t m_failedLoads;
+    uint64_t m_updateCount;
+
+    // Shared with the I/O thread
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<CellCoord> m_queue;
+    std::deque<CellCoord> m_probeQueue;
+    std::vector<std::unique_ptr<LoadResult>> m_completed;
+    std::vector<std::pair<CellCoord, size_t>> m_probed;
+    size_t m_loading;                           // Loads or header reads in progress
+    bool m_stopping;
+
+    std::thread m_thread;
+};
+
+}   // end namespace gameutils
@@ -0,0 +1,241 @@
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "gameutils/profile.h"
+
+using std::chrono::steady_clock;
+
+namespace gameutils {
+namespace profile {
+
+const size_t ThreadBuffer::capacity;
+
+namespace {
+
+struct Registry
+{
+    Registry()
+      : nextThreadId(1)
+      , calibrationTicks(timestamp())
+      , calibrationTime(steady_clock::now()) { }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer *> freeBuffers;    // Buffers of threads that have exited
+    uint32_t nextThreadId;
+
+    // Reference point used to convert timestamps to microseconds
+    const uint64_t calibrationTicks;
+    const steady_clock::time_point calibrationTime;
+};
+
+Registry& registry()
+{
+    // Intentionally leaked, so that threads that outlive static destruction
+    // can still record zones safely.
+    static Registry *pRegistry = new Registry();
+    return *pRegistry;
+}
+
+// Releases the calling thread's buffer for reuse when the thread exits
+class ThreadExit
+{
+public:
+    ThreadExit()
+      : m_pBuffer(nullptr) { }
+
+    ~ThreadExit()
+    {
+        s_exited = true;
+        if (!m_pBuffer) {
+            return;
+        }
+
+        // Zones recorded by later thread_local destructors register a new
+        // buffer, rather than writing to one that another thread may reuse
+        threadBufferSlot() = nullptr;
+
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.freeBuffers.push_back(m_pBuffer);
+    }
+
+    void track(ThreadBuffer *pBuffer)
+    {
+        m_pBuffer = pBuffer;
+    }
+
+    // Set once the thread's ThreadExit has been destroyed
+    static thread_local bool s_exited;
+
+private:
+    ThreadExit(const ThreadExit &);
+    ThreadExit& operator=(const ThreadExit &);
+
+    ThreadBuffer *m_pBuffer;
+};
+
+thread_local bool ThreadExit::s_exited = false;
+thread_local ThreadExit threadExit;
+
+void writeEscaped(std::ostream &out, const char *str)
+{
+    out << '"';
+    for (const char *c = str; *c; ++c) {
+        switch (*c) {
+        case '"':
+            out << "\\\"";
+            break;
+        case '\\':
+            out << "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(*c) >= 0x20) {
+                out << *c;
+            }
+        }
+    }
+    out << '"';
+}
+
+}   // end anonymous namespace
+
+ThreadBuffer* registerThread()
+{
+    ThreadBuffer *pBuffer;
+    {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+
+        const uint32_t threadId = reg.nextThreadId++;
+        if (!reg.freeBuffers.empty() && !ThreadExit::s_exited) {
+            // Only the exporter reads a free buffer, and it holds the lock
+            pBuffer = reg.freeBuffers.back();
+            reg.freeBuffers.pop_back();
+            pBuffer->threadId = threadId;
+            pBuffer->threadName.store(nullptr, std::memory_order_relaxed);
+            pBuffer->tail.store(pBuffer->head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        } else {
+            reg.buffers.emplace_back(new ThreadBuffer(threadId));
+            pBuffer = reg.buffers.back().get();
+        }
+    }
+
+    // A thread that is exiting keeps its new buffer, since it cannot track
+    // it any more
+    if (!ThreadExit::s_exited) {
+        threadExit.track(pBuffer);
+    }
+
+    threadBufferSlot() = pBuffer;
+    return pBuffer;
+}
+
+void clear()
+{
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    for (auto &pBuffer: reg.buffers) {
+        pBuffer->tail.store(pBuffer->head.load(std::memory_order_acquire),
+            std::memory_order_relaxed);
+    }
+}
+
+double ticksPerMicrosecond()
+{
+#if defined(GAMEUTILS_PROFILE_HAS_RDTSC) && !defined(GAMEUTILS_PROFILE_STEADY_CLOCK)
+    Registry &reg = registry();
+
+    // Require a reasonable interval since calibration, to limit error
+    const steady_clock::duration minInterval = std::chrono::milliseconds(10);
+    const steady_clock::time_point earliest = reg.calibrationTime + minInterval;
+    if (steady_clock::now() < earliest) {
+        std::this_thread::sleep_until(earliest);
+    }
+
+    const uint64_t ticks = timestamp();
+    const steady_clock::time_point now = steady_clock::now();
+    const double micros = std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(
+        now - reg.calibrationTime).count();
+
+    return static_cast<double>(ticks - reg.calibrationTicks) / micros;
+#else
+    return 1000.0;
+#endif
+}
+
+void writeChromeTrace(std::ostream &out)
+{
+    const double scale = 1.0 / ticksPerMicrosecond();
+
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+
+    const uint64_t base = reg.calibrationTicks;
+    bool first = true;
+
+    // Timestamps are in microseconds, and grow large enough over a session
+    // that the default precision would round them to tens of microseconds.
+    // The caller's format is restored afterwards.
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[";
+
+    for (auto &pBuffer: reg.buffers) {
+        const ThreadBuffer &buffer = *pBuffer;
+
+        const char *threadName = buffer.threadName.load(std::memory_order_relaxed);
+        if (threadName) {
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                << buffer.threadId << ",\"args\":{\"name\":";
+            writeEscaped(out, threadName);
+            out << "}}";
+            first = false;
+        }
+
+        const uint64_t head = buffer.head.load(std::memory_order_acquire);
+        const uint64_t tail = buffer.tail.load(std::memory_order_relaxed);
+        const uint64_t begin = std::max(tail,
+            head > ThreadBuffer::capacity ? head - ThreadBuffer::capacity : 0);
+
+        for (uint64_t i = begin; i < head; ++i) {
+            // Skip records that are overwritten while they are being read
+            const ZoneRecord &record = buffer.records[i & (ThreadBuffer::capacity - 1)];
+            if (record.sequence.load(std::memory_order_acquire) != i) {
+                continue;
+            }
+
+            const char *name = record.name.load(std::memory_order_relaxed);
+            const uint64_t start = record.start.load(std::memory_order_relaxed);
+            const uint64_t end = record.end.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (record.sequence.load(std::memory_order_relaxed) != i) {
+                continue;
+            }
+
+            const double ts = static_cast<double>(static_cast<int64_t>(start - base)) * scale;
+            const double dur = static_cast<double>(end - start) * scale;
+
+            out << (first ? "" : ",") << "\n{\"name\":";
+            writeEscaped(out, name);
+            out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.threadId
+                << ",\"ts\":" << ts << ",\"dur\":" << dur << "}";
+            first = false;
+        }
+    }
+
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+}   // end namespace profile
+}   // end namespace gameutils
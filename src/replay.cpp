@@ -0,0 +1,389 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "gameutils/replay.h"
+
+namespace gameutils {
+
+namespace {
+
+const uint32_t ReplayMagic = 0x4c525547;   // "GURL"
+const uint32_t ReplayVersion = 1;
+const size_t HeaderSize = 2 * sizeof(uint32_t);
+
+bool hasEntity(EntityRecorder::Operation operation)
+{
+    return operation != EntityRecorder::DestroyAll && operation != EntityRecorder::Purge;
+}
+
+bool hasType(EntityRecorder::Operation operation)
+{
+    return operation == EntityRecorder::Attach || operation == EntityRecorder::Detach ||
+        operation == EntityRecorder::Add || operation == EntityRecorder::Remove;
+}
+
+void appendU32(std::vector<uint8_t> &data, uint32_t value)
+{
+    const uint8_t *pBytes = reinterpret_cast<const uint8_t *>(&value);
+    data.insert(data.end(), pBytes, pBytes + sizeof(value));
+}
+
+// Reads values from an in-memory log, checking bounds
+class Reader
+{
+public:
+    Reader(const uint8_t *pData, size_t size)
+      : m_pData(pData)
+      , m_pEnd(pData + size) { }
+
+    bool done() const
+    {
+        return m_pData == m_pEnd;
+    }
+
+    bool readU32(uint32_t &value)
+    {
+        if (static_cast<size_t>(m_pEnd - m_pData) < sizeof(value)) {
+            return false;
+        }
+
+        memcpy(&value, m_pData, sizeof(value));
+        m_pData += sizeof(value);
+        return true;
+    }
+
+    bool readByte(uint8_t &value)
+    {
+        if (m_pData == m_pEnd) {
+            return false;
+        }
+
+        value = *m_pData++;
+        return true;
+    }
+
+    // Reads an unsigned LEB128 value of at most 32 bits
+    bool readVarint(uint32_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; shift < 35; shift += 7) {
+            uint8_t byte;
+            if (!readByte(byte)) {
+                return false;
+            }
+
+            value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    const uint8_t *m_pData;
+    const uint8_t *m_pEnd;
+};
+
+}   // end anonymous namespace
+
+//----------------------------------------------------------------------------
+//
+// ReplayFormat
+//
+//----------------------------------------------------------------------------
+
+void ReplayFormat::registerEntry(const Entry &entry)
+{
+    if (findEntry(entry.id) || findEntry(entry.type)) {
+        throw std::runtime_error("Component type or ID has already been registered.");
+    }
+
+    m_byType.insert(std::make_pair(entry.type, m_entries.size()));
+    m_entries.push_back(entry);
+}
+
+const ReplayFormat::Entry* ReplayFormat::findEntry(uint32_t id) const
+{
+    for (const Entry &entry: m_entries) {
+        if (entry.id == id) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+const ReplayFormat::Entry* ReplayFormat::findEntry(const std::type_index &type) const
+{
+    auto iter = m_byType.find(type);
+    return iter == m_byType.end() ? nullptr : &m_entries[iter->second];
+}
+
+//----------------------------------------------------------------------------
+//
+// CommandRecorder
+//
+//----------------------------------------------------------------------------
+
+CommandRecorder::CommandRecorder(EntityManager &world, const ReplayFormat &format)
+  : m_pWorld(&world)
+  , m_format(format)
+  , m_nextNumber(0)
+  , m_commandCount(0)
+  , m_skippedCount(0)
+{
+    if (world.recorder()) {
+        throw std::runtime_error("The world is already being recorded.");
+    }
+
+    appendU32(m_data, ReplayMagic);
+    appendU32(m_data, ReplayVersion);
+    world.setRecorder(this);
+}
+
+CommandRecorder::~CommandRecorder()
+{
+    stop();
+}
+
+void CommandRecorder::stop()
+{
+    if (m_pWorld) {
+        m_pWorld->setRecorder(nullptr);
+        m_pWorld = nullptr;
+    }
+}
+
+bool CommandRecorder::save(const std::string &path) const
+{
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char *>(m_data.data()), m_data.size());
+    return out.good();
+}
+
+void CommandRecorder::record(Operation operation, EntityId entityId, const std::type_index *pType)
+{
+    const ReplayFormat::Entry *pEntry = nullptr;
+    if (pType) {
+        pEntry = m_format.findEntry(*pType);
+        if (!pEntry) {
+            m_skippedCount++;
+            return;
+        }
+    }
+
+    switch (operation) {
+    case Create:
+        // A new ID may be the same as that of an entity destroyed before
+        // recording started, so it is always given a new number
+        writeOperation(Create);
+        writeVarint(m_nextNumber);
+        m_numbers[entityId] = m_nextNumber++;
+        return;
+    case Destroy: {
+        const uint32_t number = entityNumber(entityId);
+        writeOperation(Destroy);
+        writeVarint(number);
+        m_numbers.erase(entityId);
+        return;
+    }
+    case DestroyAll:
+        writeOperation(DestroyAll);
+        m_numbers.clear();
+        return;
+    case Purge:
+        writeOperation(Purge);
+        return;
+    default:
+        break;
+    }
+
+    const uint32_t number = entityNumber(entityId);
+    writeOperation(operation);
+    writeVarint(number);
+    if (pEntry) {
+        writeVarint(pEntry->id);
+    }
+}
+
+uint32_t CommandRecorder::entityNumber(EntityId entityId)
+{
+    auto result = m_numbers.insert(std::make_pair(entityId, m_nextNumber));
+    if (result.second) {
+        writeOperation(Create);
+        writeVarint(m_nextNumber++);
+    }
+
+    return result.first->second;
+}
+
+void CommandRecorder::writeOperation(Operation operation)
+{
+    m_data.push_back(static_cast<uint8_t>(operation));
+    m_commandCount++;
+}
+
+void CommandRecorder::writeVarint(uint32_t value)
+{
+    while (value >= 0x80) {
+        m_data.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+
+    m_data.push_back(static_cast<uint8_t>(value));
+}
+
+//----------------------------------------------------------------------------
+//
+// CommandPlayer
+//
+//----------------------------------------------------------------------------
+
+bool CommandPlayer::load(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) {
+        clear();
+        return false;
+    }
+
+    const std::streamoff fileSize = in.tellg();
+    if (fileSize < static_cast<std::streamoff>(HeaderSize)) {
+        clear();
+        return false;
+    }
+
+    std::vector<uint8_t> contents(static_cast<size_t>(fileSize));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(contents.data()), fileSize)) {
+        clear();
+        return false;
+    }
+
+    return load(contents);
+}
+
+bool CommandPlayer::load(const uint8_t *pData, size_t size)
+{
+    clear();
+
+    Reader reader(pData, size);
+    uint32_t magic, version;
+    if (!reader.readU32(magic) || magic != ReplayMagic ||
+        !reader.readU32(version) || version != ReplayVersion) {
+        return false;
+    }
+
+    while (!reader.done()) {
+        uint8_t operation;
+        if (!reader.readByte(operation) || operation > EntityRecorder::Purge) {
+            clear();
+            return false;
+        }
+
+        Command command = { static_cast<EntityRecorder::Operation>(operation), 0, nullptr };
+        if (hasEntity(command.operation) && !reader.readVarint(command.entity)) {
+            clear();
+            return false;
+        }
+
+        if (hasType(command.operation)) {
+            uint32_t id;
+            if (!reader.readVarint(id)) {
+                clear();
+                return false;
+            }
+
+            command.pEntry = m_format.findEntry(id);
+            if (!command.pEntry) {
+                m_skippedCount++;
+                continue;
+            }
+        }
+
+        // Entities are numbered in order of creation, so a number is either
+        // new or has been created before
+        if (command.operation == EntityRecorder::Create) {
+            if (command.entity != m_entityCount) {
+                clear();
+                return false;
+            }
+
+            m_entityCount++;
+        } else if (hasEntity(command.operation) && command.entity >= m_entityCount) {
+            clear();
+            return false;
+        }
+
+        m_commands.push_back(command);
+    }
+
+    return true;
+}
+
+ReplayResult CommandPlayer::replay(EntityManager &world) const
+{
+    GAMEUTILS_PROFILE_ZONE("CommandPlayer::replay");
+
+    std::vector<EntityId> entities(m_entityCount, InvalidEntity);
+
+    ReplayResult result;
+    result.commands = m_commands.size();
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const Command &command: m_commands) {
+        bool ok = true;
+        switch (command.operation) {
+        case EntityRecorder::Create:
+            entities[command.entity] = world.createEntity();
+            ok = entities[command.entity] != InvalidEntity;
+            break;
+        case EntityRecorder::Destroy:
+            ok = world.destroyEntity(entities[command.entity]);
+            break;
+        case EntityRecorder::DestroyAll:
+            ok = world.destroyAllEntities();
+            break;
+        case EntityRecorder::Attach:
+            ok = command.pEntry->attach(world, entities[command.entity]);
+            break;
+        case EntityRecorder::Detach:
+            ok = command.pEntry->detach(world, entities[command.entity]);
+            break;
+        case EntityRecorder::Add:
+            ok = command.pEntry->add(world, entities[command.entity]);
+            break;
+        case EntityRecorder::Remove:
+            ok = command.pEntry->remove(world, entities[command.entity]);
+            break;
+        case EntityRecorder::MarkForRemoval:
+            world.markForRemoval(entities[command.entity]);
+            break;
+        case EntityRecorder::Purge:
+            world.purge();
+            break;
+        }
+
+        result.failed += ok ? 0 : 1;
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+void CommandPlayer::clear()
+{
+    m_commands.clear();
+    m_entityCount = 0;
+    m_skippedCount = 0;
+}
+
+}   // end namespace gameutils
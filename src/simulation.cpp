@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "gameutils/simulation.h"
+
+namespace gameutils {
+
+//----------------------------------------------------------------------------
+//
+// Snapshot
+//
+//----------------------------------------------------------------------------
+
+void Snapshot::capture(const EntityManager &world)
+{
+    // The buffers are swapped, so the values of the current step become the
+    // previous values without being copied
+    std::swap(m_previous, m_current);
+
+    const ComponentPool *pPool = world.findPool(typeInfo());
+    if (pPool) {
+        m_current.entities.assign(pPool->entities(), pPool->entities() + pPool->size());
+        read(*pPool, m_current);
+    } else {
+        m_current.entities.clear();
+        for (size_t lane = 0; lane < m_lanes; ++lane) {
+            m_current.lanes[lane].clear();
+        }
+    }
+
+    m_aligned = m_previous.entities == m_current.entities;
+    if (m_aligned) {
+        return;
+    }
+
+    m_indexScratch.clear();
+    for (size_t i = 0; i < m_previous.entities.size(); ++i) {
+        m_indexScratch[m_previous.entities[i]] = static_cast<uint32_t>(i);
+    }
+
+    m_previousIndexes.resize(m_current.entities.size());
+    for (size_t i = 0; i < m_current.entities.size(); ++i) {
+        auto iter = m_indexScratch.find(m_current.entities[i]);
+        m_previousIndexes[i] = iter == m_indexScratch.end() ? NoPrevious : iter->second;
+    }
+}
+
+void Vec3Snapshot::interpolate(float alpha, Vec3<float> *pOut) const
+{
+    const float *px = m_previous.lanes[0].data();
+    const float *py = m_previous.lanes[1].data();
+    const float *pz = m_previous.lanes[2].data();
+    const float *cx = m_current.lanes[0].data();
+    const float *cy = m_current.lanes[1].data();
+    const float *cz = m_current.lanes[2].data();
+    const size_t count = size();
+
+    if (m_aligned) {
+        for (size_t i = 0; i < count; ++i) {
+            pOut[i] = lerp(Vec3<float>(px[i], py[i], pz[i]), Vec3<float>(cx[i], cy[i], cz[i]), alpha);
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const Vec3<float> current(cx[i], cy[i], cz[i]);
+        const uint32_t j = m_previousIndexes[i];
+        pOut[i] = j == NoPrevious ? current : lerp(Vec3<float>(px[j], py[j], pz[j]), current, alpha);
+    }
+}
+
+void QuatSnapshot::interpolate(float alpha, Quat<float> *pOut) const
+{
+    const float *ps = m_previous.lanes[0].data();
+    const float *px = m_previous.lanes[1].data();
+    const float *py = m_previous.lanes[2].data();
+    const float *pz = m_previous.lanes[3].data();
+    const float *cs = m_current.lanes[0].data();
+    const float *cx = m_current.lanes[1].data();
+    const float *cy = m_current.lanes[2].data();
+    const float *cz = m_current.lanes[3].data();
+    const size_t count = size();
+
+    if (m_aligned) {
+        for (size_t i = 0; i < count; ++i) {
+            pOut[i] = nlerp(Quat<float>(ps[i], px[i], py[i], pz[i]), Quat<float>(cs[i], cx[i], cy[i], cz[i]), alpha);
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const Quat<float> current(cs[i], cx[i], cy[i], cz[i]);
+        const uint32_t j = m_previousIndexes[i];
+        pOut[i] = j == NoPrevious ? current : nlerp(Quat<float>(ps[j], px[j], py[j], pz[j]), current, alpha);
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+// SimulationRunner
+//
+//----------------------------------------------------------------------------
+
+SimulationRunner::SimulationRunner(EntityManager &world, const SimulationConfig &config)
+  : m_world(world)
+  , m_config(config)
+  , m_accumulator(0)
+  , m_tick(0)
+  , m_droppedSteps(0)
+{
+    if (!(config.timestep > 0)) {
+        throw std::runtime_error("Simulation timestep must be positive.");
+    }
+}
+
+void SimulationRunner::addSystem(const System &system, const char *name)
+{
+    NamedSystem namedSystem;
+    namedSystem.system = system;
+    namedSystem.name = name;
+    m_systems.push_back(namedSystem);
+}
+
+size_t SimulationRunner::advance(double frameTime)
+{
+    GAMEUTILS_PROFILE_ZONE("SimulationRunner::advance");
+
+    m_accumulator += std::max(frameTime, 0.0);
+
+    const double due = std::floor(m_accumulator / m_config.timestep);
+    const size_t steps = due < static_cast<double>(m_config.maxStepsPerFrame) ?
+        static_cast<size_t>(due) : m_config.maxStepsPerFrame;
+
+    // Time for steps beyond the limit is dropped, so that the simulation
+    // slows down instead of falling further behind
+    if (due > static_cast<double>(steps)) {
+        m_droppedSteps += static_cast<uint64_t>(due) - steps;
+    }
+
+    m_accumulator = std::min(std::max(m_accumulator - due * m_config.timestep, 0.0),
+        std::nextafter(m_config.timestep, 0.0));
+
+    // Only the last two steps are needed for interpolation
+    for (size_t i = 0; i < steps; ++i) {
+        runSystems(i + 2 >= steps);
+    }
+
+    return steps;
+}
+
+void SimulationRunner::step()
+{
+    runSystems(true);
+}
+
+void SimulationRunner::runSystems(bool capture)
+{
+    for (const NamedSystem &namedSystem: m_systems) {
+        GAMEUTILS_PROFILE_ZONE(namedSystem.name);
+        namedSystem.system(m_world, m_config.timestep);
+    }
+
+    m_tick++;
+
+    if (capture) {
+        for (auto &pSnapshot: m_snapshots) {
+            pSnapshot->capture(m_world);
+        }
+    }
+}
+
+}   // end namespace gameutils
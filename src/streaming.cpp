@@ -0,0 +1,751 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "gameutils/streaming.h"
+
+namespace gameutils {
+
+namespace {
+
+const uint32_t CellMagic = 0x4c435547;     // "GUCL"
+const uint32_t CellVersion = 1;
+
+void writeU32(std::ostream &out, uint32_t value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Reads values from an in-memory copy of a cell file, checking bounds
+class Reader
+{
+public:
+    Reader(const char *pData, size_t size)
+      : m_pData(pData)
+      , m_remaining(size) { }
+
+    bool readU32(uint32_t &value)
+    {
+        const char *pBytes = read(sizeof(value));
+        if (!pBytes) {
+            return false;
+        }
+
+        memcpy(&value, pBytes, sizeof(value));
+        return true;
+    }
+
+    // Returns a pointer to the next 'size' bytes, or nullptr
+    const char* read(size_t size)
+    {
+        if (size > m_remaining) {
+            return nullptr;
+        }
+
+        const char *pBytes = m_pData;
+        m_pData += size;
+        m_remaining -= size;
+        return pBytes;
+    }
+
+private:
+    const char *m_pData;
+    size_t m_remaining;
+};
+
+// Aligned space for a single component, so that components can be copied
+// out of unaligned file data, or modified before being written
+class Scratch
+{
+public:
+    explicit Scratch(const ComponentTypeInfo &info)
+      : m_pData(detail::allocateAligned(info.size, info.alignment)) { }
+
+    ~Scratch()
+    {
+        detail::deallocateAligned(m_pData);
+    }
+
+    unsigned char* data()
+    {
+        return m_pData;
+    }
+
+private:
+    Scratch(const Scratch &);
+    Scratch& operator=(const Scratch &);
+
+    unsigned char *m_pData;
+};
+
+}   // end anonymous namespace
+
+//----------------------------------------------------------------------------
+//
+// CellFormat
+//
+//----------------------------------------------------------------------------
+
+void CellFormat::registerComponent(uint32_t id, const ComponentTypeInfo &info)
+{
+    if (!info.triviallyCopyable) {
+        throw std::runtime_error("Streamed components must be trivially copyable.");
+    }
+
+    if (info.storage != PooledStorage) {
+        throw std::runtime_error("Streamed components must use pooled storage.");
+    }
+
+    for (const Entry &entry: m_entries) {
+        if (entry.id == id || entry.pInfo == &info) {
+            throw std::runtime_error("Component type or ID has already been registered.");
+        }
+    }
+
+    Entry entry = { id, &info };
+    m_entries.push_back(entry);
+}
+
+const CellFormat::Entry* CellFormat::findEntry(uint32_t id) const
+{
+    for (const Entry &entry: m_entries) {
+        if (entry.id == id) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+bool CellFormat::writeCell(const std::string &path, const EntityManager &em,
+    const std::vector<EntityId> &entities) const
+{
+    // Entities are numbered from 1 within the file, so that references to
+    // entities in the same cell can be restored when it is loaded. References
+    // to other entities are cleared, since their IDs could be mistaken for
+    // local numbers.
+    EntityRemap toLocal;
+    toLocal.setUnmapped(InvalidEntity);
+    for (size_t i = 0; i < entities.size(); ++i) {
+        toLocal.add(entities[i], static_cast<EntityId>(i + 1));
+    }
+
+    // Find the entities that have each registered component
+    std::vector<std::pair<const Entry *, std::vector<uint32_t>>> blocks;
+    for (const Entry &entry: m_entries) {
+        const ComponentPool *pPool = em.findPool(*entry.pInfo);
+        if (!pPool) {
+            continue;
+        }
+
+        std::vector<uint32_t> locals;
+        for (size_t i = 0; i < entities.size(); ++i) {
+            if (pPool->contains(entities[i])) {
+                locals.push_back(static_cast<uint32_t>(i));
+            }
+        }
+
+        if (!locals.empty()) {
+            blocks.push_back(std::make_pair(&entry, std::move(locals)));
+        }
+    }
+
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+
+    writeU32(out, CellMagic);
+    writeU32(out, CellVersion);
+    writeU32(out, static_cast<uint32_t>(entities.size()));
+    writeU32(out, static_cast<uint32_t>(blocks.size()));
+
+    for (const auto &block: blocks) {
+        const ComponentTypeInfo &info = *block.first->pInfo;
+        const std::vector<uint32_t> &locals = block.second;
+        const ComponentPool &pool = *em.findPool(info);
+
+        writeU32(out, block.first->id);
+        writeU32(out, static_cast<uint32_t>(info.size));
+        writeU32(out, static_cast<uint32_t>(locals.size()));
+        out.write(reinterpret_cast<const char *>(locals.data()), locals.size() * sizeof(uint32_t));
+
+        Scratch scratch(info);
+        for (uint32_t local: locals) {
+            memcpy(scratch.data(), pool.find(entities[local]), info.size);
+            if (info.remap) {
+                info.remap(scratch.data(), toLocal);
+            }
+            out.write(reinterpret_cast<const char *>(scratch.data()), info.size);
+        }
+    }
+
+    return out.good();
+}
+
+size_t CellFormat::cellBytes(const std::string &path) const
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    uint32_t header[4];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        header[0] != CellMagic || header[1] != CellVersion) {
+        return 0;
+    }
+
+    // Only the header of each block is read, and the rest is skipped
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < header[3]; ++i) {
+        uint32_t block[3];
+        if (!in.read(reinterpret_cast<char *>(block), sizeof(block))) {
+            return 0;
+        }
+
+        const uint32_t id = block[0], size = block[1], count = block[2];
+        const Entry *pEntry = findEntry(id);
+        if (pEntry && pEntry->pInfo->size == size) {
+            bytes += static_cast<size_t>(count) * size;
+        }
+
+        in.seekg(static_cast<std::streamoff>(count) * (sizeof(uint32_t) + size), std::ios::cur);
+    }
+
+    return in ? bytes : 0;
+}
+
+bool CellFormat::readCell(const std::string &path, EntityManager &em,
+    std::vector<EntityId> &entities, size_t *pBytes) const
+{
+    GAMEUTILS_PROFILE_ZONE("CellFormat::readCell");
+
+    entities.clear();
+    if (pBytes) {
+        *pBytes = 0;
+    }
+
+    // Read the whole file, so that it can be validated before any entities
+    // are created
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+
+    const std::streamoff fileSize = in.tellg();
+    if (fileSize <= 0) {
+        return false;
+    }
+
+    std::vector<char> contents(static_cast<size_t>(fileSize));
+    in.seekg(0);
+    if (!in.read(contents.data(), fileSize)) {
+        return false;
+    }
+
+    Reader reader(contents.data(), contents.size());
+    uint32_t magic, version, entityCount, blockCount;
+    if (!reader.readU32(magic) || magic != CellMagic ||
+        !reader.readU32(version) || version != CellVersion ||
+        !reader.readU32(entityCount) || !reader.readU32(blockCount)) {
+        return false;
+    }
+
+    // Entities without components take no space in the file, so the count
+    // can only be bounded by the size of the file
+    if (entityCount > contents.size()) {
+        return false;
+    }
+
+    struct Block
+    {
+        const ComponentTypeInfo *pInfo;
+        uint32_t count;
+        const char *pLocals;
+        const char *pData;
+    };
+
+    std::vector<Block> blocks;
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        uint32_t id, size, count;
+        if (!reader.readU32(id) || !reader.readU32(size) || !reader.readU32(count)) {
+            return false;
+        }
+
+        Block block = { nullptr, count, reader.read(count * sizeof(uint32_t)), nullptr };
+        block.pData = reader.read(static_cast<size_t>(count) * size);
+        if (!block.pLocals || !block.pData) {
+            return false;
+        }
+
+        const Entry *pEntry = findEntry(id);
+        if (!pEntry) {
+            continue;
+        }
+
+        if (pEntry->pInfo->size != size) {
+            return false;
+        }
+
+        for (uint32_t j = 0; j < count; ++j) {
+            uint32_t local;
+            memcpy(&local, block.pLocals + j * sizeof(uint32_t), sizeof(local));
+            if (local >= entityCount) {
+                return false;
+            }
+        }
+
+        block.pInfo = pEntry->pInfo;
+        blocks.push_back(block);
+    }
+
+    EntityRemap toWorld;
+    toWorld.setUnmapped(InvalidEntity);
+    entities.reserve(entityCount);
+    for (uint32_t i = 0; i < entityCount; ++i) {
+        entities.push_back(em.createEntity());
+        toWorld.add(i + 1, entities.back());
+    }
+
+    size_t bytes = 0;
+    for (const Block &block: blocks) {
+        const ComponentTypeInfo &info = *block.pInfo;
+        Scratch scratch(info);
+        for (uint32_t j = 0; j < block.count; ++j) {
+            uint32_t local;
+            memcpy(&local, block.pLocals + j * sizeof(uint32_t), sizeof(local));
+            memcpy(scratch.data(), block.pData + j * info.size, info.size);
+
+            void *pComponent = em.addComponent(entities[local], info, scratch.data());
+            if (pComponent && info.remap) {
+                info.remap(pComponent, toWorld);
+            }
+        }
+
+        bytes += block.count * info.size;
+    }
+
+    if (pBytes) {
+        *pBytes = bytes;
+    }
+
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+// WorldStreamer
+//
+//----------------------------------------------------------------------------
+
+WorldStreamer::WorldStreamer(EntityManager &world, const CellFormat &format,
+    const StreamingConfig &config)
+  : m_world(world)
+  , m_format(format)
+  , m_config(config)
+  , m_residentBytes(0)
+  , m_failedLoads(0)
+  , m_updateCount(0)
+  , m_loading(0)
+  , m_stopping(false)
+{
+    m_thread = std::thread(&WorldStreamer::ioThread, this);
+}
+
+WorldStreamer::~WorldStreamer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void WorldStreamer::setFocusPoints(const std::vector<Vec2<float>> &points)
+{
+    m_focusPoints = points;
+}
+
+CellCoord WorldStreamer::cellAt(const Vec2<float> &point) const
+{
+    return CellCoord(
+        static_cast<int32_t>(std::floor(point.x / m_config.cellSize)),
+        static_cast<int32_t>(std::floor(point.y / m_config.cellSize)));
+}
+
+float WorldStreamer::distanceToCell(const Vec2<float> &point, CellCoord cell) const
+{
+    const float minX = cell.x * m_config.cellSize;
+    const float minY = cell.y * m_config.cellSize;
+    const float dx = std::max(std::max(minX - point.x, point.x - (minX + m_config.cellSize)), 0.0f);
+    const float dy = std::max(std::max(minY - point.y, point.y - (minY + m_config.cellSize)), 0.0f);
+    return std::sqrt(dx * dx + dy * dy);
+}
+
+float WorldStreamer::nearestFocusDistance(CellCoord cell) const
+{
+    float nearest = std::numeric_limits<float>::max();
+    for (const Vec2<float> &point: m_focusPoints) {
+        nearest = std::min(nearest, distanceToCell(point, cell));
+    }
+
+    return nearest;
+}
+
+bool WorldStreamer::isResident(CellCoord cell) const
+{
+    return m_resident.find(cell) != m_resident.end();
+}
+
+const std::vector<EntityId>* WorldStreamer::findCellEntities(CellCoord cell) const
+{
+    auto iter = m_resident.find(cell);
+    return iter == m_resident.end() ? nullptr : &iter->second.entities;
+}
+
+void WorldStreamer::update()
+{
+    GAMEUTILS_PROFILE_ZONE("WorldStreamer::update");
+
+    m_updateCount++;
+    mergeCompleted(m_config.maxMergesPerUpdate);
+
+    mergeEstimates();
+
+    // Find the cells within loadRadius of each focus point
+    std::map<CellCoord, float> &wanted = m_wanted;
+    wanted.clear();
+    const Vec2<float> radius(m_config.loadRadius, m_config.loadRadius);
+    for (const Vec2<float> &point: m_focusPoints) {
+        const CellCoord first = cellAt(point - radius);
+        const CellCoord last = cellAt(point + radius);
+        for (int32_t x = first.x; x <= last.x; ++x) {
+            for (int32_t y = first.y; y <= last.y; ++y) {
+                const CellCoord cell(x, y);
+                const float distance = distanceToCell(point, cell);
+                if (distance > m_config.loadRadius) {
+                    continue;
+                }
+
+                auto result = wanted.insert(std::make_pair(cell, distance));
+                if (!result.second) {
+                    result.first->second = std::min(result.first->second, distance);
+                }
+            }
+        }
+    }
+
+    // Unload cells that are beyond unloadRadius, and cancel their loads
+    for (auto iter = m_resident.begin(); iter != m_resident.end(); ) {
+        auto current = iter++;
+        if (wanted.count(current->first)) {
+            current->second.lastUsed = m_updateCount;
+        } else if (nearestFocusDistance(current->first) > m_config.unloadRadius) {
+            unloadCell(current);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto iter = m_queue.begin(); iter != m_queue.end(); ) {
+            if (nearestFocusDistance(*iter) > m_config.unloadRadius) {
+                m_requested.erase(*iter);
+                iter = m_queue.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+
+        for (auto iter = m_probeQueue.begin(); iter != m_probeQueue.end(); ) {
+            if (nearestFocusDistance(*iter) > m_config.unloadRadius) {
+                m_probing.erase(*iter);
+                iter = m_probeQueue.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+
+    enforceBudget(wanted);
+    requestLoads();
+}
+
+void WorldStreamer::requestLoads()
+{
+    std::vector<std::pair<float, CellCoord>> missing;
+    for (const auto &cell: m_wanted) {
+        if (!isResident(cell.first) && !m_requested.count(cell.first)) {
+            missing.push_back(std::make_pair(cell.second, cell.first));
+        }
+    }
+
+    if (missing.empty()) {
+        return;
+    }
+
+    std::sort(missing.begin(), missing.end());
+
+    // Cell files are not expected to change while the world is streamed, so
+    // the headers of each one are read once, and corrected when it is loaded
+    std::vector<CellCoord> probes;
+    for (const auto &cell: missing) {
+        if (!m_estimates.count(cell.second) && m_probing.insert(cell.second).second) {
+            probes.push_back(cell.second);
+        }
+    }
+
+    size_t projected = m_residentBytes;
+    for (CellCoord cell: m_requested) {
+        projected += m_estimates[cell];
+    }
+
+    // Request the nearest cells first, while they are expected to fit. A
+    // cell whose headers have not been read yet holds back farther cells.
+    std::vector<CellCoord> loads;
+    for (const auto &cell: missing) {
+        auto iter = m_estimates.find(cell.second);
+        if (iter == m_estimates.end() || projected + iter->second > m_config.memoryBudget) {
+            break;
+        }
+
+        projected += iter->second;
+        m_requested.insert(cell.second);
+        loads.push_back(cell.second);
+    }
+
+    if (probes.empty() && loads.empty()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_probeQueue.insert(m_probeQueue.end(), probes.begin(), probes.end());
+        m_queue.insert(m_queue.end(), loads.begin(), loads.end());
+    }
+
+    m_cond.notify_all();
+}
+
+void WorldStreamer::mergeEstimates()
+{
+    std::vector<std::pair<CellCoord, size_t>> probed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        probed.swap(m_probed);
+    }
+
+    for (const auto &estimate: probed) {
+        m_probing.erase(estimate.first);
+        m_estimates.insert(estimate);
+    }
+}
+
+void WorldStreamer::unloadAll()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.clear();
+        m_probeQueue.clear();
+        m_completed.clear();
+    }
+
+    // Loads that are in progress will be discarded once they complete
+    m_requested.clear();
+    m_probing.clear();
+
+    while (!m_resident.empty()) {
+        unloadCell(m_resident.begin());
+    }
+}
+
+void WorldStreamer::flush()
+{
+    // Cells whose headers were still being read are requested once the
+    // headers are available, and then waited for in the same way
+    for (int pass = 0; pass < 2; ++pass) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] {
+                return m_queue.empty() && m_probeQueue.empty() && m_loading == 0;
+            });
+        }
+
+        mergeEstimates();
+        if (pass == 0) {
+            requestLoads();
+        }
+    }
+
+    mergeCompleted(std::numeric_limits<size_t>::max());
+}
+
+void WorldStreamer::ioThread()
+{
+    GAMEUTILS_PROFILE_THREAD_NAME("WorldStreamer I/O");
+
+    for (;;) {
+        CellCoord cell;
+        bool probe;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] {
+                return m_stopping || !m_queue.empty() || !m_probeQueue.empty();
+            });
+            if (m_stopping) {
+                return;
+            }
+
+            // Headers are read first, since they are small and are needed
+            // before further loads can be requested
+            probe = !m_probeQueue.empty();
+            std::deque<CellCoord> &queue = probe ? m_probeQueue : m_queue;
+            cell = queue.front();
+            queue.pop_front();
+            m_loading++;
+        }
+
+        if (probe) {
+            const size_t bytes = m_format.cellBytes(m_config.cellPath(cell));
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_probed.push_back(std::make_pair(cell, bytes));
+                m_loading--;
+            }
+
+            m_cond.notify_all();
+            continue;
+        }
+
+        std::unique_ptr<LoadResult> pResult(new LoadResult());
+        pResult->cell = cell;
+        pResult->bytes = 0;
+        pResult->failed = false;
+
+        // A cell without a file is empty
+        const std::string path = m_config.cellPath(cell);
+        if (std::ifstream(path.c_str(), std::ios::binary)) {
+            pResult->pStaging.reset(new EntityManager(&m_world));
+            if (!m_format.readCell(path, *pResult->pStaging, pResult->entities, &pResult->bytes)) {
+                pResult->pStaging.reset();
+                pResult->failed = true;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_completed.push_back(std::move(pResult));
+            m_loading--;
+        }
+
+        m_cond.notify_all();
+    }
+}
+
+void WorldStreamer::mergeCompleted(size_t maxMerges)
+{
+    GAMEUTILS_PROFILE_ZONE("WorldStreamer::mergeCompleted");
+
+    std::vector<std::unique_ptr<LoadResult>> results;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t count = std::min(maxMerges, m_completed.size());
+        std::move(m_completed.begin(), m_completed.begin() + count, std::back_inserter(results));
+        m_completed.erase(m_completed.begin(), m_completed.begin() + count);
+    }
+
+    for (auto &pResult: results) {
+        // Discard cells whose loads were cancelled
+        if (m_requested.erase(pResult->cell) == 0 || isResident(pResult->cell)) {
+            continue;
+        }
+
+        if (pResult->failed) {
+            m_failedLoads++;
+        }
+
+        ResidentCell &resident = m_resident[pResult->cell];
+        resident.bytes = pResult->bytes;
+        m_estimates[pResult->cell] = pResult->bytes;
+        resident.lastUsed = m_updateCount;
+
+        if (pResult->pStaging) {
+            // IDs were reserved from the world, so they should not change
+            EntityRemap remap;
+            m_world.merge(std::move(*pResult->pStaging), &remap);
+            for (EntityId &entityId: pResult->entities) {
+                remap.apply(entityId);
+            }
+
+            resident.entities.swap(pResult->entities);
+        }
+
+        m_residentBytes += resident.bytes;
+    }
+}
+
+void WorldStreamer::unloadCell(std::map<CellCoord, ResidentCell>::iterator iter)
+{
+    for (EntityId entityId: iter->second.entities) {
+        m_world.destroyEntity(entityId);
+    }
+
+    m_residentBytes -= iter->second.bytes;
+    m_resident.erase(iter);
+}
+
+void WorldStreamer::enforceBudget(const std::map<CellCoord, float> &wanted)
+{
+    if (m_residentBytes <= m_config.memoryBudget) {
+        return;
+    }
+
+    // Order cells from the first to be evicted to the last. Cells outside
+    // loadRadius always come first.
+    struct Candidate
+    {
+        bool wanted;
+        float key;
+        CellCoord cell;
+
+        bool operator<(const Candidate &other) const
+        {
+            if (wanted != other.wanted) {
+                return !wanted;
+            }
+
+            return key < other.key;
+        }
+    };
+
+    std::vector<Candidate> candidates;
+    candidates.reserve(m_resident.size());
+    for (const auto &resident: m_resident) {
+        // Evicting empty cells would not free anything
+        if (resident.second.bytes == 0) {
+            continue;
+        }
+
+        Candidate candidate;
+        candidate.wanted = wanted.count(resident.first) > 0;
+        candidate.key = m_config.eviction == EvictFarthest ?
+            -nearestFocusDistance(resident.first) : static_cast<float>(resident.second.lastUsed);
+        candidate.cell = resident.first;
+        candidates.push_back(candidate);
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+
+    for (const Candidate &candidate: candidates) {
+        if (m_residentBytes <= m_config.memoryBudget) {
+            break;
+        }
+
+        unloadCell(m_resident.find(candidate.cell));
+    }
+}
+
+}   // end namespace gameutils
@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "bench/compare.h"
+
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+using bench::CompareOptions;
+using bench::Result;
+
+class TestCompare : public testing::Test
+{
+protected:
+    static Result makeResult(const string &name, const vector<double> &samples)
+    {
+        Result result;
+        result.name = name;
+        result.samples = samples;
+        result.min = samples.front();
+        result.median = samples[samples.size() / 2];
+        return result;
+    }
+
+    // Returns the table printed by compareResults
+    static string compare(const vector<Result> &baseline, const vector<Result> &current, int &regressions)
+    {
+        FILE *pFile = tmpfile();
+        regressions = bench::compareResults(pFile, CompareOptions(), baseline, current);
+
+        string text;
+        rewind(pFile);
+        for (int c = fgetc(pFile); c != EOF; c = fgetc(pFile)) {
+            text += static_cast<char>(c);
+        }
+        fclose(pFile);
+        return text;
+    }
+};
+
+TEST_F(TestCompare, mannWhitneyPValue)
+{
+    // Expected values are those of the normal approximation with tie and
+    // continuity corrections, as given by scipy.stats.mannwhitneyu with
+    // alternative='greater' and method='asymptotic'
+    const vector<double> low = { 1, 2, 3, 4, 5 };
+    const vector<double> high = { 6, 7, 8, 9, 10 };
+    EXPECT_NEAR(0.006093, bench::mannWhitneyPValue(low, high), 1e-6);
+    EXPECT_NEAR(0.996692, bench::mannWhitneyPValue(high, low), 1e-6);
+    EXPECT_NEAR(0.332503, bench::mannWhitneyPValue({ 1, 3, 5, 7 }, { 2, 4, 6, 8 }), 1e-6);
+    EXPECT_NEAR(0.043179, bench::mannWhitneyPValue({ 1, 1, 2, 2 }, { 2, 2, 3, 3 }), 1e-6);
+
+    // No evidence of a slowdown without samples, or when all are the same
+    EXPECT_EQ(1.0, bench::mannWhitneyPValue(low, vector<double>()));
+    EXPECT_EQ(1.0, bench::mannWhitneyPValue(vector<double>(), high));
+    EXPECT_EQ(1.0, bench::mannWhitneyPValue({ 4, 4, 4 }, { 4, 4 }));
+}
+
+TEST_F(TestCompare, parseResults)
+{
+    const string text =
+        "{\n"
+        "  \"options\": {\"minSampleTime\": 0.01, \"warmupSamples\": 2, \"samples\": 3},\n"
+        "  \"benchmarks\": [\n"
+        "    {\"name\": \"forEach/1000\", \"iterations\": 10, \"itemsPerIteration\": 1000, \"min\": 1.5,"
+        " \"median\": 2, \"p99\": 3, \"mean\": 2.1, \"stddev\": 0.5, \"samples\": [2, 1.5, 3]},\n"
+        "    {\"name\": \"say \\\"hi\\\"\", \"extra\": [true, false, null, {\"a\": \"b\"}], \"samples\": []}\n"
+        "  ]\n"
+        "}\n";
+
+    vector<Result> results;
+    string error;
+    ASSERT_TRUE(bench::parseResults(text, results, error));
+    ASSERT_EQ(2, results.size());
+    EXPECT_EQ("forEach/1000", results[0].name);
+    EXPECT_EQ(1.5, results[0].min);
+    EXPECT_EQ(2.0, results[0].median);
+    EXPECT_EQ(0.5, results[0].stddev);
+    EXPECT_EQ((vector<double>{ 2, 1.5, 3 }), results[0].samples);
+    EXPECT_EQ("say \"hi\"", results[1].name);
+    EXPECT_TRUE(results[1].samples.empty());
+
+    ASSERT_TRUE(bench::parseResults("{}", results, error));
+    EXPECT_EQ(2, results.size());
+
+    // Every prefix of a valid file is truncated, and is rejected without
+    // changing the results
+    for (size_t length = 0; length < text.size() - 1; ++length) {
+        error.clear();
+        EXPECT_FALSE(bench::parseResults(text.substr(0, length), results, error)) << length;
+        EXPECT_FALSE(error.empty());
+        EXPECT_EQ(2, results.size());
+    }
+
+    const char *malformed[] = {
+        "[]",
+        "{\"benchmarks\": {}}",
+        "{\"benchmarks\": [{\"samples\": [1]}]}",
+        "{\"benchmarks\": [{\"name\": \"a\", \"samples\": [1,]}]}",
+        "{\"benchmarks\": [{\"name\": \"a\", \"median\": \"fast\"}]}",
+        "{\"benchmarks\": [{\"name\": \"a\"} {\"name\": \"b\"}]}",
+        "{\"benchmarks\": [], \"options\": tru}",
+        "{\"benchmarks\": []} {}",
+        "{\"benchmarks\" []}",
+        "{,}"
+    };
+    for (const char *pText: malformed) {
+        EXPECT_FALSE(bench::parseResults(pText, results, error)) << pText;
+    }
+    EXPECT_EQ(2, results.size());
+
+    EXPECT_FALSE(bench::readResults("/nonexistent/baseline.json", results, error));
+    EXPECT_NE(string::npos, error.find("/nonexistent/baseline.json"));
+}
+
+TEST_F(TestCompare, compareResults)
+{
+    const vector<Result> baseline = {
+        makeResult("same", { 10, 10, 11, 11, 12 }),
+        makeResult("slower", { 10, 10, 11, 11, 12 }),
+        makeResult("faster", { 10, 10, 11, 11, 12 }),
+        makeResult("removed", { 10, 10, 11, 11, 12 })
+    };
+
+    const vector<Result> current = {
+        makeResult("same", { 10, 11, 11, 12, 12 }),
+        makeResult("slower", { 20, 20, 21, 21, 22 }),
+        makeResult("faster", { 5, 5, 6, 6, 7 }),
+        makeResult("added", { 10, 10, 11, 11, 12 })
+    };
+
+    int regressions;
+    const string table = compare(baseline, current, regressions);
+    EXPECT_EQ(1, regressions);
+    EXPECT_NE(string::npos, table.find("REGRESSION"));
+    EXPECT_NE(string::npos, table.find("improved"));
+    EXPECT_NE(string::npos, table.find(" new\n"));
+
+    // Matched rows report the baseline figures alongside the current ones
+    char row[128];
+    snprintf(row, sizeof(row), "%-40s %12.2f %12.2f %+9.1f %+9.1f", "slower", 11.0, 21.0, 90.9, 100.0);
+    EXPECT_NE(string::npos, table.find(row)) << table;
+
+    // Benchmarks that were not run are reported, but are not regressions
+    const size_t removed = table.find("removed");
+    ASSERT_NE(string::npos, removed);
+    EXPECT_NE(string::npos, table.find("missing\n", removed));
+    EXPECT_NE(string::npos, table.find("1 missing"));
+
+    compare(baseline, baseline, regressions);
+    EXPECT_EQ(0, regressions);
+    EXPECT_EQ(string::npos, compare(baseline, baseline, regressions).find("missing"));
+}
@@ -1,5 +1,10 @@
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <set>
+#include <thread>
+#include <vector>
 
 #include "gameutils/entity.h"
 
@@ -9,6 +14,7 @@ using std::make_shared;
 using std::set;
 
 using gameutils::Component;
+using gameutils::EntityCommandBuffer;
 using gameutils::EntityId;
 using gameutils::EntityManager;
 using gameutils::InvalidEntity;
@@ -176,3 +182,2121 @@ TEST_F(TestEntity, getEntityNodes)
     EXPECT_EQ(1, entityNodesB->size());
     EXPECT_NE(entityNodesB->end(), entityNodesB->find(id2));
 }
+
+TEST_F(TestEntity, collectStats)
+{
+    struct SizedComponent: public Component
+    {
+        char data[64];
+    };
+
+    EntityManager em;
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    EXPECT_EQ(0, stats.entities.count);
+    EXPECT_EQ(0, stats.components.size());
+    EXPECT_EQ(0, stats.payloadBytes);
+
+    EntityId id1 = em.createEntity();
+    EntityId id2 = em.createEntity();
+    EXPECT_TRUE(em.attachComponent(id1, make_shared<SizedComponent>()));
+    EXPECT_TRUE(em.attachComponent(id2, make_shared<SizedComponent>()));
+    EXPECT_TRUE(em.attachComponent(id2, make_shared<AnonymousComponent1>()));
+
+    em.collectStats(stats);
+    EXPECT_EQ(2, stats.entities.count);
+    EXPECT_EQ(3, stats.entities.componentNodes);
+    EXPECT_EQ(2, stats.components.size());
+
+    for (const auto &cs: stats.components) {
+        if (cs.type == typeid(SizedComponent)) {
+            EXPECT_EQ(2, cs.count);
+            EXPECT_EQ(sizeof(SizedComponent), cs.componentSize);
+            EXPECT_EQ(2 * sizeof(SizedComponent), cs.payloadBytes);
+            EXPECT_LT(0, cs.bookkeepingBytes);
+        } else {
+            EXPECT_TRUE(cs.type == typeid(AnonymousComponent1));
+            EXPECT_EQ(1, cs.count);
+        }
+    }
+
+    EXPECT_EQ(stats.payloadBytes + stats.bookkeepingBytes, stats.totalBytes());
+    EXPECT_LT(0.0f, stats.fragmentation);
+    EXPECT_GT(1.0f, stats.fragmentation);
+
+    // Node counts must be kept up to date as entities are destroyed
+    EXPECT_TRUE(em.destroyEntity(id2));
+    em.collectStats(stats);
+    EXPECT_EQ(1, stats.entities.count);
+    EXPECT_EQ(1, stats.entities.componentNodes);
+
+    // Bucket counts return to zero once the entities are gone, including
+    // those that never had a component
+    const EntityId empty = em.createEntity();
+    EXPECT_TRUE(em.destroyEntity(empty));
+    EXPECT_TRUE(em.destroyEntity(id1));
+    em.collectStats(stats);
+    EXPECT_EQ(0, stats.entities.componentNodes);
+    EXPECT_EQ(0, stats.entities.componentNodeBuckets);
+
+    EntityManager dest;
+    const EntityId moved = em.createEntity();
+    EXPECT_TRUE(em.attachComponent(moved, make_shared<SizedComponent>()));
+    em.moveEntity(moved, dest);
+    em.moveEntity(em.createEntity(), dest);
+    em.collectStats(stats);
+    EXPECT_EQ(0, stats.entities.componentNodeBuckets);
+}
+
+struct CountedComponent: public Component
+{
+    explicit CountedComponent(int value)
+      : value(value) { }
+
+    int value;
+};
+
+TEST_F(TestEntity, moveEntity)
+{
+    EntityManager src;
+    EntityManager dest;
+
+    EntityId id = src.createEntity();
+    auto pComponent = make_shared<CountedComponent>(42);
+    EXPECT_TRUE(src.attachComponent(id, pComponent));
+    EXPECT_TRUE(src.attachComponent(id, make_shared<AnonymousComponent1>()));
+    src.markForRemoval(id);
+
+    EntityId newId = src.moveEntity(id, dest);
+    EXPECT_NE(InvalidEntity, newId);
+
+    // The entity must no longer exist in the source manager, and must not be
+    // purged later, even if its ID is reused
+    EXPECT_EQ(nullptr, src.getComponent<CountedComponent>(id));
+    EXPECT_EQ(0, src.getEntityNodes<CountedComponent>()->size());
+    EXPECT_EQ(0, src.memoryStats().entities.markedForRemoval);
+
+    // The same component instance must now be attached in the destination
+    EXPECT_EQ(pComponent, dest.getComponent<CountedComponent>(newId));
+    EXPECT_NE(nullptr, dest.getComponent<AnonymousComponent1>(newId));
+    EXPECT_EQ(1, dest.getEntityNodes<CountedComponent>()->count(newId));
+    EXPECT_EQ(2, dest.memoryStats().entities.componentNodes);
+
+    EXPECT_EQ(InvalidEntity, src.moveEntity(id, dest));
+    EXPECT_EQ(InvalidEntity, dest.moveEntity(newId, dest));
+}
+
+TEST_F(TestEntity, copyEntity)
+{
+    EntityManager src;
+    EntityManager dest;
+
+    EntityId id = src.createEntity();
+    auto pComponent = make_shared<CountedComponent>(42);
+    EXPECT_TRUE(src.attachComponent(id, pComponent));
+
+    EntityId newId = src.copyEntity(id, dest);
+    EXPECT_NE(InvalidEntity, newId);
+
+    // Both managers must have their own instance of the component
+    auto pCopy = dest.getComponent<CountedComponent>(newId);
+    EXPECT_NE(nullptr, pCopy);
+    EXPECT_NE(pComponent, pCopy);
+    EXPECT_EQ(42, pCopy->value);
+    EXPECT_EQ(pComponent, src.getComponent<CountedComponent>(id));
+
+    // Components attached via a base pointer cannot be copied
+    EntityId id2 = src.createEntity();
+    EXPECT_TRUE(src.attachComponent(id2, std::shared_ptr<Component>(make_shared<AnonymousComponent2>())));
+    EXPECT_EQ(InvalidEntity, src.copyEntity(id2, dest));
+}
+
+TEST_F(TestEntity, moveEntities)
+{
+    EntityManager src;
+    EntityManager dest;
+
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 100; ++i) {
+        EntityId id = src.createEntity();
+        EXPECT_TRUE(src.attachComponent(id, make_shared<CountedComponent>(i)));
+        ids.push_back(id);
+    }
+    ids.push_back(InvalidEntity);
+
+    std::vector<EntityId> newIds;
+    EXPECT_EQ(100, src.moveEntities(ids, dest, newIds));
+    ASSERT_EQ(ids.size(), newIds.size());
+    EXPECT_EQ(InvalidEntity, newIds.back());
+
+    for (int i = 0; i < 100; ++i) {
+        auto pComponent = dest.getComponent<CountedComponent>(newIds[i]);
+        ASSERT_NE(nullptr, pComponent);
+        EXPECT_EQ(i, pComponent->value);
+    }
+
+    EXPECT_EQ(100, dest.getEntityNodes<CountedComponent>()->size());
+    EXPECT_EQ(0, src.getEntityNodes<CountedComponent>()->size());
+    EXPECT_EQ(0, src.memoryStats().entities.count);
+}
+
+struct PooledPosition
+{
+    PooledPosition(float x, float y)
+      : x(x)
+      , y(y) { }
+
+    float x;
+    float y;
+};
+
+// Counts live instances, and is neither trivially copyable nor destructible
+struct PooledTracked
+{
+    explicit PooledTracked(int value)
+      : value(value)
+    {
+        s_live++;
+    }
+
+    PooledTracked(const PooledTracked &other)
+      : value(other.value)
+    {
+        s_live++;
+    }
+
+    ~PooledTracked()
+    {
+        s_live--;
+    }
+
+    int value;
+    static int s_live;
+};
+
+int PooledTracked::s_live = 0;
+
+TEST_F(TestEntity, componentTypeInfo)
+{
+    const gameutils::ComponentTypeInfo &position = gameutils::componentTypeInfo<PooledPosition>();
+    EXPECT_TRUE(position.type == typeid(PooledPosition));
+    EXPECT_EQ(sizeof(PooledPosition), position.size);
+    EXPECT_EQ(alignof(PooledPosition), position.alignment);
+    EXPECT_TRUE(position.triviallyCopyable);
+    EXPECT_TRUE(position.triviallyRelocatable);
+    EXPECT_TRUE(position.triviallyDestructible);
+    EXPECT_EQ(nullptr, position.destroy);
+    EXPECT_EQ(nullptr, position.copy);
+    EXPECT_NE(nullptr, position.copyConstruct);
+
+    const gameutils::ComponentTypeInfo &tracked = gameutils::componentTypeInfo<PooledTracked>();
+    EXPECT_FALSE(tracked.triviallyCopyable);
+    EXPECT_FALSE(tracked.triviallyRelocatable);
+    EXPECT_FALSE(tracked.triviallyDestructible);
+    EXPECT_NE(nullptr, tracked.destroy);
+    EXPECT_NE(nullptr, tracked.moveConstruct);
+
+    // Types are registered once, with distinct indices
+    gameutils::ComponentRegistry &registry = gameutils::ComponentRegistry::instance();
+    EXPECT_EQ(&position, &gameutils::componentTypeInfo<PooledPosition>());
+    EXPECT_EQ(&position, registry.find(typeid(PooledPosition)));
+    EXPECT_EQ(&tracked, registry.at(tracked.index));
+    EXPECT_NE(position.index, tracked.index);
+
+    // Components can still be copied by the shared_ptr-based API
+    EXPECT_NE(nullptr, gameutils::componentTypeInfo<CountedComponent>().copy);
+}
+
+TEST_F(TestEntity, addComponent)
+{
+    EntityManager em;
+    EntityId id1 = em.createEntity();
+    EntityId id2 = em.createEntity();
+
+    EXPECT_EQ(nullptr, em.findPool<PooledPosition>());
+    EXPECT_EQ(nullptr, em.findComponent<PooledPosition>(id1));
+    EXPECT_EQ(nullptr, em.addComponent<PooledPosition>(InvalidEntity, 1.0f, 2.0f));
+
+    PooledPosition *pPosition = em.addComponent<PooledPosition>(id1, 1.0f, 2.0f);
+    ASSERT_NE(nullptr, pPosition);
+    EXPECT_EQ(2.0f, pPosition->y);
+    EXPECT_EQ(nullptr, em.addComponent<PooledPosition>(id1, 3.0f, 4.0f));
+    EXPECT_NE(nullptr, em.addComponent<PooledPosition>(id2, 3.0f, 4.0f));
+
+    EXPECT_TRUE(em.hasComponent<PooledPosition>(id1));
+    EXPECT_EQ(1.0f, em.findComponent<PooledPosition>(id1)->x);
+    EXPECT_EQ(3.0f, em.findComponent<PooledPosition>(id2)->x);
+
+    // Pools are contiguous, and aligned to at least a cache line
+    const gameutils::ComponentPool *pPool = em.findPool<PooledPosition>();
+    ASSERT_NE(nullptr, pPool);
+    EXPECT_EQ(2, pPool->size());
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(pPool->data()) % 64);
+    for (size_t i = 0; i < pPool->size(); ++i) {
+        EXPECT_EQ(em.findComponent<PooledPosition>(pPool->entities()[i]), pPool->data<PooledPosition>() + i);
+    }
+
+    // Removing a component moves the last component into its place
+    EXPECT_TRUE(em.removeComponent<PooledPosition>(id1));
+    EXPECT_FALSE(em.removeComponent<PooledPosition>(id1));
+    EXPECT_FALSE(em.hasComponent<PooledPosition>(id1));
+    EXPECT_EQ(1, pPool->size());
+    EXPECT_EQ(id2, pPool->entities()[0]);
+    EXPECT_EQ(3.0f, em.findComponent<PooledPosition>(id2)->x);
+
+    // Destroying an entity removes its pooled components
+    EXPECT_TRUE(em.destroyEntity(id2));
+    EXPECT_EQ(0, pPool->size());
+
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    ASSERT_EQ(1, stats.components.size());
+    EXPECT_TRUE(stats.components[0].type == typeid(PooledPosition));
+    EXPECT_EQ(sizeof(PooledPosition), stats.components[0].componentSize);
+    EXPECT_LE(2, stats.components[0].capacity);
+
+    // Components can be copied from the same pool while it grows
+    std::vector<EntityId> ids;
+    do {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(ids.size()), 0.0f);
+    } while (pPool->size() < pPool->capacity());
+
+    const size_t capacity = pPool->capacity();
+    const EntityId copyId = em.createEntity();
+    ASSERT_NE(nullptr, em.addComponent<PooledPosition>(copyId, *em.findComponent<PooledPosition>(ids[0])));
+    EXPECT_LT(capacity, pPool->capacity());
+    EXPECT_EQ(1.0f, em.findComponent<PooledPosition>(copyId)->x);
+
+    const gameutils::ComponentTypeInfo &info = gameutils::componentTypeInfo<PooledPosition>();
+    while (pPool->size() < pPool->capacity()) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), 2.0f, 0.0f);
+    }
+
+    const EntityId infoCopyId = em.createEntity();
+    ASSERT_NE(nullptr, em.addComponent(infoCopyId, info, em.findComponent<PooledPosition>(copyId)));
+    EXPECT_EQ(1.0f, em.findComponent<PooledPosition>(infoCopyId)->x);
+}
+
+TEST_F(TestEntity, componentPoolLifetimes)
+{
+    PooledTracked::s_live = 0;
+
+    {
+        EntityManager em;
+        std::vector<EntityId> ids;
+
+        // Growing the pool must move components, rather than leak or
+        // double-destroy them
+        for (int i = 0; i < 100; ++i) {
+            ids.push_back(em.createEntity());
+            EXPECT_NE(nullptr, em.addComponent<PooledTracked>(ids.back(), i));
+        }
+        EXPECT_EQ(100, PooledTracked::s_live);
+
+        for (int i = 0; i < 100; i += 2) {
+            EXPECT_TRUE(em.removeComponent<PooledTracked>(ids[i]));
+        }
+        EXPECT_EQ(50, PooledTracked::s_live);
+
+        for (int i = 1; i < 100; i += 2) {
+            EXPECT_EQ(i, em.findComponent<PooledTracked>(ids[i])->value);
+        }
+
+        // Copies construct new instances, and moves relocate existing ones
+        EntityManager dest;
+        EntityId copyId = em.copyEntity(ids[1], dest);
+        EXPECT_EQ(51, PooledTracked::s_live);
+        EXPECT_EQ(1, dest.findComponent<PooledTracked>(copyId)->value);
+
+        EntityId moveId = em.moveEntity(ids[3], dest);
+        EXPECT_EQ(51, PooledTracked::s_live);
+        EXPECT_EQ(3, dest.findComponent<PooledTracked>(moveId)->value);
+        EXPECT_FALSE(em.hasComponent<PooledTracked>(ids[3]));
+
+        EXPECT_TRUE(em.destroyAllEntities());
+        EXPECT_EQ(2, PooledTracked::s_live);
+    }
+
+    EXPECT_EQ(0, PooledTracked::s_live);
+}
+
+struct UnusedPooled
+{
+    int value;
+};
+
+TEST_F(TestEntity, forEachChunk)
+{
+    EntityManager em;
+    const int count = 10000;
+    for (int i = 0; i < count; ++i) {
+        const EntityId id = em.createEntity();
+        em.addComponent<PooledPosition>(id, static_cast<float>(i), 0.0f);
+        if (i % 3 == 0) {
+            em.addComponent<PooledTracked>(id, i);
+        }
+    }
+
+    // Entities without every component are skipped
+    size_t visited = 0;
+    size_t chunks = 0;
+    auto check = [&](size_t n, const EntityId *pEntities, PooledPosition *pPositions,
+        PooledTracked *pTracked) {
+        EXPECT_GE(static_cast<size_t>(EntityManager::ChunkSize), n);
+        EXPECT_EQ(0, reinterpret_cast<uintptr_t>(pPositions) % 64);
+        EXPECT_EQ(0, reinterpret_cast<uintptr_t>(pTracked) % 64);
+        for (size_t i = 0; i < n; ++i) {
+            EXPECT_EQ(em.findComponent<PooledPosition>(pEntities[i]), &pPositions[i]);
+            EXPECT_EQ(em.findComponent<PooledTracked>(pEntities[i]), &pTracked[i]);
+            EXPECT_EQ(static_cast<int>(pPositions[i].x), pTracked[i].value);
+        }
+        visited += n;
+        chunks++;
+    };
+
+    EXPECT_EQ(3334, (em.forEachChunk<PooledPosition, PooledTracked>(check)));
+    EXPECT_EQ(3334, visited);
+    EXPECT_EQ(1, chunks);
+
+    // The alignment is kept until one of the pools changes
+    const uint64_t version = em.findPool<PooledPosition>()->version();
+    EXPECT_EQ(3334, (em.forEachChunk<PooledTracked, PooledPosition>(
+        [](size_t, const EntityId *, PooledTracked *, PooledPosition *) { })));
+    EXPECT_EQ(3334, (em.forEachChunk<PooledPosition, PooledTracked>(
+        [](size_t, const EntityId *, PooledPosition *, PooledTracked *) { })));
+    EXPECT_EQ(version, em.findPool<PooledPosition>()->version());
+
+    EXPECT_TRUE(em.removeComponent<PooledTracked>(em.findPool<PooledTracked>()->entities()[0]));
+    visited = 0;
+    chunks = 0;
+    EXPECT_EQ(3333, (em.forEachChunk<PooledPosition, PooledTracked>(check)));
+    EXPECT_EQ(3333, visited);
+
+    // Large pools are split into several chunks
+    visited = 0;
+    chunks = 0;
+    EXPECT_EQ(count, em.forEachChunk<PooledPosition>([&](size_t n, const EntityId *, PooledPosition *pPositions) {
+        EXPECT_EQ(0, reinterpret_cast<uintptr_t>(pPositions) % 64);
+        visited += n;
+        chunks++;
+    }));
+    EXPECT_EQ(count, visited);
+    EXPECT_EQ(3, chunks);
+
+    EXPECT_EQ(0, (em.forEachChunk<PooledPosition, UnusedPooled>(
+        [](size_t, const EntityId *, PooledPosition *, UnusedPooled *) { ADD_FAILURE(); })));
+}
+
+TEST_F(TestEntity, forEach)
+{
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 100; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(i), 0.0f);
+        EXPECT_TRUE(em.attachComponent(ids.back(), make_shared<CountedComponent>(i)));
+    }
+
+    // Pools are visited backwards, so each odd entity destroys itself and
+    // the even entity before it, while entities divisible by 5 lose their
+    // attached component
+    std::set<EntityId> visited;
+    em.forEach<PooledPosition>([&](EntityId id, PooledPosition &position) {
+        EXPECT_TRUE(visited.insert(id).second);
+        EXPECT_EQ(&position, em.findComponent<PooledPosition>(id));
+
+        const int i = static_cast<int>(position.x);
+        if (i % 5 == 0) {
+            EXPECT_TRUE(em.detachComponent<CountedComponent>(id));
+        }
+
+        if (i % 2 == 1) {
+            EXPECT_TRUE(em.destroyEntity(ids[i - 1]));
+            EXPECT_FALSE(em.destroyEntity(ids[i - 1]));
+            EXPECT_TRUE(em.destroyEntity(id));
+            EXPECT_EQ(nullptr, em.findComponent<PooledPosition>(id));
+        }
+    });
+
+    // Destroyed entities that had not yet been visited are skipped
+    EXPECT_EQ(50, visited.size());
+    EXPECT_EQ(0, em.findPool<PooledPosition>()->size());
+    EXPECT_EQ(0, em.getEntityNodes<CountedComponent>()->size());
+
+    for (int i = 0; i < 10; ++i) {
+        ids[i] = em.createEntity();
+        EXPECT_TRUE(em.attachComponent(ids[i], make_shared<CountedComponent>(i)));
+        em.addComponent<PooledPosition>(ids[i], static_cast<float>(i), 0.0f);
+    }
+
+    // Changes made within nested loops are deferred until the outer loop ends
+    size_t outer = 0;
+    em.forEachAttached<CountedComponent>([&](EntityId id, std::shared_ptr<CountedComponent> pComponent) {
+        outer++;
+        if (pComponent->value == 0) {
+            em.forEach<PooledPosition>([&](EntityId innerId, PooledPosition &) {
+                EXPECT_TRUE(em.removeComponent<PooledPosition>(innerId));
+            });
+            EXPECT_EQ(10, em.findPool<PooledPosition>()->size());
+        }
+
+        if (pComponent->value % 2) {
+            EXPECT_TRUE(em.detachComponent<CountedComponent>(id));
+            EXPECT_EQ(nullptr, em.getComponent<CountedComponent>(id));
+        }
+    });
+
+    EXPECT_EQ(10, outer);
+    EXPECT_EQ(0, em.findPool<PooledPosition>()->size());
+    EXPECT_EQ(5, em.getEntityNodes<CountedComponent>()->size());
+}
+
+TEST_F(TestEntity, forEach_transfers)
+{
+    EntityManager em;
+    EntityManager other;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 10; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(i), 0.0f);
+    }
+
+    // Only the entity being visited can be moved, since moving any other
+    // entity would change the pool under the loop
+    std::set<EntityId> visited;
+    std::vector<EntityId> newIds;
+    em.forEach<PooledPosition>([&](EntityId id, PooledPosition &position) {
+        EXPECT_TRUE(visited.insert(id).second);
+
+        const int i = static_cast<int>(position.x);
+        if (i > 0) {
+            EXPECT_EQ(InvalidEntity, em.moveEntity(ids[i - 1], other));
+            EXPECT_EQ(0, em.moveEntities({ ids[0], ids[i - 1] }, other, newIds));
+            EXPECT_NE(InvalidEntity, em.copyEntity(ids[i - 1], other));
+        }
+
+        EXPECT_EQ(0, other.merge(std::move(em)));
+        EXPECT_EQ(0, em.merge(std::move(other)));
+
+        if (i % 2 == 0) {
+            EXPECT_NE(InvalidEntity, em.moveEntity(id, other));
+            EXPECT_EQ(nullptr, em.findComponent<PooledPosition>(id));
+        }
+    });
+
+    EXPECT_EQ(10, visited.size());
+    EXPECT_EQ(5, em.findPool<PooledPosition>()->size());
+    EXPECT_EQ(14, other.findPool<PooledPosition>()->size());
+}
+
+struct SharedMesh
+{
+    explicit SharedMesh(int mesh)
+      : mesh(mesh) { }
+
+    bool operator==(const SharedMesh &other) const
+    {
+        return mesh == other.mesh;
+    }
+
+    int mesh;
+};
+
+namespace gameutils {
+
+template<>
+struct SharedComponentHash<SharedMesh>
+{
+    size_t operator()(const SharedMesh &value) const
+    {
+        return std::hash<int>()(value.mesh);
+    }
+};
+
+}   // end namespace gameutils
+
+TEST_F(TestEntity, enableDisable)
+{
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 10; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(i), 0.0f);
+        em.addComponent<PooledTracked>(ids.back(), i);
+        EXPECT_TRUE(em.attachComponent(ids.back(), make_shared<CountedComponent>(i)));
+    }
+
+    EXPECT_FALSE(em.setEntityEnabled(InvalidEntity, false));
+    EXPECT_FALSE(em.setComponentEnabled<UnusedPooled>(ids[0], false));
+    EXPECT_TRUE(em.setEntityEnabled(ids[2], false));
+    EXPECT_TRUE(em.setComponentEnabled<PooledTracked>(ids[5], false));
+    EXPECT_FALSE(em.isEntityEnabled(ids[2]));
+    EXPECT_TRUE(em.isEntityEnabled(ids[5]));
+    EXPECT_FALSE(em.isComponentEnabled<PooledTracked>(ids[5]));
+    EXPECT_TRUE(em.isComponentEnabled<PooledPosition>(ids[5]));
+    EXPECT_EQ(1, em.memoryStats().entities.disabled);
+
+    // Disabled components can still be found by ID
+    EXPECT_EQ(5, em.findComponent<PooledTracked>(ids[5])->value);
+
+    std::set<int> visited;
+    em.forEach<PooledTracked>([&](EntityId, PooledTracked &tracked) {
+        visited.insert(tracked.value);
+    });
+    EXPECT_EQ((std::set<int>{0, 1, 3, 4, 6, 7, 8, 9}), visited);
+
+    visited.clear();
+    em.forEach<PooledTracked>([&](EntityId, PooledTracked &tracked) {
+        visited.insert(tracked.value);
+    }, gameutils::IncludeDisabled);
+    EXPECT_EQ(10, visited.size());
+
+    visited.clear();
+    em.forEachAttached<CountedComponent>([&](EntityId, const std::shared_ptr<CountedComponent> &pComponent) {
+        visited.insert(pComponent->value);
+    });
+    EXPECT_EQ(9, visited.size());
+    EXPECT_EQ(0, visited.count(2));
+
+    // Chunks are split around disabled entities
+    size_t chunks = 0;
+    EXPECT_EQ(8, (em.forEachChunk<PooledPosition, PooledTracked>(
+        [&](size_t n, const EntityId *pEntities, PooledPosition *, PooledTracked *pTracked) {
+            for (size_t i = 0; i < n; ++i) {
+                EXPECT_TRUE(em.isEntityEnabled(pEntities[i]));
+                EXPECT_NE(5, pTracked[i].value);
+            }
+            chunks++;
+        })));
+    EXPECT_EQ(3, chunks);
+    EXPECT_EQ(9, em.forEachChunk<PooledPosition>([](size_t, const EntityId *, PooledPosition *) { }));
+
+    // Entities can be toggled while iterating
+    em.forEach<PooledPosition>([&](EntityId id, PooledPosition &) {
+        em.setEntityEnabled(id, false);
+    });
+    EXPECT_EQ(10, em.memoryStats().entities.disabled);
+    for (EntityId id: ids) {
+        EXPECT_TRUE(em.setEntityEnabled(id, true));
+    }
+    EXPECT_TRUE(em.isEntityEnabled(ids[2]));
+
+    // Moving an entity keeps its state, and removing a component enables it
+    EXPECT_TRUE(em.setEntityEnabled(ids[7], false));
+    EntityManager dest;
+    const EntityId moved = em.moveEntity(ids[5], dest);
+    const EntityId copied = em.copyEntity(ids[7], dest);
+    EXPECT_FALSE(dest.isComponentEnabled<PooledTracked>(moved));
+    EXPECT_FALSE(dest.isEntityEnabled(copied));
+    EXPECT_FALSE(em.isEntityEnabled(ids[7]));
+
+    EXPECT_TRUE(dest.removeComponent<PooledTracked>(moved));
+    dest.addComponent<PooledTracked>(moved, 5);
+    EXPECT_TRUE(dest.isComponentEnabled<PooledTracked>(moved));
+
+    // Destroyed entities do not leave their state behind
+    EXPECT_TRUE(em.destroyEntity(ids[7]));
+    EXPECT_EQ(0, em.memoryStats().entities.disabled);
+
+    gameutils::EntityRemap remap;
+    em.merge(std::move(dest), &remap);
+    EXPECT_FALSE(em.isEntityEnabled(remap(copied)));
+    EXPECT_TRUE(em.isComponentEnabled<PooledTracked>(remap(moved)));
+    EXPECT_EQ(1, em.memoryStats().entities.disabled);
+}
+
+TEST_F(TestEntity, expiryWheel)
+{
+    gameutils::ExpiryWheel wheel;
+    std::vector<EntityId> expired;
+
+    // Delays that span several levels of the wheel expire on the right tick
+    std::map<EntityId, uint64_t> expected;
+    const uint64_t delays[] = {1, 2, 63, 64, 65, 100, 4095, 4096, 4097, 70000, 300000};
+    EntityId next = 1;
+    for (uint64_t delay: delays) {
+        wheel.schedule(next, delay);
+        expected[next++] = delay;
+    }
+
+    wheel.schedule(next, 0);
+    expected[next++] = 1;
+
+    // Rescheduling and cancelling
+    wheel.schedule(next, 10);
+    wheel.schedule(next, 5000);
+    expected[next++] = 5000;
+    wheel.schedule(next, 50);
+    EXPECT_TRUE(wheel.cancel(next));
+    EXPECT_FALSE(wheel.cancel(next));
+    EXPECT_EQ(expected.size(), wheel.size());
+    EXPECT_EQ(4096, wheel.remaining(8));
+
+    for (uint64_t tick = 1; tick <= 300000; ++tick) {
+        expired.clear();
+        wheel.advance(1, expired);
+        for (EntityId entityId: expired) {
+            EXPECT_EQ(expected[entityId], tick);
+            expected.erase(entityId);
+        }
+    }
+
+    EXPECT_TRUE(expected.empty());
+    EXPECT_EQ(0, wheel.size());
+
+    // Advancing an empty wheel is free, and advancing by several ticks
+    // expires everything in between
+    wheel.advance(uint64_t(1) << 40, expired);
+    EXPECT_EQ(300000 + (uint64_t(1) << 40), wheel.now());
+    wheel.schedule(1, 10);
+    wheel.schedule(2, 1000);
+    wheel.schedule(3, std::numeric_limits<uint64_t>::max());
+    expired.clear();
+    wheel.advance(1000, expired);
+    EXPECT_EQ((std::vector<EntityId>{1, 2}), expired);
+    EXPECT_EQ(std::numeric_limits<uint64_t>::max() - wheel.now(), wheel.remaining(3));
+}
+
+TEST_F(TestEntity, lifetimes)
+{
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 10; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(i), 0.0f);
+        EXPECT_TRUE(em.setLifetime(ids.back(), 1 + i));
+    }
+
+    EXPECT_FALSE(em.setLifetime(InvalidEntity, 1));
+    EXPECT_TRUE(em.clearLifetime(ids[9]));
+    EXPECT_EQ(0, em.remainingLifetime(ids[9]));
+    EXPECT_EQ(5, em.remainingLifetime(ids[4]));
+
+    EXPECT_EQ(1, em.advanceLifetimes());
+    EXPECT_FALSE(em.hasComponent<PooledPosition>(ids[0]));
+    EXPECT_EQ(3, em.advanceLifetimes(3));
+    EXPECT_EQ(6, em.memoryStats().entities.count);
+
+    // Destroyed entities no longer expire, even if their ID is reused
+    EXPECT_TRUE(em.destroyEntity(ids[4]));
+    EXPECT_EQ(0, em.remainingLifetime(ids[4]));
+
+    // Entities expiring during iteration are destroyed once it completes
+    bool advanced = false;
+    em.forEach<PooledPosition>([&](EntityId, PooledPosition &) {
+        if (!advanced) {
+            EXPECT_EQ(1, em.advanceLifetimes(2));
+            advanced = true;
+        }
+    });
+    EXPECT_FALSE(em.hasComponent<PooledPosition>(ids[5]));
+    EXPECT_EQ(4, em.memoryStats().entities.count);
+
+    // Moving an entity keeps its remaining lifetime
+    EntityManager dest;
+    dest.advanceLifetimes(100);
+    const EntityId moved = em.moveEntity(ids[8], dest);
+    EXPECT_EQ(3, dest.remainingLifetime(moved));
+    EXPECT_EQ(0, em.remainingLifetime(ids[8]));
+
+    gameutils::EntityRemap remap;
+    em.merge(std::move(dest), &remap);
+    EXPECT_EQ(3, em.remainingLifetime(remap(moved)));
+    EXPECT_EQ(3, em.advanceLifetimes(3));
+    EXPECT_EQ(1, em.memoryStats().entities.count);
+
+    EXPECT_TRUE(em.setLifetime(ids[9], 1));
+    EXPECT_TRUE(em.destroyAllEntities());
+    EXPECT_EQ(0, em.advanceLifetimes());
+}
+
+TEST_F(TestEntity, updateIntervals)
+{
+    using gameutils::UpdateBuckets;
+
+    EXPECT_EQ(1, UpdateBuckets::roundInterval(0));
+    EXPECT_EQ(4, UpdateBuckets::roundInterval(3));
+    EXPECT_EQ(static_cast<uint32_t>(UpdateBuckets::MaxInterval), UpdateBuckets::roundInterval(1000));
+
+    EntityManager em;
+    std::vector<EntityId> ids;
+    const uint32_t intervals[] = {1, 2, 8, 8, 3};
+    for (int i = 0; i < 1000; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledTracked>(ids.back(), i);
+        EXPECT_TRUE(em.setUpdateInterval(ids.back(), intervals[i % 5]));
+    }
+
+    const EntityId unscheduled = em.createEntity();
+    em.addComponent<PooledTracked>(unscheduled, -1);
+    EXPECT_FALSE(em.setUpdateInterval(InvalidEntity, 1));
+    EXPECT_EQ(4, em.updateInterval(ids[4]));
+    EXPECT_EQ(0, em.updateInterval(unscheduled));
+
+    // The load is spread evenly across ticks
+    const UpdateBuckets &buckets = em.updateBuckets();
+    size_t minDue = buckets.dueCount(0);
+    size_t maxDue = minDue;
+    for (uint64_t tick = 0; tick < UpdateBuckets::MaxInterval; ++tick) {
+        minDue = std::min(minDue, buckets.dueCount(tick));
+        maxDue = std::max(maxDue, buckets.dueCount(tick));
+    }
+    EXPECT_LE(maxDue - minDue, 2);
+
+    // Each entity is visited once per interval
+    std::vector<int> visits(ids.size());
+    for (uint64_t tick = 100; tick < 164; ++tick) {
+        size_t due = 0;
+        em.forEachDue<PooledTracked>(tick, [&](EntityId id, PooledTracked &tracked, uint32_t interval) {
+            ASSERT_NE(unscheduled, id);
+            EXPECT_EQ(em.updateInterval(id), interval);
+            visits[tracked.value]++;
+            due++;
+        });
+        EXPECT_EQ(buckets.dueCount(tick), due);
+    }
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        EXPECT_EQ(64 / em.updateInterval(ids[i]), visits[i]);
+    }
+
+    // Intervals can be changed, and entities destroyed, while iterating.
+    // ids[0] is visited first, so it is destroyed immediately.
+    const size_t dueCount = buckets.dueCount(0);
+    size_t visited = 0;
+    em.forEachDue<PooledTracked>(0, [&](EntityId id, PooledTracked &, uint32_t) {
+        em.setUpdateInterval(id, 1);
+        em.destroyEntity(ids[0]);
+        visited++;
+    });
+    EXPECT_EQ(dueCount, visited);
+    EXPECT_EQ(0, em.updateInterval(ids[0]));
+    EXPECT_EQ(999, buckets.size());
+
+    EntityManager dest;
+    const EntityId moved = em.moveEntity(ids[2], dest);
+    EXPECT_EQ(8, dest.updateInterval(moved));
+    EXPECT_EQ(0, em.updateInterval(ids[2]));
+
+    gameutils::EntityRemap remap;
+    em.merge(std::move(dest), &remap);
+    EXPECT_EQ(8, em.updateInterval(remap(moved)));
+    EXPECT_EQ(999, buckets.size());
+
+    EXPECT_TRUE(em.clearUpdateInterval(ids[1]));
+    EXPECT_TRUE(em.destroyAllEntities());
+    EXPECT_EQ(0, buckets.size());
+}
+
+struct SparseFlag
+{
+    explicit SparseFlag(int value)
+      : value(value) { }
+
+    int value;
+};
+
+// Neither copyable nor movable, so can only be stored stably
+struct StableBlock
+{
+    explicit StableBlock(int value)
+      : value(value) { }
+
+    StableBlock(const StableBlock &) = delete;
+
+    int value;
+    char payload[256];
+};
+
+struct CopyableBlock
+{
+    explicit CopyableBlock(int value)
+      : value(value) { }
+
+    int value;
+    char payload[256];
+};
+
+struct FrozenTag { };
+
+namespace gameutils {
+
+template<>
+struct ComponentStoragePolicy<SparseFlag>: std::integral_constant<StoragePolicy, SparseStorage> { };
+
+template<>
+struct ComponentStoragePolicy<StableBlock>: std::integral_constant<StoragePolicy, StableStorage> { };
+
+template<>
+struct ComponentStoragePolicy<CopyableBlock>: std::integral_constant<StoragePolicy, StableStorage> { };
+
+template<>
+struct ComponentStoragePolicy<FrozenTag>: std::integral_constant<StoragePolicy, TagStorage> { };
+
+}   // end namespace gameutils
+
+TEST_F(TestEntity, storagePolicies)
+{
+    using gameutils::componentTypeInfo;
+
+    EXPECT_EQ(gameutils::PooledStorage, componentTypeInfo<PooledPosition>().storage);
+    EXPECT_EQ(gameutils::TagStorage, componentTypeInfo<FrozenTag>().storage);
+
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 100; ++i) {
+        ids.push_back(em.createEntity());
+    }
+
+    // Stable components are never moved
+    std::vector<StableBlock *> blocks;
+    for (int i = 0; i < 100; ++i) {
+        blocks.push_back(em.addComponent<StableBlock>(ids[i], i));
+        ASSERT_TRUE(blocks.back() != nullptr);
+    }
+
+    EXPECT_EQ(nullptr, em.addComponent<StableBlock>(ids[0], 0));
+    for (int i = 0; i < 100; i += 2) {
+        EXPECT_TRUE(em.removeComponent<StableBlock>(ids[i]));
+    }
+
+    for (int i = 1; i < 100; i += 2) {
+        EXPECT_EQ(blocks[i], em.findComponent<StableBlock>(ids[i]));
+        EXPECT_EQ(i, blocks[i]->value);
+    }
+
+    EXPECT_NE(nullptr, em.addComponent<SparseFlag>(ids[7], 7));
+    EXPECT_NE(nullptr, em.addComponent<FrozenTag>(ids[7]));
+    EXPECT_NE(nullptr, em.addComponent<FrozenTag>(ids[8]));
+    EXPECT_EQ(nullptr, em.addComponent<FrozenTag>(ids[8]));
+    EXPECT_EQ(7, em.findComponent<SparseFlag>(ids[7])->value);
+    EXPECT_TRUE(em.hasComponent<FrozenTag>(ids[8]));
+    EXPECT_FALSE(em.hasComponent<FrozenTag>(ids[9]));
+    EXPECT_FALSE(em.hasComponent<SparseFlag>(ids[8]));
+
+    // forEach allows the same structural changes for every policy
+    int visited = 0;
+    em.forEach<FrozenTag>([&](EntityId id, FrozenTag &) {
+        visited++;
+        em.removeComponent<FrozenTag>(id);
+        em.destroyEntity(ids[7]);
+    });
+    EXPECT_EQ(2, visited);
+    EXPECT_FALSE(em.hasComponent<FrozenTag>(ids[8]));
+    EXPECT_EQ(nullptr, em.findComponent<SparseFlag>(ids[7]));
+    EXPECT_EQ(nullptr, em.findComponent<StableBlock>(ids[7]));
+
+    int sum = 0;
+    em.forEach<StableBlock>([&](EntityId, StableBlock &block) {
+        sum += block.value;
+    });
+    EXPECT_EQ(2500 - 7, sum);
+
+    // Cloning, moving and merging
+    const EntityId source = em.createEntity();
+    em.addComponent<SparseFlag>(source, 3);
+    em.addComponent<CopyableBlock>(source, 4);
+    em.addComponent<FrozenTag>(source);
+
+    std::vector<EntityId> newIds;
+    EXPECT_EQ(2, em.cloneEntity(source, 2, newIds));
+    EXPECT_EQ(3, em.findComponent<SparseFlag>(newIds[1])->value);
+    EXPECT_EQ(4, em.findComponent<CopyableBlock>(newIds[1])->value);
+    EXPECT_TRUE(em.hasComponent<FrozenTag>(newIds[1]));
+
+    // StableBlock cannot be copied
+    EXPECT_EQ(0, em.cloneEntity(ids[1], 1, newIds));
+
+    EntityManager dest;
+    const EntityId moved = em.moveEntity(newIds[0], dest);
+    EXPECT_EQ(4, dest.findComponent<CopyableBlock>(moved)->value);
+    EXPECT_TRUE(dest.hasComponent<FrozenTag>(moved));
+    EXPECT_FALSE(em.hasComponent<FrozenTag>(newIds[0]));
+
+    EntityManager staging(&em);
+    const EntityId staged = staging.createEntity();
+    staging.addComponent<SparseFlag>(staged, 9);
+    staging.addComponent<FrozenTag>(staged);
+    em.merge(std::move(staging));
+    EXPECT_EQ(9, em.findComponent<SparseFlag>(staged)->value);
+    EXPECT_TRUE(em.hasComponent<FrozenTag>(staged));
+
+    // StableBlock cannot be moved either, so the entity stays where it is
+    EXPECT_EQ(InvalidEntity, em.moveEntity(ids[1], dest));
+    EXPECT_EQ(blocks[1], em.findComponent<StableBlock>(ids[1]));
+    EXPECT_EQ(1, blocks[1]->value);
+
+    // Its store can only be merged whole, into a manager without one
+    EntityManager blockStaging(&em);
+    const EntityId blockStaged = blockStaging.createEntity();
+    StableBlock *pBlock = blockStaging.addComponent<StableBlock>(blockStaged, 5);
+    EXPECT_EQ(0, em.merge(std::move(blockStaging)));
+    EXPECT_EQ(pBlock, blockStaging.findComponent<StableBlock>(blockStaged));
+    EXPECT_FALSE(em.hasComponent<StableBlock>(blockStaged));
+
+    EntityManager blockDest;
+    blockDest.addComponent<StableBlock>(blockDest.createEntity(), 6);
+    EXPECT_TRUE(blockDest.destroyAllEntities());
+    EXPECT_EQ(1, blockDest.merge(std::move(blockStaging)));
+    EXPECT_EQ(pBlock, blockDest.findComponent<StableBlock>(blockStaged));
+    EXPECT_EQ(5, pBlock->value);
+    EXPECT_FALSE(blockStaging.hasComponent<StableBlock>(blockStaged));
+
+    EXPECT_TRUE(em.destroyAllEntities());
+    EXPECT_FALSE(em.hasComponent<FrozenTag>(staged));
+    EXPECT_EQ(0, em.memoryStats().payloadBytes);
+}
+
+TEST_F(TestEntity, sharedComponents)
+{
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 100; ++i) {
+        ids.push_back(em.createEntity());
+        EXPECT_NE(nullptr, em.setSharedComponent(ids.back(), SharedMesh(i % 3)));
+    }
+
+    EXPECT_EQ(nullptr, em.setSharedComponent(InvalidEntity, SharedMesh(0)));
+
+    // Entities with equal values share a single instance
+    const gameutils::SharedComponentStore<SharedMesh> *pStore = em.findSharedComponents<SharedMesh>();
+    ASSERT_NE(nullptr, pStore);
+    EXPECT_EQ(3, pStore->valueCount());
+    EXPECT_EQ(100, pStore->size());
+    EXPECT_EQ(em.findSharedComponent<SharedMesh>(ids[0]), em.findSharedComponent<SharedMesh>(ids[3]));
+    EXPECT_NE(em.findSharedComponent<SharedMesh>(ids[0]), em.findSharedComponent<SharedMesh>(ids[1]));
+
+    size_t groups = 0;
+    size_t entities = 0;
+    em.forEachSharedGroup<SharedMesh>([&](const SharedMesh &value, const EntityId *pEntities, size_t count) {
+        groups++;
+        entities += count;
+        for (size_t i = 0; i < count; ++i) {
+            EXPECT_EQ(value.mesh, em.findSharedComponent<SharedMesh>(pEntities[i])->mesh);
+        }
+    });
+    EXPECT_EQ(3, groups);
+    EXPECT_EQ(100, entities);
+
+    // Changing a value moves the entity to another group, and values are
+    // released once they are no longer used
+    EXPECT_EQ(2, em.setSharedComponent(ids[0], SharedMesh(2))->mesh);
+    EXPECT_EQ(33, pStore->findEntities(SharedMesh(0))->size());
+    EXPECT_EQ(34, pStore->findEntities(SharedMesh(2))->size());
+
+    for (int i = 0; i < 100; ++i) {
+        if (em.findSharedComponent<SharedMesh>(ids[i])->mesh == 1) {
+            EXPECT_TRUE(i % 2 ? em.destroyEntity(ids[i]) : em.removeSharedComponent<SharedMesh>(ids[i]));
+        }
+    }
+    EXPECT_EQ(2, pStore->valueCount());
+    EXPECT_EQ(nullptr, pStore->findEntities(SharedMesh(1)));
+    EXPECT_FALSE(em.removeSharedComponent<SharedMesh>(ids[1]));
+
+    // Payload scales with distinct values, rather than with entities
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    ASSERT_EQ(1, stats.components.size());
+    EXPECT_EQ(67, stats.components[0].count);
+    EXPECT_EQ(2 * sizeof(SharedMesh), stats.components[0].payloadBytes);
+
+    // Shared values are interned again when entities are moved
+    EntityManager dest;
+    EntityId newId = em.moveEntity(ids[0], dest);
+    EXPECT_EQ(2, dest.findSharedComponent<SharedMesh>(newId)->mesh);
+    EXPECT_EQ(nullptr, em.findSharedComponent<SharedMesh>(ids[0]));
+    EXPECT_EQ(66, pStore->size());
+}
+
+TEST_F(TestEntity, cloneEntity)
+{
+    PooledTracked::s_live = 0;
+
+    {
+        EntityManager em;
+        EntityId id = em.createEntity();
+        auto pComponent = make_shared<CountedComponent>(7);
+        EXPECT_TRUE(em.attachComponent(id, pComponent));
+        em.addComponent<PooledTracked>(id, 8);
+        em.setSharedComponent(id, SharedMesh(9));
+
+        std::vector<EntityId> newIds;
+        EXPECT_EQ(100, em.cloneEntity(id, 100, newIds));
+        ASSERT_EQ(100, newIds.size());
+        EXPECT_EQ(101, em.getEntityNodes<CountedComponent>()->size());
+        EXPECT_EQ(101, em.findPool<PooledTracked>()->size());
+        EXPECT_EQ(101, PooledTracked::s_live);
+        EXPECT_EQ(1, em.findSharedComponents<SharedMesh>()->valueCount());
+
+        // Each clone has its own copy of every component
+        std::set<EntityId> unique(newIds.begin(), newIds.end());
+        EXPECT_EQ(100, unique.size());
+        for (EntityId newId: newIds) {
+            EXPECT_NE(id, newId);
+            auto pCopy = em.getComponent<CountedComponent>(newId);
+            ASSERT_NE(nullptr, pCopy);
+            EXPECT_NE(pComponent, pCopy);
+            EXPECT_EQ(7, pCopy->value);
+            EXPECT_EQ(8, em.findComponent<PooledTracked>(newId)->value);
+            EXPECT_EQ(em.findSharedComponent<SharedMesh>(id), em.findSharedComponent<SharedMesh>(newId));
+        }
+
+        // A prefab outlives the entity it was made from
+        gameutils::Prefab prefab;
+        EXPECT_TRUE(em.makePrefab(id, prefab));
+        EXPECT_EQ(3, prefab.size());
+        EXPECT_EQ(102, PooledTracked::s_live);
+        EXPECT_TRUE(em.destroyEntity(id));
+        pComponent->value = 0;
+
+        EntityManager other;
+        EXPECT_EQ(10, other.instantiate(prefab, 10, newIds));
+        EXPECT_EQ(7, other.getComponent<CountedComponent>(newIds[9])->value);
+        EXPECT_EQ(8, other.findComponent<PooledTracked>(newIds[9])->value);
+        EXPECT_EQ(9, other.findSharedComponent<SharedMesh>(newIds[9])->mesh);
+
+        EXPECT_EQ(0, em.cloneEntity(id, 10, newIds));
+        EXPECT_TRUE(newIds.empty());
+        EXPECT_FALSE(em.makePrefab(id, prefab));
+        EXPECT_TRUE(prefab.empty());
+
+        // Components attached via a base pointer cannot be copied
+        EntityId id2 = em.createEntity();
+        EXPECT_TRUE(em.attachComponent(id2, std::shared_ptr<Component>(make_shared<AnonymousComponent2>())));
+        EXPECT_EQ(0, em.cloneEntity(id2, 10, newIds));
+    }
+
+    EXPECT_EQ(0, PooledTracked::s_live);
+}
+
+struct Targeting: public Component
+{
+    explicit Targeting(EntityId target)
+      : target(target) { }
+
+    EntityId target;
+};
+
+struct PooledTargeting
+{
+    EntityId target;
+};
+
+namespace gameutils {
+
+template<>
+struct EntityFields<Targeting>
+{
+    static void remap(Targeting &component, const EntityRemap &remap)
+    {
+        remap.apply(component.target);
+    }
+};
+
+template<>
+struct EntityFields<PooledTargeting>
+{
+    static void remap(PooledTargeting &component, const EntityRemap &remap)
+    {
+        remap.apply(component.target);
+    }
+};
+
+}   // end namespace gameutils
+
+TEST_F(TestEntity, merge)
+{
+    EntityManager live;
+    EntityId liveId = live.createEntity();
+    live.addComponent<PooledPosition>(liveId, 1.0f, 0.0f);
+
+    // A staging manager reserves its IDs from the live manager, so no
+    // entities need to be given new IDs
+    EntityManager staging(&live);
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 10; ++i) {
+        ids.push_back(staging.createEntity());
+        EXPECT_NE(liveId, ids.back());
+        EXPECT_TRUE(staging.attachComponent(ids.back(), make_shared<CountedComponent>(i)));
+        staging.addComponent<PooledPosition>(ids.back(), 2.0f, static_cast<float>(i));
+        staging.addComponent<PooledTracked>(ids.back(), i);
+        staging.setSharedComponent(ids.back(), SharedMesh(i % 2));
+    }
+    staging.markForRemoval(ids[0]);
+
+    auto pNodes = staging.getEntityNodes<CountedComponent>();
+    gameutils::EntityRemap remap;
+    EXPECT_EQ(10, live.merge(std::move(staging), &remap));
+    EXPECT_TRUE(remap.empty());
+
+    // Entity nodes are adopted rather than rebuilt
+    EXPECT_EQ(pNodes, live.getEntityNodes<CountedComponent>());
+    EXPECT_EQ(11, live.findPool<PooledPosition>()->size());
+    EXPECT_EQ(10, live.findPool<PooledTracked>()->size());
+    EXPECT_EQ(2, live.findSharedComponents<SharedMesh>()->valueCount());
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_EQ(i, live.getComponent<CountedComponent>(ids[i])->value);
+        EXPECT_EQ(static_cast<float>(i), live.findComponent<PooledPosition>(ids[i])->y);
+        EXPECT_EQ(i, live.findComponent<PooledTracked>(ids[i])->value);
+        EXPECT_EQ(i % 2, live.findSharedComponent<SharedMesh>(ids[i])->mesh);
+    }
+    EXPECT_EQ(1.0f, live.findComponent<PooledPosition>(liveId)->x);
+
+    // The staging manager is left empty, but usable
+    gameutils::MemoryStats stats;
+    staging.collectStats(stats);
+    EXPECT_EQ(0, stats.entities.count);
+    EXPECT_EQ(0, stats.entities.componentNodes);
+    EXPECT_EQ(0, stats.payloadBytes);
+    EXPECT_NE(InvalidEntity, staging.createEntity());
+
+    live.purge();
+    EXPECT_EQ(nullptr, live.getComponent<CountedComponent>(ids[0]));
+
+    // Entities from an unrelated manager may need new IDs, in which case
+    // their entity fields are updated
+    EntityManager other;
+    EntityId a = other.createEntity();
+    EntityId b = other.createEntity();
+    EXPECT_EQ(liveId, a);
+    EXPECT_TRUE(other.attachComponent(a, make_shared<Targeting>(b)));
+    other.addComponent<PooledTargeting>(b)->target = a;
+    other.addComponent<PooledPosition>(b, 3.0f, 0.0f);
+
+    EXPECT_EQ(2, live.merge(std::move(other), &remap));
+    EXPECT_EQ(1, remap.size());
+    const EntityId newA = remap(a);
+    EXPECT_NE(a, newA);
+    EXPECT_EQ(b, remap(b));
+    EXPECT_EQ(b, live.getComponent<Targeting>(newA)->target);
+    EXPECT_EQ(newA, live.findComponent<PooledTargeting>(b)->target);
+    EXPECT_EQ(3.0f, live.findComponent<PooledPosition>(b)->x);
+    EXPECT_EQ(1.0f, live.findComponent<PooledPosition>(liveId)->x);
+}
+
+struct TimeResource
+{
+    explicit TimeResource(float elapsed)
+      : elapsed(elapsed) { }
+
+    float elapsed;
+};
+
+struct InputResource
+{
+    int buttons;
+};
+
+TEST_F(TestEntity, resources)
+{
+    EntityManager em;
+    EXPECT_FALSE(em.hasResource<TimeResource>());
+    EXPECT_EQ(nullptr, em.findResource<TimeResource>());
+    EXPECT_THROW(em.resource<TimeResource>(), std::runtime_error);
+
+    TimeResource &time = em.setResource<TimeResource>(1.0f);
+    EXPECT_TRUE(em.hasResource<TimeResource>());
+    EXPECT_FALSE(em.hasResource<InputResource>());
+    EXPECT_EQ(&time, &em.resource<TimeResource>());
+    EXPECT_EQ(&time, em.findResource<TimeResource>());
+
+    em.resource<TimeResource>().elapsed += 0.5f;
+    EXPECT_EQ(1.5f, static_cast<const EntityManager &>(em).resource<TimeResource>().elapsed);
+
+    // Setting a resource again replaces its value
+    EXPECT_EQ(3.0f, em.setResource<TimeResource>(3.0f).elapsed);
+    EXPECT_EQ(3.0f, em.resource<TimeResource>().elapsed);
+
+    // Resources are separate for each manager, and survive destroyAllEntities
+    EntityManager other;
+    EXPECT_FALSE(other.hasResource<TimeResource>());
+    em.setResource<InputResource>();
+    em.destroyAllEntities();
+    EXPECT_TRUE(em.hasResource<InputResource>());
+
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    EXPECT_EQ(sizeof(TimeResource) + sizeof(InputResource), stats.resourceBytes);
+
+    EXPECT_TRUE(em.removeResource<TimeResource>());
+    EXPECT_FALSE(em.removeResource<TimeResource>());
+    EXPECT_FALSE(em.hasResource<TimeResource>());
+    EXPECT_TRUE(em.hasResource<InputResource>());
+}
+
+TEST_F(TestEntity, ResourceAccess)
+{
+    using gameutils::ResourceAccess;
+
+    ResourceAccess readTime = ResourceAccess().read<TimeResource>();
+    ResourceAccess readBoth = ResourceAccess().read<TimeResource>().read<InputResource>();
+    ResourceAccess writeTime = ResourceAccess().write<TimeResource>();
+    ResourceAccess writeInput = ResourceAccess().read<TimeResource>().write<InputResource>();
+
+    EXPECT_TRUE(readBoth.reads<InputResource>());
+    EXPECT_FALSE(readBoth.writes<InputResource>());
+    EXPECT_TRUE(writeTime.reads<TimeResource>());
+    EXPECT_TRUE(writeTime.writes<TimeResource>());
+
+    // Reads never conflict with each other
+    EXPECT_FALSE(readTime.conflictsWith(readBoth));
+    EXPECT_FALSE(readTime.conflictsWith(writeInput));
+
+    EXPECT_TRUE(readTime.conflictsWith(writeTime));
+    EXPECT_TRUE(writeTime.conflictsWith(readTime));
+    EXPECT_TRUE(writeTime.conflictsWith(writeTime));
+    EXPECT_TRUE(readBoth.conflictsWith(writeInput));
+    EXPECT_FALSE(writeTime.conflictsWith(ResourceAccess().write<InputResource>()));
+
+    EXPECT_TRUE(readTime.merge(writeInput).writes<InputResource>());
+    EXPECT_TRUE(readTime.conflictsWith(readBoth));
+}
+
+struct UnitComponent: public Component
+{
+    UnitComponent(uint64_t accountId, int team)
+      : accountId(accountId)
+      , team(team) { }
+
+    uint64_t accountId;
+    int team;
+};
+
+template<typename Range>
+static set<EntityId> indexedEntities(const Range &range)
+{
+    set<EntityId> entities;
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        entities.insert(iter->second);
+    }
+
+    return entities;
+}
+
+struct DamageEvent
+{
+    DamageEvent(EntityId target, int amount)
+      : target(target)
+      , amount(amount) { }
+
+    EntityId target;
+    int amount;
+};
+
+TEST_F(TestEntity, events)
+{
+    EntityManager em;
+    EXPECT_TRUE(em.events<DamageEvent>().empty());
+
+    // Events are readable after the next swap, and discarded by the one after
+    em.emit<DamageEvent>(1, 10);
+    em.emit<DamageEvent>(2, 20);
+    EXPECT_TRUE(em.events<DamageEvent>().empty());
+    EXPECT_EQ(2, em.pendingEvents<DamageEvent>());
+
+    em.swapEvents();
+    gameutils::EventSpan<DamageEvent> events = em.events<DamageEvent>();
+    ASSERT_EQ(2, events.size());
+    EXPECT_EQ(events.data() + 2, events.end());
+    EXPECT_EQ(1, events[0].target);
+    EXPECT_EQ(20, events[1].amount);
+    EXPECT_EQ(0, em.pendingEvents<DamageEvent>());
+
+    em.emit<DamageEvent>(3, 30);
+    em.swapEvents();
+    ASSERT_EQ(1, em.events<DamageEvent>().size());
+    EXPECT_EQ(3, em.events<DamageEvent>()[0].target);
+
+    em.swapEvents();
+    EXPECT_TRUE(em.events<DamageEvent>().empty());
+
+    // Buffers are reused once they have grown to fit a frame
+    gameutils::MemoryStats before;
+    for (int frame = 0; frame < 4; ++frame) {
+        for (int i = 0; i < 100; ++i) {
+            em.emit<DamageEvent>(i, frame);
+        }
+        em.swapEvents();
+        if (frame == 1) {
+            em.collectStats(before);
+        }
+    }
+    gameutils::MemoryStats after;
+    em.collectStats(after);
+    EXPECT_EQ(before.bookkeepingBytes, after.bookkeepingBytes);
+    EXPECT_EQ(100, em.events<DamageEvent>().size());
+
+    // Events are not shared between managers, and survive destroyAllEntities
+    EntityManager other;
+    EXPECT_TRUE(other.events<DamageEvent>().empty());
+    em.destroyAllEntities();
+    EXPECT_EQ(100, em.events<DamageEvent>().size());
+}
+
+TEST_F(TestEntity, valueIndexes)
+{
+    EntityManager em;
+    const EntityId a = em.createEntity();
+    const EntityId b = em.createEntity();
+    const EntityId c = em.createEntity();
+    em.attachComponent(a, make_shared<UnitComponent>(100, 1));
+    em.attachComponent(b, make_shared<UnitComponent>(200, 2));
+
+    // Existing components are indexed when the index is added
+    auto &byAccount = em.addHashIndex(&UnitComponent::accountId);
+    auto &byTeam = em.addOrderedIndex(&UnitComponent::team);
+    EXPECT_EQ(2, byAccount.size());
+    EXPECT_EQ(a, byAccount.findFirst(100));
+    EXPECT_EQ(gameutils::InvalidEntity, byAccount.findFirst(300));
+    EXPECT_TRUE(byAccount.find(300).empty());
+
+    em.attachComponent(c, make_shared<UnitComponent>(300, 2));
+    EXPECT_EQ(c, byAccount.findFirst(300));
+    EXPECT_EQ(2, byTeam.count(2));
+    EXPECT_EQ(set<EntityId>({b, c}), indexedEntities(byTeam.find(2)));
+    EXPECT_EQ(set<EntityId>({a, b, c}), indexedEntities(byTeam.range(0, 5)));
+    EXPECT_EQ(set<EntityId>({a}), indexedEntities(byTeam.range(1, 1)));
+    EXPECT_TRUE(indexedEntities(byTeam.range(3, 1)).empty());
+
+    // Modification
+    EXPECT_TRUE(em.modifyComponent<UnitComponent>(b, [](UnitComponent &unit) {
+        unit.accountId = 201;
+        unit.team = 3;
+    }));
+    EXPECT_EQ(gameutils::InvalidEntity, byAccount.findFirst(200));
+    EXPECT_EQ(b, byAccount.findFirst(201));
+    EXPECT_EQ(b, byTeam.findFirst(3));
+    EXPECT_FALSE(em.modifyComponent<UnitComponent>(em.createEntity(), [](UnitComponent &) { }));
+
+    em.getComponent<UnitComponent>(a)->team = 2;
+    EXPECT_EQ(a, byTeam.findFirst(1));
+    EXPECT_TRUE(em.reindexComponent<UnitComponent>(a));
+    EXPECT_EQ(set<EntityId>({a, c}), indexedEntities(byTeam.find(2)));
+
+    // Detaching, destruction and moving remove entities from the index
+    EXPECT_TRUE(em.detachComponent<UnitComponent>(c));
+    EXPECT_EQ(gameutils::InvalidEntity, byAccount.findFirst(300));
+    EXPECT_TRUE(em.destroyEntity(a));
+    EXPECT_EQ(1, byAccount.size());
+    EXPECT_EQ(1, byTeam.size());
+
+    EntityManager dest;
+    auto &destByAccount = dest.addHashIndex(&UnitComponent::accountId);
+    const EntityId moved = em.moveEntity(b, dest);
+    EXPECT_EQ(0, byAccount.size());
+    EXPECT_EQ(moved, destByAccount.findFirst(201));
+
+    // Merged components are indexed using their new IDs
+    EntityManager staging;
+    const EntityId d = staging.createEntity();
+    staging.attachComponent(d, make_shared<UnitComponent>(400, 4));
+    staging.addHashIndex(&UnitComponent::accountId);
+    gameutils::EntityRemap remap;
+    em.merge(std::move(staging), &remap);
+    EXPECT_EQ(remap(d), byAccount.findFirst(400));
+    EXPECT_EQ(remap(d), byTeam.findFirst(4));
+
+    em.destroyAllEntities();
+    EXPECT_EQ(0, byAccount.size());
+    EXPECT_EQ(0, byTeam.size());
+
+    EXPECT_TRUE(em.removeIndex(byAccount));
+    EXPECT_FALSE(em.removeIndex(destByAccount));
+    EXPECT_TRUE(dest.removeIndex(destByAccount));
+}
+
+TEST_F(TestEntity, valueIndexes_pooledAndStored)
+{
+    EntityManager em;
+    const EntityId a = em.createEntity();
+    const EntityId b = em.createEntity();
+    const EntityId c = em.createEntity();
+    em.addComponent<PooledPosition>(a, 1.0f, 0.0f);
+    em.addComponent<SparseFlag>(a, 10);
+
+    // Existing pooled and stored components are indexed when the index is added
+    auto &byX = em.addOrderedIndex(&PooledPosition::x);
+    auto &byFlag = em.addHashIndex(&SparseFlag::value);
+    EXPECT_EQ(a, byX.findFirst(1.0f));
+    EXPECT_EQ(a, byFlag.findFirst(10));
+
+    em.addComponent<PooledPosition>(b, 2.0f, 0.0f);
+    em.addComponent<PooledPosition>(c, 3.0f, 0.0f);
+    em.addComponent<SparseFlag>(c, 30);
+    EXPECT_EQ(set<EntityId>({b, c}), indexedEntities(byX.range(2.0f, 3.0f)));
+    EXPECT_EQ(c, byFlag.findFirst(30));
+
+    // Modification, for which there is no attached component
+    EXPECT_TRUE(em.modifyComponent<PooledPosition>(b, [](PooledPosition &position) {
+        position.x = 5.0f;
+    }));
+    EXPECT_EQ(b, byX.findFirst(5.0f));
+    em.findComponent<SparseFlag>(c)->value = 31;
+    EXPECT_TRUE(em.reindexComponent<SparseFlag>(c));
+    EXPECT_EQ(gameutils::InvalidEntity, byFlag.findFirst(30));
+    EXPECT_EQ(c, byFlag.findFirst(31));
+    EXPECT_FALSE(em.reindexComponent<SparseFlag>(b));
+
+    // Removal, destruction, expiry and moving remove entities from the index
+    EXPECT_TRUE(em.removeComponent<PooledPosition>(a));
+    EXPECT_EQ(gameutils::InvalidEntity, byX.findFirst(1.0f));
+    EXPECT_EQ(2, byX.size());
+    EXPECT_TRUE(em.destroyEntity(a));
+    EXPECT_EQ(1, byFlag.size());
+
+    EXPECT_TRUE(em.setLifetime(b, 1));
+    EXPECT_EQ(1, em.advanceLifetimes());
+    EXPECT_EQ(1, byX.size());
+
+    EntityManager dest;
+    auto &destByFlag = dest.addHashIndex(&SparseFlag::value);
+    const EntityId moved = em.moveEntity(c, dest);
+    EXPECT_EQ(0, byX.size());
+    EXPECT_EQ(0, byFlag.size());
+    EXPECT_EQ(moved, destByFlag.findFirst(31));
+
+    // Stores and pools that are adopted by a merge are indexed
+    em.merge(std::move(dest));
+    EXPECT_EQ(moved, byFlag.findFirst(31));
+    EXPECT_EQ(moved, byX.findFirst(3.0f));
+    EXPECT_EQ(0, destByFlag.size());
+
+    // Memory used by indexes is part of the bookkeeping, and grows with the
+    // number of entities indexed
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    const size_t indexBytes = stats.indexBytes;
+    EXPECT_LT(byX.bookkeepingBytes() + byFlag.bookkeepingBytes(), indexBytes);
+    EXPECT_LE(indexBytes, stats.bookkeepingBytes);
+
+    std::vector<EntityId> more;
+    for (int i = 0; i < 100; ++i) {
+        more.push_back(em.createEntity());
+        em.addComponent<SparseFlag>(more.back(), i % 10);
+    }
+    em.collectStats(stats);
+    EXPECT_LT(indexBytes + 100 * sizeof(EntityId), stats.indexBytes);
+    for (EntityId id: more) {
+        EXPECT_TRUE(em.destroyEntity(id));
+    }
+
+    // Once an index is removed, the pool no longer reports to it
+    EXPECT_TRUE(em.removeIndex(byFlag));
+    const EntityId d = em.createEntity();
+    em.addComponent<PooledPosition>(d, 4.0f, 0.0f);
+    em.addComponent<SparseFlag>(d, 40);
+    EXPECT_EQ(d, byX.findFirst(4.0f));
+    em.collectStats(stats);
+    EXPECT_LT(stats.indexBytes, indexBytes);
+
+    em.destroyAllEntities();
+    EXPECT_EQ(0, byX.size());
+}
+
+namespace gameutils {
+
+template<>
+struct ChecksumHash<UnitComponent>
+{
+    uint64_t operator()(const UnitComponent &unit) const
+    {
+        return unit.accountId * 31 + static_cast<uint64_t>(unit.team);
+    }
+};
+
+}   // end namespace gameutils
+
+struct CountedHash
+{
+    uint64_t operator()(const CountedComponent &component) const
+    {
+        return static_cast<uint64_t>(component.value);
+    }
+};
+
+TEST_F(TestEntity, checksums)
+{
+    using gameutils::ComponentChecksum;
+
+    EntityManager em;
+    EntityManager peer;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 100; ++i) {
+        ids.push_back(em.createEntity());
+        EXPECT_EQ(ids.back(), peer.createEntity());
+    }
+
+    // Components are hashed when the checksum is added, or when attached
+    for (size_t i = 0; i < 50; ++i) {
+        em.attachComponent(ids[i], make_shared<UnitComponent>(i, 1));
+    }
+    auto &units = em.addChecksum<UnitComponent>(1);
+    EXPECT_EQ(1, units.typeId());
+    EXPECT_THROW((em.addChecksum<CountedComponent, CountedHash>(1)), std::runtime_error);
+    for (size_t i = 50; i < ids.size(); ++i) {
+        em.attachComponent(ids[i], make_shared<UnitComponent>(i, 1));
+    }
+    EXPECT_EQ(100, units.size());
+
+    // The checksum does not depend on the order of attachment
+    auto &peerUnits = peer.addChecksum<UnitComponent>(1);
+    for (size_t i = ids.size(); i-- > 0;) {
+        peer.attachComponent(ids[i], make_shared<UnitComponent>(i, 1));
+    }
+    EXPECT_EQ(units.value(), peerUnits.value());
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // Nor on the order in which checksums are added
+    em.attachComponent(ids[0], make_shared<CountedComponent>(5));
+    peer.attachComponent(ids[0], make_shared<CountedComponent>(5));
+    auto &counted = em.addChecksum<CountedComponent, CountedHash>(2);
+    EntityManager reordered;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        EXPECT_EQ(ids[i], reordered.createEntity());
+    }
+    reordered.addChecksum<CountedComponent, CountedHash>(2);
+    reordered.addChecksum<UnitComponent>(1);
+    reordered.attachComponent(ids[0], make_shared<CountedComponent>(5));
+    for (size_t i = 0; i < ids.size(); ++i) {
+        reordered.attachComponent(ids[i], make_shared<UnitComponent>(i, 1));
+    }
+    EXPECT_NE(em.checksum(), peer.checksum());
+    EXPECT_EQ(em.checksum(), reordered.checksum());
+    EXPECT_TRUE(em.removeIndex(counted));
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // Swapping the values of two entities changes the checksum
+    em.modifyComponent<UnitComponent>(ids[3], [](UnitComponent &unit) { unit.accountId = 4; });
+    em.modifyComponent<UnitComponent>(ids[4], [](UnitComponent &unit) { unit.accountId = 3; });
+    EXPECT_NE(units.value(), peerUnits.value());
+    EXPECT_NE(em.checksum(), peer.checksum());
+
+    // Find the diverging entities by comparing buckets
+    std::set<EntityId> diverging;
+    for (size_t b = 0; b < ComponentChecksum::BucketCount; ++b) {
+        if (units.bucketValues()[b] != peerUnits.bucketValues()[b]) {
+            units.forEachInBucket(b, [&](EntityId id, uint64_t hash) {
+                EXPECT_EQ(b, ComponentChecksum::bucketOf(id));
+                if (hash != peerUnits.entityHash(id)) {
+                    diverging.insert(id);
+                }
+            });
+        }
+    }
+    EXPECT_EQ(set<EntityId>({ids[3], ids[4]}), diverging);
+
+    // Direct modification is seen once reindexed
+    em.getComponent<UnitComponent>(ids[3])->accountId = 3;
+    em.getComponent<UnitComponent>(ids[4])->accountId = 4;
+    EXPECT_NE(em.checksum(), peer.checksum());
+    em.reindexComponent<UnitComponent>(ids[3]);
+    em.reindexComponent<UnitComponent>(ids[4]);
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // Detaching and destruction remove entities from the checksum
+    const uint64_t before = units.value();
+    EXPECT_TRUE(em.detachComponent<UnitComponent>(ids[10]));
+    EXPECT_NE(before, units.value());
+    EXPECT_EQ(0, units.entityHash(ids[10]));
+    em.attachComponent(ids[10], make_shared<UnitComponent>(10, 1));
+    EXPECT_EQ(before, units.value());
+
+    EXPECT_TRUE(em.destroyEntity(ids[20]));
+    EXPECT_TRUE(peer.destroyEntity(ids[20]));
+    EXPECT_EQ(99, units.size());
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    em.destroyAllEntities();
+    EXPECT_EQ(0, units.size());
+    EXPECT_EQ(0, units.value());
+
+    // Removed checksums are no longer combined
+    const uint64_t empty = em.checksum();
+    EXPECT_TRUE(em.removeIndex(units));
+    EXPECT_NE(empty, em.checksum());
+    EXPECT_EQ(0, em.checksum());
+}
+
+struct PositionHash
+{
+    uint64_t operator()(const PooledPosition &position) const
+    {
+        return static_cast<uint64_t>(position.x * 1000.0f) * 31 +
+            static_cast<uint64_t>(position.y * 1000.0f);
+    }
+};
+
+struct SparseFlagHash
+{
+    uint64_t operator()(const SparseFlag &flag) const
+    {
+        return static_cast<uint64_t>(flag.value);
+    }
+};
+
+TEST_F(TestEntity, checksums_pooledAndStored)
+{
+    EntityManager em;
+    EntityManager peer;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 20; ++i) {
+        ids.push_back(em.createEntity());
+        EXPECT_EQ(ids.back(), peer.createEntity());
+    }
+
+    // Pooled and stored components are hashed when added, in any order
+    auto &positions = em.addChecksum<PooledPosition, PositionHash>(1);
+    em.addChecksum<SparseFlag, SparseFlagHash>(2);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        em.addComponent<PooledPosition>(ids[i], static_cast<float>(i), 1.0f);
+        em.addComponent<SparseFlag>(ids[i], static_cast<int>(i));
+    }
+    EXPECT_EQ(20, positions.size());
+    EXPECT_NE(0, em.checksum());
+
+    for (size_t i = ids.size(); i-- > 0;) {
+        peer.addComponent<PooledPosition>(ids[i], static_cast<float>(i), 1.0f);
+        peer.addComponent<SparseFlag>(ids[i], static_cast<int>(i));
+    }
+    peer.addChecksum<SparseFlag, SparseFlagHash>(2);
+    peer.addChecksum<PooledPosition, PositionHash>(1);
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // Relocation within a pool does not change the checksum
+    EXPECT_TRUE(em.removeComponent<PooledPosition>(ids[0]));
+    em.addComponent<PooledPosition>(ids[0], 0.0f, 1.0f);
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // A desync in either type is detected
+    em.modifyComponent<PooledPosition>(ids[5], [](PooledPosition &position) { position.y = 2.0f; });
+    EXPECT_NE(em.checksum(), peer.checksum());
+    em.findComponent<PooledPosition>(ids[5])->y = 1.0f;
+    em.reindexComponent<PooledPosition>(ids[5]);
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    EXPECT_TRUE(em.removeComponent<SparseFlag>(ids[7]));
+    EXPECT_NE(em.checksum(), peer.checksum());
+    EXPECT_TRUE(peer.removeComponent<SparseFlag>(ids[7]));
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // Destruction removes every component of the entity
+    EXPECT_TRUE(em.destroyEntity(ids[9]));
+    EXPECT_TRUE(peer.destroyEntity(ids[9]));
+    EXPECT_EQ(19, positions.size());
+    EXPECT_EQ(em.checksum(), peer.checksum());
+
+    // The per-entity hashes are included in the memory statistics
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    EXPECT_LT(sizeof(gameutils::ComponentChecksum) + 19 * (sizeof(EntityId) + sizeof(uint64_t)),
+        positions.bookkeepingBytes());
+    EXPECT_LT(positions.bookkeepingBytes(), stats.indexBytes);
+    EXPECT_LT(19, positions.heapBlocks());
+}
+
+struct Targets { };
+struct DockedAt { };
+
+TEST_F(TestEntity, relations)
+{
+    EntityManager em;
+    const EntityId turret1 = em.createEntity();
+    const EntityId turret2 = em.createEntity();
+    const EntityId ship = em.createEntity();
+    const EntityId station = em.createEntity();
+
+    EXPECT_TRUE(em.addRelation<Targets>(turret1, ship));
+    EXPECT_TRUE(em.addRelation<Targets>(turret2, ship));
+    EXPECT_TRUE(em.addRelation<Targets>(turret2, station));
+    EXPECT_TRUE(em.addRelation<DockedAt>(ship, station));
+    EXPECT_FALSE(em.addRelation<Targets>(turret1, ship));
+    EXPECT_FALSE(em.addRelation<Targets>(turret1, gameutils::InvalidEntity));
+
+    EXPECT_TRUE(em.hasRelation<Targets>(turret2, station));
+    EXPECT_FALSE(em.hasRelation<Targets>(station, turret2));
+    EXPECT_FALSE(em.hasRelation<DockedAt>(turret2, station));
+    EXPECT_EQ(set<EntityId>({turret1, turret2}), set<EntityId>(
+        em.relationSources<Targets>(ship).begin(), em.relationSources<Targets>(ship).end()));
+    EXPECT_EQ(set<EntityId>({ship, station}), set<EntityId>(
+        em.relationTargets<Targets>(turret2).begin(), em.relationTargets<Targets>(turret2).end()));
+    EXPECT_TRUE(em.relationTargets<Targets>(ship).empty());
+    EXPECT_EQ(3, em.getRelations<Targets>().size());
+
+    EXPECT_TRUE(em.removeRelation<Targets>(turret2, ship));
+    EXPECT_FALSE(em.removeRelation<Targets>(turret2, ship));
+    EXPECT_EQ(1, em.relationSources<Targets>(ship).size());
+    EXPECT_EQ(station, em.relationTargets<Targets>(turret2)[0]);
+
+    // Queries match on the target, and see only sources with the component
+    em.addComponent<PooledPosition>(turret1, 0.0f, 0.0f);
+    em.addComponent<PooledPosition>(turret2, 0.0f, 0.0f);
+    em.addComponent<PooledPosition>(ship, 1.0f, 0.0f);
+    em.addRelation<Targets>(ship, station);
+    em.setEntityEnabled(turret1, false);
+
+    std::vector<EntityId> related;
+    const auto collect = [&related](EntityId id, PooledPosition &) { related.push_back(id); };
+    em.forEachRelated<Targets, PooledPosition>(station, collect);
+    EXPECT_EQ(set<EntityId>({turret2, ship}), set<EntityId>(related.begin(), related.end()));
+    related.clear();
+    em.forEachRelated<Targets, PooledPosition>(ship, collect);
+    EXPECT_TRUE(related.empty());
+    em.forEachRelated<Targets, PooledPosition>(ship, collect, gameutils::IncludeDisabled);
+    EXPECT_EQ(std::vector<EntityId>({turret1}), related);
+    em.forEachRelated<DockedAt, PooledPosition>(station, collect);
+    EXPECT_EQ(std::vector<EntityId>({turret1, ship}), related);
+
+    // Relationships can be changed during the query
+    related.clear();
+    em.forEachRelated<Targets, PooledPosition>(station, [&](EntityId id, PooledPosition &) {
+        em.removeRelation<Targets>(id, station);
+        em.removeComponent<PooledPosition>(id);
+        related.push_back(id);
+    });
+    EXPECT_EQ(2, related.size());
+    EXPECT_TRUE(em.relationSources<Targets>(station).empty());
+    EXPECT_FALSE(em.hasComponent<PooledPosition>(ship));
+    em.setEntityEnabled(turret1, true);
+
+    // Destroying a target removes the relationships of every kind
+    EXPECT_TRUE(em.destroyEntity(station));
+    EXPECT_TRUE(em.relationTargets<Targets>(turret2).empty());
+    EXPECT_TRUE(em.relationTargets<DockedAt>(ship).empty());
+    EXPECT_EQ(0, em.getRelations<DockedAt>().size());
+
+    // Relationships are kept when merged, using the new IDs
+    EntityManager staging;
+    const EntityId drone = staging.createEntity();
+    const EntityId carrier = staging.createEntity();
+    staging.addRelation<DockedAt>(drone, carrier);
+    gameutils::EntityRemap remap;
+    em.merge(std::move(staging), &remap);
+    EXPECT_TRUE(em.hasRelation<DockedAt>(remap(drone), remap(carrier)));
+    EXPECT_EQ(0, staging.getRelations<DockedAt>().size());
+
+    // ...and dropped when moved to another manager
+    EntityManager dest;
+    em.moveEntity(turret1, dest);
+    EXPECT_TRUE(em.relationSources<Targets>(ship).empty());
+
+    EXPECT_EQ(1, em.removeRelations<DockedAt>(remap(carrier)));
+    em.addRelation<Targets>(turret2, ship);
+
+    // The forward and reverse indexes are included in the memory statistics
+    gameutils::MemoryStats stats;
+    em.collectStats(stats);
+    const size_t relationBytes = stats.relationBytes;
+    EXPECT_LE(relationBytes, stats.bookkeepingBytes);
+    std::vector<EntityId> targets;
+    for (int i = 0; i < 50; ++i) {
+        targets.push_back(em.createEntity());
+        EXPECT_TRUE(em.addRelation<Targets>(turret2, targets.back()));
+    }
+    em.collectStats(stats);
+    const size_t peakBytes = stats.relationBytes;
+    EXPECT_LT(relationBytes + 50 * 2 * sizeof(EntityId), peakBytes);
+
+    // Nodes and lists are freed, but the maps keep their buckets
+    em.destroyAllEntities();
+    EXPECT_EQ(0, em.getRelations<Targets>().size());
+    em.collectStats(stats);
+    EXPECT_GT(peakBytes - 50 * 2 * sizeof(EntityId), stats.relationBytes);
+}
+
+TEST_F(TestEntity, lifetimes_batch)
+{
+    EntityManager em;
+    const int liveBefore = PooledTracked::s_live;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 20; ++i) {
+        ids.push_back(em.createEntity());
+        em.addComponent<PooledPosition>(ids.back(), static_cast<float>(i), 0.0f);
+        if (i % 4 == 0) {
+            em.addComponent<PooledTracked>(ids.back(), i);
+            em.addComponent<SparseFlag>(ids.back(), i);
+            em.setSharedComponent(ids.back(), SharedMesh(i % 8));
+            EXPECT_TRUE(em.attachComponent(ids.back(), make_shared<CountedComponent>(i)));
+        }
+
+        if (i > 0) {
+            em.addRelation<Targets>(ids.back(), ids[i - 1]);
+        }
+
+        EXPECT_TRUE(em.setLifetime(ids.back(), i < 15 ? 1 : 2));
+    }
+
+    // The position pool is larger than the batch, and is searched for each
+    // expired entity, while the smaller pools are scanned instead
+    EXPECT_EQ(15, em.advanceLifetimes());
+    EXPECT_EQ(5, em.memoryStats().entities.count);
+    EXPECT_EQ(5, em.findPool<PooledPosition>()->size());
+    for (int i = 15; i < 20; ++i) {
+        EXPECT_EQ(static_cast<float>(i), em.findComponent<PooledPosition>(ids[i])->x);
+    }
+
+    EXPECT_EQ(1, em.findPool<PooledTracked>()->size());
+    EXPECT_EQ(liveBefore + 1, PooledTracked::s_live);
+    EXPECT_EQ(nullptr, em.findComponent<SparseFlag>(ids[0]));
+    EXPECT_NE(nullptr, em.findComponent<SparseFlag>(ids[16]));
+    EXPECT_EQ(1, em.findSharedComponents<SharedMesh>()->valueCount());
+    EXPECT_EQ(1, em.getEntityNodes<CountedComponent>()->size());
+    EXPECT_EQ(4, em.getRelations<Targets>().size());
+    EXPECT_TRUE(em.relationTargets<Targets>(ids[15]).empty());
+
+    EXPECT_EQ(5, em.advanceLifetimes());
+    EXPECT_EQ(0, em.memoryStats().entities.count);
+    EXPECT_EQ(liveBefore, PooledTracked::s_live);
+    EXPECT_EQ(0, em.getRelations<Targets>().size());
+}
+
+TEST_F(TestEntity, reserveEntities)
+{
+    EntityManager em;
+
+    // Blocks of reserved IDs must not overlap with each other, or with
+    // entities created normally
+    set<EntityId> usedIDs;
+    EntityId first = em.reserveEntities(16);
+    for (EntityId id = first; id > first - 16; --id) {
+        EXPECT_TRUE(usedIDs.insert(id).second);
+    }
+
+    EntityId id = em.createEntity();
+    EXPECT_TRUE(usedIDs.insert(id).second);
+
+    EntityId reserved = em.reserveEntity();
+    EXPECT_TRUE(usedIDs.insert(reserved).second);
+
+    // A reserved entity does not exist until it has been committed
+    EXPECT_FALSE(em.attachComponent(reserved, make_shared<AnonymousComponent1>()));
+    EXPECT_TRUE(em.commitEntity(reserved));
+    EXPECT_FALSE(em.commitEntity(reserved));
+    EXPECT_TRUE(em.attachComponent(reserved, make_shared<AnonymousComponent1>()));
+
+    EXPECT_EQ(InvalidEntity, em.reserveEntities(0));
+}
+
+TEST_F(TestEntity, EntityCommandBuffer)
+{
+    const int numThreads = 4;
+    const int entitiesPerThread = 1000;
+
+    EntityManager em;
+    std::vector<std::unique_ptr<EntityCommandBuffer>> buffers;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < numThreads; ++i) {
+        buffers.emplace_back(new EntityCommandBuffer(em, 16));
+    }
+
+    // Reserve IDs and queue components concurrently
+    for (int i = 0; i < numThreads; ++i) {
+        EntityCommandBuffer *pBuffer = buffers[i].get();
+        threads.push_back(std::thread([pBuffer, i] {
+            for (int j = 0; j < entitiesPerThread; ++j) {
+                EntityId id = pBuffer->createEntity();
+                pBuffer->attachComponent(id, make_shared<CountedComponent>(i));
+            }
+        }));
+    }
+
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    for (auto &pBuffer: buffers) {
+        EXPECT_EQ(2 * entitiesPerThread, pBuffer->commit());
+        EXPECT_TRUE(pBuffer->empty());
+    }
+
+    EXPECT_EQ(numThreads * entitiesPerThread, em.getEntityNodes<CountedComponent>()->size());
+    EXPECT_EQ(numThreads * entitiesPerThread, em.memoryStats().entities.count);
+
+    // Destruction is deferred until commit
+    EntityId id = em.getEntityNodes<CountedComponent>()->begin()->first;
+    buffers[0]->destroyEntity(id);
+    EXPECT_NE(nullptr, em.getComponent<CountedComponent>(id));
+    EXPECT_EQ(1, buffers[0]->commit());
+    EXPECT_EQ(nullptr, em.getComponent<CountedComponent>(id));
+}
+
+static std::atomic<int> s_racesDetected(0);
+
+static void countRace(const char *)
+{
+    s_racesDetected++;
+}
+
+TEST_F(TestEntity, concurrentReads)
+{
+    gameutils::RaceHandler previous = gameutils::setRaceHandler(&countRace);
+    s_racesDetected = 0;
+
+    EntityManager em;
+    std::vector<EntityId> ids;
+    for (int i = 0; i < 1000; ++i) {
+        EntityId id = em.createEntity();
+        EXPECT_TRUE(em.attachComponent(id, make_shared<CountedComponent>(i)));
+        em.addComponent<PooledPosition>(id, static_cast<float>(i), 0.0f);
+        em.addComponent<SparseFlag>(id, 1);
+        em.addComponent<FrozenTag>(id);
+        ids.push_back(id);
+    }
+    EXPECT_TRUE(em.setComponentEnabled<SparseFlag>(ids[0], false));
+
+    // Removing a tag invalidates the store's cached list of entities, which
+    // readers must not rebuild
+    EXPECT_TRUE(em.removeComponent<FrozenTag>(ids[1]));
+
+    std::atomic<int> total(0);
+    std::atomic<int> pooledTotal(0);
+    std::atomic<int> storedTotal(0);
+    std::atomic<int> tagged(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i) {
+        readers.push_back(std::thread([&em, &ids, &total, &pooledTotal, &storedTotal, &tagged] {
+            const EntityManager &cem = em;
+            EntityManager::ReadScope scope(cem);
+            int sum = 0;
+            for (EntityId id: ids) {
+                sum += cem.getComponent<CountedComponent>(id)->value;
+            }
+            EXPECT_EQ(ids.size(), cem.findEntityNodes<CountedComponent>()->size());
+            total += sum;
+
+            // Pooled and stored components are read using the const forEach
+            cem.forEach<PooledPosition>([&pooledTotal](EntityId, const PooledPosition &position) {
+                pooledTotal += static_cast<int>(position.x);
+            });
+            cem.forEach<SparseFlag>([&storedTotal](EntityId, const SparseFlag &flag) {
+                storedTotal += flag.value;
+            });
+            cem.forEach<FrozenTag>([&tagged](EntityId, const FrozenTag &) {
+                tagged++;
+            });
+        }));
+    }
+
+    for (auto &reader: readers) {
+        reader.join();
+    }
+
+    EXPECT_EQ(4 * (999 * 1000 / 2), total);
+    EXPECT_EQ(4 * (999 * 1000 / 2), pooledTotal);
+    EXPECT_EQ(4 * 999, storedTotal);
+    EXPECT_EQ(4 * 999, tagged);
+    EXPECT_EQ(nullptr, em.findEntityNodes<AnonymousComponent1>());
+    EXPECT_EQ(0, s_racesDetected);
+
+    gameutils::setRaceHandler(previous);
+}
+
+TEST_F(TestEntity, concurrentEvents)
+{
+    gameutils::RaceHandler previous = gameutils::setRaceHandler(&countRace);
+    s_racesDetected = 0;
+
+    EntityManager em;
+    em.registerEvent<DamageEvent>();
+
+    const int threadCount = 4;
+    const int eventsPerThread = 1000;
+    for (int frame = 0; frame < 2; ++frame) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < threadCount; ++t) {
+            threads.push_back(std::thread([&em, t] {
+                for (int i = 0; i < eventsPerThread; ++i) {
+                    em.emit<DamageEvent>(t, i);
+                }
+            }));
+        }
+
+        for (auto &thread: threads) {
+            thread.join();
+        }
+
+        em.swapEvents();
+
+        // The events of each thread stay in order
+        std::vector<int> next(threadCount, 0);
+        for (const DamageEvent &event: em.events<DamageEvent>()) {
+            EXPECT_EQ(next[event.target], event.amount);
+            next[event.target]++;
+        }
+        EXPECT_EQ(std::vector<int>(threadCount, eventsPerThread), next);
+    }
+
+    EXPECT_EQ(0, s_racesDetected);
+    gameutils::setRaceHandler(previous);
+}
+
+TEST_F(TestEntity, WriteScope)
+{
+    EntityManager em;
+    std::atomic<bool> releaseReader(false);
+    std::atomic<bool> readerStarted(false);
+    std::atomic<bool> writerFinished(false);
+
+    std::thread reader([&] {
+        EntityManager::ReadScope scope(em);
+        readerStarted = true;
+        while (!releaseReader) {
+            std::this_thread::yield();
+        }
+    });
+
+    while (!readerStarted) {
+        std::this_thread::yield();
+    }
+
+    std::thread writer([&] {
+        EntityManager::WriteScope scope(em);
+        em.createEntity();
+        writerFinished = true;
+    });
+
+    // The writer must wait for the reader to finish
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_FALSE(writerFinished);
+
+    releaseReader = true;
+    reader.join();
+    writer.join();
+    EXPECT_TRUE(writerFinished);
+}
+
+#if GAMEUTILS_ENTITY_RACE_DETECTOR
+TEST_F(TestEntity, raceDetector)
+{
+    gameutils::RaceHandler previous = gameutils::setRaceHandler(&countRace);
+    s_racesDetected = 0;
+
+    EntityManager em;
+    EntityId id = em.createEntity();
+    EXPECT_EQ(0, s_racesDetected);
+
+    // Structural changes within a read phase must be reported
+    {
+        EntityManager::ReadScope scope(em);
+        em.getComponent<CountedComponent>(id);
+        static_cast<const EntityManager &>(em).forEach<PooledPosition>(
+            [](EntityId, const PooledPosition &) { });
+        EXPECT_EQ(0, s_racesDetected);
+
+        em.attachComponent(id, make_shared<CountedComponent>(1));
+        EXPECT_EQ(1, s_racesDetected);
+    }
+
+    // Nested structural changes on the same thread are permitted
+    {
+        EntityManager::WriteScope scope(em);
+        em.markForRemoval(id);
+        em.purge();
+    }
+    EXPECT_EQ(1, s_racesDetected);
+
+    gameutils::setRaceHandler(previous);
+}
+#endif
@@ -175,6 +175,15 @@ TEST_F(TestMath, Mat3_invert)
     EXPECT_TRUE(actual.equalTo(v, 5));
 }
 
+TEST_F(TestMath, Vec3_lerp)
+{
+    Vec3<float> a(1, 2, 3);
+    Vec3<float> b(3, -2, 7);
+    EXPECT_TRUE(lerp(a, b, 0.0f).equalTo(a, 5));
+    EXPECT_TRUE(lerp(a, b, 1.0f).equalTo(b, 5));
+    EXPECT_TRUE(lerp(a, b, 0.25f).equalTo(Vec3<float>(1.5, 1, 4), 5));
+}
+
 //----------------------------------------------------------------------------
 //
 // Quat
@@ -220,3 +229,19 @@ TEST_F(TestMath, Quat_rotation)
     Mat4<float> c = a.makeMat4().transpose();
     EXPECT_TRUE(b.equalTo(c, 5));
 }
+
+TEST_F(TestMath, Quat_nlerp)
+{
+    Quat<float> a = Quat<float>::rotation(0, 0, 0, 1);
+    Quat<float> b = Quat<float>::rotation(M_PI / 2, 0, 0, 1);
+    EXPECT_TRUE(nlerp(a, b, 0.0f).equalTo(a, 5));
+    EXPECT_TRUE(nlerp(a, b, 1.0f).equalTo(b, 5));
+
+    // Halfway between two rotations about the same axis, nlerp and slerp agree
+    Quat<float> expected = Quat<float>::rotation(M_PI / 4, 0, 0, 1);
+    EXPECT_TRUE(nlerp(a, b, 0.5f).equalTo(expected, 5));
+
+    // The negation of b is the same rotation, so the shorter arc is taken
+    Quat<float> negated(-b.scalar, -b.x, -b.y, -b.z);
+    EXPECT_TRUE(nlerp(a, negated, 0.5f).equalTo(expected, 5));
+}
@@ -0,0 +1,180 @@
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "gameutils/profile.h"
+
+#include "gtest/gtest.h"
+
+using std::string;
+using std::stringstream;
+
+using gameutils::profile::ThreadBuffer;
+using gameutils::profile::Zone;
+
+class TestProfile : public testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        gameutils::profile::clear();
+    }
+};
+
+static size_t countOccurrences(const string &haystack, const string &needle)
+{
+    size_t count = 0;
+    for (size_t pos = haystack.find(needle); pos != string::npos;
+            pos = haystack.find(needle, pos + needle.size())) {
+        count++;
+    }
+
+    return count;
+}
+
+TEST_F(TestProfile, timestamp)
+{
+    const uint64_t t0 = gameutils::profile::timestamp();
+    const uint64_t t1 = gameutils::profile::timestamp();
+    EXPECT_LE(t0, t1);
+    EXPECT_LT(0.0, gameutils::profile::ticksPerMicrosecond());
+}
+
+TEST_F(TestProfile, Zone)
+{
+    ThreadBuffer &buffer = gameutils::profile::threadBuffer();
+    const uint64_t head = buffer.head.load();
+
+    {
+        Zone outer("outer");
+        Zone inner("inner");
+    }
+
+    // Inner zone is destroyed, and therefore recorded, first
+    ASSERT_EQ(head + 2, buffer.head.load());
+    const auto &inner = buffer.records[head & (ThreadBuffer::capacity - 1)];
+    const auto &outer = buffer.records[(head + 1) & (ThreadBuffer::capacity - 1)];
+    EXPECT_EQ(0, strcmp("inner", inner.name.load()));
+    EXPECT_EQ(0, strcmp("outer", outer.name.load()));
+    EXPECT_EQ(head, inner.sequence.load());
+    EXPECT_LE(outer.start.load(), inner.start.load());
+    EXPECT_LE(inner.end.load(), outer.end.load());
+}
+
+TEST_F(TestProfile, writeChromeTrace)
+{
+    {
+        Zone zone("mainZone");
+    }
+
+    std::thread worker([] {
+        gameutils::profile::setThreadName("worker \"1\"");
+        for (int i = 0; i < 3; ++i) {
+            Zone zone("workerZone");
+        }
+    });
+    worker.join();
+
+    stringstream out;
+    gameutils::profile::writeChromeTrace(out);
+    const string trace = out.str();
+
+    EXPECT_EQ(0, trace.find("{\"traceEvents\":["));
+    EXPECT_EQ(1, countOccurrences(trace, "\"name\":\"mainZone\""));
+    EXPECT_EQ(3, countOccurrences(trace, "\"name\":\"workerZone\""));
+    EXPECT_EQ(1, countOccurrences(trace, "\"name\":\"worker \\\"1\\\"\""));
+
+    // Times are written with a fixed number of decimal places, rather than
+    // in scientific notation once they become large
+    for (const char *key: { "\"ts\":", "\"dur\":" }) {
+        for (size_t pos = trace.find(key); pos != string::npos; pos = trace.find(key, pos + 1)) {
+            const size_t begin = pos + strlen(key);
+            const size_t end = trace.find_first_of(",}", begin);
+            const string value = trace.substr(begin, end - begin);
+            EXPECT_EQ(string::npos, value.find_first_not_of("-0123456789.")) << value;
+            EXPECT_EQ(value.size() - 4, value.find('.')) << value;
+        }
+    }
+
+    // The stream's own format is left unchanged
+    out.str("");
+    out << 0.5;
+    EXPECT_EQ("0.5", out.str());
+
+    // Cleared records must not be exported again
+    gameutils::profile::clear();
+    out.str("");
+    gameutils::profile::writeChromeTrace(out);
+    EXPECT_EQ(0, countOccurrences(out.str(), "Zone\""));
+}
+
+TEST_F(TestProfile, ringBufferOverwritesOldestRecords)
+{
+    for (size_t i = 0; i < ThreadBuffer::capacity + 10; ++i) {
+        Zone zone("repeated");
+    }
+
+    stringstream out;
+    gameutils::profile::writeChromeTrace(out);
+    EXPECT_EQ(ThreadBuffer::capacity, countOccurrences(out.str(), "\"name\":\"repeated\""));
+}
+
+TEST_F(TestProfile, buffersAreReused)
+{
+    ThreadBuffer *pFirst = nullptr;
+    std::thread first([&pFirst] {
+        gameutils::profile::setThreadName("first");
+        Zone zone("firstZone");
+        pFirst = &gameutils::profile::threadBuffer();
+    });
+    first.join();
+
+    // Records of a thread that has exited can still be exported
+    stringstream out;
+    gameutils::profile::writeChromeTrace(out);
+    EXPECT_EQ(1, countOccurrences(out.str(), "\"name\":\"firstZone\""));
+
+    // Until its buffer is reused by a new thread
+    ThreadBuffer *pSecond = nullptr;
+    uint32_t secondId = 0;
+    std::thread second([&pSecond, &secondId] {
+        Zone zone("secondZone");
+        pSecond = &gameutils::profile::threadBuffer();
+        secondId = pSecond->threadId;
+    });
+    second.join();
+
+    EXPECT_EQ(pFirst, pSecond);
+    out.str("");
+    gameutils::profile::writeChromeTrace(out);
+    EXPECT_EQ(0, countOccurrences(out.str(), "\"name\":\"firstZone\""));
+    EXPECT_EQ(0, countOccurrences(out.str(), "\"name\":\"first\""));
+    EXPECT_EQ(1, countOccurrences(out.str(), "\"name\":\"secondZone\""));
+    EXPECT_EQ(1, countOccurrences(out.str(), "\"tid\":" + std::to_string(secondId) + ","));
+}
+
+TEST_F(TestProfile, exportWhileRecording)
+{
+    // Records that are overwritten during the export are skipped, so every
+    // exported record is complete
+    std::atomic<bool> stop(false);
+    std::thread worker([&stop] {
+        while (!stop.load()) {
+            Zone zone("busyZone");
+        }
+    });
+
+    for (int i = 0; i < 20; ++i) {
+        stringstream out;
+        gameutils::profile::writeChromeTrace(out);
+        const string trace = out.str();
+        EXPECT_EQ(countOccurrences(trace, "\"ph\":\"X\""),
+            countOccurrences(trace, "\"name\":\"busyZone\""));
+        EXPECT_GE(ThreadBuffer::capacity, countOccurrences(trace, "\"name\":\"busyZone\""));
+    }
+
+    stop.store(true);
+    worker.join();
+}
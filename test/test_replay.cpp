@@ -0,0 +1,233 @@
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gameutils/replay.h"
+
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+using gameutils::CommandPlayer;
+using gameutils::CommandRecorder;
+using gameutils::Component;
+using gameutils::EntityId;
+using gameutils::EntityManager;
+using gameutils::ReplayFormat;
+using gameutils::ReplayResult;
+
+struct ReplayedHealth: public Component
+{
+    ReplayedHealth()
+      : value(100) { }
+
+    int value;
+};
+
+struct ReplayedPosition
+{
+    float x;
+    float y;
+};
+
+struct ReplayedUnregistered
+{
+    int value;
+};
+
+class TestReplay : public testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        m_format.registerComponent<ReplayedHealth>(1);
+        m_format.registerComponent<ReplayedPosition>(2);
+    }
+
+    struct Counts
+    {
+        size_t entities;
+        size_t health;
+        size_t positions;
+
+        bool operator==(const Counts &other) const
+        {
+            return entities == other.entities && health == other.health && positions == other.positions;
+        }
+    };
+
+    static Counts count(EntityManager &em)
+    {
+        gameutils::MemoryStats stats;
+        em.collectStats(stats);
+
+        Counts counts = { stats.entities.count, em.getEntityNodes<ReplayedHealth>()->size(), 0 };
+        em.forEach<ReplayedPosition>([&counts](EntityId, ReplayedPosition &) { counts.positions++; });
+        return counts;
+    }
+
+    // Run a session that uses each kind of change
+    static void runSession(EntityManager &em, EntityId existing)
+    {
+        vector<EntityId> ids;
+        for (int i = 0; i < 10; ++i) {
+            const EntityId id = em.createEntity();
+            em.attachComponent(id, std::make_shared<ReplayedHealth>());
+            if (i % 2 == 0) {
+                em.addComponent<ReplayedPosition>(id);
+                em.addComponent<ReplayedUnregistered>(id);
+            }
+            ids.push_back(id);
+        }
+
+        em.addComponent<ReplayedPosition>(existing);
+        em.detachComponent<ReplayedHealth>(ids[1]);
+        em.removeComponent<ReplayedPosition>(ids[2]);
+
+        em.markForRemoval(ids[3]);
+        em.markForRemoval(ids[4]);
+        em.purge();
+        em.destroyEntity(ids[5]);
+
+        // Deferred until the end of the iteration
+        em.forEach<ReplayedPosition>([&](EntityId id, ReplayedPosition &) {
+            if (id == ids[6]) {
+                em.destroyEntity(id);
+            }
+        });
+    }
+
+    ReplayFormat m_format;
+};
+
+TEST_F(TestReplay, registerComponent)
+{
+    EXPECT_THROW(m_format.registerComponent<ReplayedHealth>(3), std::runtime_error);
+    EXPECT_THROW(m_format.registerComponent<ReplayedUnregistered>(1), std::runtime_error);
+    EXPECT_EQ(nullptr, m_format.findEntry(3));
+    ASSERT_NE(nullptr, m_format.findEntry(typeid(ReplayedPosition)));
+    EXPECT_EQ(2, m_format.findEntry(typeid(ReplayedPosition))->id);
+}
+
+TEST_F(TestReplay, recordAndReplay)
+{
+    EntityManager world;
+    const EntityId existing = world.createEntity();
+
+    CommandRecorder recorder(world, m_format);
+    EXPECT_EQ(&recorder, world.recorder());
+    EXPECT_THROW(CommandRecorder(world, m_format), std::runtime_error);
+
+    runSession(world, existing);
+    recorder.stop();
+    EXPECT_EQ(nullptr, world.recorder());
+    EXPECT_EQ(5, recorder.skippedCount());
+
+    // Changes after stopping are not recorded
+    const size_t commandCount = recorder.commandCount();
+    world.createEntity();
+    EXPECT_EQ(commandCount, recorder.commandCount());
+
+    CommandPlayer player(m_format);
+    ASSERT_TRUE(player.load(recorder.data()));
+    EXPECT_EQ(commandCount, player.size());
+    EXPECT_EQ(0, player.skippedCount());
+
+    // The entity that existed before recording is created when first changed
+    EntityManager replayed;
+    const ReplayResult result = player.replay(replayed);
+    EXPECT_EQ(commandCount, result.commands);
+    EXPECT_EQ(0, result.failed);
+
+    Counts expected = count(world);
+    expected.entities--;
+    EXPECT_TRUE(expected == count(replayed));
+    EXPECT_EQ(7, count(replayed).entities);
+    EXPECT_EQ(5, count(replayed).health);
+    EXPECT_EQ(3, count(replayed).positions);
+}
+
+TEST_F(TestReplay, recordBulkChanges)
+{
+    EntityManager world;
+    EntityManager other;
+    CommandRecorder recorder(world, m_format);
+
+    // Copied components are recorded with the entities that hold them, and
+    // moving an entity away destroys it
+    const EntityId source = world.createEntity();
+    world.attachComponent(source, std::make_shared<ReplayedHealth>());
+    world.addComponent<ReplayedPosition>(source);
+
+    vector<EntityId> ids;
+    EXPECT_EQ(3, world.cloneEntity(source, 3, ids));
+    EXPECT_NE(gameutils::InvalidEntity, world.moveEntity(ids[0], other));
+
+    // A removal that follows a deferred destruction has no effect
+    world.forEach<ReplayedPosition>([&](EntityId id, ReplayedPosition &) {
+        if (id == ids[1]) {
+            world.destroyEntity(id);
+            world.removeComponent<ReplayedPosition>(id);
+        }
+    });
+    recorder.stop();
+
+    CommandPlayer player(m_format);
+    ASSERT_TRUE(player.load(recorder.data()));
+
+    EntityManager replayed;
+    EXPECT_EQ(0, player.replay(replayed).failed);
+    EXPECT_TRUE(count(world) == count(replayed));
+    EXPECT_EQ(2, count(replayed).entities);
+    EXPECT_EQ(2, count(replayed).health);
+    EXPECT_EQ(2, count(replayed).positions);
+}
+
+TEST_F(TestReplay, saveAndLoad)
+{
+    char path[] = "/tmp/gameutils_replay_XXXXXX";
+    const int fd = mkstemp(path);
+    ASSERT_NE(-1, fd);
+    close(fd);
+
+    EntityManager world;
+    CommandRecorder recorder(world, m_format);
+    runSession(world, world.createEntity());
+    ASSERT_TRUE(recorder.save(path));
+
+    CommandPlayer player(m_format);
+    ASSERT_TRUE(player.load(string(path)));
+    EXPECT_EQ(recorder.commandCount(), player.size());
+    EXPECT_FALSE(player.load(string(path) + ".missing"));
+    EXPECT_EQ(0, player.size());
+    remove(path);
+
+    // Types that are not registered are skipped when loading
+    ReplayFormat healthOnly;
+    healthOnly.registerComponent<ReplayedHealth>(1);
+    CommandPlayer partial(healthOnly);
+    ASSERT_TRUE(partial.load(recorder.data()));
+    EXPECT_LT(0, partial.skippedCount());
+    EXPECT_EQ(recorder.commandCount(), partial.size() + partial.skippedCount());
+
+    EntityManager replayed;
+    EXPECT_EQ(0, partial.replay(replayed).failed);
+    EXPECT_EQ(count(world).health, count(replayed).health);
+    EXPECT_EQ(0, count(replayed).positions);
+
+    // Malformed logs are rejected
+    vector<uint8_t> data = recorder.data();
+    data.push_back(200);
+    EXPECT_FALSE(player.load(data));
+    data.back() = gameutils::EntityRecorder::Destroy;
+    EXPECT_FALSE(player.load(data));
+    EXPECT_TRUE(player.load(vector<uint8_t>(data.begin(), data.begin() + 8)));
+    EXPECT_EQ(0, player.size());
+    data[0] = 0;
+    EXPECT_FALSE(player.load(data));
+}
@@ -0,0 +1,161 @@
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gameutils/profile.h"
+#include "gameutils/simulation.h"
+
+#include "gtest/gtest.h"
+
+using std::vector;
+
+using gameutils::EntityId;
+using gameutils::EntityManager;
+using gameutils::Quat;
+using gameutils::QuatSnapshot;
+using gameutils::SimulationConfig;
+using gameutils::SimulationRunner;
+using gameutils::Vec3;
+using gameutils::Vec3Snapshot;
+
+struct SimulatedBody
+{
+    Vec3<float> position;
+    Vec3<float> velocity;
+    Quat<float> rotation;
+};
+
+class TestSimulation : public testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        m_config.timestep = 0.25;
+        m_config.maxStepsPerFrame = 4;
+    }
+
+    EntityId createBody(EntityManager &em, float x, float vx)
+    {
+        const EntityId id = em.createEntity();
+        SimulatedBody *pBody = em.addComponent<SimulatedBody>(id);
+        pBody->position = Vec3<float>(x, 0, 0);
+        pBody->velocity = Vec3<float>(vx, 0, 0);
+        return id;
+    }
+
+    static void integrate(EntityManager &em, double dt)
+    {
+        em.forEach<SimulatedBody>([dt](EntityId, SimulatedBody &body) {
+            body.position += body.velocity * static_cast<float>(dt);
+        });
+    }
+
+    SimulationConfig m_config;
+};
+
+TEST_F(TestSimulation, advance)
+{
+    EntityManager em;
+    SimulationRunner runner(em, m_config);
+
+    vector<double> steps;
+    runner.addSystem([&](EntityManager &, double dt) { steps.push_back(dt); });
+
+    EXPECT_EQ(0, runner.advance(0.1));
+    EXPECT_FLOAT_EQ(0.4f, runner.alpha());
+    EXPECT_EQ(1, runner.advance(0.2));
+    EXPECT_FLOAT_EQ(0.2f, runner.alpha());
+    EXPECT_EQ(2, runner.advance(0.5));
+    EXPECT_EQ(3, runner.tick());
+    EXPECT_DOUBLE_EQ(0.75, runner.time());
+    EXPECT_EQ(vector<double>(3, 0.25), steps);
+
+    // Steps beyond the limit are dropped
+    EXPECT_EQ(4, runner.advance(10.0));
+    EXPECT_EQ(36, runner.droppedSteps());
+    EXPECT_LE(0.0f, runner.alpha());
+    EXPECT_GT(1.0f, runner.alpha());
+
+    runner.step();
+    EXPECT_EQ(8, runner.tick());
+
+    m_config.timestep = 0;
+    EXPECT_THROW(SimulationRunner(em, m_config), std::runtime_error);
+}
+
+TEST_F(TestSimulation, interpolateVec3)
+{
+    EntityManager em;
+    const EntityId a = createBody(em, 0, 4);
+    const EntityId b = createBody(em, 10, -4);
+
+    SimulationRunner runner(em, m_config);
+    runner.addSystem(integrate);
+    const Vec3Snapshot &positions = runner.interpolateVec3(&SimulatedBody::position);
+    EXPECT_EQ(0, positions.size());
+
+    // Several steps in one frame: only the last two are interpolated
+    vector<Vec3<float>> out;
+    EXPECT_EQ(3, runner.advance(0.875));
+    EXPECT_TRUE(positions.aligned());
+    ASSERT_EQ(2, positions.size());
+    positions.interpolate(runner.alpha(), out);
+    ASSERT_EQ(2, out.size());
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const float expected = positions.entities()[i] == a ? 2.5f : 7.5f;
+        EXPECT_FLOAT_EQ(expected, out[i].x);
+    }
+
+    // New entities use their current value, and destroyed ones are dropped
+    em.destroyEntity(b);
+    const EntityId c = createBody(em, 100, 0);
+    EXPECT_EQ(1, runner.advance(0.25));
+    EXPECT_FALSE(positions.aligned());
+    positions.interpolate(0.5f, out);
+    ASSERT_EQ(2, out.size());
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const EntityId id = positions.entities()[i];
+        EXPECT_TRUE(id == a || id == c);
+        EXPECT_FLOAT_EQ(id == a ? 3.5f : 100.0f, out[i].x);
+    }
+}
+
+TEST_F(TestSimulation, interpolateQuat)
+{
+    EntityManager em;
+    const EntityId id = createBody(em, 0, 0);
+
+    SimulationRunner runner(em, m_config);
+    runner.addSystem([id](EntityManager &em, double) {
+        SimulatedBody *pBody = em.findComponent<SimulatedBody>(id);
+        pBody->rotation = Quat<float>::rotation(M_PI / 2, 0, 0, 1) * pBody->rotation;
+    });
+    const QuatSnapshot &rotations = runner.interpolateQuat(&SimulatedBody::rotation);
+
+    EXPECT_EQ(2, runner.advance(0.5));
+
+    vector<Quat<float>> out;
+    rotations.interpolate(0.5f, out);
+    ASSERT_EQ(1, out.size());
+    EXPECT_TRUE(out[0].equalTo(Quat<float>::rotation(3 * M_PI / 4, 0, 0, 1), 5));
+}
+
+#if defined(GAMEUTILS_PROFILE)
+TEST_F(TestSimulation, systemZones)
+{
+    EntityManager em;
+    SimulationRunner runner(em, m_config);
+    runner.addSystem([](EntityManager &, double) { }, "TestSimulation::first");
+    runner.addSystem([](EntityManager &, double) { });
+
+    gameutils::profile::clear();
+    EXPECT_EQ(2, runner.advance(0.5));
+
+    std::stringstream out;
+    gameutils::profile::writeChromeTrace(out);
+    const std::string trace = out.str();
+    EXPECT_NE(std::string::npos, trace.find("\"TestSimulation::first\""));
+    EXPECT_NE(std::string::npos, trace.find("\"SimulationRunner::system\""));
+}
+#endif
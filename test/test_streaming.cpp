@@ -0,0 +1,310 @@
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gameutils/streaming.h"
+
+#include "gtest/gtest.h"
+
+using std::string;
+using std::vector;
+
+using gameutils::CellCoord;
+using gameutils::CellFormat;
+using gameutils::EntityId;
+using gameutils::EntityManager;
+using gameutils::InvalidEntity;
+using gameutils::StreamingConfig;
+using gameutils::Vec2;
+using gameutils::WorldStreamer;
+
+struct StreamedPosition
+{
+    float x;
+    float y;
+};
+
+struct StreamedLink
+{
+    EntityId target;
+};
+
+struct StreamedOnly
+{
+    int value;
+};
+
+namespace gameutils {
+
+template<>
+struct EntityFields<StreamedLink>
+{
+    static void remap(StreamedLink &component, const EntityRemap &remap)
+    {
+        remap.apply(component.target);
+    }
+};
+
+}   // end namespace gameutils
+
+class TestStreaming : public testing::Test
+{
+protected:
+    virtual void SetUp()
+    {
+        char dir[] = "/tmp/gameutils_streaming_XXXXXX";
+        ASSERT_TRUE(mkdtemp(dir) != nullptr);
+        m_dir = dir;
+
+        m_format.registerComponent<StreamedPosition>(1);
+        m_format.registerComponent<StreamedLink>(2);
+    }
+
+    virtual void TearDown()
+    {
+        for (const string &path: m_paths) {
+            remove(path.c_str());
+        }
+
+        rmdir(m_dir.c_str());
+    }
+
+    string path(const string &name)
+    {
+        m_paths.push_back(m_dir + "/" + name);
+        return m_paths.back();
+    }
+
+    string cellPath(CellCoord cell)
+    {
+        return path(std::to_string(cell.x) + "_" + std::to_string(cell.y) + ".cell");
+    }
+
+    // Write a cell file containing 'count' entities, each with a position
+    void writeCell(CellCoord cell, size_t count)
+    {
+        EntityManager em;
+        vector<EntityId> entities;
+        for (size_t i = 0; i < count; ++i) {
+            entities.push_back(em.createEntity());
+            em.addComponent<StreamedPosition>(entities.back(), StreamedPosition{float(i), float(cell.x)});
+        }
+
+        ASSERT_TRUE(m_format.writeCell(cellPath(cell), em, entities));
+    }
+
+    StreamingConfig config()
+    {
+        StreamingConfig config;
+        config.cellSize = 64.0f;
+        config.loadRadius = 64.0f;
+        config.unloadRadius = 96.0f;
+
+        const string dir = m_dir;
+        config.cellPath = [dir](CellCoord cell) {
+            return dir + "/" + std::to_string(cell.x) + "_" + std::to_string(cell.y) + ".cell";
+        };
+
+        return config;
+    }
+
+    string m_dir;
+    vector<string> m_paths;
+    CellFormat m_format;
+};
+
+TEST_F(TestStreaming, registerComponent)
+{
+    EXPECT_THROW(m_format.registerComponent<StreamedPosition>(3), std::runtime_error);
+    EXPECT_THROW(m_format.registerComponent<StreamedOnly>(1), std::runtime_error);
+    EXPECT_NO_THROW(m_format.registerComponent<StreamedOnly>(3));
+}
+
+TEST_F(TestStreaming, writeCell_and_readCell)
+{
+    EntityManager src;
+    const EntityId a = src.createEntity();
+    const EntityId b = src.createEntity();
+    const EntityId c = src.createEntity();
+    const EntityId outside = src.createEntity();
+    src.addComponent<StreamedPosition>(a, StreamedPosition{1.0f, 2.0f});
+    src.addComponent<StreamedPosition>(c, StreamedPosition{3.0f, 4.0f});
+    src.addComponent<StreamedLink>(b, StreamedLink{c});
+    src.addComponent<StreamedLink>(c, StreamedLink{outside});
+    src.addComponent<StreamedOnly>(a, StreamedOnly{7});
+
+    const string file = path("cell");
+    ASSERT_TRUE(m_format.writeCell(file, src, {a, b, c}));
+
+    EntityManager dest;
+    dest.createEntity();
+    vector<EntityId> entities;
+    size_t bytes = 0;
+    ASSERT_TRUE(m_format.readCell(file, dest, entities, &bytes));
+    ASSERT_EQ(3, entities.size());
+    EXPECT_EQ(4, dest.memoryStats().entities.count);
+    EXPECT_EQ(2 * sizeof(StreamedPosition) + 2 * sizeof(StreamedLink), bytes);
+    EXPECT_EQ(bytes, m_format.cellBytes(file));
+
+    // Unregistered components are not stored
+    EXPECT_FALSE(dest.hasComponent<StreamedOnly>(entities[0]));
+
+    EXPECT_EQ(2.0f, dest.findComponent<StreamedPosition>(entities[0])->y);
+    EXPECT_EQ(nullptr, dest.findComponent<StreamedPosition>(entities[1]));
+    EXPECT_EQ(3.0f, dest.findComponent<StreamedPosition>(entities[2])->x);
+
+    // References within the cell refer to the new entities, and others are
+    // cleared
+    EXPECT_EQ(entities[2], dest.findComponent<StreamedLink>(entities[1])->target);
+    EXPECT_EQ(InvalidEntity, dest.findComponent<StreamedLink>(entities[2])->target);
+}
+
+TEST_F(TestStreaming, readCell_invalid)
+{
+    EntityManager em;
+    vector<EntityId> entities;
+    EXPECT_FALSE(m_format.readCell(path("missing"), em, entities));
+
+    EntityManager src;
+    const EntityId a = src.createEntity();
+    src.addComponent<StreamedPosition>(a, StreamedPosition{1.0f, 2.0f});
+    const string file = path("truncated");
+    ASSERT_TRUE(m_format.writeCell(file, src, {a}));
+
+    string contents;
+    {
+        std::ifstream in(file.c_str(), std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    {
+        std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+        out.write(contents.data(), contents.size() - 1);
+    }
+
+    EXPECT_FALSE(m_format.readCell(file, em, entities));
+    EXPECT_TRUE(entities.empty());
+    EXPECT_EQ(0, em.memoryStats().entities.count);
+
+    // A header that declares more entities than the file could hold is
+    // rejected before anything is allocated
+    {
+        std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+        const uint32_t header[] = { 0x4c435547, 1, 0xffffffff, 0 };
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    }
+
+    EXPECT_FALSE(m_format.readCell(file, em, entities));
+    EXPECT_TRUE(entities.empty());
+    EXPECT_EQ(0, em.memoryStats().entities.count);
+}
+
+TEST_F(TestStreaming, loadAndUnload)
+{
+    writeCell(CellCoord(0, 0), 10);
+    writeCell(CellCoord(1, 0), 5);
+    writeCell(CellCoord(4, 0), 20);
+
+    {
+        std::ofstream out(cellPath(CellCoord(0, 1)).c_str(), std::ios::binary);
+        out << "not a cell";
+    }
+
+    EntityManager world;
+    WorldStreamer streamer(world, m_format, config());
+    EXPECT_EQ(CellCoord(-1, 0), streamer.cellAt(Vec2<float>(-0.5f, 63.0f)));
+    EXPECT_EQ(0.0f, streamer.distanceToCell(Vec2<float>(10.0f, 10.0f), CellCoord(0, 0)));
+    EXPECT_EQ(54.0f, streamer.distanceToCell(Vec2<float>(10.0f, 10.0f), CellCoord(1, 0)));
+
+    streamer.setFocusPoints({Vec2<float>(32.0f, 32.0f)});
+    streamer.update();
+    EXPECT_LT(0, streamer.pendingLoads());
+    streamer.flush();
+    EXPECT_EQ(0, streamer.pendingLoads());
+
+    // Cells without files are empty, and the invalid cell is counted
+    EXPECT_EQ(9, streamer.residentCells());
+    EXPECT_EQ(1, streamer.failedLoads());
+    EXPECT_FALSE(streamer.isResident(CellCoord(4, 0)));
+    ASSERT_TRUE(streamer.findCellEntities(CellCoord(1, 0)) != nullptr);
+    EXPECT_EQ(5, streamer.findCellEntities(CellCoord(1, 0))->size());
+    EXPECT_EQ(15, world.memoryStats().entities.count);
+    EXPECT_EQ(15 * sizeof(StreamedPosition), streamer.residentBytes());
+
+    for (EntityId entityId: *streamer.findCellEntities(CellCoord(1, 0))) {
+        EXPECT_EQ(1.0f, world.findComponent<StreamedPosition>(entityId)->y);
+    }
+
+    // Cells between loadRadius and unloadRadius stay resident
+    streamer.setFocusPoints({Vec2<float>(160.0f, 32.0f)});
+    streamer.update();
+    streamer.flush();
+    EXPECT_TRUE(streamer.isResident(CellCoord(0, 0)));
+    EXPECT_FALSE(streamer.isResident(CellCoord(-1, 0)));
+
+    streamer.setFocusPoints({Vec2<float>(288.0f, 32.0f)});
+    streamer.update();
+    streamer.flush();
+    EXPECT_FALSE(streamer.isResident(CellCoord(0, 0)));
+    EXPECT_FALSE(streamer.isResident(CellCoord(1, 0)));
+    EXPECT_TRUE(streamer.isResident(CellCoord(4, 0)));
+    EXPECT_EQ(20, world.memoryStats().entities.count);
+
+    streamer.unloadAll();
+    EXPECT_EQ(0, streamer.residentCells());
+    EXPECT_EQ(0, streamer.residentBytes());
+    EXPECT_EQ(0, world.memoryStats().entities.count);
+}
+
+TEST_F(TestStreaming, memoryBudget)
+{
+    writeCell(CellCoord(0, 0), 10);
+    writeCell(CellCoord(1, 0), 1);
+    writeCell(CellCoord(-1, 0), 10);
+    EXPECT_EQ(10 * sizeof(StreamedPosition), m_format.cellBytes(cellPath(CellCoord(0, 0))));
+    EXPECT_EQ(0, m_format.cellBytes(cellPath(CellCoord(5, 5))));
+
+    StreamingConfig budgeted = config();
+    budgeted.memoryBudget = 12 * sizeof(StreamedPosition);
+
+    // Loads that would exceed the budget are not started, even before any
+    // cell is resident
+    EntityManager world;
+    WorldStreamer streamer(world, m_format, budgeted);
+    streamer.setFocusPoints({Vec2<float>(60.0f, 32.0f)});
+    streamer.update();
+    streamer.flush();
+    EXPECT_TRUE(streamer.isResident(CellCoord(0, 0)));
+    EXPECT_TRUE(streamer.isResident(CellCoord(1, 0)));
+    EXPECT_FALSE(streamer.isResident(CellCoord(-1, 0)));
+    EXPECT_EQ(11 * sizeof(StreamedPosition), streamer.residentBytes());
+
+    streamer.update();
+    EXPECT_EQ(0, streamer.pendingLoads());
+    EXPECT_EQ(11, world.memoryStats().entities.count);
+
+    // If a file grows, the budget is exceeded until the farthest cell is
+    // evicted, and it is not requested again
+    streamer.setFocusPoints({Vec2<float>(1000.0f, 32.0f)});
+    streamer.update();
+    EXPECT_EQ(0, streamer.residentCells());
+    writeCell(CellCoord(1, 0), 10);
+
+    streamer.setFocusPoints({Vec2<float>(60.0f, 32.0f)});
+    streamer.update();
+    streamer.flush();
+    EXPECT_EQ(20 * sizeof(StreamedPosition), streamer.residentBytes());
+
+    streamer.update();
+    EXPECT_TRUE(streamer.isResident(CellCoord(0, 0)));
+    EXPECT_FALSE(streamer.isResident(CellCoord(1, 0)));
+    EXPECT_EQ(0, streamer.pendingLoads());
+    EXPECT_EQ(10, world.memoryStats().entities.count);
+    EXPECT_EQ(10 * sizeof(StreamedPosition), streamer.residentBytes());
+}